@@ -0,0 +1,131 @@
+#!/bin/sh
+###############################################################################
+# File: pipeline_bench.sh
+# Description: end-to-end benchmark of tty_sim -> tty_mqtt -> mqtt_rrdtool
+#              through the in-tree ss_broker
+# Author: Steven Swann - swannonline@googlemail.com
+#
+# Copyright (c) swannonline, 2013-2014
+#
+# This file is part of sensorspace.
+#
+# sensorspace is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# sensorspace is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with sensorspace.  If not, see <http://www.gnu.org/licenses/>.
+#
+###############################################################################
+#
+# Usage: pipeline_bench.sh [bin-dir]
+#
+# Environment:
+#   RATE      frames written per second by tty_sim, 0 for unlimited (1000)
+#   DURATION  seconds to write frames for (10)
+#   SENSORS   number of simulated sensors, 1 to 10 (4)
+#   PORT      TCP port for ss_broker (18830)
+#
+# Prints the frames written, readings delivered to mqtt_rrdtool, messages
+# per second and the CPU time per message used by each process.
+
+BIN=${1:-.}
+RATE=${RATE:-1000}
+DURATION=${DURATION:-10}
+SENSORS=${SENSORS:-4}
+PORT=${PORT:-18830}
+TOPIC=sensorspace/bench
+
+TMP=$(mktemp -d /tmp/ss_bench.XXXXXX) || exit 1
+PIDS=""
+
+cleanup() {
+  [ -n "$PIDS" ] && kill $PIDS 2>/dev/null
+  wait 2>/dev/null
+  rm -rf "$TMP"
+}
+trap cleanup EXIT INT TERM
+
+# utime + stime in clock ticks
+cpu_ticks() {
+  awk '{ print $14 + $15 }' /proc/$1/stat 2>/dev/null || echo 0
+}
+
+for prog in ss_broker tty_sim tty_mqtt mqtt_rrdtool; do
+  if [ ! -x "$BIN/$prog" ]; then
+    echo "$BIN/$prog not found - build first" >&2
+    exit 1
+  fi
+done
+
+"$BIN/ss_broker" -p $PORT -v ERROR > "$TMP/broker.out" 2>&1 &
+BROKER=$!
+PIDS="$BROKER"
+sleep 0.5
+
+# one RRD per sensor
+RRD_ARGS=""
+i=1
+while [ $i -le $SENSORS ]; do
+  if command -v rrdtool > /dev/null; then
+    rrdtool create "$TMP/sensor$i.rrd" --step 1 \
+      DS:watts:GAUGE:10:0:U RRA:AVERAGE:0.5:1:3600 || exit 1
+  fi
+  RRD_ARGS="$RRD_ARGS -r $TMP/sensor$i.rrd -s $i"
+  i=$((i + 1))
+done
+
+"$BIN/mqtt_rrdtool" -p $PORT -t "$TOPIC" -v ERROR $RRD_ARGS \
+  > "$TMP/rrdtool.out" 2>&1 &
+RRDTOOL=$!
+PIDS="$PIDS $RRDTOOL"
+
+# the terminal must exist before tty_mqtt starts, frames follow later
+"$BIN/tty_sim" -l "$TMP/tty" -n $SENSORS -r $RATE -d $DURATION -w 1 \
+  -v ERROR > "$TMP/sim.out" 2>&1 &
+SIM=$!
+PIDS="$PIDS $SIM"
+sleep 0.5
+
+"$BIN/tty_mqtt" -T CC_DEV -D "$TMP/tty" -d 1 -p $PORT -t "$TOPIC" -v ERROR \
+  > "$TMP/tty_mqtt.out" 2>&1 &
+TTY_MQTT=$!
+PIDS="$PIDS $TTY_MQTT"
+
+wait $SIM
+
+# let the pipeline drain
+sleep 1
+kill -USR1 $BROKER
+sleep 0.2
+
+TICKS=$(getconf CLK_TCK)
+FRAMES=$(awk '/^frames:/ { print $2 }' "$TMP/sim.out")
+SECS=$(awk '/^frames:/ { sub("s", "", $4); print $4 }' "$TMP/sim.out")
+SIM_CPU=$(awk '/^frames:/ { sub("s", "", $6); print $6 }' "$TMP/sim.out")
+STATS=$(tail -n 1 "$TMP/broker.out")
+PUBLISHED=$(echo "$STATS" | awk '{ for (i = 1; i < NF; i++) if ($i == "published:") print $(i + 1) }')
+DELIVERED=$(echo "$STATS" | awk '{ for (i = 1; i < NF; i++) if ($i == "delivered:") print $(i + 1) }')
+
+echo "frames written:     ${FRAMES:-0} in ${SECS:-0}s"
+echo "readings published: ${PUBLISHED:-0}"
+echo "readings delivered: ${DELIVERED:-0}"
+awk -v n="${DELIVERED:-0}" -v s="${SECS:-1}" \
+  'BEGIN { printf("messages/s:         %.0f\n", s > 0 ? n / s : 0) }'
+
+# tty_sim has exited, so reports its own CPU time
+SIM_TICKS=$(awk -v s="${SIM_CPU:-0}" -v hz=$TICKS 'BEGIN { print s * hz }')
+
+for p in "tty_sim $SIM_TICKS" "tty_mqtt $(cpu_ticks $TTY_MQTT)" \
+    "ss_broker $(cpu_ticks $BROKER)" "mqtt_rrdtool $(cpu_ticks $RRDTOOL)"; do
+  set -- $p
+  awk -v name=$1 -v t=$2 -v hz=$TICKS -v n="${DELIVERED:-0}" \
+    'BEGIN { printf("%-13s cpu: %7.3fs  %8.2fus/msg\n", name, t / hz,
+        n ? t / hz * 1e6 / n : 0) }'
+done
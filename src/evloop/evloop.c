@@ -0,0 +1,467 @@
+/******************************************************************************
+ * File: evloop.c
+ * Description: epoll event loop with timerfd timers and signalfd signals
+ * Author: Steven Swann - swannonline@googlemail.com
+ *
+ * Copyright (c) swannonline, 2013-2014
+ *
+ * This file is part of sensorspace.
+ *
+ * sensorspace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * sensorspace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with sensorspace.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+
+#include "sensorspace.h"
+#include "log.h"
+#include "evloop.h"
+
+#define EVLOOP_FD        0
+#define EVLOOP_TIMER     1
+#define EVLOOP_SIGNAL    2
+
+/**
+ * \brief Initialise an event loop
+ * \param el_p Pointer to the event loop
+ */
+int evloop_init(struct evloop **el_p) {
+
+  struct evloop *el;
+
+  if (!(el = calloc(1, sizeof(struct evloop)))) {
+    log_stderr(LOG_ERROR, "Allocating space for the event loop failed");
+    return SS_OUT_OF_MEM_ERROR;
+  }
+
+  if ((el->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    log_stderr(LOG_ERROR, "epoll_create1: %s", strerror(errno));
+    free(el);
+    return SS_INIT_ERROR;
+  }
+  sigemptyset(&el->sigmask);
+
+  *el_p = el;
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Register a handler with epoll, growing the fd table as needed
+ */
+static int evloop_register(struct evloop *el, struct evloop_handler *h,
+    uint32_t events) {
+
+  struct epoll_event ev;
+  struct evloop_handler **fds;
+  unsigned len;
+
+  if (h->fd < 0) {
+    return SS_INIT_ERROR;
+  }
+
+  if ((unsigned)h->fd >= el->fds_len) {
+    len = el->fds_len ? el->fds_len : 64;
+    while (len <= (unsigned)h->fd) {
+      len *= 2;
+    }
+    if (!(fds = realloc(el->fds, len * sizeof(struct evloop_handler *)))) {
+      log_stderr(LOG_ERROR, "Allocating space for the fd table failed");
+      return SS_OUT_OF_MEM_ERROR;
+    }
+    memset(fds + el->fds_len, 0,
+        (len - el->fds_len) * sizeof(struct evloop_handler *));
+    el->fds = fds;
+    el->fds_len = len;
+  }
+
+  if (el->fds[h->fd]) {
+    log_stderr(LOG_ERROR, "fd %d is already registered", h->fd);
+    return SS_INIT_ERROR;
+  }
+
+  memset(&ev, 0, sizeof(struct epoll_event));
+  ev.events = events;
+  ev.data.ptr = h;
+  if (epoll_ctl(el->epfd, EPOLL_CTL_ADD, h->fd, &ev)) {
+    log_stderr(LOG_ERROR, "epoll_ctl: %d: %s", h->fd, strerror(errno));
+    return SS_INIT_ERROR;
+  }
+
+  el->fds[h->fd] = h;
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Remove a handler from epoll. The handler is released straight
+ *        away unless events are being dispatched, in which case it may
+ *        still be referenced by a pending event.
+ */
+static void evloop_unregister(struct evloop *el, struct evloop_handler *h) {
+
+  /* the fd may already be closed, which removes it from the epoll set */
+  epoll_ctl(el->epfd, EPOLL_CTL_DEL, h->fd, NULL);
+  el->fds[h->fd] = NULL;
+
+  if (h->type != EVLOOP_FD) {
+    close(h->fd);
+  }
+
+  if (el->dispatching) {
+    h->deleted = true;
+    h->next = el->garbage;
+    el->garbage = h;
+  } else {
+    free(h);
+  }
+}
+
+/**
+ * \brief Watch an fd
+ * \param el The event loop
+ * \param fd The fd, which remains owned by the caller
+ * \param events The epoll events to watch for, e.g. EPOLLIN
+ * \param cb Called when the fd is ready
+ * \param arg The argument passed to the callback
+ */
+int evloop_add_fd(struct evloop *el, int fd, uint32_t events,
+    evloop_fd_cb cb, void *arg) {
+
+  struct evloop_handler *h;
+  int ret;
+
+  if (!(h = calloc(1, sizeof(struct evloop_handler)))) {
+    log_stderr(LOG_ERROR, "Allocating space for the fd handler failed");
+    return SS_OUT_OF_MEM_ERROR;
+  }
+
+  h->fd = fd;
+  h->type = EVLOOP_FD;
+  h->fd_cb = cb;
+  h->arg = arg;
+
+  if ((ret = evloop_register(el, h, events))) {
+    free(h);
+  }
+
+  return ret;
+}
+
+/**
+ * \brief Change the epoll events watched for on an fd
+ * \param el The event loop
+ * \param fd The registered fd
+ * \param events The epoll events to watch for
+ */
+int evloop_mod_fd(struct evloop *el, int fd, uint32_t events) {
+
+  struct epoll_event ev;
+
+  if (fd < 0 || (unsigned)fd >= el->fds_len || !el->fds[fd]) {
+    return SS_NO_MATCH;
+  }
+
+  memset(&ev, 0, sizeof(struct epoll_event));
+  ev.events = events;
+  ev.data.ptr = el->fds[fd];
+  if (epoll_ctl(el->epfd, EPOLL_CTL_MOD, fd, &ev)) {
+    log_stderr(LOG_ERROR, "epoll_ctl: %d: %s", fd, strerror(errno));
+    return SS_INIT_ERROR;
+  }
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Stop watching an fd. This should be called before the fd is
+ *        closed, or at least before its number can be reused.
+ * \param el The event loop
+ * \param fd The registered fd
+ */
+void evloop_del_fd(struct evloop *el, int fd) {
+
+  if (fd >= 0 && (unsigned)fd < el->fds_len && el->fds[fd] &&
+      el->fds[fd]->type == EVLOOP_FD) {
+    evloop_unregister(el, el->fds[fd]);
+  }
+}
+
+/**
+ * \brief Add a disarmed timer, see evloop_timer_set()
+ * \param el The event loop
+ * \param t_p Pointer to the timer
+ * \param cb Called when the timer expires
+ * \param arg The argument passed to the callback
+ */
+int evloop_add_timer(struct evloop *el, struct evloop_timer **t_p,
+    evloop_timer_cb cb, void *arg) {
+
+  struct evloop_timer *t;
+  int ret;
+
+  if (!(t = calloc(1, sizeof(struct evloop_timer)))) {
+    log_stderr(LOG_ERROR, "Allocating space for the timer failed");
+    return SS_OUT_OF_MEM_ERROR;
+  }
+
+  t->h.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (t->h.fd < 0) {
+    log_stderr(LOG_ERROR, "timerfd_create: %s", strerror(errno));
+    free(t);
+    return SS_INIT_ERROR;
+  }
+  t->h.type = EVLOOP_TIMER;
+  t->h.timer_cb = cb;
+  t->h.arg = arg;
+
+  if ((ret = evloop_register(el, &t->h, EPOLLIN))) {
+    close(t->h.fd);
+    free(t);
+    return ret;
+  }
+
+  *t_p = t;
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Arm or disarm a timer
+ * \param t The timer
+ * \param ms Milliseconds until the timer expires, 0 to expire on the next
+ *        loop iteration or -1 to disarm
+ * \param interval_ms The period after the first expiry, 0 for a one-shot
+ *        timer
+ */
+int evloop_timer_set(struct evloop_timer *t, long ms, unsigned interval_ms) {
+
+  struct itimerspec its;
+
+  memset(&its, 0, sizeof(struct itimerspec));
+  if (ms >= 0) {
+    its.it_value.tv_sec = ms / 1000;
+    its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+    if (!ms) {
+      /* a zero it_value disarms */
+      its.it_value.tv_nsec = 1;
+    }
+    its.it_interval.tv_sec = interval_ms / 1000;
+    its.it_interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+  }
+
+  if (timerfd_settime(t->h.fd, 0, &its, NULL)) {
+    log_stderr(LOG_ERROR, "timerfd_settime: %s", strerror(errno));
+    return SS_INIT_ERROR;
+  }
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Remove and free a timer
+ * \param el The event loop
+ * \param t The timer
+ */
+void evloop_del_timer(struct evloop *el, struct evloop_timer *t) {
+
+  if (t) {
+    evloop_unregister(el, &t->h);
+  }
+}
+
+/**
+ * \brief Handle a signal through the event loop. The signal is blocked so
+ *        that it is only delivered through a signalfd.
+ * \param el The event loop
+ * \param sig The signal number
+ * \param cb Called when the signal is received
+ * \param arg The argument passed to the callback
+ */
+int evloop_add_signal(struct evloop *el, int sig, evloop_signal_cb cb,
+    void *arg) {
+
+  sigset_t mask;
+  int fd;
+
+  if (sig <= 0 || sig >= _NSIG) {
+    return SS_INIT_ERROR;
+  }
+
+  sigemptyset(&mask);
+  sigaddset(&mask, sig);
+  sigaddset(&el->sigmask, sig);
+  if (sigprocmask(SIG_BLOCK, &mask, NULL)) {
+    log_stderr(LOG_ERROR, "sigprocmask: %s", strerror(errno));
+    return SS_INIT_ERROR;
+  }
+
+  el->sig_cb[sig] = cb;
+  el->sig_arg[sig] = arg;
+
+  /* the signalfd is shared by every signal */
+  fd = signalfd(el->sigfd ? el->sigfd->fd : -1, &el->sigmask,
+      SFD_NONBLOCK | SFD_CLOEXEC);
+  if (fd < 0) {
+    log_stderr(LOG_ERROR, "signalfd: %s", strerror(errno));
+    return SS_INIT_ERROR;
+  }
+
+  if (!el->sigfd) {
+    if (!(el->sigfd = calloc(1, sizeof(struct evloop_handler)))) {
+      log_stderr(LOG_ERROR, "Allocating space for the signal handler failed");
+      close(fd);
+      return SS_OUT_OF_MEM_ERROR;
+    }
+    el->sigfd->fd = fd;
+    el->sigfd->type = EVLOOP_SIGNAL;
+    if (evloop_register(el, el->sigfd, EPOLLIN)) {
+      close(fd);
+      free(el->sigfd);
+      el->sigfd = NULL;
+      return SS_INIT_ERROR;
+    }
+  }
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Read and dispatch every pending signal
+ */
+static void evloop_read_signals(struct evloop *el) {
+
+  struct signalfd_siginfo si[8];
+  ssize_t n;
+  unsigned i;
+  int sig;
+
+  while ((n = read(el->sigfd->fd, si, sizeof(si))) > 0) {
+    for (i = 0; i < n / sizeof(struct signalfd_siginfo); i++) {
+      sig = si[i].ssi_signo;
+      if (sig > 0 && sig < _NSIG && el->sig_cb[sig]) {
+        el->sig_cb[sig](el, sig, el->sig_arg[sig]);
+      }
+    }
+  }
+}
+
+/**
+ * \brief Wait for and dispatch one round of events
+ * \param el The event loop
+ * \param timeout_ms The maximum time to wait, -1 to wait indefinitely
+ */
+int evloop_run_once(struct evloop *el, int timeout_ms) {
+
+  struct epoll_event events[EVLOOP_MAX_EVENTS];
+  struct evloop_handler *h;
+  struct evloop_timer *t;
+  int i, n;
+
+  n = epoll_wait(el->epfd, events, EVLOOP_MAX_EVENTS, timeout_ms);
+  if (n < 0) {
+    if (errno == EINTR) {
+      return SS_SUCCESS;
+    }
+    log_stderr(LOG_ERROR, "epoll_wait: %s", strerror(errno));
+    return SS_SELECT_ERROR;
+  }
+
+  el->dispatching = true;
+  for (i = 0; i < n; i++) {
+    h = (struct evloop_handler *)events[i].data.ptr;
+    if (h->deleted) {
+      continue;
+    }
+
+    switch (h->type) {
+      case EVLOOP_FD:
+        h->fd_cb(el, h->fd, events[i].events, h->arg);
+        break;
+
+      case EVLOOP_TIMER:
+        t = (struct evloop_timer *)h;
+        if (read(h->fd, &t->expirations, sizeof(uint64_t)) ==
+            sizeof(uint64_t)) {
+          h->timer_cb(el, t, h->arg);
+        }
+        break;
+
+      case EVLOOP_SIGNAL:
+        evloop_read_signals(el);
+        break;
+    }
+  }
+  el->dispatching = false;
+
+  while ((h = el->garbage)) {
+    el->garbage = h->next;
+    free(h);
+  }
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Dispatch events until evloop_stop() is called
+ * \param el The event loop
+ */
+int evloop_run(struct evloop *el) {
+
+  int ret = SS_SUCCESS;
+
+  el->stop = false;
+  while (!el->stop && !(ret = evloop_run_once(el, -1)));
+
+  return ret;
+}
+
+/**
+ * \brief Make evloop_run() return once the current events are dispatched
+ * \param el The event loop
+ */
+void evloop_stop(struct evloop *el) {
+
+  el->stop = true;
+}
+
+/**
+ * \brief Free an event loop, closing its timers and signalfd. Registered
+ *        signals are unblocked, fds registered with evloop_add_fd() are
+ *        left open.
+ * \param el The event loop
+ */
+void free_evloop(struct evloop *el) {
+
+  unsigned i;
+
+  if (!el) {
+    return;
+  }
+
+  for (i = 0; i < el->fds_len; i++) {
+    if (el->fds[i]) {
+      evloop_unregister(el, el->fds[i]);
+    }
+  }
+  sigprocmask(SIG_UNBLOCK, &el->sigmask, NULL);
+
+  close(el->epfd);
+  free(el->fds);
+  free(el);
+}
@@ -0,0 +1,138 @@
+#ifndef EVLOOP__H
+#define EVLOOP__H
+/******************************************************************************
+ * File: evloop.h
+ * Description: epoll event loop with timerfd timers and signalfd signals
+ * Author: Steven Swann - swannonline@googlemail.com
+ *
+ * Copyright (c) swannonline, 2013-2014
+ *
+ * This file is part of sensorspace.
+ *
+ * sensorspace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * sensorspace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with sensorspace.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+#include <stdint.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <sys/epoll.h>
+
+#define EVLOOP_MAX_EVENTS           64
+
+struct evloop;
+struct evloop_timer;
+
+/*
+ * \brief Callback invoked when a registered fd is ready
+ * \param el The event loop
+ * \param fd The ready fd
+ * \param events The ready epoll events
+ * \param arg The argument given when the fd was registered
+ */
+typedef void (*evloop_fd_cb)(struct evloop *el, int fd, uint32_t events,
+    void *arg);
+
+/*
+ * \brief Callback invoked when a timer expires
+ * \param el The event loop
+ * \param t The expired timer
+ * \param arg The argument given when the timer was added
+ */
+typedef void (*evloop_timer_cb)(struct evloop *el, struct evloop_timer *t,
+    void *arg);
+
+/*
+ * \brief Callback invoked when a registered signal is received
+ * \param el The event loop
+ * \param sig The signal number
+ * \param arg The argument given when the signal was registered
+ */
+typedef void (*evloop_signal_cb)(struct evloop *el, int sig, void *arg);
+
+/*
+ * \brief Struct to hold a registered fd, timer or signalfd
+ * \param fd The fd
+ * \param type The handler type
+ * \param deleted The handler was removed while events were dispatched
+ * \param fd_cb The fd callback
+ * \param timer_cb The timer callback
+ * \param arg The argument passed to the callback
+ * \param next The next handler awaiting release
+ */
+struct evloop_handler {
+  int fd;
+  uint8_t type;
+  bool deleted;
+  evloop_fd_cb fd_cb;
+  evloop_timer_cb timer_cb;
+  void *arg;
+  struct evloop_handler *next;
+};
+
+/*
+ * \brief Struct to hold a timer, each timer is backed by a timerfd on
+ *        CLOCK_MONOTONIC
+ * \param h The timer handler
+ * \param expirations The expirations read when the timer last fired
+ */
+struct evloop_timer {
+  struct evloop_handler h;
+  uint64_t expirations;
+};
+
+/*
+ * \brief Struct to hold an event loop
+ * \param epfd The epoll fd
+ * \param fds The fd handlers, indexed by fd
+ * \param fds_len The length of the fds table
+ * \param sigfd The signalfd handler, NULL until a signal is registered
+ * \param sigmask The registered signals
+ * \param sig_cb The signal callbacks, indexed by signal number
+ * \param sig_arg The signal callback arguments
+ * \param garbage Handlers removed during dispatch, released afterwards
+ * \param dispatching Events are being dispatched
+ * \param stop Set by evloop_stop() to end evloop_run()
+ */
+struct evloop {
+  int epfd;
+  struct evloop_handler **fds;
+  unsigned fds_len;
+
+  struct evloop_handler *sigfd;
+  sigset_t sigmask;
+  evloop_signal_cb sig_cb[_NSIG];
+  void *sig_arg[_NSIG];
+
+  struct evloop_handler *garbage;
+  bool dispatching;
+  bool stop;
+};
+
+int evloop_init(struct evloop **el_p);
+int evloop_add_fd(struct evloop *el, int fd, uint32_t events,
+    evloop_fd_cb cb, void *arg);
+int evloop_mod_fd(struct evloop *el, int fd, uint32_t events);
+void evloop_del_fd(struct evloop *el, int fd);
+int evloop_add_timer(struct evloop *el, struct evloop_timer **t_p,
+    evloop_timer_cb cb, void *arg);
+int evloop_timer_set(struct evloop_timer *t, long ms, unsigned interval_ms);
+void evloop_del_timer(struct evloop *el, struct evloop_timer *t);
+int evloop_add_signal(struct evloop *el, int sig, evloop_signal_cb cb,
+    void *arg);
+int evloop_run_once(struct evloop *el, int timeout_ms);
+int evloop_run(struct evloop *el);
+void evloop_stop(struct evloop *el);
+void free_evloop(struct evloop *el);
+
+#endif        /* EVLOOP__H */
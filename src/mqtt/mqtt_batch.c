@@ -0,0 +1,443 @@
+/******************************************************************************
+ * File: mqtt_batch.c
+ * Description: functions to batch published messages per topic
+ * Author: Steven Swann - swannonline@googlemail.com
+ *
+ * Copyright (c) swannonline, 2013-2014
+ *
+ * This file is part of sensorspace.
+ *
+ * sensorspace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * sensorspace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with sensorspace.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sensorspace.h"
+#include "log.h"
+#include "mqtt_publish.h"
+#include "mqtt_batch.h"
+
+/**
+ * \brief Milliseconds elapsed since a CLOCK_MONOTONIC time
+ */
+static long elapsed_ms(const struct timespec *since) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (now.tv_sec - since->tv_sec) * 1000 +
+    (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+/**
+ * \brief Send a message at QoS 1 if enabled, otherwise through the spool
+ */
+static int mqtt_batcher_send(struct mqtt_batcher *b, struct mqtt_pub_tmpl *t,
+    const uint8_t *payload, size_t len) {
+
+  if (b->qos) {
+    return mqtt_qos_publish(b->qos, t, payload, len);
+  }
+
+  return mqtt_spool_publish(b->spool, b->conn, t, payload, len);
+}
+
+/**
+ * \brief Initialise a batching publisher
+ * \param b_p Pointer to the batcher to be returned
+ * \param conn The broker connection's output buffer, NULL while
+ *        disconnected
+ * \param retain The retain flag for published batches
+ * \param linger_ms Maximum time a message is held, 0 disables batching
+ * \param max_bytes Maximum payload size of a batch, 0 for the default
+ */
+int mqtt_batcher_init(struct mqtt_batcher **b_p, struct mqtt_out *conn,
+    uint8_t retain, unsigned linger_ms, size_t max_bytes) {
+
+  struct mqtt_batcher *b;
+
+  if (!(b = calloc(1, sizeof(struct mqtt_batcher)))) {
+    log_stderr(LOG_ERROR, "Batcher: Out of memory");
+    return SS_OUT_OF_MEM_ERROR;
+  }
+
+  b->conn = conn;
+  b->retain = retain;
+  b->linger_ms = linger_ms;
+  b->max_bytes = max_bytes ? max_bytes : MQTT_BATCH_DEFAULT_BYTES;
+
+  if (linger_ms) {
+    log_stdout(LOG_INFO, "Batching messages: linger %ums, max %zu bytes",
+        b->linger_ms, b->max_bytes);
+  }
+
+  *b_p = b;
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Change the output buffer used by the batcher, and its QoS 1
+ *        publisher, after a reconnect. NULL while disconnected.
+ */
+void mqtt_batcher_set_conn(struct mqtt_batcher *b, struct mqtt_out *conn) {
+
+  b->conn = conn;
+  mqtt_qos_set_conn(b->qos, conn);
+}
+
+/**
+ * \brief Managed connection callback keeping a batcher on the current
+ *        connection, see mqtt_conn_set_callbacks()
+ * \param mc The managed connection
+ * \param b The batcher
+ */
+void mqtt_batcher_conn_changed(struct mqtt_conn *mc, void *b) {
+
+  mqtt_batcher_set_conn((struct mqtt_batcher *)b, mc->conn);
+  mqtt_batcher_arm((struct mqtt_batcher *)b);
+}
+
+/**
+ * \brief Arm the event loop timer for the next batch, spool replay or
+ *        retransmission due
+ */
+static void mqtt_batcher_schedule(struct mqtt_batcher *b) {
+
+  int wait_ms, ms;
+
+  if (!b->timer || b->service_due) {
+    return;
+  }
+
+  /* at QoS 1 spooled packets are sent as the window frees */
+  wait_ms = mqtt_batcher_timeout(b);
+  ms = b->conn && !b->qos ? mqtt_spool_timeout(b->spool) : -1;
+  if (ms >= 0 && (wait_ms < 0 || ms < wait_ms)) {
+    wait_ms = ms;
+  }
+  ms = mqtt_qos_timeout(b->qos);
+  if (ms >= 0 && (wait_ms < 0 || ms < wait_ms)) {
+    wait_ms = ms;
+  }
+
+  evloop_timer_set(b->timer, wait_ms, 0);
+}
+
+/**
+ * \brief Event loop callback publishing lingering batches, replaying the
+ *        spool and resending unacknowledged packets, then writing them
+ */
+static void mqtt_batcher_expired(struct evloop *el, struct evloop_timer *t,
+    void *arg) {
+
+  struct mqtt_batcher *b = (struct mqtt_batcher *)arg;
+
+  (void)el;
+  (void)t;
+
+  b->service_due = false;
+
+  mqtt_batcher_flush_due(b);
+  if (!b->qos && b->conn && mqtt_spool_pending(b->spool)) {
+    mqtt_spool_drain(b->spool, b->conn);
+  }
+  mqtt_qos_retransmit(b->qos);
+
+  mqtt_conn_flush(b->mc);
+  if (b->on_flush) {
+    b->on_flush(b, b->flush_arg);
+  }
+
+  mqtt_batcher_schedule(b);
+}
+
+/**
+ * \brief Managed connection callback servicing the batcher once the
+ *        output it was held back by has been written
+ */
+static void mqtt_batcher_drained(struct mqtt_conn *mc, void *b) {
+
+  (void)mc;
+
+  mqtt_batcher_arm((struct mqtt_batcher *)b);
+}
+
+/**
+ * \brief Drive the batcher from the event loop its connection is attached
+ *        to. Lingering batches, spooled packets and retransmissions are
+ *        sent as they fall due, and anything queued is written on the next
+ *        loop iteration.
+ * \param b The batcher
+ * \param mc The managed connection, attached to an event loop
+ */
+int mqtt_batcher_attach(struct mqtt_batcher *b, struct mqtt_conn *mc) {
+
+  int ret;
+
+  if ((ret = evloop_add_timer(mc->el, &b->timer, mqtt_batcher_expired, b))) {
+    return ret;
+  }
+
+  b->mc = mc;
+  mqtt_conn_set_drain_cb(mc, mqtt_batcher_drained, b);
+  mqtt_batcher_arm(b);
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Set the function called each time the attached batcher has
+ *        written the packets due, for example to hold back input while
+ *        the connection is congested. NULL to clear it.
+ */
+void mqtt_batcher_set_flush_cb(struct mqtt_batcher *b, mqtt_batcher_cb cb,
+    void *arg) {
+
+  b->on_flush = cb;
+  b->flush_arg = arg;
+}
+
+/**
+ * \brief Have the attached batcher write what is queued, and work out its
+ *        next deadline, on the next event loop iteration
+ */
+void mqtt_batcher_arm(struct mqtt_batcher *b) {
+
+  if (b->timer && !b->service_due && !evloop_timer_set(b->timer, 0, 0)) {
+    b->service_due = true;
+  }
+}
+
+/**
+ * \brief Publish, and empty, a single topic batch
+ */
+static int mqtt_batch_flush(struct mqtt_batcher *b, struct mqtt_batch *batch) {
+
+  int ret;
+
+  if (!batch->count) {
+    return SS_SUCCESS;
+  }
+
+  log_stdout(LOG_DEBUG, "Publishing batch of %u messages (%zu bytes) to %s",
+      batch->count, batch->len, batch->tmpl->topic);
+
+  ret = mqtt_batcher_send(b, batch->tmpl, batch->buf, batch->len);
+
+  batch->len = 0;
+  batch->count = 0;
+
+  return ret;
+}
+
+/**
+ * \brief Find the batch for a topic, creating one if required. When all
+ *        slots are in use, the oldest batch is published and its slot reused.
+ * \param batch_p Pointer to the batch, set to NULL if none could be made
+ * \return SS_WRITE_ERROR if publishing the evicted batch failed
+ */
+static int mqtt_batcher_get(struct mqtt_batcher *b, const char *topic,
+    struct mqtt_batch **batch_p) {
+
+  int ret = SS_SUCCESS;
+  struct mqtt_batch *batch;
+  unsigned i;
+
+  *batch_p = NULL;
+
+  for (i = 0; i < b->count; i++) {
+    if (!strcmp(b->batch[i].tmpl->topic, topic)) {
+      *batch_p = &b->batch[i];
+      return SS_SUCCESS;
+    }
+  }
+
+  if (b->count == MQTT_BATCH_MAX_TOPICS) {
+    /* evict the oldest batch, preferring empty batches */
+    batch = &b->batch[0];
+    for (i = 1; i < b->count; i++) {
+      if (!b->batch[i].count || (batch->count &&
+            elapsed_ms(&b->batch[i].first) > elapsed_ms(&batch->first))) {
+        batch = &b->batch[i];
+      }
+    }
+    if ((ret = mqtt_batch_flush(b, batch))) {
+      log_stderr(LOG_ERROR, "Publishing evicted batch for %s failed",
+          batch->tmpl->topic);
+    }
+    free_mqtt_pub_tmpl(batch->tmpl);
+    free(batch->buf);
+    *batch = b->batch[--b->count];
+  }
+
+  batch = &b->batch[b->count];
+  memset(batch, 0, sizeof(struct mqtt_batch));
+
+  if (!(batch->buf = malloc(b->max_bytes))) {
+    log_stderr(LOG_ERROR, "Batcher: Out of memory");
+    return SS_OUT_OF_MEM_ERROR;
+  }
+
+  if (mqtt_pub_tmpl_init(&batch->tmpl, topic, b->retain)) {
+    free(batch->buf);
+    batch->buf = NULL;
+    return SS_OUT_OF_MEM_ERROR;
+  }
+  b->count++;
+
+  *batch_p = batch;
+  return ret;
+}
+
+/**
+ * \brief Queue a message for publishing. Messages are published immediately
+ *        when batching is disabled or the message will not fit in a batch.
+ * \param b The batcher
+ * \param topic The topic to publish to
+ * \param msg The message
+ * \param len The length of the message
+ */
+int mqtt_batcher_add(struct mqtt_batcher *b, const char *topic,
+    const uint8_t *msg, size_t len) {
+
+  struct mqtt_batch *batch;
+  int ret;
+
+  /* an evicted batch that failed to publish is reported with this message */
+  ret = mqtt_batcher_get(b, topic, &batch);
+  if (!batch) {
+    return ret;
+  }
+
+  /* what is queued is written, or its linger timed, by the loop */
+  mqtt_batcher_arm(b);
+
+  if (!b->linger_ms || len >= b->max_bytes) {
+    /* keep ordering with anything already queued */
+    if (mqtt_batch_flush(b, batch)) {
+      ret = SS_WRITE_ERROR;
+    }
+    if (mqtt_batcher_send(b, batch->tmpl, msg, len)) {
+      ret = SS_WRITE_ERROR;
+    }
+    return ret;
+  }
+
+  /* publish the current batch if the message will not fit */
+  if (batch->count && batch->len + 1 + len > b->max_bytes &&
+      mqtt_batch_flush(b, batch)) {
+    ret = SS_WRITE_ERROR;
+  }
+
+  if (batch->count) {
+    batch->buf[batch->len++] = MQTT_BATCH_SEPARATOR;
+  } else {
+    clock_gettime(CLOCK_MONOTONIC, &batch->first);
+  }
+
+  memcpy(batch->buf + batch->len, msg, len);
+  batch->len += len;
+  batch->count++;
+
+  log_stdout(LOG_DEBUG, "Queued message %u (%zu bytes) for %s",
+      batch->count, batch->len, topic);
+
+  return ret;
+}
+
+/**
+ * \brief Get the time until the next batch is due to be published
+ * \return The timeout in milliseconds, or -1 if there is nothing queued
+ */
+int mqtt_batcher_timeout(struct mqtt_batcher *b) {
+
+  long timeout = -1;
+  long remain;
+  unsigned i;
+
+  for (i = 0; i < b->count; i++) {
+    if (b->batch[i].count) {
+      remain = (long)b->linger_ms - elapsed_ms(&b->batch[i].first);
+      if (remain < 0) {
+        remain = 0;
+      }
+      if (timeout < 0 || remain < timeout) {
+        timeout = remain;
+      }
+    }
+  }
+
+  return (int)timeout;
+}
+
+/**
+ * \brief Publish all batches that have lingered for the linger time
+ */
+int mqtt_batcher_flush_due(struct mqtt_batcher *b) {
+
+  int ret = SS_SUCCESS;
+  unsigned i;
+
+  for (i = 0; i < b->count; i++) {
+    if (b->batch[i].count &&
+        elapsed_ms(&b->batch[i].first) >= (long)b->linger_ms) {
+      if (mqtt_batch_flush(b, &b->batch[i])) {
+        ret = SS_WRITE_ERROR;
+      }
+    }
+  }
+
+  return ret;
+}
+
+/**
+ * \brief Publish all queued batches
+ */
+int mqtt_batcher_flush(struct mqtt_batcher *b) {
+
+  int ret = SS_SUCCESS;
+  unsigned i;
+
+  for (i = 0; i < b->count; i++) {
+    if (mqtt_batch_flush(b, &b->batch[i])) {
+      ret = SS_WRITE_ERROR;
+    }
+  }
+
+  return ret;
+}
+
+/**
+ * \brief Free a batcher, any queued messages are discarded
+ */
+void free_mqtt_batcher(struct mqtt_batcher *b) {
+
+  unsigned i;
+
+  if (b) {
+    if (b->timer) {
+      mqtt_conn_set_drain_cb(b->mc, NULL, NULL);
+      evloop_del_timer(b->mc->el, b->timer);
+    }
+    for (i = 0; i < b->count; i++) {
+      free_mqtt_pub_tmpl(b->batch[i].tmpl);
+      free(b->batch[i].buf);
+    }
+    free(b);
+  }
+
+  return;
+}
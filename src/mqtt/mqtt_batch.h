@@ -0,0 +1,121 @@
+#ifndef MQTT_BATCH__H
+#define MQTT_BATCH__H
+/******************************************************************************
+ * File: mqtt_batch.h
+ * Description: functions to batch published messages per topic
+ * Author: Steven Swann - swannonline@googlemail.com
+ *
+ * Copyright (c) swannonline, 2013-2014
+ *
+ * This file is part of sensorspace.
+ *
+ * sensorspace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * sensorspace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with sensorspace.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "uMQTT.h"
+#include "uMQTT_linux_client.h"
+
+#include "mqtt_publish.h"
+#include "mqtt_spool.h"
+#include "mqtt_qos.h"
+#include "mqtt_conn.h"
+
+#define MQTT_BATCH_MAX_TOPICS         16
+#define MQTT_BATCH_DEFAULT_BYTES      1024
+#define MQTT_BATCH_SEPARATOR          '\n'
+
+/*
+ * \brief Struct to hold the messages queued for a single topic
+ * \param tmpl The publish template for the batch topic
+ * \param buf The batch payload, messages separated by MQTT_BATCH_SEPARATOR
+ * \param len The length of the batch payload
+ * \param count The number of messages in the batch
+ * \param first The time (CLOCK_MONOTONIC) the first message was queued
+ */
+struct mqtt_batch {
+  struct mqtt_pub_tmpl *tmpl;
+  uint8_t *buf;
+  size_t len;
+  unsigned count;
+  struct timespec first;
+};
+
+struct mqtt_batcher;
+
+/*
+ * \brief Callback invoked once the batcher has written the packets due
+ * \param b The batcher
+ * \param arg The argument given to mqtt_batcher_set_flush_cb()
+ */
+typedef void (*mqtt_batcher_cb)(struct mqtt_batcher *b, void *arg);
+
+/*
+ * \brief Struct to hold a batching publisher
+ * \param conn The broker connection's output buffer, NULL while
+ *        disconnected
+ * \param spool Optional spool for packets that could not be sent
+ * \param qos Optional QoS 1 publisher, used in place of the spool. It
+ *        spools packets itself while its window is full.
+ * \param retain The retain flag for published batches
+ * \param linger_ms Maximum time a message is held before publishing,
+ *        0 disables batching.
+ * \param max_bytes Maximum payload size of a batch
+ * \param batch The per-topic batches
+ * \param count The number of topics with a batch
+ * \param mc The managed connection the batcher is attached to, or NULL
+ * \param timer The event loop timer publishing lingering batches,
+ *        replaying the spool and resending unacknowledged packets
+ * \param service_due The timer is set to fire on the next loop iteration
+ * \param on_flush Called after the timer has written the packets due
+ * \param flush_arg The argument passed to on_flush
+ */
+struct mqtt_batcher {
+  struct mqtt_out *conn;
+  struct mqtt_spool *spool;
+  struct mqtt_qos *qos;
+  uint8_t retain;
+  unsigned linger_ms;
+  size_t max_bytes;
+
+  struct mqtt_batch batch[MQTT_BATCH_MAX_TOPICS];
+  unsigned count;
+
+  struct mqtt_conn *mc;
+  struct evloop_timer *timer;
+  bool service_due;
+  mqtt_batcher_cb on_flush;
+  void *flush_arg;
+};
+
+int mqtt_batcher_init(struct mqtt_batcher **b_p, struct mqtt_out *conn,
+    uint8_t retain, unsigned linger_ms, size_t max_bytes);
+int mqtt_batcher_add(struct mqtt_batcher *b, const char *topic,
+    const uint8_t *msg, size_t len);
+void mqtt_batcher_set_conn(struct mqtt_batcher *b, struct mqtt_out *conn);
+void mqtt_batcher_conn_changed(struct mqtt_conn *mc, void *b);
+int mqtt_batcher_attach(struct mqtt_batcher *b, struct mqtt_conn *mc);
+void mqtt_batcher_set_flush_cb(struct mqtt_batcher *b, mqtt_batcher_cb cb,
+    void *arg);
+void mqtt_batcher_arm(struct mqtt_batcher *b);
+int mqtt_batcher_timeout(struct mqtt_batcher *b);
+int mqtt_batcher_flush_due(struct mqtt_batcher *b);
+int mqtt_batcher_flush(struct mqtt_batcher *b);
+void free_mqtt_batcher(struct mqtt_batcher *b);
+
+#endif        /* MQTT_BATCH__H */
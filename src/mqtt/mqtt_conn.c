@@ -0,0 +1,918 @@
+/******************************************************************************
+ * File: mqtt_conn.c
+ * Description: managed broker connection with keepalive and reconnection
+ * Author: Steven Swann - swannonline@googlemail.com
+ *
+ * Copyright (c) swannonline, 2013-2014
+ *
+ * This file is part of sensorspace.
+ *
+ * sensorspace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * sensorspace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with sensorspace.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "sensorspace.h"
+#include "log.h"
+#include "mqtt_publish.h"
+#include "mqtt_spool.h"
+#include "mqtt_conn.h"
+
+#define MQTT_CONNACK_TYPE         0x20
+#define MQTT_PINGREQ_TYPE         0xc0
+#define MQTT_DISCONNECT_TYPE      0xe0
+#define MQTT_SUBACK_FAILURE       0x80
+
+/**
+ * \brief Get the number of milliseconds until a CLOCK_MONOTONIC time
+ */
+static long mqtt_conn_until(const struct timespec *t) {
+
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (t->tv_sec - now.tv_sec) * 1000 +
+    (t->tv_nsec - now.tv_nsec) / 1000000;
+}
+
+/**
+ * \brief Set a CLOCK_MONOTONIC time a number of milliseconds from now
+ */
+static void mqtt_conn_set_time(struct timespec *t, unsigned ms) {
+
+  clock_gettime(CLOCK_MONOTONIC, t);
+
+  t->tv_sec += ms / 1000;
+  t->tv_nsec += (ms % 1000) * 1000000L;
+  if (t->tv_nsec >= 1000000000L) {
+    t->tv_sec++;
+    t->tv_nsec -= 1000000000L;
+  }
+}
+
+/**
+ * \brief Schedule the next reconnect attempt, doubling the delay after
+ *        each failure
+ */
+static void mqtt_conn_backoff(struct mqtt_conn *mc) {
+
+  if (!mc->backoff_ms) {
+    mc->backoff_ms = MQTT_CONN_BACKOFF_MIN_MS;
+  } else if (mc->backoff_ms < MQTT_CONN_BACKOFF_MAX_MS / 2) {
+    mc->backoff_ms *= 2;
+  } else {
+    mc->backoff_ms = MQTT_CONN_BACKOFF_MAX_MS;
+  }
+
+  mqtt_conn_set_time(&mc->retry_at, mc->backoff_ms);
+  log_stderr(LOG_WARN, "Reconnecting to broker in %ums", mc->backoff_ms);
+}
+
+/**
+ * \brief Arm the event loop timer for the next keepalive or reconnect
+ */
+static void mqtt_conn_arm(struct mqtt_conn *mc) {
+
+  if (mc->timer) {
+    evloop_timer_set(mc->timer, mqtt_conn_timeout(mc), 0);
+  }
+}
+
+/**
+ * \brief Event loop callback writing queued output and reading broker
+ *        input
+ */
+static void mqtt_conn_input(struct evloop *el, int fd, uint32_t events,
+    void *arg) {
+
+  struct mqtt_conn *mc = (struct mqtt_conn *)arg;
+
+  (void)el;
+  (void)fd;
+
+  if (events & EPOLLOUT) {
+    if (mqtt_conn_flush(mc)) {
+      return;
+    }
+    if (!mc->out_watch && mc->on_drain) {
+      mc->on_drain(mc, mc->drain_arg);
+    }
+  }
+
+  if ((events & ~EPOLLOUT) && !mqtt_conn_fill(mc)) {
+    mc->on_input(mc, mc->input_arg);
+  }
+}
+
+/**
+ * \brief Event loop callback for keepalive and reconnect
+ */
+static void mqtt_conn_expired(struct evloop *el, struct evloop_timer *t,
+    void *arg) {
+
+  (void)el;
+  (void)t;
+
+  if (!mqtt_conn_service((struct mqtt_conn *)arg)) {
+    mqtt_conn_flush((struct mqtt_conn *)arg);
+  }
+}
+
+/**
+ * \brief Watch the connection's socket in the attached event loop
+ */
+static void mqtt_conn_watch(struct mqtt_conn *mc) {
+
+  if (mc->el && mc->fd >= 0 && !mc->pending && mc->ev_fd < 0) {
+    mc->ev_fd = mc->fd;
+    if (evloop_add_fd(mc->el, mc->ev_fd, EPOLLIN, mqtt_conn_input, mc)) {
+      mc->ev_fd = -1;
+      return;
+    }
+    mc->out_watch = false;
+
+    /* packets are queued and written as the socket allows */
+    mqtt_out_attach(mc->out, mc->ev_fd);
+    mc->conn = mc->out;
+  }
+}
+
+/**
+ * \brief Output buffer callback returning a QoS 0 PUBLISH packet that was
+ *        not written to the front of the spool. QoS 1 packets are
+ *        retransmitted from their window instead.
+ */
+static void mqtt_conn_requeue(const struct iovec *iov, int cnt, void *arg) {
+
+  uint8_t ctrl = *(const uint8_t *)iov[0].iov_base;
+
+  if (MQTT_PKT_TYPE(ctrl) == MQTT_PUBLISH_TYPE &&
+      !(ctrl & MQTT_PUBLISH_QOS_MASK)) {
+    mqtt_spool_prepend((struct mqtt_spool *)arg, iov, cnt);
+  }
+}
+
+/**
+ * \brief Stop watching the connection's socket, before it is closed
+ */
+static void mqtt_conn_unwatch(struct mqtt_conn *mc) {
+
+  if (mc->el && mc->ev_fd >= 0) {
+    mqtt_out_detach(mc->out, mc->spool ? mqtt_conn_requeue : NULL,
+        mc->spool);
+    mc->conn = NULL;
+    evloop_del_fd(mc->el, mc->ev_fd);
+    mc->ev_fd = -1;
+  }
+}
+
+/**
+ * \brief Set the iovecs covering a packet built by uMQTT
+ * \param pkt The finalised packet
+ * \param iov Three iovecs
+ * \return The number of iovecs used
+ */
+static int mqtt_conn_pkt_iov(struct mqtt_packet *pkt, struct iovec *iov) {
+
+  iov[0].iov_base = pkt->fixed;
+  iov[0].iov_len = pkt->fix_len;
+  iov[1].iov_base = pkt->variable;
+  iov[1].iov_len = pkt->var_len;
+  iov[2].iov_base = pkt->payload;
+  iov[2].iov_len = pkt->pay_len;
+
+  return 3;
+}
+
+/**
+ * \brief Queue a SUBSCRIBE packet for a topic at QoS 0. Its SUBACK is
+ *        taken by mqtt_conn_next().
+ * \param mc The managed connection, which should be connected
+ * \param topic The topic
+ * \return SS_WRITE_ERROR if the packet could not be sent
+ */
+static int mqtt_conn_send_subscribe(struct mqtt_conn *mc,
+    const char *topic) {
+
+  struct mqtt_packet *pkt;
+  struct iovec iov[3];
+  int ret = SS_WRITE_ERROR;
+
+  log_stdout(LOG_INFO, "Subscribing to %s", topic);
+
+  if (!(pkt = construct_packet_headers(SUBSCRIBE)) ||
+      init_packet_payload(pkt, SUBSCRIBE, (uint8_t *)topic,
+        strlen(topic))) {
+    goto free;
+  }
+  finalise_packet(pkt);
+
+  if (!mqtt_out_queuev(mc->conn, iov, mqtt_conn_pkt_iov(pkt, iov))) {
+    ret = SS_SUCCESS;
+  }
+
+free:
+  if (ret) {
+    log_stderr(LOG_ERROR, "Subscribing to topic %s.", topic);
+  }
+  if (pkt) {
+    free_packet(pkt);
+  }
+  return ret;
+}
+
+/**
+ * \brief Initialise a managed broker connection, no connection is made
+ *        until mqtt_conn_connect() or mqtt_conn_service() is called
+ * \param mc_p Pointer to the managed connection to be returned
+ * \param ip The broker IP address
+ * \param port The broker port
+ * \param clientid The client identifier, NULL or empty for the default
+ * \param keepalive_s Interval between PINGREQs in seconds, 0 disables
+ *        keepalive
+ */
+int mqtt_conn_init(struct mqtt_conn **mc_p, const char *ip, unsigned port,
+    const char *clientid, unsigned keepalive_s) {
+
+  struct mqtt_conn *mc;
+
+  if (!(mc = calloc(1, sizeof(struct mqtt_conn)))) {
+    log_stderr(LOG_ERROR, "Connection: Out of memory");
+    return SS_OUT_OF_MEM_ERROR;
+  }
+
+  if (mqtt_rx_init(&mc->rx, 0)) {
+    free(mc);
+    return SS_OUT_OF_MEM_ERROR;
+  }
+
+  strncpy(mc->ip, ip, sizeof(mc->ip) - 1);
+  mc->port = port;
+  if (clientid) {
+    strncpy(mc->clientid, clientid, sizeof(mc->clientid) - 1);
+  }
+  mc->keepalive_ms = keepalive_s * 1000;
+  mc->fd = -1;
+  mc->ev_fd = -1;
+
+  /* the first attempt is due immediately */
+  clock_gettime(CLOCK_MONOTONIC, &mc->retry_at);
+
+  *mc_p = mc;
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Set the functions called when the connection is established
+ *        or lost, for example to update the connection used by publishers
+ */
+void mqtt_conn_set_callbacks(struct mqtt_conn *mc, mqtt_conn_cb on_connect,
+    mqtt_conn_cb on_disconnect, void *arg) {
+
+  mc->on_connect = on_connect;
+  mc->on_disconnect = on_disconnect;
+  mc->arg = arg;
+}
+
+/**
+ * \brief Set the function called once the socket has taken the output
+ *        that was waiting for it to be writable, for example to resume
+ *        publishers held back while congested
+ */
+void mqtt_conn_set_drain_cb(struct mqtt_conn *mc, mqtt_conn_cb cb,
+    void *arg) {
+
+  mc->on_drain = cb;
+  mc->drain_arg = arg;
+}
+
+/**
+ * \brief Add a topic to be subscribed to on every connect. If connected,
+ *        the topic is subscribed to immediately.
+ * \param mc The managed connection
+ * \param topic The topic
+ * \return SS_CONN_ERROR if the subscribe failed, the connection is then
+ *         re-established
+ */
+int mqtt_conn_subscribe(struct mqtt_conn *mc, const char *topic) {
+
+  unsigned size;
+  char **t;
+
+  if (mc->topic_count == mc->topic_size) {
+    size = mc->topic_size ? mc->topic_size * 2 : MQTT_CONN_MIN_TOPICS;
+    if (!(t = realloc(mc->topic, size * sizeof(char *)))) {
+      log_stderr(LOG_ERROR, "Connection: Out of memory");
+      return SS_OUT_OF_MEM_ERROR;
+    }
+    mc->topic = t;
+    mc->topic_size = size;
+  }
+
+  if (!(mc->topic[mc->topic_count] = strdup(topic))) {
+    log_stderr(LOG_ERROR, "Connection: Out of memory");
+    return SS_OUT_OF_MEM_ERROR;
+  }
+  mc->topic_count++;
+
+  if (mc->conn && mqtt_conn_send_subscribe(mc, topic)) {
+    mqtt_conn_lost(mc);
+    return SS_CONN_ERROR;
+  }
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Close the broker socket, once the event loop no longer watches it
+ */
+static void mqtt_conn_close(struct mqtt_conn *mc) {
+
+  if (mc->fd >= 0) {
+    close(mc->fd);
+    mc->fd = -1;
+  }
+  mc->pending = false;
+  mc->connack_wait = false;
+}
+
+/**
+ * \brief Abandon the connection being established, and schedule the next
+ *        attempt with backoff
+ */
+static void mqtt_conn_abandon(struct mqtt_conn *mc) {
+
+  if (mc->ev_fd >= 0) {
+    evloop_del_fd(mc->el, mc->ev_fd);
+    mc->ev_fd = -1;
+  }
+  mqtt_conn_close(mc);
+  mqtt_rx_reset(mc->rx);
+
+  mqtt_conn_backoff(mc);
+  mqtt_conn_arm(mc);
+}
+
+/**
+ * \brief Send the CONNECT packet once the socket has connected. The
+ *        packet is small enough to be taken by the empty socket buffer.
+ * \return SS_WRITE_ERROR if the packet could not be sent
+ */
+static int mqtt_conn_send_connect(struct mqtt_conn *mc) {
+
+  unsigned keepalive_s = mc->keepalive_ms / 1000;
+  char clientid[UMQTT_CLIENTID_MAX_LEN];
+  struct mqtt_packet *pkt;
+  struct iovec iov[3];
+  struct msghdr msg;
+  int ret = SS_WRITE_ERROR;
+  ssize_t n;
+
+  if (mc->clientid[0]) {
+    strncpy(clientid, mc->clientid, sizeof(clientid) - 1);
+    clientid[sizeof(clientid) - 1] = '\0';
+  } else {
+    snprintf(clientid, sizeof(clientid), "sensorspace-%d", (int)getpid());
+  }
+
+  if (keepalive_s > 0xffff) {
+    keepalive_s = 0xffff;
+  }
+
+  if (!(pkt = construct_packet_headers(CONNECT)) ||
+      init_packet_payload(pkt, CONNECT, (uint8_t *)clientid,
+        strlen(clientid))) {
+    log_stderr(LOG_ERROR, "Constructing CONNECT packet");
+    goto free;
+  }
+  pkt->variable->connect.keep_alive = htons(keepalive_s);
+  finalise_packet(pkt);
+
+  memset(&msg, 0, sizeof(struct msghdr));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = mqtt_conn_pkt_iov(pkt, iov);
+
+  do {
+    n = sendmsg(mc->fd, &msg, MSG_NOSIGNAL);
+  } while (n < 0 && errno == EINTR);
+
+  if (n != (ssize_t)(pkt->fix_len + pkt->var_len + pkt->pay_len)) {
+    log_stderr(LOG_ERROR, "Sending CONNECT: %s",
+        n < 0 ? strerror(errno) : "short write");
+    goto free;
+  }
+
+  ret = SS_SUCCESS;
+
+free:
+  if (pkt) {
+    free_packet(pkt);
+  }
+  return ret;
+}
+
+/**
+ * \brief Make the pending connection the broker connection, once its
+ *        CONNACK has arrived, and subscribe to each topic
+ */
+static void mqtt_conn_established(struct mqtt_conn *mc) {
+
+  unsigned i;
+
+  /* the socket stays non-blocking, it is now read by mqtt_conn_input() */
+  evloop_del_fd(mc->el, mc->fd);
+  mc->ev_fd = -1;
+
+  log_stdout(LOG_INFO, "Connected to broker:\nip: %s port: %u", mc->ip,
+      mc->port);
+
+  mc->pending = false;
+  mc->connack_wait = false;
+  mc->backoff_ms = 0;
+  mc->connects++;
+  mc->ping_pending = false;
+  mqtt_conn_set_time(&mc->next_ping, mc->keepalive_ms);
+  mqtt_conn_watch(mc);
+  mqtt_conn_arm(mc);
+  if (!mc->conn) {
+    mqtt_conn_lost(mc);
+    return;
+  }
+
+  for (i = 0; i < mc->topic_count; i++) {
+    if (mqtt_conn_send_subscribe(mc, mc->topic[i])) {
+      mqtt_conn_lost(mc);
+      return;
+    }
+  }
+
+  if (mc->on_connect) {
+    mc->on_connect(mc, mc->arg);
+  }
+
+  /* write the SUBSCRIBEs, and anything queued by on_connect */
+  if (mqtt_conn_flush(mc)) {
+    return;
+  }
+
+  /* anything the broker sent after the CONNACK */
+  if (mc->on_input && mc->rx->off < mc->rx->len) {
+    mc->on_input(mc, mc->input_arg);
+  }
+}
+
+/**
+ * \brief Event loop callback advancing the connection being established:
+ *        CONNECT is sent once the socket has connected, and the
+ *        connection is established by a successful CONNACK
+ */
+static void mqtt_conn_progress(struct evloop *el, int fd, uint32_t events,
+    void *arg) {
+
+  struct mqtt_conn *mc = (struct mqtt_conn *)arg;
+  socklen_t len = sizeof(int);
+  struct mqtt_frame f;
+  int err = 0, ret;
+
+  (void)el;
+  (void)events;
+
+  if (!mc->connack_wait) {
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) || err) {
+      log_stderr(LOG_ERROR, "Connecting to broker: %s",
+          strerror(err ? err : errno));
+      mqtt_conn_abandon(mc);
+      return;
+    }
+
+    if (mqtt_conn_send_connect(mc) || evloop_mod_fd(mc->el, fd, EPOLLIN)) {
+      mqtt_conn_abandon(mc);
+      return;
+    }
+    mc->connack_wait = true;
+    return;
+  }
+
+  if (mqtt_rx_fill(mc->rx, fd)) {
+    mqtt_conn_abandon(mc);
+    return;
+  }
+
+  if ((ret = mqtt_rx_next(mc->rx, &f)) == SS_BUF_EMPTY) {
+    return;
+  }
+
+  if (ret || MQTT_PKT_TYPE(f.ctrl) != MQTT_CONNACK_TYPE || f.len < 2 ||
+      f.body[1]) {
+    log_stderr(LOG_ERROR, "Connection refused by broker: %u",
+        !ret && f.len >= 2 ? f.body[1] : 0);
+    mqtt_conn_abandon(mc);
+    return;
+  }
+
+  mqtt_conn_established(mc);
+}
+
+/**
+ * \brief Start an attempt to connect to the broker. The socket connects,
+ *        and the CONNACK is awaited, without blocking; the connection is
+ *        established by the event loop, which then subscribes to each
+ *        topic. An attempt not complete within MQTT_CONN_CONNECT_TIMEOUT_MS
+ *        is abandoned, and on any failure the next attempt is scheduled
+ *        with backoff.
+ * \param mc The managed connection, attached to an event loop
+ * \return SS_CONTINUE while the attempt is in progress, SS_CONN_ERROR if
+ *         it failed to start, SS_SUCCESS if already connected
+ */
+int mqtt_conn_connect(struct mqtt_conn *mc) {
+
+  struct sockaddr_in addr;
+
+  if (mc->fd >= 0) {
+    return mc->pending ? SS_CONTINUE : SS_SUCCESS;
+  }
+
+  if (!mc->el) {
+    log_stderr(LOG_ERROR, "Connection is not attached to an event loop");
+    return SS_INIT_ERROR;
+  }
+
+  log_stdout(LOG_INFO, "Connecting to broker %s:%u", mc->ip, mc->port);
+
+  memset(&addr, 0, sizeof(struct sockaddr_in));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(mc->port);
+  if (inet_pton(AF_INET, mc->ip, &addr.sin_addr) != 1) {
+    log_stderr(LOG_ERROR, "Invalid broker address: %s", mc->ip);
+    goto backoff;
+  }
+
+  if ((mc->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+    log_stderr(LOG_ERROR, "socket: %s", strerror(errno));
+    goto backoff;
+  }
+  mc->pending = true;
+
+  if (connect(mc->fd, (struct sockaddr *)&addr, sizeof(addr)) &&
+      errno != EINPROGRESS) {
+    log_stderr(LOG_ERROR, "Connecting to broker: %s", strerror(errno));
+    goto close;
+  }
+
+  /* the socket is writable once connected */
+  if (evloop_add_fd(mc->el, mc->fd, EPOLLOUT, mqtt_conn_progress, mc)) {
+    goto close;
+  }
+  mc->ev_fd = mc->fd;
+  mc->connack_wait = false;
+  mqtt_rx_reset(mc->rx);
+  mqtt_conn_set_time(&mc->connect_by, MQTT_CONN_CONNECT_TIMEOUT_MS);
+  mqtt_conn_arm(mc);
+
+  return SS_CONTINUE;
+
+close:
+  mqtt_conn_close(mc);
+backoff:
+  mqtt_conn_backoff(mc);
+  mqtt_conn_arm(mc);
+  return SS_CONN_ERROR;
+}
+
+/**
+ * \brief Attach the connection to an event loop. Broker input is then read
+ *        by the loop, and connection, keepalive and reconnection are driven
+ *        by a timer so that mqtt_conn_service() need not be called. The
+ *        first connection attempt is made once the loop runs.
+ * \param mc The managed connection
+ * \param el The event loop, which must outlive the connection
+ * \param on_input Called with packets waiting to be taken with
+ *        mqtt_conn_next()
+ * \param arg The argument passed to on_input
+ */
+int mqtt_conn_attach(struct mqtt_conn *mc, struct evloop *el,
+    mqtt_conn_cb on_input, void *arg) {
+
+  int ret;
+
+  if ((ret = mqtt_out_init(&mc->out, 0, 0))) {
+    return ret;
+  }
+
+  if ((ret = evloop_add_timer(el, &mc->timer, mqtt_conn_expired, mc))) {
+    free_mqtt_out(mc->out);
+    mc->out = NULL;
+    return ret;
+  }
+
+  mc->el = el;
+  mc->on_input = on_input;
+  mc->input_arg = arg;
+
+  mqtt_conn_watch(mc);
+  mqtt_conn_arm(mc);
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Run the attached event loop until the connection is established,
+ *        for those that cannot start without it. Failed attempts are
+ *        retried with backoff meanwhile.
+ * \param mc The managed connection, attached to an event loop
+ * \param timeout_ms The maximum time to wait, -1 to wait indefinitely
+ * \return SS_CONN_ERROR if the wait timed out
+ */
+int mqtt_conn_wait(struct mqtt_conn *mc, int timeout_ms) {
+
+  struct timespec until;
+  long wait;
+  int ret;
+
+  mqtt_conn_set_time(&until, timeout_ms > 0 ? timeout_ms : 0);
+
+  while (!mc->conn) {
+    wait = -1;
+    if (timeout_ms >= 0 && (wait = mqtt_conn_until(&until)) <= 0) {
+      log_stderr(LOG_ERROR, "Timed out connecting to broker");
+      return SS_CONN_ERROR;
+    }
+
+    if ((ret = evloop_run_once(mc->el, (int)wait))) {
+      return ret;
+    }
+  }
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Get the broker socket
+ * \return The socket, or -1 while disconnected
+ */
+int mqtt_conn_fd(struct mqtt_conn *mc) {
+
+  return mc->pending ? -1 : mc->fd;
+}
+
+/**
+ * \brief Get the time until mqtt_conn_service() has work to do
+ * \return The timeout in milliseconds, or -1 if there is none
+ */
+int mqtt_conn_timeout(struct mqtt_conn *mc) {
+
+  long wait;
+
+  if (mc->conn && !mc->keepalive_ms) {
+    return -1;
+  }
+
+  wait = mqtt_conn_until(mc->conn ? &mc->next_ping :
+      mc->pending ? &mc->connect_by : &mc->retry_at);
+
+  return wait > 0 ? (int)wait : 0;
+}
+
+/**
+ * \brief Perform any due keepalive or reconnect action. A PINGREQ is
+ *        sent each keepalive interval, the connection is considered lost
+ *        if its PINGRESP has not arrived by the next. A connection attempt
+ *        is abandoned once MQTT_CONN_CONNECT_TIMEOUT_MS has passed.
+ * \param mc The managed connection
+ * \return SS_SUCCESS if connected, otherwise SS_CONN_ERROR
+ */
+int mqtt_conn_service(struct mqtt_conn *mc) {
+
+  static const uint8_t pingreq[] = { MQTT_PINGREQ_TYPE, 0 };
+  struct iovec iov;
+  int ret;
+
+  if (mc->pending) {
+    if (mqtt_conn_until(&mc->connect_by) > 0) {
+      mqtt_conn_arm(mc);
+    } else {
+      log_stderr(LOG_ERROR, "Timed out connecting to broker");
+      mqtt_conn_abandon(mc);
+    }
+    return SS_CONN_ERROR;
+  }
+
+  if (!mc->conn) {
+    if (mqtt_conn_until(&mc->retry_at) > 0) {
+      mqtt_conn_arm(mc);
+      return SS_CONN_ERROR;
+    }
+    mqtt_conn_connect(mc);
+    return SS_CONN_ERROR;
+  }
+
+  if (!mc->keepalive_ms || mqtt_conn_until(&mc->next_ping) > 0) {
+    mqtt_conn_arm(mc);
+    return SS_SUCCESS;
+  }
+
+  if (mc->ping_pending) {
+    log_stderr(LOG_ERROR, "No PINGRESP from broker");
+    mqtt_conn_lost(mc);
+    return SS_CONN_ERROR;
+  }
+
+  log_stdout(LOG_DEBUG, "Sending PINGREQ");
+
+  iov.iov_base = (void *)pingreq;
+  iov.iov_len = sizeof(pingreq);
+  if ((ret = mqtt_out_queuev(mc->conn, &iov, 1)) == SS_BUF_FULL) {
+    /* try again once the output buffer drains */
+    mqtt_conn_set_time(&mc->next_ping, MQTT_CONN_BACKOFF_MIN_MS);
+    mqtt_conn_arm(mc);
+    return SS_SUCCESS;
+  } else if (ret) {
+    mqtt_conn_lost(mc);
+    return SS_CONN_ERROR;
+  }
+
+  mc->ping_pending = true;
+  mqtt_conn_set_time(&mc->next_ping, mc->keepalive_ms);
+  mqtt_conn_arm(mc);
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Write packets queued while attached to an event loop. Whatever
+ *        the socket does not take now is written once it is writable.
+ * \param mc The managed connection
+ * \return SS_CONN_ERROR if disconnected or the connection was lost
+ */
+int mqtt_conn_flush(struct mqtt_conn *mc) {
+
+  bool pending;
+  int ret;
+
+  if (!mc->conn) {
+    return SS_CONN_ERROR;
+  }
+
+  if (!mc->conn->len && !mc->out_watch) {
+    return SS_SUCCESS;
+  }
+
+  ret = mqtt_out_flush(mc->conn);
+  if (ret && ret != SS_CONTINUE) {
+    mqtt_conn_lost(mc);
+    return SS_CONN_ERROR;
+  }
+
+  pending = (ret == SS_CONTINUE);
+  if (pending != mc->out_watch &&
+      !evloop_mod_fd(mc->el, mc->ev_fd,
+        pending ? EPOLLIN | EPOLLOUT : EPOLLIN)) {
+    mc->out_watch = pending;
+  }
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Check whether publishers should hold back, because more than the
+ *        output buffer high-water mark is waiting to be written
+ */
+bool mqtt_conn_congested(struct mqtt_conn *mc) {
+
+  return mqtt_out_above_hwm(mc->conn);
+}
+
+/**
+ * \brief Read any data available from the broker into the receive buffer
+ * \return SS_CONN_ERROR if disconnected or the connection was lost
+ */
+int mqtt_conn_fill(struct mqtt_conn *mc) {
+
+  if (!mc->conn) {
+    return SS_CONN_ERROR;
+  }
+
+  if (mqtt_rx_fill(mc->rx, mc->fd)) {
+    mqtt_conn_lost(mc);
+    return SS_CONN_ERROR;
+  }
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Get the next packet received from the broker. PINGRESPs and
+ *        SUBACKs are handled here and not returned.
+ * \param mc The managed connection
+ * \param f The frame to be set to the packet
+ * \return SS_SUCCESS if a packet was returned, SS_BUF_EMPTY if more data
+ *         is required, otherwise the stream was malformed and the
+ *         connection is dropped
+ */
+int mqtt_conn_next(struct mqtt_conn *mc, struct mqtt_frame *f) {
+
+  int ret;
+
+  while (!(ret = mqtt_rx_next(mc->rx, f))) {
+    if (MQTT_PKT_TYPE(f->ctrl) == MQTT_PINGRESP_TYPE) {
+      log_stdout(LOG_DEBUG, "PINGRESP");
+      mc->ping_pending = false;
+    } else if (MQTT_PKT_TYPE(f->ctrl) == MQTT_SUBACK_TYPE) {
+      if (f->len < 3 || f->body[2] == MQTT_SUBACK_FAILURE) {
+        log_stderr(LOG_ERROR, "Subscription refused by broker");
+      } else {
+        log_stdout(LOG_DEBUG, "SUBACK");
+      }
+    } else {
+      return SS_SUCCESS;
+    }
+  }
+
+  if (ret != SS_BUF_EMPTY) {
+    mqtt_conn_lost(mc);
+  }
+
+  return ret;
+}
+
+/**
+ * \brief Drop the broker connection and schedule a reconnect. The first
+ *        attempt is made immediately.
+ */
+void mqtt_conn_lost(struct mqtt_conn *mc) {
+
+  if (mc->fd < 0 || mc->pending) {
+    return;
+  }
+
+  log_stderr(LOG_ERROR, "Lost connection to broker");
+
+  /* the socket is unusable, so no DISCONNECT is sent */
+  mqtt_conn_unwatch(mc);
+  mqtt_conn_close(mc);
+  mc->backoff_ms = 0;
+  clock_gettime(CLOCK_MONOTONIC, &mc->retry_at);
+  mqtt_rx_reset(mc->rx);
+  mqtt_conn_arm(mc);
+
+  if (mc->on_disconnect) {
+    mc->on_disconnect(mc, mc->arg);
+  }
+}
+
+/**
+ * \brief Free a managed connection, disconnecting from the broker
+ */
+void free_mqtt_conn(struct mqtt_conn *mc) {
+
+  static const uint8_t disconnect[] = { MQTT_DISCONNECT_TYPE, 0 };
+  struct iovec iov;
+  unsigned i;
+
+  if (mc) {
+    if (mc->conn) {
+      log_stdout(LOG_INFO, "Disconnecting from broker");
+      iov.iov_base = (void *)disconnect;
+      iov.iov_len = sizeof(disconnect);
+      mqtt_out_queuev(mc->conn, &iov, 1);
+      /* give queued packets a chance to reach the broker */
+      mqtt_out_sync(mc->conn, MQTT_CONN_CLOSE_TIMEOUT_MS);
+    }
+    mqtt_conn_unwatch(mc);
+    mqtt_conn_close(mc);
+    if (mc->el) {
+      evloop_del_timer(mc->el, mc->timer);
+    }
+    for (i = 0; i < mc->topic_count; i++) {
+      free(mc->topic[i]);
+    }
+    free(mc->topic);
+    free_mqtt_rx(mc->rx);
+    if (mc->out) {
+      log_stdout(LOG_DEBUG, "Output: %lu packets in %lu writes",
+          mc->out->packets, mc->out->writes);
+    }
+    free_mqtt_out(mc->out);
+    free(mc);
+  }
+}
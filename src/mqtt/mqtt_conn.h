@@ -0,0 +1,158 @@
+#ifndef MQTT_CONN__H
+#define MQTT_CONN__H
+/******************************************************************************
+ * File: mqtt_conn.h
+ * Description: managed broker connection with keepalive and reconnection
+ * Author: Steven Swann - swannonline@googlemail.com
+ *
+ * Copyright (c) swannonline, 2013-2014
+ *
+ * This file is part of sensorspace.
+ *
+ * sensorspace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * sensorspace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with sensorspace.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "uMQTT.h"
+
+#include "mqtt_rx.h"
+#include "mqtt_out.h"
+#include "evloop.h"
+
+#define MQTT_CONN_MIN_TOPICS          16
+#define MQTT_CONN_DEFAULT_KEEPALIVE   30
+#define MQTT_CONN_BACKOFF_MIN_MS      50
+#define MQTT_CONN_BACKOFF_MAX_MS      30000
+#define MQTT_CONN_CLOSE_TIMEOUT_MS    1000
+#define MQTT_CONN_CONNECT_TIMEOUT_MS  5000
+
+struct mqtt_conn;
+struct mqtt_spool;
+
+/*
+ * \brief Callback invoked when a managed connection is established, lost
+ *        or has drained its output
+ * \param mc The managed connection
+ * \param arg The argument given when the callback was set
+ */
+typedef void (*mqtt_conn_cb)(struct mqtt_conn *mc, void *arg);
+
+/*
+ * \brief Struct to hold a managed broker connection. The connection is
+ *        re-established with exponential backoff when lost, and topics
+ *        are subscribed to again on each connect.
+ * \param conn The output buffer publishers queue packets to, NULL while
+ *        disconnected
+ * \param fd The broker socket, owned by the connection, -1 if none
+ * \param pending fd is a connection still being established
+ * \param connack_wait CONNECT was sent on the pending connection and its
+ *        CONNACK is awaited, otherwise the socket is still connecting
+ * \param connect_by The time (CLOCK_MONOTONIC) the pending connection is
+ *        abandoned by
+ * \param rx The broker stream receive buffer, emptied on each connect
+ * \param ip The broker IP address
+ * \param port The broker port
+ * \param clientid The client identifier, empty for one derived from the
+ *        process ID
+ * \param topic The topics to subscribe to
+ * \param topic_count The number of topics
+ * \param topic_size The size of topic
+ * \param keepalive_ms Interval between PINGREQs, 0 disables keepalive
+ * \param next_ping The time (CLOCK_MONOTONIC) the next PINGREQ is due
+ * \param ping_pending A PINGRESP is awaited
+ * \param backoff_ms The delay before the next reconnect attempt
+ * \param retry_at The time (CLOCK_MONOTONIC) of the next reconnect attempt
+ * \param connects The number of times the connection was established
+ * \param on_connect Called after each connect and subscribe
+ * \param on_disconnect Called when the connection is lost
+ * \param arg The argument passed to the callbacks
+ * \param el The event loop the connection is attached to, or NULL
+ * \param timer The keepalive and reconnect timer
+ * \param ev_fd The fd registered with the event loop, -1 if none
+ * \param on_input Called when packets are waiting in rx
+ * \param input_arg The argument passed to on_input
+ * \param out The output buffer, allocated when attached to an event loop
+ * \param out_watch The loop is watching for the socket to be writable
+ * \param on_drain Called once the output the loop was waiting to write has
+ *        been written
+ * \param drain_arg The argument passed to on_drain
+ * \param spool The spool QoS 0 PUBLISH packets queued but not written
+ *        are returned to when the connection is lost, NULL to drop them
+ */
+struct mqtt_conn {
+  struct mqtt_out *conn;
+  int fd;
+  bool pending;
+  bool connack_wait;
+  struct timespec connect_by;
+  struct mqtt_rx *rx;
+  char ip[16];
+  unsigned port;
+  char clientid[UMQTT_CLIENTID_MAX_LEN];
+
+  char **topic;
+  unsigned topic_count;
+  unsigned topic_size;
+
+  unsigned keepalive_ms;
+  struct timespec next_ping;
+  bool ping_pending;
+
+  unsigned backoff_ms;
+  struct timespec retry_at;
+  unsigned long connects;
+
+  mqtt_conn_cb on_connect;
+  mqtt_conn_cb on_disconnect;
+  void *arg;
+
+  struct evloop *el;
+  struct evloop_timer *timer;
+  int ev_fd;
+  mqtt_conn_cb on_input;
+  void *input_arg;
+
+  struct mqtt_out *out;
+  bool out_watch;
+  mqtt_conn_cb on_drain;
+  void *drain_arg;
+  struct mqtt_spool *spool;
+};
+
+int mqtt_conn_init(struct mqtt_conn **mc_p, const char *ip, unsigned port,
+    const char *clientid, unsigned keepalive_s);
+void mqtt_conn_set_callbacks(struct mqtt_conn *mc, mqtt_conn_cb on_connect,
+    mqtt_conn_cb on_disconnect, void *arg);
+void mqtt_conn_set_drain_cb(struct mqtt_conn *mc, mqtt_conn_cb cb,
+    void *arg);
+int mqtt_conn_subscribe(struct mqtt_conn *mc, const char *topic);
+int mqtt_conn_connect(struct mqtt_conn *mc);
+int mqtt_conn_attach(struct mqtt_conn *mc, struct evloop *el,
+    mqtt_conn_cb on_input, void *arg);
+int mqtt_conn_wait(struct mqtt_conn *mc, int timeout_ms);
+int mqtt_conn_fd(struct mqtt_conn *mc);
+int mqtt_conn_timeout(struct mqtt_conn *mc);
+int mqtt_conn_service(struct mqtt_conn *mc);
+int mqtt_conn_flush(struct mqtt_conn *mc);
+bool mqtt_conn_congested(struct mqtt_conn *mc);
+int mqtt_conn_fill(struct mqtt_conn *mc);
+int mqtt_conn_next(struct mqtt_conn *mc, struct mqtt_frame *f);
+void mqtt_conn_lost(struct mqtt_conn *mc);
+void free_mqtt_conn(struct mqtt_conn *mc);
+
+#endif        /* MQTT_CONN__H */
@@ -0,0 +1,416 @@
+/******************************************************************************
+ * File: mqtt_out.c
+ * Description: per-connection output buffer coalescing packets into
+ *              vectored writes
+ * Author: Steven Swann - swannonline@googlemail.com
+ *
+ * Copyright (c) swannonline, 2013-2014
+ *
+ * This file is part of sensorspace.
+ *
+ * sensorspace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * sensorspace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with sensorspace.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "sensorspace.h"
+#include "log.h"
+#include "mqtt_out.h"
+
+/**
+ * \brief Initialise an output buffer
+ * \param o_p Pointer to the output buffer to be returned
+ * \param size The size of the buffer, 0 for MQTT_OUT_DEFAULT_SIZE
+ * \param hwm The high-water mark, 0 for MQTT_OUT_DEFAULT_HWM
+ */
+int mqtt_out_init(struct mqtt_out **o_p, size_t size, size_t hwm) {
+
+  struct mqtt_out *o;
+
+  if (!(o = calloc(1, sizeof(struct mqtt_out)))) {
+    goto free;
+  }
+
+  o->size = size ? size : MQTT_OUT_DEFAULT_SIZE;
+  o->hwm = hwm ? hwm : MQTT_OUT_DEFAULT_HWM;
+  if (o->hwm > o->size) {
+    o->hwm = o->size;
+  }
+  o->fd = -1;
+
+  if (!(o->buf = malloc(o->size))) {
+    goto free;
+  }
+
+  *o_p = o;
+  return SS_SUCCESS;
+
+free:
+  log_stderr(LOG_ERROR, "Output buffer: Out of memory");
+  free_mqtt_out(o);
+  return SS_OUT_OF_MEM_ERROR;
+}
+
+/**
+ * \brief Write the output buffer to a socket. Any data queued for a
+ *        previous socket is discarded.
+ * \param o The output buffer
+ * \param fd The socket
+ */
+int mqtt_out_attach(struct mqtt_out *o, int fd) {
+
+  if (fd < 0) {
+    return SS_INIT_ERROR;
+  }
+
+  mqtt_out_detach(o, NULL, NULL);
+  o->fd = fd;
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Get the length of a queued packet from its fixed header
+ * \param o The output buffer
+ * \param off The offset of the packet from head
+ */
+static size_t mqtt_out_pkt_len(struct mqtt_out *o, size_t off) {
+
+  size_t rem = 0, mult = 1, i;
+  uint8_t b;
+
+  /* a remaining length takes at most 4 bytes */
+  for (i = 1; i <= 4; i++) {
+    b = o->buf[(o->head + off + i) % o->size];
+    rem += (b & 0x7f) * mult;
+    mult *= 128;
+    if (!(b & 0x80)) {
+      break;
+    }
+  }
+
+  return i + 1 + rem;
+}
+
+/**
+ * \brief Set the iovecs covering queued data, which wraps at most once
+ * \param o The output buffer
+ * \param off The offset of the data from head
+ * \param len The length of the data
+ * \param iov Two iovecs
+ * \return The number of iovecs used
+ */
+static int mqtt_out_iov(struct mqtt_out *o, size_t off, size_t len,
+    struct iovec *iov) {
+
+  size_t pos = (o->head + off) % o->size;
+
+  iov[0].iov_base = o->buf + pos;
+  if (pos + len <= o->size) {
+    iov[0].iov_len = len;
+    return 1;
+  }
+
+  iov[0].iov_len = o->size - pos;
+  iov[1].iov_base = o->buf;
+  iov[1].iov_len = len - iov[0].iov_len;
+
+  return 2;
+}
+
+/**
+ * \brief Stop writing the output buffer to its socket. Must be called
+ *        before the socket is closed.
+ * \param o The output buffer
+ * \param cb Called with each packet not completely written, newest first
+ *        so that each can be requeued ahead of the last. NULL to discard
+ *        them.
+ * \param arg The argument passed to cb
+ */
+void mqtt_out_detach(struct mqtt_out *o, mqtt_out_pkt_cb cb, void *arg) {
+
+  struct iovec iov[2];
+  size_t *start = NULL, off;
+  unsigned count = 0, i;
+
+  if (o->len && cb) {
+    /* packets are found from their headers, oldest first */
+    for (off = 0; off < o->len; off += mqtt_out_pkt_len(o, off)) {
+      count++;
+    }
+    if ((start = malloc(count * sizeof(size_t)))) {
+      for (off = 0, i = 0; i < count; off += mqtt_out_pkt_len(o, off)) {
+        start[i++] = off;
+      }
+      for (i = count; i-- > 0;) {
+        off = (i + 1 < count ? start[i + 1] : o->len) - start[i];
+        cb(iov, mqtt_out_iov(o, start[i], off, iov), arg);
+      }
+      free(start);
+      log_stdout(LOG_INFO, "Requeued %u packets of queued output", count);
+    } else {
+      log_stderr(LOG_ERROR, "Output buffer: Out of memory");
+    }
+  }
+
+  if (o->len && !start) {
+    log_stderr(LOG_WARN, "Discarding %zu bytes of queued output",
+        o->len - o->sent);
+  }
+
+  o->fd = -1;
+  o->head = 0;
+  o->len = 0;
+  o->sent = 0;
+  o->refused = false;
+}
+
+/**
+ * \brief Set the function called once a producer refused for lack of room
+ *        can queue again, to resend what was refused
+ * \param o The output buffer
+ * \param cb The callback, NULL for none
+ * \param arg The argument passed to cb
+ */
+void mqtt_out_set_drain_cb(struct mqtt_out *o, mqtt_out_cb cb, void *arg) {
+
+  o->on_drain = cb;
+  o->drain_arg = arg;
+}
+
+/**
+ * \brief Wait for the socket to become writable
+ * \param timeout_ms The maximum time to wait, -1 to wait indefinitely
+ * \return SS_WRITE_ERROR on timeout or error
+ */
+static int mqtt_out_poll(struct mqtt_out *o, int timeout_ms) {
+
+  struct pollfd p;
+  int ret;
+
+  p.fd = o->fd;
+  p.events = POLLOUT;
+
+  do {
+    ret = poll(&p, 1, timeout_ms);
+  } while (ret < 0 && errno == EINTR);
+
+  if (ret <= 0) {
+    log_stderr(LOG_ERROR, "Output buffer: %s",
+        ret ? strerror(errno) : "timed out waiting to write");
+    return SS_WRITE_ERROR;
+  }
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Copy data to the tail of the ring
+ */
+static void mqtt_out_copy(struct mqtt_out *o, const uint8_t *data,
+    size_t len) {
+
+  size_t tail = (o->head + o->len) % o->size;
+  size_t n = o->size - tail;
+
+  if (n > len) {
+    n = len;
+  }
+
+  memcpy(o->buf + tail, data, n);
+  memcpy(o->buf, data + n, len - n);
+  o->len += len;
+}
+
+/**
+ * \brief Write as much queued data as the socket accepts without blocking
+ * \return SS_SUCCESS if the buffer is empty, SS_CONTINUE if data remains
+ *         queued until the socket is writable, SS_WRITE_ERROR if the
+ *         connection failed
+ */
+static int mqtt_out_write(struct mqtt_out *o) {
+
+  struct msghdr msg;
+  struct iovec iov[2];
+  size_t len;
+  ssize_t n;
+
+  memset(&msg, 0, sizeof(struct msghdr));
+  msg.msg_iov = iov;
+
+  while (o->sent < o->len) {
+    msg.msg_iovlen = mqtt_out_iov(o, o->sent, o->len - o->sent, iov);
+
+    n = sendmsg(o->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    o->writes++;
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return SS_CONTINUE;
+      }
+      log_stderr(LOG_ERROR, "sendmsg: %s", strerror(errno));
+      return SS_WRITE_ERROR;
+    }
+
+    /* release the packets written completely */
+    o->sent += n;
+    while (o->sent < o->len && o->sent >= (len = mqtt_out_pkt_len(o, 0))) {
+      o->head = (o->head + len) % o->size;
+      o->len -= len;
+      o->sent -= len;
+    }
+  }
+
+  /* keep the next burst contiguous */
+  o->head = 0;
+  o->len = 0;
+  o->sent = 0;
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Queue a packet. If the buffer is full as much is written out as
+ *        the socket takes without blocking; use mqtt_out_above_hwm() to
+ *        hold back before then. An empty buffer grows to take a packet
+ *        larger than it.
+ * \param o The output buffer
+ * \param iov The iovecs holding the packet
+ * \param cnt The number of iovecs
+ * \return SS_BUF_FULL if there is no room until the socket is writable,
+ *         SS_WRITE_ERROR if the connection failed
+ */
+int mqtt_out_queuev(struct mqtt_out *o, const struct iovec *iov, int cnt) {
+
+  size_t total = 0;
+  uint8_t *buf;
+  int i, ret;
+
+  for (i = 0; i < cnt; i++) {
+    total += iov[i].iov_len;
+  }
+
+  if (o->len && total > o->size - o->len &&
+      (ret = mqtt_out_write(o)) && ret != SS_CONTINUE) {
+    return ret;
+  }
+
+  if (total > o->size - o->len) {
+    if (o->len) {
+      o->refused = true;
+      return SS_BUF_FULL;
+    }
+    if (!(buf = realloc(o->buf, total))) {
+      log_stderr(LOG_ERROR, "Output buffer: Out of memory");
+      return SS_OUT_OF_MEM_ERROR;
+    }
+    o->buf = buf;
+    o->size = total;
+    o->head = 0;
+  }
+
+  for (i = 0; i < cnt; i++) {
+    mqtt_out_copy(o, (const uint8_t *)iov[i].iov_base, iov[i].iov_len);
+  }
+  o->packets++;
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Write as much queued data as the socket accepts without blocking.
+ *        Once a buffer that refused a packet is back under its high-water
+ *        mark, its drain callback is given the chance to queue again.
+ * \param o The output buffer
+ * \return SS_SUCCESS if the buffer is empty, SS_CONTINUE if data remains
+ *         queued until the socket is writable, SS_WRITE_ERROR if the
+ *         connection failed
+ */
+int mqtt_out_flush(struct mqtt_out *o) {
+
+  int ret = mqtt_out_write(o);
+
+  if ((ret == SS_SUCCESS || (ret == SS_CONTINUE && o->len <= o->hwm)) &&
+      o->refused && o->on_drain) {
+    o->refused = false;
+    o->on_drain(o, o->drain_arg);
+    ret = mqtt_out_write(o);
+  }
+
+  return ret;
+}
+
+/**
+ * \brief Write out everything queued, waiting as needed
+ * \param o The output buffer, may be NULL
+ * \param timeout_ms The maximum time to wait, -1 to wait indefinitely
+ * \return SS_WRITE_ERROR on timeout or if the connection failed
+ */
+int mqtt_out_sync(struct mqtt_out *o, int timeout_ms) {
+
+  struct timespec start, now;
+  long left = timeout_ms;
+  int ret;
+
+  if (!o || o->fd < 0) {
+    return SS_SUCCESS;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  while ((ret = mqtt_out_flush(o)) == SS_CONTINUE) {
+    if (timeout_ms >= 0) {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      left = timeout_ms - ((now.tv_sec - start.tv_sec) * 1000 +
+          (now.tv_nsec - start.tv_nsec) / 1000000);
+      if (left <= 0) {
+        left = 0;
+      }
+    }
+    if ((ret = mqtt_out_poll(o, left))) {
+      return ret;
+    }
+  }
+
+  return ret;
+}
+
+/**
+ * \brief Check whether producers should hold back until the queue drains
+ * \return true if more than the high-water mark is queued
+ */
+bool mqtt_out_above_hwm(struct mqtt_out *o) {
+
+  return o && o->len > o->hwm;
+}
+
+/**
+ * \brief Free an output buffer, detaching it first. Queued data is
+ *        discarded, see mqtt_out_sync().
+ */
+void free_mqtt_out(struct mqtt_out *o) {
+
+  if (o) {
+    mqtt_out_detach(o, NULL, NULL);
+    free(o->buf);
+    free(o);
+  }
+}
@@ -0,0 +1,100 @@
+#ifndef MQTT_OUT__H
+#define MQTT_OUT__H
+/******************************************************************************
+ * File: mqtt_out.h
+ * Description: per-connection output buffer coalescing packets into
+ *              vectored writes
+ * Author: Steven Swann - swannonline@googlemail.com
+ *
+ * Copyright (c) swannonline, 2013-2014
+ *
+ * This file is part of sensorspace.
+ *
+ * sensorspace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * sensorspace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with sensorspace.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+
+#define MQTT_OUT_DEFAULT_SIZE     (256 * 1024)
+#define MQTT_OUT_DEFAULT_HWM      (128 * 1024)
+
+/*
+ * \brief Callback taking a packet that was queued but not written
+ * \param iov The iovecs holding the packet
+ * \param cnt The number of iovecs
+ * \param arg The argument given to mqtt_out_detach()
+ */
+typedef void (*mqtt_out_pkt_cb)(const struct iovec *iov, int cnt,
+    void *arg);
+
+struct mqtt_out;
+
+/*
+ * \brief Callback invoked once a buffer that refused a packet has room
+ * \param o The output buffer
+ * \param arg The argument given to mqtt_out_set_drain_cb()
+ */
+typedef void (*mqtt_out_cb)(struct mqtt_out *o, void *arg);
+
+/*
+ * \brief Struct to hold a connection's output buffer. Packets queued with
+ *        mqtt_out_queuev() are held in a ring and written with as few
+ *        sendmsg() calls as the socket allows.
+ *        A packet stays in the ring until all of it has been written, so
+ *        that packets not written can be handed back on detach.
+ * \param fd The socket, -1 when not attached
+ * \param buf The ring buffer
+ * \param size The size of the ring buffer
+ * \param head The offset of the first packet not completely written
+ * \param len The number of bytes queued from head
+ * \param sent The number of bytes from head already written
+ * \param hwm The queued length above which producers should hold back
+ * \param packets The number of packets queued
+ * \param writes The number of sendmsg() calls made
+ * \param refused A packet was refused for lack of room since the buffer
+ *        last drained
+ * \param on_drain Called by mqtt_out_flush() once a refused producer can
+ *        queue again
+ * \param drain_arg The argument passed to on_drain
+ */
+struct mqtt_out {
+  int fd;
+  uint8_t *buf;
+  size_t size;
+  size_t head;
+  size_t len;
+  size_t sent;
+  size_t hwm;
+  unsigned long packets;
+  unsigned long writes;
+
+  bool refused;
+  mqtt_out_cb on_drain;
+  void *drain_arg;
+};
+
+int mqtt_out_init(struct mqtt_out **o_p, size_t size, size_t hwm);
+int mqtt_out_attach(struct mqtt_out *o, int fd);
+void mqtt_out_detach(struct mqtt_out *o, mqtt_out_pkt_cb cb, void *arg);
+void mqtt_out_set_drain_cb(struct mqtt_out *o, mqtt_out_cb cb, void *arg);
+int mqtt_out_queuev(struct mqtt_out *o, const struct iovec *iov, int cnt);
+int mqtt_out_flush(struct mqtt_out *o);
+int mqtt_out_sync(struct mqtt_out *o, int timeout_ms);
+bool mqtt_out_above_hwm(struct mqtt_out *o);
+void free_mqtt_out(struct mqtt_out *o);
+
+#endif        /* MQTT_OUT__H */
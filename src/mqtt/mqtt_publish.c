@@ -0,0 +1,202 @@
+/******************************************************************************
+ * File: mqtt_publish.c
+ * Description: functions to publish sensorspace messages to a broker
+ * Author: Steven Swann - swannonline@googlemail.com
+ *
+ * Copyright (c) swannonline, 2013-2014
+ *
+ * This file is part of sensorspace.
+ *
+ * sensorspace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * sensorspace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with sensorspace.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "sensorspace.h"
+#include "log.h"
+#include "mqtt_publish.h"
+#include "mqtt_out.h"
+
+/**
+ * \brief Initialise a PUBLISH template, encoding the topic ready for use
+ * \param t_p Pointer to the template to be returned
+ * \param topic The NULL terminated topic to publish to
+ * \param retain The retain flag
+ */
+int mqtt_pub_tmpl_init(struct mqtt_pub_tmpl **t_p, const char *topic,
+    uint8_t retain) {
+
+  struct mqtt_pub_tmpl *t;
+  size_t len = strlen(topic);
+
+  if (len > UINT16_MAX) {
+    log_stderr(LOG_ERROR, "Topic too long: %zu bytes", len);
+    return SS_INIT_ERROR;
+  }
+
+  if (!(t = calloc(1, sizeof(struct mqtt_pub_tmpl)))) {
+    goto free;
+  }
+
+  if (!(t->topic = strdup(topic))) {
+    goto free;
+  }
+
+  t->var_len = 2 + len;
+  if (!(t->buf = malloc(MQTT_FIXED_HDR_MAX_LEN + t->var_len))) {
+    goto free;
+  }
+
+  /* UTF-8 encoded topic follows the largest possible fixed header */
+  t->buf[MQTT_FIXED_HDR_MAX_LEN] = len >> 8;
+  t->buf[MQTT_FIXED_HDR_MAX_LEN + 1] = len & 0xff;
+  memcpy(t->buf + MQTT_FIXED_HDR_MAX_LEN + 2, topic, len);
+
+  t->ctrl = MQTT_PUBLISH_TYPE | (retain ? MQTT_PUBLISH_RETAIN : 0);
+
+  *t_p = t;
+  return SS_SUCCESS;
+
+free:
+  log_stderr(LOG_ERROR, "Publish template: Out of memory");
+  free_mqtt_pub_tmpl(t);
+  return SS_OUT_OF_MEM_ERROR;
+}
+
+/**
+ * \brief Encode the remaining length field of a fixed header
+ * \param buf Space for at least MQTT_FIXED_HDR_MAX_LEN - 1 bytes
+ * \param len The remaining length of the packet
+ * \return The number of bytes encoded
+ */
+size_t mqtt_encode_remaining_len(uint8_t *buf, size_t len) {
+
+  size_t n = 0;
+
+  do {
+    buf[n] = len % 128;
+    len /= 128;
+    if (len) {
+      buf[n] |= 0x80;
+    }
+    n++;
+  } while (len);
+
+  return n;
+}
+
+/**
+ * \brief Encode the fixed header of a template for a given payload length
+ * \param t The template
+ * \param rem_len The remaining length of the packet
+ * \return pointer to the start of the packet header within the template
+ */
+static uint8_t *mqtt_pub_tmpl_encode(struct mqtt_pub_tmpl *t,
+    size_t rem_len) {
+
+  uint8_t enc[MQTT_FIXED_HDR_MAX_LEN - 1];
+  size_t n = mqtt_encode_remaining_len(enc, rem_len);
+  uint8_t *start;
+
+  /* header is right aligned against the encoded topic */
+  start = t->buf + MQTT_FIXED_HDR_MAX_LEN - n - 1;
+  start[0] = t->ctrl;
+  memcpy(start + 1, enc, n);
+
+  return start;
+}
+
+/**
+ * \brief Build the iovecs for a PUBLISH packet from a template
+ * \param t The publish template for the topic
+ * \param payload The message payload
+ * \param len The length of the payload
+ * \param iov Two iovecs, set to the packet header and the payload
+ * \return SS_WRITE_ERROR if the payload is too large for a packet
+ */
+int mqtt_pub_tmpl_iov(struct mqtt_pub_tmpl *t, const uint8_t *payload,
+    size_t len, struct iovec *iov) {
+
+  uint8_t *start;
+
+  if (t->var_len + len > MQTT_REMAINING_LEN_MAX) {
+    log_stderr(LOG_ERROR, "Payload too large: %zu bytes", len);
+    return SS_WRITE_ERROR;
+  }
+
+  start = mqtt_pub_tmpl_encode(t, t->var_len + len);
+
+  iov[0].iov_base = start;
+  iov[0].iov_len = (t->buf + MQTT_FIXED_HDR_MAX_LEN + t->var_len) - start;
+  iov[1].iov_base = (void *)payload;
+  iov[1].iov_len = len;
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Queue a PUBLISH packet built from a template
+ * \param conn The broker connection's output buffer
+ * \param t The publish template for the topic
+ * \param payload The message payload
+ * \param len The length of the payload
+ * \return SS_WRITE_ERROR if the packet could not be sent, SS_BUF_FULL if
+ *         the output buffer has no room for it, SS_CONN_ERROR if there is
+ *         no connection
+ */
+int mqtt_publish(struct mqtt_out *conn, struct mqtt_pub_tmpl *t,
+    const uint8_t *payload, size_t len) {
+
+  struct iovec iov[2];
+  int ret;
+
+  if (!conn) {
+    return SS_CONN_ERROR;
+  }
+
+  if (mqtt_pub_tmpl_iov(t, payload, len, iov)) {
+    return SS_WRITE_ERROR;
+  }
+
+  log_stdout(LOG_DEBUG, "PUBLISH %s: %.*s", t->topic, (int)len, payload);
+
+  /* Send packet */
+  if ((ret = mqtt_out_queuev(conn, iov, 2)) == SS_BUF_FULL) {
+    return ret;
+  } else if (ret) {
+    log_stderr(LOG_ERROR, "Sending packet failed");
+    return SS_WRITE_ERROR;
+  }
+
+  log_stdout(LOG_INFO, "Successfully sent packet to broker");
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Free a PUBLISH template
+ */
+void free_mqtt_pub_tmpl(struct mqtt_pub_tmpl *t) {
+
+  if (t) {
+    free(t->topic);
+    free(t->buf);
+    free(t);
+  }
+
+  return;
+}
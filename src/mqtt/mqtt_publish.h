@@ -0,0 +1,69 @@
+#ifndef MQTT_PUBLISH__H
+#define MQTT_PUBLISH__H
+/******************************************************************************
+ * File: mqtt_publish.h
+ * Description: functions to publish sensorspace messages to a broker
+ * Author: Steven Swann - swannonline@googlemail.com
+ *
+ * Copyright (c) swannonline, 2013-2014
+ *
+ * This file is part of sensorspace.
+ *
+ * sensorspace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * sensorspace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with sensorspace.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+#include "uMQTT.h"
+#include "uMQTT_linux_client.h"
+
+#include "mqtt_out.h"
+
+/* control byte plus a maximum of four remaining length bytes */
+#define MQTT_FIXED_HDR_MAX_LEN    5
+#define MQTT_REMAINING_LEN_MAX    268435455
+#define MQTT_PUBLISH_TYPE         0x30
+#define MQTT_PUBLISH_RETAIN       0x01
+#define MQTT_PUBLISH_QOS1         0x02
+#define MQTT_PUBLISH_QOS_MASK     0x06
+#define MQTT_PUBLISH_DUP          0x08
+
+/*
+ * \brief Struct to hold a pre-encoded PUBLISH header for a topic. The
+ *        topic is UTF-8 encoded once, only the remaining length field
+ *        is patched for each message sent.
+ * \param topic The NULL terminated topic
+ * \param buf Space for the fixed header followed by the encoded topic
+ * \param var_len The length of the encoded topic
+ * \param ctrl The fixed header control byte
+ */
+struct mqtt_pub_tmpl {
+  char *topic;
+  uint8_t *buf;
+  size_t var_len;
+  uint8_t ctrl;
+};
+
+size_t mqtt_encode_remaining_len(uint8_t *buf, size_t len);
+int mqtt_pub_tmpl_init(struct mqtt_pub_tmpl **t_p, const char *topic,
+    uint8_t retain);
+int mqtt_pub_tmpl_iov(struct mqtt_pub_tmpl *t, const uint8_t *payload,
+    size_t len, struct iovec *iov);
+int mqtt_publish(struct mqtt_out *conn, struct mqtt_pub_tmpl *t,
+    const uint8_t *payload, size_t len);
+void free_mqtt_pub_tmpl(struct mqtt_pub_tmpl *t);
+
+#endif        /* MQTT_PUBLISH__H */
@@ -0,0 +1,578 @@
+/******************************************************************************
+ * File: mqtt_qos.c
+ * Description: functions to publish at QoS 1 with a window of in-flight packets
+ * Author: Steven Swann - swannonline@googlemail.com
+ *
+ * Copyright (c) swannonline, 2013-2014
+ *
+ * This file is part of sensorspace.
+ *
+ * sensorspace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * sensorspace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with sensorspace.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "sensorspace.h"
+#include "log.h"
+#include "mqtt_qos.h"
+
+/**
+ * \brief Initialise a QoS 1 publisher. PUBACKs are passed to it with
+ *        mqtt_qos_handle() by whatever reads the broker connection.
+ * \param q_p Pointer to the publisher to be returned
+ * \param conn The broker connection's output buffer, NULL while
+ *        disconnected
+ * \param window The maximum number of unacknowledged packets, 0 for the
+ *        default
+ * \param timeout_ms Time to wait for a PUBACK before retransmitting, 0
+ *        for the default
+ */
+int mqtt_qos_init(struct mqtt_qos **q_p, struct mqtt_out *conn,
+    unsigned window, unsigned timeout_ms) {
+
+  struct mqtt_qos *q;
+
+  if (window > MQTT_QOS_MAX_WINDOW) {
+    log_stderr(LOG_ERROR, "In-flight window too large: %u", window);
+    return SS_INIT_ERROR;
+  }
+
+  if (!(q = calloc(1, sizeof(struct mqtt_qos)))) {
+    goto free;
+  }
+
+  q->window = window ? window : MQTT_QOS_DEFAULT_WINDOW;
+  q->timeout_ms = timeout_ms ? timeout_ms : MQTT_QOS_DEFAULT_TIMEOUT;
+  q->next_id = 1;
+  q->oldest_id = 1;
+
+  if (!(q->slot = calloc(q->window, sizeof(struct mqtt_inflight)))) {
+    goto free;
+  }
+
+  mqtt_qos_set_conn(q, conn);
+
+  *q_p = q;
+  return SS_SUCCESS;
+
+free:
+  log_stderr(LOG_ERROR, "QoS publisher: Out of memory");
+  free_mqtt_qos(q);
+  return SS_OUT_OF_MEM_ERROR;
+}
+
+/**
+ * \brief Get the number of milliseconds since a time
+ */
+static long mqtt_qos_elapsed(const struct timespec *then) {
+
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (now.tv_sec - then->tv_sec) * 1000 +
+    (now.tv_nsec - then->tv_nsec) / 1000000;
+}
+
+/**
+ * \brief Get the identifier following another, 0 is not a valid identifier
+ */
+static uint16_t mqtt_qos_next_id(uint16_t id) {
+  return id == UINT16_MAX ? 1 : id + 1;
+}
+
+/**
+ * \brief Send an in-flight packet. The PUBACK timeout runs from when the
+ *        output buffer takes the packet, until then it is left unsent.
+ * \return SS_BUF_FULL if the output buffer has no room for the packet,
+ *         SS_WRITE_ERROR if it could not be sent
+ */
+static int mqtt_qos_send(struct mqtt_qos *q, struct mqtt_inflight *slot) {
+
+  struct iovec iov;
+  int ret;
+
+  if (!q->conn) {
+    ret = SS_CONN_ERROR;
+  } else {
+    iov.iov_base = slot->buf;
+    iov.iov_len = slot->len;
+    ret = mqtt_out_queuev(q->conn, &iov, 1);
+  }
+
+  if (!ret) {
+    clock_gettime(CLOCK_MONOTONIC, &slot->sent);
+  }
+
+  if (!ret && slot->unsent) {
+    slot->unsent = false;
+    q->unsent--;
+  } else if (ret && !slot->unsent) {
+    slot->unsent = true;
+    q->unsent++;
+  }
+
+  return ret;
+}
+
+/**
+ * \brief Send the in-flight packets left unsent, oldest first, stopping
+ *        once the output buffer is full
+ * \return SS_WRITE_ERROR if a packet could not be sent
+ */
+static int mqtt_qos_resend(struct mqtt_qos *q) {
+
+  struct mqtt_inflight *slot;
+  uint16_t id;
+  int ret;
+
+  for (id = q->oldest_id; q->unsent && id != q->next_id;
+      id = mqtt_qos_next_id(id)) {
+    slot = &q->slot[id % q->window];
+    if (slot->id == id && slot->unsent &&
+        (ret = mqtt_qos_send(q, slot))) {
+      return ret == SS_BUF_FULL ? SS_SUCCESS : SS_WRITE_ERROR;
+    }
+  }
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Check whether the in-flight window is full. As identifiers are
+ *        used in sequence, the window is also full while the slot of the
+ *        next identifier holds an unacknowledged packet.
+ */
+bool mqtt_qos_full(struct mqtt_qos *q) {
+  return q->count >= q->window || q->slot[q->next_id % q->window].id;
+}
+
+/**
+ * \brief Encode a PUBLISH packet at QoS 1 into the slot of the next
+ *        identifier and send it, or leave it unsent behind those waiting
+ *        for room in the output buffer. The window must not be full.
+ * \param q The QoS 1 publisher
+ * \param ctrl The fixed header control byte, without the QoS bits
+ * \param var The encoded topic
+ * \param var_len The length of the encoded topic
+ * \param payload The message payload
+ * \param len The length of the payload
+ * \return SS_WRITE_ERROR if the packet could not be sent, it remains
+ *         in-flight and will be retransmitted.
+ */
+static int mqtt_qos_queue(struct mqtt_qos *q, uint8_t ctrl,
+    const uint8_t *var, size_t var_len, const uint8_t *payload, size_t len) {
+
+  struct mqtt_inflight *slot = &q->slot[q->next_id % q->window];
+  size_t rem_len = var_len + 2 + len;
+  size_t need = MQTT_FIXED_HDR_MAX_LEN + rem_len;
+  uint8_t *buf;
+  int ret;
+
+  if (rem_len > MQTT_REMAINING_LEN_MAX) {
+    log_stderr(LOG_ERROR, "Payload too large: %zu bytes", len);
+    return SS_WRITE_ERROR;
+  }
+
+  if (slot->size < need) {
+    if (!(buf = realloc(slot->buf, need))) {
+      log_stderr(LOG_ERROR, "QoS publisher: Out of memory");
+      return SS_OUT_OF_MEM_ERROR;
+    }
+    slot->buf = buf;
+    slot->size = need;
+  }
+
+  slot->id = q->next_id;
+  q->next_id = mqtt_qos_next_id(q->next_id);
+
+  /* encode packet, the identifier follows the topic */
+  buf = slot->buf;
+  buf[0] = ctrl | MQTT_PUBLISH_QOS1;
+  slot->len = 1 + mqtt_encode_remaining_len(buf + 1, rem_len);
+  memcpy(buf + slot->len, var, var_len);
+  slot->len += var_len;
+  buf[slot->len++] = slot->id >> 8;
+  buf[slot->len++] = slot->id & 0xff;
+  memcpy(buf + slot->len, payload, len);
+  slot->len += len;
+
+  q->count++;
+
+  log_stdout(LOG_DEBUG, "PUBLISH (id %u): %.*s", slot->id, (int)len,
+      payload);
+
+  /* keep packets in order behind those waiting for room */
+  if (q->unsent) {
+    slot->unsent = true;
+    q->unsent++;
+    return SS_SUCCESS;
+  }
+
+  if ((ret = mqtt_qos_send(q, slot)) == SS_BUF_FULL) {
+    log_stdout(LOG_DEBUG, "Output buffer full, packet %u waits", slot->id);
+    return SS_SUCCESS;
+  } else if (ret) {
+    log_stderr(LOG_WARN, "Sending packet %u failed, will retransmit",
+        slot->id);
+    return SS_WRITE_ERROR;
+  }
+
+  log_stdout(LOG_INFO, "Successfully sent packet to broker");
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Move spooled packets into the in-flight window as it frees up,
+ *        oldest first. Packets are spooled at QoS 0 and are given an
+ *        identifier as they are sent.
+ * \return SS_WRITE_ERROR if a packet could not be sent, it remains
+ *         in-flight and will be retransmitted.
+ */
+static int mqtt_qos_drain(struct mqtt_qos *q) {
+
+  const uint8_t *pkt;
+  size_t len, hdr, var_len, off;
+  int ret;
+
+  while (q->conn && !mqtt_qos_full(q) &&
+      !mqtt_spool_peek(q->spool, &pkt, &len)) {
+
+    /* skip the fixed header, the encoded topic follows */
+    for (hdr = 1; hdr < len && (pkt[hdr] & 0x80); hdr++);
+    hdr++;
+    var_len = len;
+    if (hdr + 2 <= len) {
+      var_len = 2 + (((size_t)pkt[hdr] << 8) | pkt[hdr + 1]);
+    }
+    off = hdr + var_len + ((pkt[0] & MQTT_PUBLISH_QOS_MASK) ? 2 : 0);
+
+    if ((pkt[0] & 0xf0) != MQTT_PUBLISH_TYPE || off > len) {
+      log_stderr(LOG_ERROR, "Dropping malformed spooled packet");
+      mqtt_spool_pop(q->spool);
+      continue;
+    }
+
+    ret = mqtt_qos_queue(q, pkt[0] &
+        ~(MQTT_PUBLISH_QOS_MASK | MQTT_PUBLISH_DUP), pkt + hdr, var_len,
+        pkt + off, len - off);
+    if (ret == SS_OUT_OF_MEM_ERROR) {
+      return ret;
+    }
+
+    /* the packet is now held in-flight */
+    mqtt_spool_pop(q->spool);
+    if (ret) {
+      return ret;
+    }
+  }
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Publish a message at QoS 1. When the window is full, the message
+ *        is spooled until a PUBACK frees a slot.
+ * \param q The QoS 1 publisher
+ * \param t The publish template for the topic
+ * \param payload The message payload
+ * \param len The length of the payload
+ * \return SS_BUF_FULL if the window is full and the message could not be
+ *         spooled, SS_WRITE_ERROR if the packet could not be sent, it
+ *         then remains in-flight and will be retransmitted.
+ */
+int mqtt_qos_publish(struct mqtt_qos *q, struct mqtt_pub_tmpl *t,
+    const uint8_t *payload, size_t len) {
+
+  struct iovec iov[2];
+  int ret;
+
+  if (t->var_len + 2 + len > MQTT_REMAINING_LEN_MAX) {
+    log_stderr(LOG_ERROR, "Payload too large: %zu bytes", len);
+    return SS_WRITE_ERROR;
+  }
+
+  if ((ret = mqtt_qos_drain(q)) == SS_OUT_OF_MEM_ERROR) {
+    return ret;
+  }
+
+  /* keep packets in order behind those already spooled */
+  if (mqtt_qos_full(q) || mqtt_spool_pending(q->spool)) {
+    if (!q->spool) {
+      log_stdout(LOG_DEBUG, "In-flight window full");
+      return SS_BUF_FULL;
+    }
+    log_stdout(LOG_DEBUG, "In-flight window full, spooling packet");
+    if (mqtt_pub_tmpl_iov(t, payload, len, iov) ||
+        mqtt_spool_append(q->spool, iov, 2)) {
+      return SS_BUF_FULL;
+    }
+    return SS_SUCCESS;
+  }
+
+  log_stdout(LOG_DEBUG, "PUBLISH %s", t->topic);
+
+  return mqtt_qos_queue(q, t->ctrl, t->buf + MQTT_FIXED_HDR_MAX_LEN,
+      t->var_len, payload, len);
+}
+
+/**
+ * \brief Handle a packet received from the broker
+ * \param q The QoS 1 publisher
+ * \param f The received packet
+ * \return SS_NO_MATCH if the packet is not an expected PUBACK
+ */
+int mqtt_qos_handle(struct mqtt_qos *q, const struct mqtt_frame *f) {
+
+  struct mqtt_inflight *slot;
+  uint16_t id;
+
+  if (MQTT_PKT_TYPE(f->ctrl) != MQTT_PUBACK_TYPE || f->len < 2) {
+    return SS_NO_MATCH;
+  }
+
+  id = (f->body[0] << 8) | f->body[1];
+  slot = &q->slot[id % q->window];
+
+  if (!id || slot->id != id) {
+    log_stdout(LOG_DEBUG, "PUBACK for unknown packet %u", id);
+    return SS_NO_MATCH;
+  }
+
+  log_stdout(LOG_DEBUG, "PUBACK %u", id);
+
+  slot->id = 0;
+  q->count--;
+  if (slot->unsent) {
+    slot->unsent = false;
+    q->unsent--;
+  }
+
+  while (q->oldest_id != q->next_id &&
+      q->slot[q->oldest_id % q->window].id != q->oldest_id) {
+    q->oldest_id = mqtt_qos_next_id(q->oldest_id);
+  }
+
+  /* the freed slot is taken by the oldest spooled packet */
+  mqtt_qos_drain(q);
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Get the time until the next retransmission is due, or spooled
+ *        packets can be sent
+ * \return The timeout in milliseconds, or -1 if nothing is in-flight or
+ *         there is no connection to retransmit on
+ */
+int mqtt_qos_timeout(struct mqtt_qos *q) {
+
+  long wait, min = -1;
+  unsigned i;
+
+  if (!q || !q->conn) {
+    return -1;
+  } else if (mqtt_spool_pending(q->spool) && !mqtt_qos_full(q)) {
+    return 0;
+  } else if (q->count == q->unsent) {
+    return -1;
+  }
+
+  /* unsent packets are sent as the output buffer drains */
+  for (i = 0; i < q->window; i++) {
+    if (q->slot[i].id && !q->slot[i].unsent) {
+      wait = (long)q->timeout_ms - mqtt_qos_elapsed(&q->slot[i].sent);
+      if (wait < 0) {
+        wait = 0;
+      }
+      if (min < 0 || wait < min) {
+        min = wait;
+      }
+    }
+  }
+
+  return (int)min;
+}
+
+/**
+ * \brief Retransmit in-flight packets that have not been acknowledged
+ *        within the timeout, oldest first, then send any spooled packets
+ *        the window has room for
+ * \return SS_WRITE_ERROR if a packet could not be sent
+ */
+int mqtt_qos_retransmit(struct mqtt_qos *q) {
+
+  struct mqtt_inflight *slot;
+  int ret = SS_SUCCESS;
+  uint16_t id;
+
+  if (!q || !q->conn) {
+    return SS_SUCCESS;
+  }
+
+  /* due packets join those waiting for room, and are sent in order */
+  for (id = q->oldest_id; id != q->next_id; id = mqtt_qos_next_id(id)) {
+    slot = &q->slot[id % q->window];
+    if (slot->id == id && !slot->unsent &&
+        mqtt_qos_elapsed(&slot->sent) >= q->timeout_ms) {
+      log_stdout(LOG_INFO, "Retransmitting packet %u", slot->id);
+      slot->buf[0] |= MQTT_PUBLISH_DUP;
+      slot->unsent = true;
+      q->unsent++;
+      q->retries++;
+    }
+  }
+
+  if (mqtt_qos_resend(q)) {
+    ret = SS_WRITE_ERROR;
+  }
+
+  if (mqtt_qos_drain(q)) {
+    ret = SS_WRITE_ERROR;
+  }
+
+  return ret;
+}
+
+/**
+ * \brief Output buffer callback sending the packets it refused, and then
+ *        spooled packets, once it has room
+ */
+static void mqtt_qos_drained(struct mqtt_out *o, void *arg) {
+
+  struct mqtt_qos *q = (struct mqtt_qos *)arg;
+
+  (void)o;
+
+  if (!mqtt_qos_resend(q)) {
+    mqtt_qos_drain(q);
+  }
+}
+
+/**
+ * \brief Wait until no more than max packets are in-flight or spooled,
+ *        running the event loop of the connection meanwhile. PUBACKs, and
+ *        anything else received, are handled by its input callback.
+ * \param q The QoS 1 publisher
+ * \param mc The managed connection, attached to an event loop
+ * \param max The number of packets to wait for
+ * \param timeout_ms The maximum time to wait without a packet being
+ *        acknowledged, -1 to wait indefinitely
+ * \return SS_CONN_ERROR if the wait timed out
+ */
+int mqtt_qos_wait(struct mqtt_qos *q, struct mqtt_conn *mc, unsigned max,
+    int timeout_ms) {
+
+  uint64_t pending, last = 0;
+  struct timespec start;
+  long wait, left;
+  int ret;
+
+  while ((pending = q->count + mqtt_spool_pending(q->spool)) > max) {
+    if (!last || pending < last) {
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      last = pending;
+    }
+
+    mqtt_qos_retransmit(q);
+    mqtt_conn_flush(mc);
+
+    wait = mqtt_qos_timeout(q);
+    if (timeout_ms >= 0) {
+      left = timeout_ms - mqtt_qos_elapsed(&start);
+      if (left <= 0) {
+        log_stderr(LOG_ERROR, "Timed out with %llu packets unacknowledged",
+            (unsigned long long)pending);
+        return SS_CONN_ERROR;
+      }
+      if (wait < 0 || left < wait) {
+        wait = left;
+      }
+    }
+
+    if ((ret = evloop_run_once(mc->el, wait))) {
+      return ret;
+    }
+  }
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Change the broker connection's output buffer, NULL while
+ *        disconnected. On a new connection every in-flight packet is
+ *        retransmitted, as the output buffer allows.
+ */
+void mqtt_qos_set_conn(struct mqtt_qos *q, struct mqtt_out *conn) {
+
+  struct mqtt_inflight *slot;
+  unsigned i;
+
+  if (!q || q->conn == conn) {
+    return;
+  }
+
+  if (q->conn) {
+    mqtt_out_set_drain_cb(q->conn, NULL, NULL);
+  }
+  q->conn = conn;
+
+  if (!conn) {
+    return;
+  }
+  mqtt_out_set_drain_cb(conn, mqtt_qos_drained, q);
+
+  for (i = 0; i < q->window; i++) {
+    slot = &q->slot[i];
+    if (slot->id && !slot->unsent) {
+      slot->buf[0] |= MQTT_PUBLISH_DUP;
+      slot->unsent = true;
+      q->unsent++;
+    }
+  }
+
+  if (!mqtt_qos_resend(q)) {
+    mqtt_qos_drain(q);
+  }
+}
+
+/**
+ * \brief Free a QoS 1 publisher
+ */
+void free_mqtt_qos(struct mqtt_qos *q) {
+
+  unsigned i;
+
+  if (q) {
+    mqtt_qos_set_conn(q, NULL);
+    if (q->count) {
+      log_stderr(LOG_WARN, "%u packets were not acknowledged", q->count);
+    }
+    if (q->retries) {
+      log_stdout(LOG_INFO, "%lu packets were retransmitted", q->retries);
+    }
+    if (q->slot) {
+      for (i = 0; i < q->window; i++) {
+        free(q->slot[i].buf);
+      }
+      free(q->slot);
+    }
+    free(q);
+  }
+
+  return;
+}
@@ -0,0 +1,109 @@
+#ifndef MQTT_QOS__H
+#define MQTT_QOS__H
+/******************************************************************************
+ * File: mqtt_qos.h
+ * Description: functions to publish at QoS 1 with a window of in-flight packets
+ * Author: Steven Swann - swannonline@googlemail.com
+ *
+ * Copyright (c) swannonline, 2013-2014
+ *
+ * This file is part of sensorspace.
+ *
+ * sensorspace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * sensorspace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with sensorspace.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "uMQTT.h"
+#include "uMQTT_linux_client.h"
+
+#include "mqtt_publish.h"
+#include "mqtt_rx.h"
+#include "mqtt_spool.h"
+#include "mqtt_conn.h"
+
+#define MQTT_QOS_DEFAULT_WINDOW     64
+#define MQTT_QOS_MAX_WINDOW         UINT16_MAX
+#define MQTT_QOS_DEFAULT_TIMEOUT    5000
+
+/*
+ * \brief Struct to hold an unacknowledged PUBLISH packet
+ * \param id The packet identifier, 0 when the slot is free
+ * \param buf The encoded packet, kept for retransmission
+ * \param len The length of the encoded packet
+ * \param size The size of buf
+ * \param sent The time (CLOCK_MONOTONIC) the packet was last queued to
+ *        the output buffer
+ * \param unsent The packet is waiting for room in the output buffer
+ */
+struct mqtt_inflight {
+  uint16_t id;
+  uint8_t *buf;
+  size_t len;
+  size_t size;
+  struct timespec sent;
+  bool unsent;
+};
+
+/*
+ * \brief Struct to hold a QoS 1 publisher. Packet identifiers are used in
+ *        sequence and a packet is held in slot (id % window) until its
+ *        PUBACK is received, so acknowledgements are matched without
+ *        searching and packets are retransmitted in the order sent.
+ * \param conn The broker connection's output buffer, NULL while
+ *        disconnected
+ * \param spool Optional spool holding packets while the window is full
+ * \param window The maximum number of unacknowledged packets
+ * \param timeout_ms Time to wait for a PUBACK before retransmitting
+ * \param slot The in-flight packets
+ * \param count The number of in-flight packets
+ * \param unsent The number of in-flight packets waiting for room in the
+ *        output buffer, sent in order before any other
+ * \param next_id The identifier of the next packet sent
+ * \param oldest_id The identifier of the oldest in-flight packet, next_id
+ *        if there is none
+ * \param retries The number of packets retransmitted
+ */
+struct mqtt_qos {
+  struct mqtt_out *conn;
+  struct mqtt_spool *spool;
+  unsigned window;
+  unsigned timeout_ms;
+
+  struct mqtt_inflight *slot;
+  unsigned count;
+  unsigned unsent;
+  uint16_t next_id;
+  uint16_t oldest_id;
+
+  unsigned long retries;
+};
+
+int mqtt_qos_init(struct mqtt_qos **q_p, struct mqtt_out *conn,
+    unsigned window, unsigned timeout_ms);
+bool mqtt_qos_full(struct mqtt_qos *q);
+int mqtt_qos_publish(struct mqtt_qos *q, struct mqtt_pub_tmpl *t,
+    const uint8_t *payload, size_t len);
+int mqtt_qos_handle(struct mqtt_qos *q, const struct mqtt_frame *f);
+int mqtt_qos_timeout(struct mqtt_qos *q);
+int mqtt_qos_retransmit(struct mqtt_qos *q);
+int mqtt_qos_wait(struct mqtt_qos *q, struct mqtt_conn *mc, unsigned max,
+    int timeout_ms);
+void mqtt_qos_set_conn(struct mqtt_qos *q, struct mqtt_out *conn);
+void free_mqtt_qos(struct mqtt_qos *q);
+
+#endif        /* MQTT_QOS__H */
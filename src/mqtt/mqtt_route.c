@@ -0,0 +1,433 @@
+/******************************************************************************
+ * File: mqtt_route.c
+ * Description: topic filter trie routing received messages to handlers
+ * Author: Steven Swann - swannonline@googlemail.com
+ *
+ * Copyright (c) swannonline, 2013-2014
+ *
+ * This file is part of sensorspace.
+ *
+ * sensorspace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * sensorspace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with sensorspace.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+#include <stdlib.h>
+#include <string.h>
+
+#include "sensorspace.h"
+#include "log.h"
+#include "mqtt_route.h"
+
+#define MQTT_ROUTE_FNV_BASIS      2166136261u
+#define MQTT_ROUTE_FNV_PRIME      16777619u
+
+/*
+ * \brief State of a match of a topic against the trie
+ * \param topic The topic
+ * \param topic_len The length of the topic
+ * \param payload The payload passed to handlers
+ * \param len The length of the payload
+ * \param all Call the handler of every matching route, rather than stop at
+ *        the first
+ * \param found The first matching route
+ * \param count The number of handlers called
+ */
+struct mqtt_route_ctx {
+  const char *topic;
+  size_t topic_len;
+  const uint8_t *payload;
+  size_t len;
+  bool all;
+  struct mqtt_route *found;
+  unsigned count;
+};
+
+/**
+ * \brief Get the hash of a level name below a parent level
+ */
+static uint32_t route_hash(const struct mqtt_route_node *parent,
+    const char *level, size_t len) {
+
+  uint32_t h = MQTT_ROUTE_FNV_BASIS;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    h = (h ^ (uint8_t)level[i]) * MQTT_ROUTE_FNV_PRIME;
+  }
+
+  return h ^ ((uint32_t)((uintptr_t)parent >> 4) * 2654435761u);
+}
+
+/**
+ * \brief Find the level of a name below a parent level
+ */
+static struct mqtt_route_node *route_child(struct mqtt_router *rt,
+    const struct mqtt_route_node *parent, const char *level, size_t len) {
+
+  struct mqtt_route_node *n;
+
+  n = rt->hash[route_hash(parent, level, len) & (rt->hash_size - 1)];
+  for (; n; n = n->hash_next) {
+    if (n->parent == parent && n->len == len &&
+        !memcmp(n->level, level, len)) {
+      break;
+    }
+  }
+
+  return n;
+}
+
+/**
+ * \brief Double the hash buckets once there are more levels than buckets
+ */
+static int route_rehash(struct mqtt_router *rt) {
+
+  struct mqtt_route_node **hash, *n, *next;
+  unsigned size = rt->hash_size * 2, i, b;
+
+  if (!(hash = calloc(size, sizeof(struct mqtt_route_node *)))) {
+    log_stderr(LOG_ERROR, "Router: Out of memory");
+    return SS_OUT_OF_MEM_ERROR;
+  }
+
+  for (i = 0; i < rt->hash_size; i++) {
+    for (n = rt->hash[i]; n; n = next) {
+      next = n->hash_next;
+      b = route_hash(n->parent, n->level, n->len) & (size - 1);
+      n->hash_next = hash[b];
+      hash[b] = n;
+    }
+  }
+
+  free(rt->hash);
+  rt->hash = hash;
+  rt->hash_size = size;
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Get the level of a name below a parent level, adding it if new.
+ *        + and # levels are also linked from the parent directly.
+ */
+static int route_child_add(struct mqtt_router *rt,
+    struct mqtt_route_node *parent, const char *level, size_t len,
+    struct mqtt_route_node **n_p) {
+
+  struct mqtt_route_node *n;
+  unsigned b;
+  int ret;
+
+  if ((n = route_child(rt, parent, level, len))) {
+    *n_p = n;
+    return SS_SUCCESS;
+  }
+
+  if (rt->nodes >= rt->hash_size && (ret = route_rehash(rt))) {
+    return ret;
+  }
+
+  if (!(n = calloc(1, sizeof(struct mqtt_route_node))) ||
+      !(n->level = malloc(len ? len : 1))) {
+    log_stderr(LOG_ERROR, "Router: Out of memory");
+    free(n);
+    return SS_OUT_OF_MEM_ERROR;
+  }
+  memcpy(n->level, level, len);
+  n->len = len;
+  n->parent = parent;
+
+  b = route_hash(parent, level, len) & (rt->hash_size - 1);
+  n->hash_next = rt->hash[b];
+  rt->hash[b] = n;
+  rt->nodes++;
+
+  if (len == 1 && *level == '+') {
+    parent->plus = n;
+  } else if (len == 1 && *level == '#') {
+    parent->multi = n;
+  }
+
+  *n_p = n;
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Check a topic filter: + and # should fill a level, and # should be
+ *        the last level
+ */
+static int route_check_filter(const char *filter) {
+
+  const char *p;
+
+  if (!*filter) {
+    return SS_INIT_ERROR;
+  }
+
+  for (p = filter; *p; p++) {
+    if (*p != '+' && *p != '#') {
+      continue;
+    }
+    if ((p != filter && p[-1] != '/') ||
+        (p[1] && (*p == '#' || p[1] != '/'))) {
+      return SS_INIT_ERROR;
+    }
+  }
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Initialise a router holding no routes
+ * \param rt_p Pointer to the router
+ */
+int mqtt_router_init(struct mqtt_router **rt_p) {
+
+  struct mqtt_router *rt;
+
+  if (!(rt = calloc(1, sizeof(struct mqtt_router))) ||
+      !(rt->hash = calloc(MQTT_ROUTE_HASH_MIN,
+          sizeof(struct mqtt_route_node *)))) {
+    log_stderr(LOG_ERROR, "Router: Out of memory");
+    free(rt);
+    return SS_OUT_OF_MEM_ERROR;
+  }
+  rt->hash_size = MQTT_ROUTE_HASH_MIN;
+
+  *rt_p = rt;
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Route the messages received on topics matching a filter to a
+ *        handler. Each filter can be given a single route.
+ * \param rt The router
+ * \param filter The topic filter, levels may be + or a final #
+ * \param cb The handler, may be NULL if routes are only matched
+ * \param arg The argument of the handler
+ * \param route_p Pointer to the new route, may be NULL
+ * \return SS_INIT_ERROR if the filter is invalid or already routed
+ */
+int mqtt_router_add(struct mqtt_router *rt, const char *filter,
+    mqtt_route_cb cb, void *arg, struct mqtt_route **route_p) {
+
+  struct mqtt_route_node *n = &rt->root;
+  struct mqtt_route *route;
+  const char *p = filter, *sep;
+  int ret;
+
+  if (route_check_filter(filter)) {
+    log_stderr(LOG_ERROR, "Router: Invalid topic filter: %s", filter);
+    return SS_INIT_ERROR;
+  }
+
+  /* each level of the filter, including empty ones */
+  while (1) {
+    sep = strchr(p, '/');
+    if ((ret = route_child_add(rt, n, p, sep ? (size_t)(sep - p) : strlen(p),
+            &n))) {
+      return ret;
+    }
+    if (!sep) {
+      break;
+    }
+    p = sep + 1;
+  }
+
+  if (n->route) {
+    log_stderr(LOG_ERROR, "Router: Duplicate topic filter: %s", filter);
+    return SS_INIT_ERROR;
+  }
+
+  if (!(route = calloc(1, sizeof(struct mqtt_route))) ||
+      !(route->filter = strdup(filter))) {
+    log_stderr(LOG_ERROR, "Router: Out of memory");
+    free(route);
+    return SS_OUT_OF_MEM_ERROR;
+  }
+  route->cb = cb;
+  route->arg = arg;
+
+  n->route = route;
+
+  if (rt->routes_tail) {
+    rt->routes_tail->list_next = route;
+  } else {
+    rt->routes = route;
+  }
+  rt->routes_tail = route;
+  rt->count++;
+
+  if (route_p) {
+    *route_p = route;
+  }
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Take the route of a matching filter, if it has one
+ * \return true if the match should stop
+ */
+static bool route_visit(struct mqtt_route_ctx *ctx, struct mqtt_route *route) {
+
+  if (!route) {
+    return false;
+  }
+
+  route->matched++;
+  if (!ctx->all) {
+    ctx->found = route;
+    return true;
+  }
+  if (!ctx->found) {
+    ctx->found = route;
+  }
+  if (route->cb) {
+    route->cb(route, ctx->topic, ctx->topic_len, ctx->payload, ctx->len);
+    ctx->count++;
+  }
+
+  return false;
+}
+
+/**
+ * \brief Match the levels of a topic from p below a level of the trie.
+ *        Named levels are tried before +, and + before #, so that the
+ *        first match is the most specific.
+ * \param n The level of the trie
+ * \param p The next level of the topic
+ * \param done Every level of the topic has been matched
+ * \return true if the match should stop
+ */
+static bool route_match(struct mqtt_router *rt, struct mqtt_route_node *n,
+    const char *p, bool done, struct mqtt_route_ctx *ctx) {
+
+  const char *end = ctx->topic + ctx->topic_len, *sep;
+  struct mqtt_route_node *child;
+  bool wild;
+
+  if (done) {
+    /* a/# also matches a */
+    return route_visit(ctx, n->route) ||
+      (n->multi && route_visit(ctx, n->multi->route));
+  }
+
+  /* wildcards do not match the first level of $ topics */
+  wild = !(n == &rt->root && p < end && *p == '$');
+
+  sep = memchr(p, '/', end - p);
+  if ((child = route_child(rt, n, p, (sep ? sep : end) - p)) &&
+      route_match(rt, child, sep ? sep + 1 : end, !sep, ctx)) {
+    return true;
+  }
+  if (wild && n->plus &&
+      route_match(rt, n->plus, sep ? sep + 1 : end, !sep, ctx)) {
+    return true;
+  }
+
+  return wild && n->multi && route_visit(ctx, n->multi->route);
+}
+
+/**
+ * \brief Find the most specific route of a topic
+ * \param rt The router
+ * \param topic The topic, need not be NUL terminated
+ * \param len The length of the topic
+ * \return The route, NULL if none matches
+ */
+struct mqtt_route *mqtt_router_match(struct mqtt_router *rt,
+    const char *topic, size_t len) {
+
+  struct mqtt_route_ctx ctx = { 0 };
+
+  ctx.topic = topic;
+  ctx.topic_len = len;
+
+  route_match(rt, &rt->root, topic, false, &ctx);
+  if (!ctx.found) {
+    rt->unmatched++;
+  }
+
+  return ctx.found;
+}
+
+/**
+ * \brief Call the handler of every route matching the topic of a message
+ * \param rt The router
+ * \param topic The topic, need not be NUL terminated
+ * \param topic_len The length of the topic
+ * \param payload The payload
+ * \param len The length of the payload
+ * \return The number of handlers called
+ */
+unsigned mqtt_router_dispatch(struct mqtt_router *rt, const char *topic,
+    size_t topic_len, const uint8_t *payload, size_t len) {
+
+  struct mqtt_route_ctx ctx = { 0 };
+
+  ctx.topic = topic;
+  ctx.topic_len = topic_len;
+  ctx.payload = payload;
+  ctx.len = len;
+  ctx.all = true;
+
+  route_match(rt, &rt->root, topic, false, &ctx);
+  if (!ctx.found) {
+    rt->unmatched++;
+    log_stdout(LOG_DEBUG, "Router: No route for %.*s", (int)topic_len,
+        topic);
+  }
+
+  return ctx.count;
+}
+
+/**
+ * \brief Check whether a topic holds wildcards, so is only valid as a filter
+ */
+bool mqtt_topic_is_filter(const char *topic) {
+  return strpbrk(topic, "+#") != NULL;
+}
+
+/**
+ * \brief Free a router and its routes
+ * \param rt The router
+ */
+void free_mqtt_router(struct mqtt_router *rt) {
+
+  struct mqtt_route_node *n, *n_next;
+  struct mqtt_route *route, *next;
+  unsigned i;
+
+  if (!rt) {
+    return;
+  }
+
+  for (route = rt->routes; route; route = next) {
+    next = route->list_next;
+    free(route->filter);
+    free(route);
+  }
+
+  for (i = 0; i < rt->hash_size; i++) {
+    for (n = rt->hash[i]; n; n = n_next) {
+      n_next = n->hash_next;
+      free(n->level);
+      free(n);
+    }
+  }
+
+  free(rt->hash);
+  free(rt);
+}
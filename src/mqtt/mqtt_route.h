@@ -0,0 +1,123 @@
+#ifndef MQTT_ROUTE__H
+#define MQTT_ROUTE__H
+/******************************************************************************
+ * File: mqtt_route.h
+ * Description: topic filter trie routing received messages to handlers
+ * Author: Steven Swann - swannonline@googlemail.com
+ *
+ * Copyright (c) swannonline, 2013-2014
+ *
+ * This file is part of sensorspace.
+ *
+ * sensorspace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * sensorspace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with sensorspace.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define MQTT_ROUTE_HASH_MIN       64
+
+struct mqtt_route;
+
+/*
+ * \brief Handler of the messages received on topics matching a filter
+ * \param route The matching route
+ * \param topic The topic of the message, not NUL terminated
+ * \param topic_len The length of the topic
+ * \param payload The payload of the message
+ * \param len The length of the payload
+ */
+typedef void (*mqtt_route_cb)(struct mqtt_route *route, const char *topic,
+    size_t topic_len, const uint8_t *payload, size_t len);
+
+/*
+ * \brief Struct to hold a route from a topic filter to a handler
+ * \param filter The topic filter, levels may be + or a final #
+ * \param cb The handler
+ * \param arg The argument of the handler
+ * \param sensor_id The sensor_id of readings received on matching topics
+ *        that do not carry their own, 0 for none
+ * \param matched The number of messages routed
+ * \param list_next The next route added to the router
+ */
+struct mqtt_route {
+  char *filter;
+  mqtt_route_cb cb;
+  void *arg;
+  uint32_t sensor_id;
+  unsigned long matched;
+
+  struct mqtt_route *list_next;
+};
+
+/*
+ * \brief Struct to hold a level of the topic filter trie
+ * \param parent The level above, NULL for the root
+ * \param level The level name, not NUL terminated
+ * \param len The length of the level name
+ * \param plus The + level below
+ * \param multi The # level below
+ * \param route The route of the filter ending at this level
+ * \param hash_next The next level in the same hash bucket
+ */
+struct mqtt_route_node {
+  struct mqtt_route_node *parent;
+  char *level;
+  size_t len;
+
+  struct mqtt_route_node *plus;
+  struct mqtt_route_node *multi;
+  struct mqtt_route *route;
+
+  struct mqtt_route_node *hash_next;
+};
+
+/*
+ * \brief Struct to hold a topic filter trie. The levels below each level
+ *        are found through a single hash of (parent, name), so that a
+ *        topic is matched in time proportional to its number of levels.
+ * \param root The root level
+ * \param hash The hash buckets of the named levels
+ * \param hash_size The number of hash buckets
+ * \param nodes The number of named levels
+ * \param routes The routes, in the order added
+ * \param routes_tail The last route added
+ * \param count The number of routes
+ * \param unmatched The number of messages matching no route
+ */
+struct mqtt_router {
+  struct mqtt_route_node root;
+
+  struct mqtt_route_node **hash;
+  unsigned hash_size;
+  unsigned nodes;
+
+  struct mqtt_route *routes;
+  struct mqtt_route *routes_tail;
+  unsigned count;
+  unsigned long unmatched;
+};
+
+int mqtt_router_init(struct mqtt_router **rt_p);
+int mqtt_router_add(struct mqtt_router *rt, const char *filter,
+    mqtt_route_cb cb, void *arg, struct mqtt_route **route_p);
+struct mqtt_route *mqtt_router_match(struct mqtt_router *rt,
+    const char *topic, size_t len);
+unsigned mqtt_router_dispatch(struct mqtt_router *rt, const char *topic,
+    size_t topic_len, const uint8_t *payload, size_t len);
+bool mqtt_topic_is_filter(const char *topic);
+void free_mqtt_router(struct mqtt_router *rt);
+
+#endif        /* MQTT_ROUTE__H */
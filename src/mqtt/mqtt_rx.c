@@ -0,0 +1,221 @@
+/******************************************************************************
+ * File: mqtt_rx.c
+ * Description: functions to read MQTT packets from a broker stream
+ * Author: Steven Swann - swannonline@googlemail.com
+ *
+ * Copyright (c) swannonline, 2013-2014
+ *
+ * This file is part of sensorspace.
+ *
+ * sensorspace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * sensorspace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with sensorspace.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "sensorspace.h"
+#include "log.h"
+#include "mqtt_publish.h"
+#include "mqtt_rx.h"
+
+/**
+ * \brief Initialise a broker stream receive buffer
+ * \param rx_p Pointer to the receive buffer to be returned
+ * \param size The initial buffer size, 0 for the default. The buffer
+ *        grows to hold larger packets.
+ */
+int mqtt_rx_init(struct mqtt_rx **rx_p, size_t size) {
+
+  struct mqtt_rx *rx;
+
+  if (!(rx = calloc(1, sizeof(struct mqtt_rx)))) {
+    goto free;
+  }
+
+  rx->size = size ? size : MQTT_RX_DEFAULT_BYTES;
+  if (!(rx->buf = malloc(rx->size))) {
+    goto free;
+  }
+
+  *rx_p = rx;
+  return SS_SUCCESS;
+
+free:
+  log_stderr(LOG_ERROR, "Receive buffer: Out of memory");
+  free_mqtt_rx(rx);
+  return SS_OUT_OF_MEM_ERROR;
+}
+
+/**
+ * \brief Discard any data held, such as a partial packet from a
+ *        connection that has been lost
+ */
+void mqtt_rx_reset(struct mqtt_rx *rx) {
+
+  if (rx) {
+    rx->len = 0;
+    rx->off = 0;
+  }
+}
+
+/**
+ * \brief Read any available data from the broker socket
+ * \param rx The receive buffer
+ * \param fd The broker socket
+ * \return SS_CONN_ERROR if the broker closed the connection
+ */
+int mqtt_rx_fill(struct mqtt_rx *rx, int fd) {
+
+  ssize_t n;
+
+  /* discard processed packets */
+  if (rx->off) {
+    memmove(rx->buf, rx->buf + rx->off, rx->len - rx->off);
+    rx->len -= rx->off;
+    rx->off = 0;
+  }
+
+  if (rx->len == rx->size) {
+    /* full, packets must be taken with mqtt_rx_next() first */
+    return SS_SUCCESS;
+  }
+
+  do {
+    n = recv(fd, rx->buf + rx->len, rx->size - rx->len, MSG_DONTWAIT);
+  } while (n < 0 && errno == EINTR);
+
+  if (n < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return SS_SUCCESS;
+    }
+    log_stderr(LOG_ERROR, "recv: %s", strerror(errno));
+    return SS_CONN_ERROR;
+  } else if (!n) {
+    log_stderr(LOG_ERROR, "Broker closed the connection");
+    return SS_CONN_ERROR;
+  }
+
+  rx->len += n;
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Get the next complete packet from the receive buffer
+ * \param rx The receive buffer
+ * \param f The frame to be set to the packet
+ * \return SS_SUCCESS if a packet was returned, SS_BUF_EMPTY if more data
+ *         is required, SS_OUT_OF_MEM_ERROR if the packet can not be held
+ */
+int mqtt_rx_next(struct mqtt_rx *rx, struct mqtt_frame *f) {
+
+  const uint8_t *p = rx->buf + rx->off;
+  size_t avail = rx->len - rx->off;
+  size_t rem_len = 0, n = 1, need;
+  unsigned shift = 0;
+  uint8_t *buf;
+
+  if (avail < 2) {
+    return SS_BUF_EMPTY;
+  }
+
+  /* decode remaining length */
+  do {
+    if (n >= avail) {
+      return SS_BUF_EMPTY;
+    }
+    if (n >= MQTT_FIXED_HDR_MAX_LEN) {
+      log_stderr(LOG_ERROR, "Malformed packet remaining length");
+      return SS_READ_ERROR;
+    }
+    rem_len |= (size_t)(p[n] & 0x7f) << shift;
+    shift += 7;
+  } while (p[n++] & 0x80);
+
+  need = n + rem_len;
+  if (avail < need) {
+    if (need > rx->size) {
+      /* grow so that the whole packet can be held */
+      if (!(buf = realloc(rx->buf, need))) {
+        log_stderr(LOG_ERROR, "Receive buffer: Out of memory");
+        return SS_OUT_OF_MEM_ERROR;
+      }
+      rx->buf = buf;
+      rx->size = need;
+    }
+    return SS_BUF_EMPTY;
+  }
+
+  f->ctrl = p[0];
+  f->body = p + n;
+  f->len = rem_len;
+
+  rx->off += need;
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Locate the topic and payload of a received PUBLISH packet. Both
+ *        point into the receive buffer and are not NULL terminated.
+ * \param f The received packet
+ * \param topic Set to the topic
+ * \param topic_len Set to the length of the topic
+ * \param payload Set to the payload
+ * \param len Set to the length of the payload
+ * \return SS_NO_MATCH if the packet is not a valid PUBLISH packet
+ */
+int mqtt_frame_publish(const struct mqtt_frame *f, const char **topic,
+    size_t *topic_len, const uint8_t **payload, size_t *len) {
+
+  size_t hdr_len;
+
+  if (MQTT_PKT_TYPE(f->ctrl) != MQTT_PUBLISH_FRAME_TYPE || f->len < 2) {
+    return SS_NO_MATCH;
+  }
+
+  *topic_len = (f->body[0] << 8) | f->body[1];
+  hdr_len = 2 + *topic_len;
+
+  /* QoS 1 and 2 packets carry a packet identifier */
+  if (f->ctrl & 0x06) {
+    hdr_len += 2;
+  }
+
+  if (hdr_len > f->len) {
+    return SS_NO_MATCH;
+  }
+
+  *topic = (const char *)f->body + 2;
+  *payload = f->body + hdr_len;
+  *len = f->len - hdr_len;
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Free a broker stream receive buffer
+ */
+void free_mqtt_rx(struct mqtt_rx *rx) {
+
+  if (rx) {
+    free(rx->buf);
+    free(rx);
+  }
+
+  return;
+}
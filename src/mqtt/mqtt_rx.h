@@ -0,0 +1,71 @@
+#ifndef MQTT_RX__H
+#define MQTT_RX__H
+/******************************************************************************
+ * File: mqtt_rx.h
+ * Description: functions to read MQTT packets from a broker stream
+ * Author: Steven Swann - swannonline@googlemail.com
+ *
+ * Copyright (c) swannonline, 2013-2014
+ *
+ * This file is part of sensorspace.
+ *
+ * sensorspace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * sensorspace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with sensorspace.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+#include <stdint.h>
+#include <stddef.h>
+
+#define MQTT_RX_DEFAULT_BYTES     4096
+#define MQTT_PKT_TYPE(ctrl)       ((ctrl) & 0xf0)
+#define MQTT_PUBLISH_FRAME_TYPE   0x30
+#define MQTT_PUBACK_TYPE          0x40
+#define MQTT_SUBACK_TYPE          0x90
+#define MQTT_PINGRESP_TYPE        0xd0
+
+/*
+ * \brief Struct to hold a received packet. The body points into the
+ *        receive buffer and is only valid until the next read.
+ * \param ctrl The fixed header control byte
+ * \param body The packet, following the fixed header
+ * \param len The remaining length of the packet
+ */
+struct mqtt_frame {
+  uint8_t ctrl;
+  const uint8_t *body;
+  size_t len;
+};
+
+/*
+ * \brief Struct to hold a broker stream receive buffer
+ * \param buf The receive buffer
+ * \param size The size of the receive buffer
+ * \param len The number of bytes held
+ * \param off The offset of the first unprocessed byte
+ */
+struct mqtt_rx {
+  uint8_t *buf;
+  size_t size;
+  size_t len;
+  size_t off;
+};
+
+int mqtt_rx_init(struct mqtt_rx **rx_p, size_t size);
+void mqtt_rx_reset(struct mqtt_rx *rx);
+int mqtt_rx_fill(struct mqtt_rx *rx, int fd);
+int mqtt_rx_next(struct mqtt_rx *rx, struct mqtt_frame *f);
+int mqtt_frame_publish(const struct mqtt_frame *f, const char **topic,
+    size_t *topic_len, const uint8_t **payload, size_t *len);
+void free_mqtt_rx(struct mqtt_rx *rx);
+
+#endif        /* MQTT_RX__H */
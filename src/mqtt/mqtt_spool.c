@@ -0,0 +1,468 @@
+/******************************************************************************
+ * File: mqtt_spool.c
+ * Description: disk backed store-and-forward spool for unsent packets
+ * Author: Steven Swann - swannonline@googlemail.com
+ *
+ * Copyright (c) swannonline, 2013-2014
+ *
+ * This file is part of sensorspace.
+ *
+ * sensorspace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * sensorspace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with sensorspace.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sensorspace.h"
+#include "log.h"
+#include "mqtt_spool.h"
+
+/**
+ * \brief Open, or create, a spool segment file
+ * \param s_p Pointer to the spool to be returned
+ * \param path The segment file path, NULL to hold the spool in memory
+ *        only, it is then lost on exit
+ * \param size The segment file size for a new spool, 0 for the default
+ * \param rate The maximum drain rate in packets/second, 0 for the default
+ */
+int mqtt_spool_open(struct mqtt_spool **s_p, const char *path,
+    size_t size, unsigned rate) {
+
+  struct mqtt_spool *s;
+  struct stat st;
+
+  if (!(s = calloc(1, sizeof(struct mqtt_spool)))) {
+    log_stderr(LOG_ERROR, "Spool: Out of memory");
+    return SS_OUT_OF_MEM_ERROR;
+  }
+  s->fd = -1;
+
+  if (!(s->path = strdup(path ? path : "(memory)"))) {
+    log_stderr(LOG_ERROR, "Spool: Out of memory");
+    goto free;
+  }
+
+  size = size ? size : MQTT_SPOOL_DEFAULT_BYTES;
+  if (!path) {
+    /* pages are only allocated as packets are spooled */
+    s->map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (s->map == MAP_FAILED) {
+      log_stderr(LOG_ERROR, "Spool: mmap: %s", strerror(errno));
+      s->map = NULL;
+      goto free;
+    }
+    goto map;
+  }
+
+  s->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (s->fd < 0 || fstat(s->fd, &st)) {
+    log_stderr(LOG_ERROR, "Spool: %s: %s", path, strerror(errno));
+    goto free;
+  }
+
+  /* only one process may own a spool */
+  if (flock(s->fd, LOCK_EX | LOCK_NB)) {
+    log_stderr(LOG_ERROR, "Spool: %s is in use", path);
+    goto free;
+  }
+
+  if ((size_t)st.st_size >= MQTT_SPOOL_DATA_OFFSET) {
+    /* reuse existing spool, along with any unsent packets */
+    size = st.st_size;
+  } else if (size <= MQTT_SPOOL_DATA_OFFSET || ftruncate(s->fd, size)) {
+    log_stderr(LOG_ERROR, "Spool: %s: failed to size spool", path);
+    goto free;
+  }
+
+  s->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+  if (s->map == MAP_FAILED) {
+    log_stderr(LOG_ERROR, "Spool: mmap %s: %s", path, strerror(errno));
+    s->map = NULL;
+    goto free;
+  }
+
+map:
+  s->hdr = (struct mqtt_spool_hdr *)s->map;
+
+  if (s->hdr->magic != MQTT_SPOOL_MAGIC ||
+      s->hdr->version != MQTT_SPOOL_VERSION || s->hdr->size != size ||
+      s->hdr->head > s->hdr->tail || s->hdr->tail > size) {
+    /* new, or unrecognised, spool */
+    s->hdr->magic = MQTT_SPOOL_MAGIC;
+    s->hdr->version = MQTT_SPOOL_VERSION;
+    s->hdr->size = size;
+    s->hdr->head = MQTT_SPOOL_DATA_OFFSET;
+    s->hdr->tail = MQTT_SPOOL_DATA_OFFSET;
+    s->hdr->count = 0;
+  }
+
+  s->rate = rate ? rate : MQTT_SPOOL_DEFAULT_RATE;
+  clock_gettime(CLOCK_MONOTONIC, &s->last);
+
+  log_stdout(LOG_INFO, "Spool %s: %zu bytes, %llu packets pending",
+      s->path, size, (unsigned long long)s->hdr->count);
+
+  *s_p = s;
+  return SS_SUCCESS;
+
+free:
+  mqtt_spool_close(s);
+  return SS_INIT_ERROR;
+}
+
+/**
+ * \brief Append a packet to the spool
+ * \param s The spool
+ * \param iov The iovecs making up the encoded packet
+ * \param cnt The number of iovecs
+ * \return SS_BUF_FULL if the packet was dropped
+ */
+int mqtt_spool_append(struct mqtt_spool *s, const struct iovec *iov,
+    int cnt) {
+
+  struct mqtt_spool_hdr *hdr = s->hdr;
+  uint32_t len = 0;
+  int i;
+
+  for (i = 0; i < cnt; i++) {
+    len += iov[i].iov_len;
+  }
+
+  if (hdr->tail + sizeof(len) + len > hdr->size &&
+      hdr->head > MQTT_SPOOL_DATA_OFFSET) {
+    /* reclaim the space of drained packets */
+    memmove(s->map + MQTT_SPOOL_DATA_OFFSET, s->map + hdr->head,
+        hdr->tail - hdr->head);
+    hdr->tail -= hdr->head - MQTT_SPOOL_DATA_OFFSET;
+    hdr->head = MQTT_SPOOL_DATA_OFFSET;
+  }
+
+  if (hdr->tail + sizeof(len) + len > hdr->size) {
+    if (!s->dropped++) {
+      log_stderr(LOG_ERROR, "Spool %s full, dropping packets", s->path);
+    }
+    return SS_BUF_FULL;
+  }
+
+  /* data first, so an interrupted append is never seen */
+  memcpy(s->map + hdr->tail, &len, sizeof(len));
+  len = sizeof(len);
+  for (i = 0; i < cnt; i++) {
+    memcpy(s->map + hdr->tail + len, iov[i].iov_base, iov[i].iov_len);
+    len += iov[i].iov_len;
+  }
+  hdr->tail += len;
+  hdr->count++;
+
+  log_stdout(LOG_DEBUG, "Spooled packet, %llu pending",
+      (unsigned long long)hdr->count);
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Return a packet to the front of the spool, ahead of those already
+ *        pending, for example one queued but not written when the
+ *        connection was lost. Pending packets are moved to the end of the
+ *        segment when there is no room in front.
+ * \param s The spool
+ * \param iov The iovecs making up the encoded packet
+ * \param cnt The number of iovecs
+ * \return SS_BUF_FULL if the packet was dropped
+ */
+int mqtt_spool_prepend(struct mqtt_spool *s, const struct iovec *iov,
+    int cnt) {
+
+  struct mqtt_spool_hdr *hdr = s->hdr;
+  uint64_t shift;
+  uint32_t len = 0;
+  size_t off;
+  int i;
+
+  for (i = 0; i < cnt; i++) {
+    len += iov[i].iov_len;
+  }
+
+  if (hdr->head < MQTT_SPOOL_DATA_OFFSET + sizeof(len) + len) {
+    if (hdr->size - (hdr->tail - hdr->head) <
+        MQTT_SPOOL_DATA_OFFSET + sizeof(len) + len) {
+      if (!s->dropped++) {
+        log_stderr(LOG_ERROR, "Spool %s full, dropping packets", s->path);
+      }
+      return SS_BUF_FULL;
+    }
+    shift = hdr->size - hdr->tail;
+    memmove(s->map + hdr->head + shift, s->map + hdr->head,
+        hdr->tail - hdr->head);
+    hdr->head += shift;
+    hdr->tail += shift;
+  }
+
+  /* data first, so an interrupted prepend is never seen */
+  off = hdr->head - sizeof(len) - len;
+  memcpy(s->map + off, &len, sizeof(len));
+  len = sizeof(len);
+  for (i = 0; i < cnt; i++) {
+    memcpy(s->map + off + len, iov[i].iov_base, iov[i].iov_len);
+    len += iov[i].iov_len;
+  }
+  hdr->head = off;
+  hdr->count++;
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief The number of packets waiting to be sent
+ */
+uint64_t mqtt_spool_pending(struct mqtt_spool *s) {
+  return s ? s->hdr->count : 0;
+}
+
+/**
+ * \brief Get the oldest spooled packet, leaving it in the spool
+ * \param s The spool, may be NULL
+ * \param pkt Pointer to the packet, valid until the spool is changed
+ * \param len Pointer to the length of the packet
+ * \return SS_BUF_EMPTY if there is no packet
+ */
+int mqtt_spool_peek(struct mqtt_spool *s, const uint8_t **pkt, size_t *len) {
+
+  uint32_t n;
+
+  if (!mqtt_spool_pending(s)) {
+    return SS_BUF_EMPTY;
+  }
+
+  memcpy(&n, s->map + s->hdr->head, sizeof(n));
+  *pkt = s->map + s->hdr->head + sizeof(n);
+  *len = n;
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Remove the oldest spooled packet, once it has been sent
+ */
+void mqtt_spool_pop(struct mqtt_spool *s) {
+
+  struct mqtt_spool_hdr *hdr = s->hdr;
+  uint32_t len;
+
+  if (!hdr->count) {
+    return;
+  }
+
+  memcpy(&len, s->map + hdr->head, sizeof(len));
+  hdr->head += sizeof(len) + len;
+
+  if (!--hdr->count) {
+    hdr->head = MQTT_SPOOL_DATA_OFFSET;
+    hdr->tail = MQTT_SPOOL_DATA_OFFSET;
+    log_stdout(LOG_INFO, "Spool drained");
+  }
+}
+
+/**
+ * \brief Add drain tokens for the time elapsed. At most 100ms worth of
+ *        tokens are held so that a drain never floods the connection.
+ */
+static void mqtt_spool_refill(struct mqtt_spool *s) {
+
+  struct timespec now;
+  double burst = s->rate / 10.0;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  s->tokens += ((now.tv_sec - s->last.tv_sec) +
+      (now.tv_nsec - s->last.tv_nsec) / 1e9) * s->rate;
+  s->last = now;
+
+  if (s->tokens > (burst > 1.0 ? burst : 1.0)) {
+    s->tokens = burst > 1.0 ? burst : 1.0;
+  }
+
+  return;
+}
+
+/**
+ * \brief Get the time until spooled packets may next be drained
+ * \return The timeout in milliseconds, or -1 if the spool is empty
+ */
+int mqtt_spool_timeout(struct mqtt_spool *s) {
+
+  if (!mqtt_spool_pending(s)) {
+    return -1;
+  }
+
+  mqtt_spool_refill(s);
+  if (s->tokens >= 1.0) {
+    return 0;
+  }
+
+  return (int)((1.0 - s->tokens) * 1000 / s->rate) + 1;
+}
+
+/**
+ * \brief Send spooled packets, in order, subject to the drain rate. Packets
+ *        are queued in bulk directly from the segment file, behind any
+ *        packets already in the connection's output buffer.
+ * \param s The spool
+ * \param conn The broker connection's output buffer, NULL while
+ *        disconnected
+ * \return SS_WRITE_ERROR if the connection failed
+ */
+int mqtt_spool_drain(struct mqtt_spool *s, struct mqtt_out *conn) {
+
+  struct mqtt_spool_hdr *hdr = s->hdr;
+  struct iovec iov[MQTT_SPOOL_DRAIN_MAX];
+  uint64_t off = hdr->head;
+  uint32_t len;
+  int ret, cnt = 0;
+
+  if (!hdr->count) {
+    return SS_SUCCESS;
+  } else if (!conn) {
+    return SS_CONN_ERROR;
+  }
+
+  mqtt_spool_refill(s);
+
+  /* gather packets */
+  while (cnt < MQTT_SPOOL_DRAIN_MAX && cnt < (int)s->tokens &&
+      (uint64_t)cnt < hdr->count) {
+    memcpy(&len, s->map + off, sizeof(len));
+    iov[cnt].iov_base = s->map + off + sizeof(len);
+    iov[cnt].iov_len = len;
+    off += sizeof(len) + len;
+    cnt++;
+  }
+
+  if (!cnt) {
+    return SS_SUCCESS;
+  }
+
+  log_stdout(LOG_DEBUG, "Draining %d spooled packets", cnt);
+
+  /* the packets leave the spool once queued together */
+  ret = mqtt_out_queuev(conn, iov, cnt);
+  if (ret == SS_BUF_FULL) {
+    /* try again once the output buffer drains */
+    s->tokens = 0;
+    return SS_SUCCESS;
+  } else if (ret) {
+    log_stderr(LOG_ERROR, "Spool drain failed");
+    /* hold off for a second before retrying */
+    s->tokens = -(double)s->rate;
+    return SS_WRITE_ERROR;
+  }
+
+  while (cnt--) {
+    mqtt_spool_pop(s);
+    s->tokens -= 1.0;
+  }
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Publish a message, spooling it if the broker can not be reached.
+ *        Pending spooled packets are drained after a successful send.
+ * \param s The spool, may be NULL to disable spooling
+ * \param conn The broker connection's output buffer, NULL while
+ *        disconnected
+ * \param t The publish template for the topic
+ * \param payload The message payload
+ * \param len The length of the payload
+ * \return SS_SUCCESS if the message was sent, queued or spooled,
+ *         SS_BUF_FULL if it was dropped, otherwise the error of the send
+ *         when spooling is disabled
+ */
+int mqtt_spool_publish(struct mqtt_spool *s, struct mqtt_out *conn,
+    struct mqtt_pub_tmpl *t, const uint8_t *payload, size_t len) {
+
+  struct iovec pkt[2];
+  int ret;
+
+  if (!s) {
+    if ((ret = mqtt_publish(conn, t, payload, len)) == SS_BUF_FULL) {
+      log_stderr(LOG_ERROR, "Output buffer full, dropping packet");
+    }
+    return ret;
+  }
+
+  if (mqtt_pub_tmpl_iov(t, payload, len, pkt)) {
+    return SS_WRITE_ERROR;
+  }
+
+  /* hold packets until the connection is re-established, and keep them in
+   * order behind those already spooled */
+  if (!conn || s->hdr->count) {
+    if (mqtt_spool_append(s, pkt, 2)) {
+      return SS_BUF_FULL;
+    }
+    if (conn) {
+      mqtt_spool_drain(s, conn);
+    }
+    return SS_SUCCESS;
+  }
+
+  if ((ret = mqtt_out_queuev(conn, pkt, 2))) {
+    /* sent once the output buffer drains, or the connection is back */
+    if (ret != SS_BUF_FULL) {
+      log_stderr(LOG_WARN, "Sending packet failed, spooling");
+    }
+    return mqtt_spool_append(s, pkt, 2);
+  }
+
+  log_stdout(LOG_INFO, "Successfully sent packet to broker");
+
+  mqtt_spool_drain(s, conn);
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Close a spool, flushing it to disk
+ */
+void mqtt_spool_close(struct mqtt_spool *s) {
+
+  if (s) {
+    if (s->map) {
+      if (s->fd >= 0) {
+        msync(s->map, s->hdr->size, MS_SYNC);
+      }
+      munmap(s->map, s->hdr->size);
+    }
+    if (s->dropped) {
+      log_stderr(LOG_WARN, "Spool %s dropped %llu packets", s->path,
+          (unsigned long long)s->dropped);
+    }
+    if (s->fd >= 0) {
+      close(s->fd);
+    }
+    free(s->path);
+    free(s);
+  }
+
+  return;
+}
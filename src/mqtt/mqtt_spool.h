@@ -0,0 +1,101 @@
+#ifndef MQTT_SPOOL__H
+#define MQTT_SPOOL__H
+/******************************************************************************
+ * File: mqtt_spool.h
+ * Description: disk backed store-and-forward spool for unsent packets
+ * Author: Steven Swann - swannonline@googlemail.com
+ *
+ * Copyright (c) swannonline, 2013-2014
+ *
+ * This file is part of sensorspace.
+ *
+ * sensorspace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * sensorspace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with sensorspace.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "uMQTT.h"
+#include "uMQTT_linux_client.h"
+
+#include "mqtt_publish.h"
+
+#define MQTT_SPOOL_MAGIC          0x50535353    /* "SSSP" */
+#define MQTT_SPOOL_VERSION        1
+#define MQTT_SPOOL_DATA_OFFSET    64
+#define MQTT_SPOOL_DEFAULT_BYTES  (64 * 1024 * 1024)
+#define MQTT_SPOOL_DEFAULT_RATE   1000
+#define MQTT_SPOOL_DRAIN_MAX      64
+
+/*
+ * \brief Struct to hold the spool segment file header. Records follow at
+ *        MQTT_SPOOL_DATA_OFFSET, each an encoded PUBLISH packet prefixed
+ *        with its 32bit length.
+ * \param magic The spool file identifier
+ * \param version The spool file format version
+ * \param size The size of the segment file
+ * \param head Offset of the oldest unsent record
+ * \param tail Offset at which the next record is appended
+ * \param count The number of unsent records
+ */
+struct mqtt_spool_hdr {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t size;
+  uint64_t head;
+  uint64_t tail;
+  uint64_t count;
+};
+
+/*
+ * \brief Struct to hold a store-and-forward spool
+ * \param path The segment file path
+ * \param fd The segment file descriptor, -1 if held in memory only
+ * \param map The memory mapped segment file
+ * \param hdr The segment file header, within map
+ * \param rate The maximum drain rate, in packets per second
+ * \param tokens Packets that may currently be drained
+ * \param last The time (CLOCK_MONOTONIC) tokens were last added
+ * \param dropped The number of packets lost because the spool was full
+ */
+struct mqtt_spool {
+  char *path;
+  int fd;
+  uint8_t *map;
+  struct mqtt_spool_hdr *hdr;
+
+  unsigned rate;
+  double tokens;
+  struct timespec last;
+
+  uint64_t dropped;
+};
+
+int mqtt_spool_open(struct mqtt_spool **s_p, const char *path,
+    size_t size, unsigned rate);
+int mqtt_spool_append(struct mqtt_spool *s, const struct iovec *iov, int cnt);
+int mqtt_spool_prepend(struct mqtt_spool *s, const struct iovec *iov,
+    int cnt);
+uint64_t mqtt_spool_pending(struct mqtt_spool *s);
+int mqtt_spool_peek(struct mqtt_spool *s, const uint8_t **pkt, size_t *len);
+void mqtt_spool_pop(struct mqtt_spool *s);
+int mqtt_spool_timeout(struct mqtt_spool *s);
+int mqtt_spool_drain(struct mqtt_spool *s, struct mqtt_out *conn);
+int mqtt_spool_publish(struct mqtt_spool *s, struct mqtt_out *conn,
+    struct mqtt_pub_tmpl *t, const uint8_t *payload, size_t len);
+void mqtt_spool_close(struct mqtt_spool *s);
+
+#endif        /* MQTT_SPOOL__H */
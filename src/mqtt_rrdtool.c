@@ -26,6 +26,7 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <errno.h>
 #include <signal.h>
 
 #include <getopt.h>
@@ -36,13 +37,17 @@
 
 #include "sensorspace.h"
 #include "reading.h"
+#include "reading_rrdpool.h"
+#include "reading_rrdcreate.h"
+#include "mqtt_batch.h"
+#include "mqtt_conn.h"
+#include "mqtt_route.h"
+#include "evloop.h"
 #include "log.h"
 
 #define MQTT_DEFAULT_TOPIC    "sensorspace/reading"
 
-#define MAX_TOPIC_LEN 1024
 #define MAX_NAME_LEN 128
-#define MAX_MSG_LEN 2048
 
 static int print_usage(void);
 
@@ -64,6 +69,40 @@ static int print_usage() {
       "                             times.\n"
       " -s [--sensor-id] <id>    : The sensor_id of the sensor to update.\n"
       " -n [--name] <name>       : The name of the sensor to update.\n"
+      " -d [--ds] <ds-name>      : The DS of the file to update. Give a\n"
+      "                             file once per DS, each with -d, to\n"
+      "                             update its DS together once per step.\n"
+      " -F [--flush] <s>         : Seconds to queue updates for before\n"
+      "                             writing each file with one update, 0\n"
+      "                             to write at the end of each step.\n"
+      "                             Default: 30\n"
+      " -O [--reorder] <s>       : Seconds to hold each step for readings\n"
+      "                             arriving out of order before its\n"
+      "                             update is queued. Later readings for\n"
+      "                             the step are dropped and counted.\n"
+      "                             Default: 0\n"
+      " -R [--rrdcached] <sock>  : Send updates to the rrdcached daemon\n"
+      "                             listening on the Unix socket <sock>\n"
+      "                             in batches, rather than writing the\n"
+      "                             files directly\n"
+      " -w [--workers] <n>       : Threads writing the RRD files, so that\n"
+      "                             slow writes do not hold up receiving\n"
+      "                             readings. Each file is always written\n"
+      "                             by the same thread, 0 to write from\n"
+      "                             the receiving thread. Default: 1\n"
+      " -C [--create] <tmpl>     : Create the file of each sensor_id not\n"
+      "                             given with -s on its first reading,\n"
+      "                             from the template for its type:\n"
+      "                             \"<type>=<step> <DS>... <RRA>...\",\n"
+      "                             where <type> is temp, current,\n"
+      "                             voltage, power, flow, unknown or\n"
+      "                             default for any other. The sensor\n"
+      "                             updates the first DS. Can be used\n"
+      "                             once per type.\n"
+      " -P [--path] <pattern>    : Path of created files, in which\n"
+      "                             {device}, {sensor}, {name} and {type}\n"
+      "                             are replaced. Default:\n"
+      "                             " RRD_CREATE_DEFAULT_PATH "\n"
       "\n"
       "Broker options:\n"
       " -b [--broker] <broker-IP>: Change the default broker IP\n"
@@ -72,7 +111,15 @@ static int print_usage() {
       " -p [--port] <port>       : Change the default port. Default: 1883\n"
       " -c [--clientid] <id>     : Change the default clientid\n"
       " -t [--topic] <topic>     : Topic, from which, the readings should\n"
-      "                             arrive on. Can be used multiple times\n"
+      "                             arrive on. Can be used multiple times,\n"
+      "                             and hold + and # wildcards.\n"
+      " -m [--map] <id>          : Give readings arriving on the topic\n"
+      "                             given before it the sensor_id <id>,\n"
+      "                             where they carry none. Readings on\n"
+      "                             topics matching several -t take the\n"
+      "                             most specific.\n"
+      " -k [--keepalive] <s>     : Seconds between keepalive PINGREQs, 0 to\n"
+      "                             disable. Default: 30\n"
       "\n"
       "\nDebug options:\n"
       " -v [--verbose] <LEVEL>   : set verbose level to LEVEL\n"
@@ -87,36 +134,161 @@ static int print_usage() {
   return 0;
 }
 
+/**
+ * \brief Reading sink adding each reading received to the RR databases
+ * \param r The reading
+ * \param arg The RR databases
+ */
+static int rrdtool_sink(struct reading *r, void *arg) {
+
+  int ret;
+
+  print_reading(r);
+
+  ret = add_reading_rrd(r, (struct rrdtool *)arg);
+  if (ret) {
+    log_stderr(LOG_ERROR, "Failed to add reading to RR database");
+  }
+
+  return ret;
+}
+
+/*
+ * \brief Struct to hold the event loop state
+ * \param el The event loop
+ * \param rrd The RRD files
+ * \param router The routes of the subscribed topics
+ * \param flush The timer updating the RRD files at the end of each step
+ * \param ret The error that stopped the loop
+ */
+struct rrdtool_loop {
+  struct evloop *el;
+  struct rrdtool *rrd;
+  struct mqtt_router *router;
+  struct evloop_timer *flush;
+  int ret;
+};
+
+/**
+ * \brief Arm the flush timer for the end of the next RRD step
+ */
+static void rrdtool_arm(struct rrdtool_loop *loop) {
+
+  evloop_timer_set(loop->flush, rrd_flush_timeout(loop->rrd, time(0)), 0);
+}
+
+/**
+ * \brief Timer callback updating the RRD files whose step has ended
+ */
+static void rrdtool_flush(struct evloop *el, struct evloop_timer *t,
+    void *arg) {
+
+  struct rrdtool_loop *loop = (struct rrdtool_loop *)arg;
+
+  (void)el;
+  (void)t;
+
+  if (flush_rrd_files(loop->rrd, time(0))) {
+    log_stderr(LOG_ERROR, "Failed to update RR database");
+  }
+  rrdtool_arm(loop);
+}
+
+/**
+ * \brief Creator callback releasing the values held for the files created
+ */
+static void rrdtool_created(struct evloop *el, int fd, uint32_t events,
+    void *arg) {
+
+  struct rrdtool_loop *loop = (struct rrdtool_loop *)arg;
+
+  (void)el;
+  (void)fd;
+  (void)events;
+
+  rrd_files_created(loop->rrd);
+  rrdtool_arm(loop);
+}
+
+/**
+ * \brief Managed connection callback processing received packets
+ */
+static void rrdtool_input(struct mqtt_conn *mc, void *arg) {
+
+  struct rrdtool_loop *loop = (struct rrdtool_loop *)arg;
+  struct mqtt_frame frame;
+  struct mqtt_route *route;
+  const uint8_t *payload;
+  const char *rx_topic;
+  size_t rx_topic_len, len;
+
+  while (!mqtt_conn_next(mc, &frame)) {
+    if (mqtt_frame_publish(&frame, &rx_topic, &rx_topic_len, &payload,
+          &len)) {
+      continue;
+    }
+
+    if (!(route = mqtt_router_match(loop->router, rx_topic, rx_topic_len))) {
+      log_stdout(LOG_DEBUG, "No route for topic %.*s", (int)rx_topic_len,
+          rx_topic);
+      continue;
+    }
+
+    /* packet border */
+    log_stdout(LOG_INFO,
+        "------------------------------------------------------------");
+    log_stdout(LOG_INFO,
+        "Received packet - Attempting to convert to a reading");
+
+    if ((loop->ret = convert_json_readings((const char *)payload, len,
+            MQTT_BATCH_SEPARATOR, route->sensor_id, rrdtool_sink,
+            loop->rrd))) {
+      evloop_stop(loop->el);
+      return;
+    }
+  }
+
+  rrdtool_arm(loop);
+}
+
+/**
+ * \brief Stop the event loop on SIGINT or SIGTERM
+ */
+static void rrdtool_stop(struct evloop *el, int sig, void *arg) {
+
+  (void)arg;
+
+  log_stdout(LOG_INFO, "Received signal %d, stopping", sig);
+  evloop_stop(el);
+}
+
 int main(int argc, char **argv) {
 
   int ret;
-  int i;
   int c, option_index = 0;
   char broker_ip[16] = MQTT_BROKER_IP;
   int broker_port = MQTT_BROKER_PORT;
-  size_t len = MAX_MSG_LEN;
-  char json[MAX_MSG_LEN] = "\0";
   char clientid[UMQTT_CLIENTID_MAX_LEN] = "\0";
-  time_t t;
+  unsigned keepalive = MQTT_CONN_DEFAULT_KEEPALIVE;
+  unsigned workers = RRD_DEFAULT_WORKERS;
+  char path[MAX_FILENAME_LEN] = RRD_CREATE_DEFAULT_PATH;
 
-  struct reading *r = NULL;
-  struct mqtt_packet *rx_pkt = NULL;
+  struct mqtt_conn *mc = NULL;
+  struct rrdtool_loop loop = { 0 };
 
   /* Topic variables */
-  char *topic[16] = { 0 };
-  uint8_t topic_idx = 0;
+  struct mqtt_router *router = NULL;
+  struct mqtt_route *route = NULL;
 
   struct rrdtool rrd;
   memset(&rrd, 0, sizeof(struct rrdtool));
+  rrd.flush_s = RRD_DEFAULT_FLUSH_S;
+  rrd.reorder_s = RRD_DEFAULT_REORDER_S;
 
-  topic[topic_idx] = calloc(MAX_TOPIC_LEN, sizeof(char));
-  if (!topic[topic_idx]) {
-    log_stderr(LOG_ERROR, "Failed to allocate memory for topics");
+  if (mqtt_router_init(&router)) {
     return -1;
   }
 
-  strncpy(topic[topic_idx], MQTT_DEFAULT_TOPIC, MAX_TOPIC_LEN);
-
   static struct option long_options[] =
   {
     /* These options set a flag. */
@@ -125,17 +297,27 @@ int main(int argc, char **argv) {
     {"rrd_file", required_argument,     0, 'r'},
     {"sensor-id", required_argument,    0, 's'},
     {"name", required_argument,         0, 'n'},
+    {"ds", required_argument,           0, 'd'},
+    {"flush", required_argument,        0, 'F'},
+    {"reorder", required_argument,      0, 'O'},
+    {"rrdcached", required_argument,    0, 'R'},
+    {"workers", required_argument,      0, 'w'},
+    {"create", required_argument,       0, 'C'},
+    {"path", required_argument,         0, 'P'},
     {"broker", required_argument,       0, 'b'},
     {"port", required_argument,         0, 'p'},
     {"clientid", required_argument,     0, 'c'},
     {"topic", required_argument,        0, 't'},
+    {"map", required_argument,          0, 'm'},
+    {"keepalive", required_argument,    0, 'k'},
     {0, 0, 0, 0}
   };
 
   /* get arguments */
   while (1)
   {
-    if ((c = getopt_long(argc, argv, "hv:s:n:t:r:b:p:c:", long_options,
+    if ((c = getopt_long(argc, argv, "hv:s:n:d:F:O:R:w:C:P:t:m:r:b:p:c:k:",
+            long_options,
             &option_index)) != -1) {
 
       switch (c) {
@@ -166,15 +348,9 @@ int main(int argc, char **argv) {
         case 't':
           /* Set topic */
           if (optarg) {
-            if (topic_idx) {
-              topic[topic_idx] = calloc(MAX_TOPIC_LEN, sizeof(char));
-              if (!topic[topic_idx]) {
-                log_stderr(LOG_ERROR,
-                    "Failed to allocate memory for topic");
-                return -1;
-              }
+            if (mqtt_router_add(router, optarg, NULL, NULL, &route)) {
+              return -1;
             }
-            strcpy(topic[topic_idx++], optarg);
           } else {
             log_stderr(LOG_ERROR,
                 "The topic flag should be followed by a topic");
@@ -182,11 +358,23 @@ int main(int argc, char **argv) {
           }
           break;
 
+        case 'm':
+          /* set the sensor_id of a topic */
+          if (optarg && route) {
+            route->sensor_id = atoi(optarg);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The map flag should follow a topic flag, and should be"
+                " followed by a sensor_id");
+            return print_usage();
+          }
+          break;
+
         case 's':
           /* set a sensor_id */
           if (optarg) {
-            if (rrd.f_count) {
-              rrd.sensor_id[rrd.f_count - 1] = atoi(optarg);
+            if (rrd.s_count) {
+              rrd.sensor[rrd.s_count - 1]->sensor_id = atoi(optarg);
             }
           } else {
             log_stderr(LOG_ERROR,
@@ -198,8 +386,9 @@ int main(int argc, char **argv) {
 
         case 'n':
           /* set a name */
-          if (optarg && rrd.f_count) {
-            strncpy(rrd.name[rrd.f_count - 1], optarg, READ_NAME_LEN);
+          if (optarg && rrd.s_count) {
+            strncpy(rrd.sensor[rrd.s_count - 1]->name, optarg,
+                READ_NAME_LEN - 1);
           } else {
             log_stderr(LOG_ERROR,
                 "The sensor name flag should follow an rrd file flag, and"
@@ -208,6 +397,92 @@ int main(int argc, char **argv) {
           }
           break;
 
+        case 'd':
+          /* name the DS */
+          if (optarg && rrd.s_count) {
+            if (rrd_ds_init(&rrd, optarg)) {
+              return -1;
+            }
+          } else {
+            log_stderr(LOG_ERROR,
+                "The DS flag should follow an rrd file flag, and"
+                " should be followed by a DS name");
+            return print_usage();
+          }
+          break;
+
+        case 'F':
+          /* set the write-behind interval */
+          if (optarg) {
+            rrd.flush_s = atoi(optarg);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The flush flag should be followed by a time in seconds");
+            return print_usage();
+          }
+          break;
+
+        case 'O':
+          /* set the out of order delay */
+          if (optarg) {
+            rrd.reorder_s = atoi(optarg);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The reorder flag should be followed by a time in seconds");
+            return print_usage();
+          }
+          break;
+
+        case 'R':
+          /* use rrdcached */
+          if (optarg && !rrd.cached) {
+            if (rrdcached_init(&rrd.cached, optarg)) {
+              return -1;
+            }
+          } else {
+            log_stderr(LOG_ERROR,
+                "The rrdcached flag should be given once, followed by a"
+                " socket");
+            return print_usage();
+          }
+          break;
+
+        case 'w':
+          /* set the number of writer threads */
+          if (optarg) {
+            workers = atoi(optarg);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The workers flag should be followed by a number of threads");
+            return print_usage();
+          }
+          break;
+
+        case 'C':
+          /* add a template for new sensors */
+          if (optarg) {
+            if ((!rrd.creator && rrd_creator_init(&rrd.creator)) ||
+                rrd_creator_template(rrd.creator, optarg)) {
+              return -1;
+            }
+          } else {
+            log_stderr(LOG_ERROR,
+                "The create flag should be followed by a template");
+            return print_usage();
+          }
+          break;
+
+        case 'P':
+          /* set the path pattern of created files */
+          if (optarg) {
+            strncpy(path, optarg, MAX_FILENAME_LEN - 1);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The path flag should be followed by a path pattern");
+            return print_usage();
+          }
+          break;
+
         case 'b':
           /* change the default broker ip */
           if (optarg) {
@@ -222,7 +497,7 @@ int main(int argc, char **argv) {
         case 'p':
           /* change the default port */
           if (optarg) {
-            broker_port = *optarg;
+            broker_port = atoi(optarg);
           } else {
             log_stderr(LOG_ERROR,
                 "The port flag should be followed by a port");
@@ -241,6 +516,17 @@ int main(int argc, char **argv) {
           }
           break;
 
+        case 'k':
+          /* set keepalive interval */
+          if (optarg) {
+            keepalive = atoi(optarg);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The keepalive flag should be followed by a time in seconds");
+            return print_usage();
+          }
+          break;
+
       }
     } else {
       /* Final arguement */
@@ -248,114 +534,81 @@ int main(int argc, char **argv) {
     }
   }
 
-  struct broker_conn *conn;
-
-  log_stdout(LOG_INFO, "Initialisig socket connection");
-
-  init_linux_socket_connection(&conn, broker_ip, sizeof(broker_ip), broker_port);
-  if (!conn) {
-    log_stderr(LOG_ERROR, "Initialising socket connection");
-    return -1;
+  if (!router->count &&
+      (ret = mqtt_router_add(router, MQTT_DEFAULT_TOPIC, NULL, NULL, NULL))) {
+    goto free;
   }
 
-  if (clientid[0]) {
-    broker_set_clientid(conn, clientid, sizeof(clientid));
+  if ((ret = validate_rrd_files(&rrd))) {
+    goto free;
   }
 
-  log_stdout(LOG_INFO, "Connecting to broker");
-
-  struct linux_broker_socket *skt = '\0';
-  if ((ret = broker_connect(conn))) {
-    log_stderr(LOG_ERROR, "Connecting to broker");
-    free_connection(conn);
-    return ret;
-  } else {
-    skt = (struct linux_broker_socket *)conn->context;
-    log_stdout(LOG_INFO,
-        "Connected to broker:\nip: %s port: %d", skt->ip, skt->port);
+  if (rrd.creator && (ret = rrd_creator_start(rrd.creator, path))) {
+    goto free;
   }
 
-  struct mqtt_packet *pkt = construct_packet_headers(SUBSCRIBE);
-
-
-  log_stdout(LOG_INFO, "Subscribing to the following topic:");
-
-  for (i = 0; i < topic_idx; i++) {
-    log_stdout(LOG_INFO, "%s", topic[i]);
-    /* Find length of topic and subscribe */
-    const char *end = strchr(topic[i], '\0');
-    if (!end || (ret = broker_subscribe(conn, (char *)topic[i],
-            end - topic[i]))) {
-      log_stderr(LOG_ERROR, "Subscribing to topic %s.", topic[i]);
-      return ret;
-    }
+  if (workers && (ret = rrd_pool_init(&rrd.pool, workers,
+          rrd.cached ? rrd.cached->path : NULL))) {
+    goto free;
   }
 
-  /* Start listening for packets */
-  while (1) {
-
-    /* packet border */
-    log_stdout(LOG_INFO,
-        "------------------------------------------------------------");
-
-    ret = init_packet(&rx_pkt);
-    if (ret) {
-      log_stderr(LOG_ERROR, "Failed to initialie packet");
-      break;
-    }
-
-    ret = reading_init(&r);
-    if (ret) {
-      log_stderr(LOG_ERROR, "Failed to initialie reading");
-      break;
-    }
-
-    /* set reading date/time to now - fallback */
-    t = time(0);
-    localtime_r(&t, &r->t);
+  if ((ret = evloop_init(&loop.el))) {
+    goto free;
+  }
+  loop.rrd = &rrd;
+  loop.router = router;
 
-    ret = conn->receive_method(conn, rx_pkt);
-    if (ret) {
-      log_stderr(LOG_ERROR, "Receiving packet");
-      break;
-    }
+  if ((ret = evloop_add_timer(loop.el, &loop.flush, rrdtool_flush, &loop))) {
+    goto free;
+  }
 
-    log_stdout(LOG_INFO, "Received packet - Attempting to convert to a reading");
+  if (rrd.creator && (ret = evloop_add_fd(loop.el, rrd.creator->fd, EPOLLIN,
+          rrdtool_created, &loop))) {
+    goto free;
+  }
 
-    /* copy payload data - which should be JSON */
-    /* Currently, we assume readings is json, but it could equally be ini? */
-    strncpy(json, (const char *)&rx_pkt->payload->data, rx_pkt->pay_len);
-    json[rx_pkt->pay_len + 1] = '\0';
-    log_stderr(LOG_DEBUG, "PKT: %s", json);
+  if ((ret = evloop_add_signal(loop.el, SIGINT, rrdtool_stop, NULL)) ||
+      (ret = evloop_add_signal(loop.el, SIGTERM, rrdtool_stop, NULL))) {
+    goto free;
+  }
 
-    /* convert reading ready for rrd_update */
-    ret = convert_json_reading(r, json, len);
-    if (ret) {
-      log_stderr(LOG_ERROR, "Converting reading from JSON");
-      continue;
-    }
+  ret = mqtt_conn_init(&mc, broker_ip, broker_port, clientid, keepalive);
+  if (ret) {
+    goto free;
+  }
 
-    print_reading(r);
+  log_stdout(LOG_INFO, "Subscribing to the following topic:");
 
-    ret = add_reading_rrd(r, &rrd);
-    if (ret) {
-      log_stderr(LOG_ERROR, "Failed to add reading to RR database");
+  for (route = router->routes; route; route = route->list_next) {
+    log_stdout(LOG_INFO, "%s", route->filter);
+    if ((ret = mqtt_conn_subscribe(mc, route->filter))) {
+      goto free;
     }
+  }
 
-    free_reading(r);
-    free_packet(rx_pkt);
+  /* connection, input, keepalive and reconnection are all driven by the
+   * loop, the broker need not be reachable yet */
+  if ((ret = mqtt_conn_attach(mc, loop.el, rrdtool_input, &loop))) {
+    goto free;
+  }
 
+  ret = evloop_run(loop.el);
+  if (loop.ret) {
+    ret = loop.ret;
   }
 
-  log_stdout(LOG_INFO, "Disconnecting from broker");
-  broker_disconnect(conn);
-  free_reading(r);
-  free_connection(conn);
-  for (i = 0; i < topic_idx; i++) {
-    free(topic[i]);
+free:
+  free_mqtt_conn(mc);
+  free_evloop(loop.el);
+  /* values cached for the current step */
+  if (flush_rrd_files(&rrd, 0)) {
+    log_stderr(LOG_ERROR, "Failed to update RR database");
   }
-  free_packet(pkt);
-  free_packet(rx_pkt);
+  /* waits for the creator and writers to finish */
+  free_rrd_creator(rrd.creator);
+  free_rrd_pool(rrd.pool);
+  free_mqtt_router(router);
   free_rrd_files(&rrd);
+  free_rrdcached(rrd.cached);
   return ret;
 }
@@ -0,0 +1,422 @@
+/******************************************************************************
+ * File: mqtt_tsdb.c
+ * Description: store readings from a broker in the native time-series store
+ * Author: Steven Swann - swannonline@googlemail.com
+ *
+ * Copyright (c) swannonline, 2013-2014
+ *
+ * This file is part of sensorspace.
+ *
+ * sensorspace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * sensorspace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with sensorspace.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+
+#include <getopt.h>
+
+#include "uMQTT.h"
+#include "uMQTT_helper.h"
+#include "uMQTT_linux_client.h"
+
+#include "sensorspace.h"
+#include "reading.h"
+#include "tsdb.h"
+#include "mqtt_batch.h"
+#include "mqtt_conn.h"
+#include "mqtt_route.h"
+#include "evloop.h"
+#include "log.h"
+
+#define MQTT_DEFAULT_TOPIC    "sensorspace/reading"
+
+static int print_usage(void);
+
+/*
+ * \brief function to print help
+ */
+static int print_usage() {
+
+  fprintf(stderr,
+      "mqtt_tsdb is an application that connects to an MQTT broker,\n"
+      "subscribes to a number of topics and appends the measurements of\n"
+      "any readings received to the native time-series store, one series\n"
+      "per sensor_id.\n"
+      "Usage: mqtt_tsdb [options];'\n"
+      "General options:\n"
+      " -h [--help]              : Displays this help and exits\n"
+      "\n"
+      "Store options:\n"
+      " -D [--dir] <dir>         : The store directory, created if needed.\n"
+      "                             Default: " TSDB_DEFAULT_DIR "\n"
+      " -F [--flush] <s>         : Seconds to hold points in memory before\n"
+      "                             writing them, 0 to write after each\n"
+      "                             packet. Default: 10\n"
+      "\n"
+      "Broker options:\n"
+      " -b [--broker] <broker-IP>: Change the default broker IP\n"
+      "                             - only IP addresses are\n"
+      "                            currently supported. Default: localhost\n"
+      " -p [--port] <port>       : Change the default port. Default: 1883\n"
+      " -c [--clientid] <id>     : Change the default clientid\n"
+      " -t [--topic] <topic>     : Topic, from which, the readings should\n"
+      "                             arrive on. Can be used multiple times,\n"
+      "                             and hold + and # wildcards.\n"
+      "                             Default: " MQTT_DEFAULT_TOPIC "\n"
+      " -m [--map] <id>          : Give readings arriving on the topic\n"
+      "                             given before it the sensor_id <id>,\n"
+      "                             where they carry none. Readings on\n"
+      "                             topics matching several -t take the\n"
+      "                             most specific.\n"
+      " -k [--keepalive] <s>     : Seconds between keepalive PINGREQs, 0 to\n"
+      "                             disable. Default: 30\n"
+      "\n"
+      "\nDebug options:\n"
+      " -v [--verbose] <LEVEL>   : set verbose level to LEVEL\n"
+      "                               Levels are:\n"
+      "                                 SILENT\n"
+      "                                 ERROR\n"
+      "                                 WARN\n"
+      "                                 INFO (default)\n"
+      "                                 DEBUG\n"
+      "\n");
+
+  return 0;
+}
+
+/**
+ * \brief Reading sink adding each reading received to the store
+ * \param r The reading
+ * \param arg The store
+ */
+static int tsdb_sink(struct reading *r, void *arg) {
+
+  int ret;
+
+  print_reading(r);
+
+  ret = add_reading_tsdb(r, (struct tsdb *)arg);
+  if (ret) {
+    log_stderr(LOG_ERROR, "Failed to add reading to the store");
+  }
+
+  return ret;
+}
+
+/*
+ * \brief Struct to hold the event loop state
+ * \param el The event loop
+ * \param db The store
+ * \param router The routes of the subscribed topics
+ * \param flush_s Seconds between writes, 0 to write after each packet
+ * \param flush The timer writing the points held in memory
+ * \param ret The error that stopped the loop
+ */
+struct tsdb_loop {
+  struct evloop *el;
+  struct tsdb *db;
+  struct mqtt_router *router;
+  unsigned flush_s;
+  struct evloop_timer *flush;
+  int ret;
+};
+
+/**
+ * \brief Timer callback writing the points held in memory
+ */
+static void tsdb_flush_timeout(struct evloop *el, struct evloop_timer *t,
+    void *arg) {
+
+  struct tsdb_loop *loop = (struct tsdb_loop *)arg;
+
+  (void)el;
+  (void)t;
+
+  if (tsdb_flush(loop->db)) {
+    log_stderr(LOG_ERROR, "Failed to write to the store");
+  }
+}
+
+/**
+ * \brief Managed connection callback processing received packets
+ */
+static void tsdb_input(struct mqtt_conn *mc, void *arg) {
+
+  struct tsdb_loop *loop = (struct tsdb_loop *)arg;
+  struct mqtt_frame frame;
+  struct mqtt_route *route;
+  const uint8_t *payload;
+  const char *rx_topic;
+  size_t rx_topic_len, len;
+
+  while (!mqtt_conn_next(mc, &frame)) {
+    if (mqtt_frame_publish(&frame, &rx_topic, &rx_topic_len, &payload,
+          &len)) {
+      continue;
+    }
+
+    if (!(route = mqtt_router_match(loop->router, rx_topic, rx_topic_len))) {
+      log_stdout(LOG_DEBUG, "No route for topic %.*s", (int)rx_topic_len,
+          rx_topic);
+      continue;
+    }
+
+    /* packet border */
+    log_stdout(LOG_INFO,
+        "------------------------------------------------------------");
+    log_stdout(LOG_INFO,
+        "Received packet - Attempting to convert to a reading");
+
+    if ((loop->ret = convert_json_readings((const char *)payload, len,
+            MQTT_BATCH_SEPARATOR, route->sensor_id, tsdb_sink, loop->db))) {
+      evloop_stop(loop->el);
+      return;
+    }
+  }
+
+  if (!loop->flush_s && tsdb_flush(loop->db)) {
+    log_stderr(LOG_ERROR, "Failed to write to the store");
+  }
+}
+
+/**
+ * \brief Stop the event loop on SIGINT or SIGTERM
+ */
+static void tsdb_stop(struct evloop *el, int sig, void *arg) {
+
+  (void)arg;
+
+  log_stdout(LOG_INFO, "Received signal %d, stopping", sig);
+  evloop_stop(el);
+}
+
+int main(int argc, char **argv) {
+
+  int ret;
+  int c, option_index = 0;
+  char broker_ip[16] = MQTT_BROKER_IP;
+  int broker_port = MQTT_BROKER_PORT;
+  char clientid[UMQTT_CLIENTID_MAX_LEN] = "\0";
+  unsigned keepalive = MQTT_CONN_DEFAULT_KEEPALIVE;
+  char dir[MAX_FILENAME_LEN] = TSDB_DEFAULT_DIR;
+
+  struct mqtt_conn *mc = NULL;
+  struct tsdb_loop loop = { 0 };
+
+  /* Topic variables */
+  struct mqtt_route *route = NULL;
+
+  loop.flush_s = TSDB_DEFAULT_FLUSH_S;
+
+  if (mqtt_router_init(&loop.router)) {
+    return -1;
+  }
+
+  static struct option long_options[] =
+  {
+    /* These options set a flag. */
+    {"help",   no_argument,             0, 'h'},
+    {"verbose", required_argument,      0, 'v'},
+    {"dir", required_argument,          0, 'D'},
+    {"flush", required_argument,        0, 'F'},
+    {"broker", required_argument,       0, 'b'},
+    {"port", required_argument,         0, 'p'},
+    {"clientid", required_argument,     0, 'c'},
+    {"topic", required_argument,        0, 't'},
+    {"map", required_argument,          0, 'm'},
+    {"keepalive", required_argument,    0, 'k'},
+    {0, 0, 0, 0}
+  };
+
+  /* get arguments */
+  while (1)
+  {
+    if ((c = getopt_long(argc, argv, "hv:D:F:b:p:c:t:m:k:", long_options,
+            &option_index)) != -1) {
+
+      switch (c) {
+        case 'h':
+          return print_usage();
+
+        case 'v':
+          /* set log level */
+          if (optarg) {
+            set_log_level_str(optarg);
+          }
+          break;
+
+        case 'D':
+          /* set the store directory */
+          if (optarg) {
+            strncpy(dir, optarg, MAX_FILENAME_LEN - 1);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The dir flag should be followed by a directory");
+            return print_usage();
+          }
+          break;
+
+        case 'F':
+          /* set the write-behind interval */
+          if (optarg) {
+            loop.flush_s = atoi(optarg);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The flush flag should be followed by a time in seconds");
+            return print_usage();
+          }
+          break;
+
+        case 't':
+          /* Set topic */
+          if (optarg) {
+            if (mqtt_router_add(loop.router, optarg, NULL, NULL, &route)) {
+              return -1;
+            }
+          } else {
+            log_stderr(LOG_ERROR,
+                "The topic flag should be followed by a topic");
+            return print_usage();
+          }
+          break;
+
+        case 'm':
+          /* set the sensor_id of a topic */
+          if (optarg && route) {
+            route->sensor_id = atoi(optarg);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The map flag should follow a topic flag, and should be"
+                " followed by a sensor_id");
+            return print_usage();
+          }
+          break;
+
+        case 'b':
+          /* change the default broker ip */
+          if (optarg) {
+            strcpy(broker_ip, optarg);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The broker flag should be followed by an IP address");
+            return print_usage();
+          }
+          break;
+
+        case 'p':
+          /* change the default port */
+          if (optarg) {
+            broker_port = atoi(optarg);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The port flag should be followed by a port");
+            return print_usage();
+          }
+          break;
+
+        case 'c':
+          /* Set clientid */
+          if (optarg) {
+            strcpy(clientid, optarg);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The clientid flag should be followed by a clientid");
+            return print_usage();
+          }
+          break;
+
+        case 'k':
+          /* set keepalive interval */
+          if (optarg) {
+            keepalive = atoi(optarg);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The keepalive flag should be followed by a time in seconds");
+            return print_usage();
+          }
+          break;
+
+        default:
+          return print_usage();
+      }
+    } else {
+      /* Final arguement */
+      break;
+    }
+  }
+
+  if (!loop.router->count && (ret = mqtt_router_add(loop.router,
+          MQTT_DEFAULT_TOPIC, NULL, NULL, NULL))) {
+    goto free;
+  }
+
+  if ((ret = tsdb_open(&loop.db, dir))) {
+    goto free;
+  }
+  log_stdout(LOG_INFO, "Storing readings in %s", dir);
+
+  if ((ret = evloop_init(&loop.el))) {
+    goto free;
+  }
+
+  if (loop.flush_s) {
+    if ((ret = evloop_add_timer(loop.el, &loop.flush, tsdb_flush_timeout,
+            &loop)) ||
+        (ret = evloop_timer_set(loop.flush, loop.flush_s * 1000,
+          loop.flush_s * 1000))) {
+      goto free;
+    }
+  }
+
+  if ((ret = evloop_add_signal(loop.el, SIGINT, tsdb_stop, NULL)) ||
+      (ret = evloop_add_signal(loop.el, SIGTERM, tsdb_stop, NULL))) {
+    goto free;
+  }
+
+  ret = mqtt_conn_init(&mc, broker_ip, broker_port, clientid, keepalive);
+  if (ret) {
+    goto free;
+  }
+
+  log_stdout(LOG_INFO, "Subscribing to the following topic:");
+
+  for (route = loop.router->routes; route; route = route->list_next) {
+    log_stdout(LOG_INFO, "%s", route->filter);
+    if ((ret = mqtt_conn_subscribe(mc, route->filter))) {
+      goto free;
+    }
+  }
+
+  /* connection, input, keepalive and reconnection are all driven by the
+   * loop, the broker need not be reachable yet */
+  if ((ret = mqtt_conn_attach(mc, loop.el, tsdb_input, &loop))) {
+    goto free;
+  }
+
+  ret = evloop_run(loop.el);
+  if (loop.ret) {
+    ret = loop.ret;
+  }
+
+free:
+  free_mqtt_conn(mc);
+  free_evloop(loop.el);
+  /* writes the points held in memory */
+  free_tsdb(loop.db);
+  free_mqtt_router(loop.router);
+  return ret;
+}
@@ -37,6 +37,12 @@
 #include "sensorspace.h"
 #include "reading.h"
 #include "controller.h"
+#include "mqtt_batch.h"
+#include "mqtt_publish.h"
+#include "mqtt_conn.h"
+#include "mqtt_route.h"
+#include "mqtt_spool.h"
+#include "evloop.h"
 #include "log.h"
 
 #define MQTT_DEFAULT_TOPIC    "sensorspace/reading"
@@ -44,6 +50,9 @@
 #define MAX_TOPIC_LEN 1024
 #define MAX_MSG_LEN 2048
 
+#define PID_STARTUP_DELAY_MS    2000
+#define PID_DEFAULT_SINTERVAL   5
+
 /* Required for test mode */
 struct controller_data {
   uint32_t second;
@@ -83,9 +92,16 @@ static int print_usage() {
       "                            currently supported. Default: localhost\n"
       " -p [--port] <port>       : Change the default port. Default: 1883\n"
       " -c [--clientid] <id>     : Change the default clientid Default: PID\n"
+      " -k [--keepalive] <s>     : Seconds between keepalive PINGREQs, 0 to\n"
+      "                            disable. Default: 30\n"
+      " -F [--spool] <file>      : Spool packets that could not be sent to\n"
+      "                            <file>, sending them once the broker\n"
+      "                            is reachable.\n"
+      " -f [--spool-rate] <rate> : Maximum spool replay rate, packets/second\n"
+      "                            Default: 1000\n"
       "\n"
       "Controller options:\n"
-      " -i [--sample-int] <secs> : sampling interval, seconds, default 1S.\n"
+      " -i [--sample-int] <secs> : sampling interval, seconds, default 5S.\n"
       " -S [--set-point]         : Set the set point.\n"
       " -P [--Kp] <prop gain>    : Set the proportional gain\n"
       " -I [--Ki] <prop gain>    : Set the integral gain\n"
@@ -325,6 +341,172 @@ void test_mode(struct pid_ctrl *pid, char *test_file) {
   return;
 }
 
+/*
+ * \brief Struct to hold the event loop state
+ * \param el The event loop
+ * \param pid The controller
+ * \param mc The broker connection
+ * \param router The routes of the subscribed topics
+ * \param spool The spool for control packets published while disconnected
+ * \param batcher The publisher of the control output, which replays the
+ *        spool once reconnected
+ * \param ctrl_topic The control output topic
+ * \param ret The error that stopped the loop
+ */
+struct pid_loop {
+  struct evloop *el;
+  struct pid_ctrl *pid;
+  struct mqtt_conn *mc;
+  struct mqtt_router *router;
+  struct mqtt_spool *spool;
+  struct mqtt_batcher *batcher;
+  const char *ctrl_topic;
+  int ret;
+};
+
+/**
+ * \brief Sample timer callback performing the controller action on the
+ *        current value of the PV and publishing the control values
+ */
+static void pid_sample(struct evloop *el, struct evloop_timer *t, void *arg) {
+
+  struct pid_loop *loop = (struct pid_loop *)arg;
+  struct reading *r;
+  char msg[1028] = "\0";
+  size_t len;
+  time_t now;
+  int ret;
+
+  (void)t;
+
+  log_stdout(LOG_INFO, "Invoking controller action");
+
+  if (!loop->pid->update_count) {
+    /* do not start PID action until we've had at least 1 update */
+    return;
+  }
+
+  if (reading_init(&r)) {
+    log_stderr(LOG_ERROR, "Failed to initialie reading");
+    loop->ret = SS_OUT_OF_MEM_ERROR;
+    evloop_stop(el);
+    return;
+  }
+
+  /* set reading date/time to now - fallback */
+  now = time(0);
+  localtime_r(&now, &r->t);
+
+  pid_controller(loop->pid);
+
+  /* send new control values */
+  ret = convert_pid_reading(loop->pid, r);
+  if (ret) {
+    log_stderr(LOG_ERROR, "Failed to convert PID to reading");
+    goto free;
+  }
+
+  /* convert reading ready for mqtt tx */
+  len = sizeof(msg);
+  ret = convert_reading_json(r, msg, &len);
+  if (ret) {
+    log_stderr(LOG_ERROR, "Failed to convert reading to JSON");
+    goto free;
+  }
+
+  log_stdout(LOG_INFO, "Sending MQTT PUBLISH packet with:");
+  log_stdout(LOG_INFO, "Topic: %s", loop->ctrl_topic);
+  log_stdout(LOG_INFO, "Message: %s", msg);
+
+  /* Send control packet, spooled while disconnected */
+  ret = mqtt_batcher_add(loop->batcher, loop->ctrl_topic, (uint8_t *)msg,
+      strlen(msg));
+  if (ret) {
+    log_stderr(LOG_ERROR, "Sending control packet failed");
+  } else {
+    log_stdout(LOG_INFO, "Successfully sent control packet");
+  }
+
+free:
+  free_reading(r);
+}
+
+/**
+ * \brief Reading sink taking the PV from a reading, if it holds one
+ * \param r The reading
+ * \param arg The PID controller
+ */
+static int pid_sink(struct reading *r, void *arg) {
+
+  struct pid_ctrl *pid = (struct pid_ctrl *)arg;
+  int i;
+
+  /* Look for PV in reading */
+  for (i = 0; i < r->count; i++) {
+    if (!strcmp(r->meas[i]->name, pid->pv_name)) {
+      log_stdout(LOG_INFO, "Updating process variable: %s - %s",
+          r->meas[i]->name, r->meas[i]->meas);
+      pid->pv = atof(r->meas[i]->meas);
+      pid->update_count++;
+      break;
+    }
+  }
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Route handler taking PV updates from readings received on the PV
+ *        topic
+ */
+static void pid_pv(struct mqtt_route *route, const char *topic,
+    size_t topic_len, const uint8_t *payload, size_t len) {
+
+  struct pid_loop *loop = (struct pid_loop *)route->arg;
+
+  (void)topic;
+  (void)topic_len;
+
+  convert_json_readings((const char *)payload, len, MQTT_BATCH_SEPARATOR, 0,
+      pid_sink, loop->pid);
+}
+
+/**
+ * \brief Managed connection callback routing received packets
+ */
+static void pid_input(struct mqtt_conn *mc, void *arg) {
+
+  struct pid_loop *loop = (struct pid_loop *)arg;
+  struct mqtt_frame frame;
+  const uint8_t *payload;
+  const char *rx_topic;
+  size_t rx_topic_len, len;
+
+  while (!mqtt_conn_next(mc, &frame)) {
+    if (mqtt_frame_publish(&frame, &rx_topic, &rx_topic_len, &payload,
+          &len)) {
+      continue;
+    }
+
+    log_stdout(LOG_INFO,
+        "Received packet - Attempting to convert to a reading");
+
+    /* only PV-topic readings carry a new PV value */
+    mqtt_router_dispatch(loop->router, rx_topic, rx_topic_len, payload, len);
+  }
+}
+
+/**
+ * \brief Stop the event loop on SIGINT or SIGTERM
+ */
+static void pid_stop(struct evloop *el, int sig, void *arg) {
+
+  (void)arg;
+
+  log_stdout(LOG_INFO, "Received signal %d, stopping", sig);
+  evloop_stop(el);
+}
+
 int main(int argc, char **argv) {
 
   int ret;
@@ -333,16 +515,12 @@ int main(int argc, char **argv) {
   char broker_ip[16] = MQTT_BROKER_IP;
   int broker_port = MQTT_BROKER_PORT;
   char clientid[UMQTT_CLIENTID_MAX_LEN] = "\0";
+  unsigned keepalive = MQTT_CONN_DEFAULT_KEEPALIVE;
   char test_file[512] = "\0";
-  char json[1026] = "\0";
-  size_t len = 0;
+  char spool_file[MAX_FILENAME_LEN] = "\0";
+  unsigned spool_rate = 0;
   uint8_t retain = 0;
 
-  /* select variables */
-  fd_set read_fds;
-  int nfds = 0;
-  struct timeval timeout;
-
   /* PID variables */
   struct pid_ctrl pid = { 0 };
 
@@ -382,6 +560,9 @@ int main(int argc, char **argv) {
     {"broker", required_argument,       0, 'b'},
     {"port", required_argument,         0, 'p'},
     {"clientid", required_argument,     0, 'c'},
+    {"keepalive", required_argument,    0, 'k'},
+    {"spool", required_argument,        0, 'F'},
+    {"spool-rate", required_argument,   0, 'f'},
     {"test-mode", required_argument,    0, 'M'},
     {"ie-max", required_argument,       0, 'E'},
     {"ie-min", required_argument,       0, 'e'},
@@ -396,7 +577,7 @@ int main(int argc, char **argv) {
   while (1)
   {
     if ((c = getopt_long(argc, argv,
-            "hi:S:P:I:D:T:s:n:V:T:v:t:rb:p:c:M:E:e:U:u:O:o:",
+            "hi:S:P:I:D:T:s:n:V:T:v:t:rb:p:c:k:M:E:e:U:u:O:o:F:f:",
             long_options, &option_index)) != -1) {
 
       switch (c) {
@@ -588,7 +769,7 @@ int main(int argc, char **argv) {
         case 'p':
           /* change the default port */
           if (optarg) {
-            broker_port = *optarg;
+            broker_port = atoi(optarg);
           } else {
             log_stderr(LOG_ERROR,
                 "The port flag should be followed by a port");
@@ -607,6 +788,39 @@ int main(int argc, char **argv) {
           }
           break;
 
+        case 'k':
+          /* set keepalive interval */
+          if (optarg) {
+            keepalive = atoi(optarg);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The keepalive flag should be followed by a time in seconds");
+            return print_usage();
+          }
+          break;
+
+        case 'F':
+          /* set spool file */
+          if (optarg) {
+            strncpy(spool_file, optarg, sizeof(spool_file) - 1);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The spool flag should be followed by a file");
+            return print_usage();
+          }
+          break;
+
+        case 'f':
+          /* set spool replay rate */
+          if (optarg) {
+            spool_rate = atoi(optarg);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The spool-rate flag should be followed by a rate");
+            return print_usage();
+          }
+          break;
+
         case 'M':
           /* Test mode */
           if (optarg) {
@@ -637,233 +851,81 @@ int main(int argc, char **argv) {
     return 0;
   }
 
-  struct broker_conn *conn;
-
-  log_stdout(LOG_INFO, "Initialisig socket connection");
+  struct pid_loop loop = { 0 };
+  struct evloop_timer *sample = NULL;
+  unsigned sinterval_ms;
 
-  init_linux_socket_connection(&conn, broker_ip, sizeof(broker_ip), broker_port);
-  if (!conn) {
-    log_stdout(LOG_ERROR, "Initialising socket connection");
-    return -1;
+  /* the control topic is derived from the PV topic */
+  if (mqtt_topic_is_filter(pid.pv_topic)) {
+    log_stderr(LOG_ERROR, "The PV topic should not hold wildcards");
+    return SS_INIT_ERROR;
   }
 
-  if (clientid[0]) {
-    broker_set_clientid(conn, clientid, sizeof(clientid));
+  ret = mqtt_conn_init(&loop.mc, broker_ip, broker_port, clientid, keepalive);
+  if (ret) {
+    return ret;
   }
+  loop.pid = &pid;
 
-  log_stdout(LOG_INFO, "Connecting to broker");
-
-  struct linux_broker_socket *skt = '\0';
-  if ((ret = broker_connect(conn))) {
-    log_stderr(LOG_ERROR, "Connecting to broker");
-    free_connection(conn);
-    return ret;
-  } else {
-    skt = (struct linux_broker_socket *)conn->context;
-    log_stdout(LOG_INFO,
-        "Connected to broker:\nip: %s port: %d", skt->ip, skt->port);
+  if ((ret = mqtt_router_init(&loop.router)) ||
+      (ret = mqtt_router_add(loop.router, pid.pv_topic, pid_pv, &loop,
+          NULL))) {
+    goto free;
   }
 
   /* subscribe to PV-TOPICS */
   log_stdout(LOG_INFO, "Subscribing to the following topic:");
   log_stdout(LOG_INFO, "%s", pid.pv_topic);
 
-  /* Find length of topic and subscribe */
-  const char *end = strchr(pid.pv_topic, '\0');
-  if (!end || (ret = broker_subscribe(conn, pid.pv_topic, end - pid.pv_topic))) {
-
-    log_stderr(LOG_ERROR, "Subscribing to topic.");
-    return ret;
+  if ((ret = mqtt_conn_subscribe(loop.mc, pid.pv_topic))) {
+    goto free;
   }
 
-  /* start up delay */
-  time_t t;
-  time_t sample_time = time(NULL) + 2;
-  //time_t time = time();
-  struct reading *r;
-  struct mqtt_packet *pkt = NULL;
-  struct mqtt_packet *rx_pkt = NULL;
-  char msg[1028] = "\0";
-  int i;
-
-  /* Start listening for packets */
-  while (1) {
-
-    /* initialise reading */
-    ret = reading_init(&r);
-    if (ret) {
-      log_stderr(LOG_ERROR, "Failed to initialie reading");
-      break;
-    }
-
-    /* set reading date/time to now - fallback */
-    t = time(0);
-    localtime_r(&t, &r->t);
-
-    /* should really be some form of time interrupt */
-    if (sample_time <= time(NULL)) {
-      /* perform controller action on current value of pv, set next sample time */
-      log_stdout(LOG_INFO, "Invoking controller action");
-      sample_time += 5;
-
-      if (!pid.update_count) {
-        /* do not start PID action until we've had at least 1 update */
-        goto next;
-      }
-
-      pid_controller(&pid);
-
-      /* send new control values */
-      ret = convert_pid_reading(&pid, r);
-      if (ret) {
-        log_stderr(LOG_ERROR, "Failed to convert PID to reading");
-        goto next;
-      }
-
-      pkt = construct_packet_headers(PUBLISH);
-      if (!pkt) {
-        log_stderr(LOG_ERROR, "Failed to initialise PUBLISH packet");
-        break;
-      }
-
-      /* build topic string */
-      sprintf(topic, "%s/controller", pid.pv_topic);
-      if (!pkt || (ret = set_publish_variable_header(pkt, topic, strlen(topic)))) {
-        log_stderr(LOG_ERROR, "Setting up packet");
-        ret = UMQTT_ERROR;
-        goto free;
-      }
-
-      if ((ret = set_publish_fixed_flags(pkt, retain, 0, 0))) {
-        log_stderr(LOG_ERROR, "Setting publish flags");
-        ret = UMQTT_ERROR;
-        goto free;
-      }
-
-      /* convert reading ready for mqtt tx */
-      len = sizeof(msg);
-      ret = convert_reading_json(r, msg, &len);
-      if (ret) {
-        log_stderr(LOG_ERROR, "Failed to convert reading to JSON");
-        goto next;
-      }
-
-      log_stdout(LOG_INFO, "Constructed MQTT PUBLISH packet with:");
-      log_stdout(LOG_INFO, "Topic: %s", topic);
-      log_stdout(LOG_INFO, "Message: %s", msg);
-
-      if ((ret = init_packet_payload(pkt, PUBLISH, (uint8_t *)msg, strlen(msg)))) {
-        log_stderr(LOG_ERROR, "Attaching payload");
-        ret = UMQTT_ERROR;
-        goto free;
-      }
-
-      finalise_packet(pkt);
-
-      log_stdout(LOG_INFO, "Sending packet to broker");
-
-      /* Send control packet */
-      ret = broker_send_packet(conn, pkt);
-      if (ret) {
-        log_stderr(LOG_ERROR, "Sending control packet failed");
-        goto next;
-      } else {
-        log_stdout(LOG_INFO, "Successfully sent control packet");
-      }
-    }
-
-    /* select init */
-    FD_ZERO(&read_fds);
-    nfds = skt->sockfd + 1;
-    FD_SET(skt->sockfd, &read_fds);
-
-    timeout.tv_usec = 250;
-    timeout.tv_sec = 0;
-    ret = select(nfds, &read_fds, NULL, NULL, &timeout);
-    if (ret == -1) {
-      if (errno == EINTR) {
-        log_stderr(LOG_ERROR, "Select: %s", strerror(errno));
-        goto next;
-      }
-      log_stderr(LOG_ERROR, "Select failed: %s", strerror(errno));
-      goto next;
-
-    } else if (!ret) {
-      /* should never get here since disabled timeout */
-      log_stdout(LOG_DEBUG, "select timed out");
-      goto next;
-    }
-
-    /* Determine if any fds are ready */
-    if (FD_ISSET(skt->sockfd, &read_fds)) {
-      /* process MQTT input */
-
-      ret = init_packet(&rx_pkt);
-      if (ret) {
-        log_stderr(LOG_ERROR, "Failed to initialise receive packet");
-        break;
-      }
-
-      ret = conn->receive_method(conn, rx_pkt);
-      if (ret) {
-        log_stderr(LOG_ERROR, "failed to process packet input");
-        goto next;
-      }
-
-      log_stdout(LOG_INFO, "Received packet - Attempting to convert to a reading");
-
-      /* copy payload data - which should be JSON */
-      /* Currently, we assume readings is json, but it could equally be ini? */
-      strncpy(json, (const char *)&rx_pkt->payload->data, rx_pkt->pay_len);
-      json[rx_pkt->pay_len + 1] = '\0';
-      log_stderr(LOG_INFO, "PKT: %s", json);
-
-      ret = convert_json_reading(r, json, len);
-      if (ret) {
-        log_stderr(LOG_ERROR, "Converting reading from JSON");
-        goto next;
-      }
+  /* control output is published unbatched, following the connection
+   * across reconnects */
+  sprintf(topic, "%s/controller", pid.pv_topic);
+  loop.ctrl_topic = topic;
+  ret = mqtt_batcher_init(&loop.batcher, loop.mc->conn, retain, 0, 0);
+  if (!ret && spool_file[0]) {
+    ret = mqtt_spool_open(&loop.spool, spool_file, 0, spool_rate);
+    loop.mc->spool = loop.spool;
+    loop.batcher->spool = loop.spool;
+  }
+  if (ret) {
+    goto free;
+  }
+  mqtt_conn_set_callbacks(loop.mc, mqtt_batcher_conn_changed,
+      mqtt_batcher_conn_changed, loop.batcher);
+
+  if ((ret = evloop_init(&loop.el)) ||
+      (ret = evloop_add_signal(loop.el, SIGINT, pid_stop, &loop)) ||
+      (ret = evloop_add_signal(loop.el, SIGTERM, pid_stop, &loop)) ||
+      (ret = mqtt_conn_attach(loop.mc, loop.el, pid_input, &loop)) ||
+      (ret = mqtt_batcher_attach(loop.batcher, loop.mc))) {
+    goto free;
+  }
 
-      /* if PV-topic get new PV value */
-      if (decode_utf8_string(topic, &rx_pkt->variable->publish.topic)) {
-        if (!strcmp(topic, pid.pv_topic)) {
-          /* Look for PV in reading */
-          for (i = 0; i < r->count; i++) {
-            if (!strcmp(r->meas[i]->name, pid.pv_name)) {
-              log_stdout(LOG_INFO, "Updating process variable: %s - %s",
-                  r->meas[i]->name, r->meas[i]->meas);
-              pid.pv = atof(r->meas[i]->meas);
-              pid.update_count++;
-              break;
-            }
-          }
-          /*preferend code from different branch.
-            char measurement[64] = "\0";
-            ret = get_sensor_name_measurement(r, pid.pv_name, measurement);
-            if (measurement[0]) {
-            pid.pv = atof(measurement);
-            pid.update_count++;
-            } */
-        }
-      }
-    }
+  /* controller action is taken every sample interval after a start up delay */
+  sinterval_ms = (pid.sinterval > 0 ? (unsigned)pid.sinterval :
+      PID_DEFAULT_SINTERVAL) * 1000;
+  if ((ret = evloop_add_timer(loop.el, &sample, pid_sample, &loop)) ||
+      (ret = evloop_timer_set(sample, PID_STARTUP_DELAY_MS, sinterval_ms))) {
+    goto free;
+  }
 
-next:
-    free_reading(r);
-    r = NULL;
-    free_packet(pkt);
-    pkt = NULL;
-    free_packet(rx_pkt);
-    rx_pkt = NULL;
-    continue;
+  /* input, keepalive, reconnection, spool replay and sampling are driven
+   * by the loop */
+  ret = evloop_run(loop.el);
+  if (loop.ret) {
+    ret = loop.ret;
   }
 
 free:
-  broker_disconnect(conn);
-  free_reading(r);
-  free_connection(conn);
-  free_packet(pkt);
-  free_packet(rx_pkt);
+  free_mqtt_batcher(loop.batcher);
+  free_mqtt_conn(loop.mc);
+  evloop_del_timer(loop.el, sample);
+  free_evloop(loop.el);
+  mqtt_spool_close(loop.spool);
+  free_mqtt_router(loop.router);
   return ret;
 }
-
@@ -115,31 +115,158 @@ int convert_tm_db_date(struct tm *date, char *buf) {
 
 /**
  * \brief converts string date in db format to struct tm date
+ * \param time The date, "YYYY-MM-DD hh:mm:ss", need not be NUL terminated
+ * \param len The length of the date string
+ * \param t The struct tm to set, unchanged if the date is malformed
  */
-int convert_db_date_to_tm(const char *time, struct tm *t) {
-  if(time) {
-    char *delim_char;
+int convert_db_date_to_tm(const char *time, size_t len, struct tm *t) {
+  static const char delim[] = "-- ::";
+  const char *end = time + len;
+  int field[sizeof(delim)];
+  unsigned i;
+
+  for (i = 0; i < sizeof(delim); i++) {
+    if (time == end || *time < '0' || *time > '9') {
+      return SS_GET_ERROR;
+    }
+
+    for (field[i] = 0; time < end && *time >= '0' && *time <= '9'; time++) {
+      field[i] = field[i] * 10 + (*time - '0');
+    }
+
+    if (delim[i] != '\0') {
+      if (time == end || *time != delim[i]) {
+        return SS_GET_ERROR;
+      }
+      time++;
+    }
+  }
+
+  t->tm_year = field[0] - 1900;
+  /* tm_mon in range 0-11 */
+  t->tm_mon = field[1] - 1;
+  t->tm_mday = field[2];
+  t->tm_hour = field[3];
+  t->tm_min = field[4];
+  t->tm_sec = field[5];
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief converts a "<seconds>.<fraction>" timestamp string to a timespec
+ * \param str The timestamp, need not be NUL terminated
+ * \param len The length of the timestamp string
+ * \param ts The timespec to set
+ */
+int convert_ts_str_to_timespec(const char *str, size_t len,
+    struct timespec *ts) {
+  const char *end = str + len;
+  long long sec = 0;
+  long nsec = 0;
+  int digits = 0;
+
+  if (str == end || *str < '0' || *str > '9') {
+    return SS_GET_ERROR;
+  }
 
-    t->tm_year = atoi(time) - 1900;
-    delim_char = strstr(time, "-");
+  for (; str < end && *str >= '0' && *str <= '9'; str++) {
+    sec = sec * 10 + (*str - '0');
+  }
 
-    /* tm_mon in range 0-11 */
-    t->tm_mon = atoi(delim_char + 1) - 1;
-    delim_char = strstr(delim_char + 1, "-");
+  if (str < end && *str == '.') {
+    for (str++; str < end && *str >= '0' && *str <= '9' && digits < 9;
+        str++, digits++) {
+      nsec = nsec * 10 + (*str - '0');
+    }
+  }
 
-    t->tm_mday = atoi(delim_char + 1);
-    delim_char = strstr(delim_char + 1, " ");
+  /* scale fraction to nanoseconds */
+  for (; digits < 9; digits++) {
+    nsec *= 10;
+  }
+  ts->tv_sec = sec;
+  ts->tv_nsec = nsec;
 
-    t->tm_hour = atoi(delim_char + 1);
-    delim_char = strstr(delim_char + 1, ":");
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Find a string within a buffer that need not be NUL terminated
+ * \param buf The buffer to search
+ * \param len The length of the buffer
+ * \param str The NUL terminated string to find
+ * \return A pointer to the first match in buf, or NULL
+ */
+const char *find_str(const char *buf, size_t len, const char *str) {
+  const char *end = buf + len;
+  size_t str_len = strlen(str);
 
-    t->tm_min = atoi(delim_char + 1);
-    delim_char = strstr(delim_char + 1, ":");
+  if (!str_len) {
+    return buf;
+  }
 
-    t->tm_sec = atoi(delim_char + 1);
+  while ((size_t)(end - buf) >= str_len &&
+      (buf = memchr(buf, *str, end - buf - str_len + 1))) {
+    if (!memcmp(buf, str, str_len)) {
+      return buf;
+    }
+    buf++;
   }
 
-    return SS_SUCCESS;
+  return NULL;
+}
+
+/**
+ * \brief Convert a decimal string that need not be NUL terminated, as atoi
+ * \param str The string, leading whitespace is skipped
+ * \param len The length of the string
+ * \return The value of the leading digits, 0 if there are none
+ */
+uint32_t convert_str_to_uint(const char *str, size_t len) {
+  const char *end = str + len;
+  uint32_t val = 0;
+
+  while (str < end && (*str == ' ' || *str == '\t')) str++;
+
+  for (; str < end && *str >= '0' && *str <= '9'; str++) {
+    val = val * 10 + (*str - '0');
+  }
+
+  return val;
+}
+
+/**
+ * \brief Names of the measurement types, by meas_type_t
+ */
+static const char *meas_type_names[MEAS_TYPE_COUNT] = {
+  "unknown", "temp", "current", "voltage", "power", "flow",
+};
+
+/**
+ * \brief Get the name of a measurement type
+ */
+const char *meas_type_str(meas_type_t type) {
+  return type < MEAS_TYPE_COUNT ? meas_type_names[type] : "unknown";
+}
+
+/**
+ * \brief Convert the name of a measurement type that need not be NUL
+ *        terminated
+ * \return The type, MEAS_UNKNOWN if the name is not known
+ */
+meas_type_t convert_str_to_meas_type(const char *str, size_t len) {
+
+  unsigned i;
+
+  for (i = 0; i < MEAS_TYPE_COUNT; i++) {
+    if (strlen(meas_type_names[i]) == len &&
+        !strncmp(meas_type_names[i], str, len)) {
+      return (meas_type_t)i;
+    }
+  }
+
+  return MEAS_UNKNOWN;
 }
 
 /**
@@ -154,6 +281,10 @@ int print_reading(struct reading *r) {
   printf("Reading Date: %02d-%02d-%d %02d:%02d:%02d\n", r->t.tm_mday,
       r->t.tm_mon + 1, r->t.tm_year + 1900, r->t.tm_hour, r->t.tm_min,
       r->t.tm_sec);
+  if (r->ts.tv_sec) {
+    printf("Reading Timestamp: %lld.%09ld\n", (long long)r->ts.tv_sec,
+        r->ts.tv_nsec);
+  }
   printf("\tMeasurements:\n");
   for (i = 0; i < r->count; i++) {
     printf("\tSensor_id: %d\n", r->meas[i]->sensor_id);
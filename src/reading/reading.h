@@ -24,6 +24,8 @@
  *
  *****************************************************************************/
 #include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
 #include <time.h>
 
 #include "sensorspace.h"
@@ -36,7 +38,17 @@
 
 /* ~11 for epoch chars */
 #define RRD_MEASUREMENT_LEN     READ_MEAS_LEN + 11
-#define RRD_MAX_SENSORS         32
+#define RRD_MAX_DS              16
+/* rrdtool limits DS names to 19 characters */
+#define RRD_DS_NAME_LEN         20
+/* updates queued for a file before it is written regardless of interval */
+#define RRD_QUEUE_MAX           256
+#define RRD_DEFAULT_FLUSH_S     30
+/* steps held per file for late readings, the oldest is written beyond */
+#define RRD_REORDER_MAX         64
+#define RRD_DEFAULT_REORDER_S   0
+/* values held per file while it is created, later ones are dropped */
+#define RRD_HOLD_MAX            1024
 
 /*
  * \brief Enum to hold measurement types supported by sensorspace
@@ -48,12 +60,15 @@ typedef enum {
   MEAS_VOLTAGE,
   MEAS_POWER,
   MEAS_FLOW,
+  /* the number of types */
+  MEAS_TYPE_COUNT,
 } meas_type_t;
 
 /*
  * \brief Struct to hold reading instance
  * \param reading_id Reading identificaton assigned when inserted into DB
  * \param t The reading time
+ * \param ts The precise reading time (CLOCK_REALTIME), zero if not known
  * \param device_id The deviceId the reading is linked to
  * \param name The name of the device/reading
  * \param meas Measurements associated with reading
@@ -62,6 +77,7 @@ typedef enum {
 struct reading {
   uint32_t reading_id;
   struct tm t;
+  struct timespec ts;
 
   uint32_t device_id;
 
@@ -86,24 +102,213 @@ struct measurement {
 };
 
 /*
- * \brief Struct to hold an rrd database file and path
+ * \brief Struct to hold an RRD data source updated by a sensor
+ * \param name The DS name, empty for the single DS of an unnamed file
+ * \param idx The position of the DS within the file
+ */
+struct rrd_ds {
+  char name[RRD_DS_NAME_LEN];
+  unsigned idx;
+};
+
+/*
+ * \brief Struct to hold the values cached for a step of an RRD file
+ * \param t The time of the latest value within the step
+ * \param val The latest value of each DS slot within the step
+ * \param set The DS slots holding a value, one bit each
+ */
+struct rrd_step {
+  time_t t;
+  char val[RRD_MAX_DS][READ_MEAS_LEN];
+  uint32_t set;
+};
+
+/*
+ * \brief Struct to hold a value received while its RRD file is created,
+ *        before the step of the file is known
+ * \param t The time of the value
+ * \param ds The DS slot of the value
+ * \param val The value
+ */
+struct rrd_value {
+  time_t t;
+  unsigned ds;
+  char val[READ_MEAS_LEN];
+};
+
+/*
+ * \brief Struct to hold the updates queued for an RRD file
+ * \param file The rrd file name and path
+ * \param buf The "<time>:<value>..." updates, each NUL terminated
+ * \param len The length of the queued updates
+ * \param size The size of buf
+ * \param count The number of updates queued
+ * \param next The next queue awaiting a writer thread
+ */
+struct rrd_queue {
+  const char *file;
+  char *buf;
+  size_t len;
+  size_t size;
+  unsigned count;
+  struct rrd_queue *next;
+};
+
+/*
+ * \brief Struct to hold an rrd database file and path, with the values
+ *        cached for its data sources until their step is written. Steps
+ *        are held in a min-heap by time, so that readings arriving out of
+ *        order are written in time order.
  * \param name The rrd file name and path
+ * \param ds The data source slots
+ * \param ds_count The number of data sources in use
+ * \param step The RRD step in seconds, 0 until read from the file
+ * \param ds_total The number of data sources in the file
+ * \param steps The heap of steps holding cached values, earliest first
+ * \param step_count The number of steps cached
+ * \param step_size The size of steps
+ * \param newest The time of the latest value cached
+ * \param late The values dropped for arriving after their step was
+ *        written
+ * \param queue The updates awaiting a write
+ * \param queue_last The time of the latest update queued
+ * \param write_at The time the queued updates should be written
+ * \param create The pending creation of the file, NULL once it exists
+ * \param held The values received while the file is created, in order
+ * \param held_count The number of values held
+ * \param held_size The size of held
+ * \param held_dropped The values dropped for arriving with RRD_HOLD_MAX
+ *        held
+ * \param hash_next The next file in the same file name hash bucket
+ * \param due The time a step of the file is released or its queued
+ *        updates are written, whichever is earlier
+ * \param due_idx The position of the file in the due heap plus 1, 0 if
+ *        nothing is cached or queued for it
  */
 struct rrd_file {
   char name[MAX_FILENAME_LEN];
+  struct rrd_ds ds[RRD_MAX_DS];
+  unsigned ds_count;
+  unsigned long step;
+  unsigned ds_total;
+
+  struct rrd_step *steps;
+  unsigned step_count;
+  unsigned step_size;
+  time_t newest;
+  unsigned long late;
+
+  struct rrd_queue queue;
+  time_t queue_last;
+  time_t write_at;
+
+  struct rrd_create *create;
+  struct rrd_value *held;
+  unsigned held_count;
+  unsigned held_size;
+  unsigned long held_dropped;
+  struct rrd_file *hash_next;
+  time_t due;
+  unsigned due_idx;
 };
 
 /*
- * \brief Struct to hold an rrd database context
- * \param file The rrd file struct
- * \param sensor_id The sensor_id of a sensor connected to a RRD
- * \param name Pointer to the name of a sensor connected to a RRD
+ * \brief Struct to hold a sensor connected to a DS of an RRD file
+ * \param sensor_id The sensor_id of the sensor, 0 to match by name only
+ * \param name The name of the sensor, empty to match by sensor_id only
+ * \param file The rrd file, shared by the DS of a multi-DS file, NULL if
+ *        its file could not be created
+ * \param ds The DS slot within the file; 0 is the owner of the file
+ * \param seen The reading the sensor was last updated by
+ * \param id_next The next sensor in the same sensor_id hash bucket
+ * \param name_next The next sensor in the same name hash bucket
+ */
+struct rrd_sensor {
+  uint32_t sensor_id;
+  char name[READ_NAME_LEN];
+  struct rrd_file *file;
+  unsigned ds;
+  unsigned long seen;
+
+  struct rrd_sensor *id_next;
+  struct rrd_sensor *name_next;
+};
+
+/*
+ * \brief Struct to hold an rrd database context. Readings are dispatched
+ *        to the sensors through hash indexes, by sensor_id and by name.
+ * \param file The rrd files, each once
+ * \param f_count The number of files
+ * \param f_size The size of file
+ * \param f_hash The file name hash buckets
+ * \param f_hash_size The number of file name hash buckets
+ * \param due The files with values cached or queued, in a min-heap by
+ *        their due time, of f_size
+ * \param d_count The number of files in due
+ * \param sensor The sensors connected to the files, each allocated once
+ *        so that the indexes can point to them
+ * \param s_count The number of sensors
+ * \param s_size The size of sensor
+ * \param by_id The sensor_id hash buckets, NULL until indexed
+ * \param by_name The name hash buckets, NULL until indexed
+ * \param s_hash_size The number of sensor hash buckets
+ * \param readings The number of readings dispatched
+ * \param flush_s Seconds updates are queued for before each file is
+ *        written with a single call, 0 to write at the end of each step
+ * \param reorder_s Seconds after its end, by the latest reading or the
+ *        clock, that a step is held for readings arriving out of order
+ * \param late The values dropped for arriving after their step was
+ *        written
+ * \param cached The rrdcached connection updates are sent to, NULL to
+ *        update the files with librrd
+ * \param pool The writer threads updates are handed to, NULL to write
+ *        them from the calling thread
+ * \param creator Creates the file of each new sensor_id, NULL to ignore
+ *        sensors not given
  */
 struct rrdtool {
-  unsigned sensor_id[RRD_MAX_SENSORS];
-  char *name[RRD_MAX_SENSORS];
-  struct rrd_file *file[RRD_MAX_SENSORS];
+  struct rrd_file **file;
   unsigned f_count;
+  unsigned f_size;
+  struct rrd_file **f_hash;
+  unsigned f_hash_size;
+  struct rrd_file **due;
+  unsigned d_count;
+
+  struct rrd_sensor **sensor;
+  unsigned s_count;
+  unsigned s_size;
+  struct rrd_sensor **by_id;
+  struct rrd_sensor **by_name;
+  unsigned s_hash_size;
+  unsigned long readings;
+
+  unsigned flush_s;
+  unsigned reorder_s;
+  unsigned long late;
+  struct rrdcached *cached;
+  struct rrd_pool *pool;
+  struct rrd_creator *creator;
+};
+
+/*
+ * \brief Struct to hold an rrdcached connection
+ * \param fd The daemon socket, -1 while disconnected
+ * \param path The daemon's Unix socket path
+ * \param buf The command and response buffer
+ * \param len The length of the data in buf
+ * \param size The size of buf
+ * \param cmd_file The file each command of a batch updates
+ * \param cmd_size The size of cmd_file
+ */
+struct rrdcached {
+  int fd;
+  char path[MAX_FILENAME_LEN];
+  char *buf;
+  size_t len;
+  size_t size;
+  unsigned *cmd_file;
+  unsigned cmd_size;
 };
 
 /* core library functions */
@@ -116,7 +321,13 @@ void free_measurements(struct reading *r);
 int print_reading(struct reading *r);
 int validate_reading(struct reading *r);
 int convert_tm_db_date(struct tm *date, char *buf);
-int convert_db_date_to_tm(const char *time, struct tm *t);
+int convert_db_date_to_tm(const char *time, size_t len, struct tm *t);
+int convert_ts_str_to_timespec(const char *str, size_t len,
+    struct timespec *ts);
+const char *find_str(const char *buf, size_t len, const char *str);
+uint32_t convert_str_to_uint(const char *str, size_t len);
+const char *meas_type_str(meas_type_t type);
+meas_type_t convert_str_to_meas_type(const char *str, size_t len);
 int get_sensor_id_measurement(struct reading *r, uint32_t sensor_id,
     char *buf, size_t len);
 int get_sensor_name_measurement(struct reading *r, char *name, char *buf,
@@ -126,19 +337,42 @@ int get_sensor_id_measurement_idx(struct reading *r, uint32_t sensor_id,
 int get_sensor_name_measurement_idx(struct reading *r, char *name,
     uint16_t *idx);
 
+/*
+ * \brief Callback taking each reading converted from a buffer
+ * \param r The reading, freed once the callback returns
+ * \param arg The argument given with the callback
+ */
+typedef int (*reading_sink_cb)(struct reading *r, void *arg);
+
 /* reading conversion functions */
-int convert_ini_reading(struct reading *r, char *buf, size_t len);
-int convert_json_reading(struct reading *r, char *buf, size_t len);
+int convert_ini_reading(struct reading *r, const char *buf, size_t len);
+int convert_json_reading(struct reading *r, const char *buf, size_t len);
+int convert_json_readings(const char *buf, size_t len, char sep,
+    uint32_t sensor_id, reading_sink_cb sink, void *arg);
 int convert_reading_json(struct reading *r, char *buf, size_t *len);
 /* device specific reading conversion functions */
 int convert_cc_dev_reading(struct reading *r, char *buf, size_t len);
 
 /* helper functions */
-int json_get_key_value(const char *buf, const char *key, char *val);
+int json_get_key_value(const char *buf, size_t len, const char *key,
+    const char **val, size_t *val_len);
 
 /* RRDtool endpoint functions */
 int rrd_file_init(struct rrdtool *rrd, char *file);
+int rrd_ds_init(struct rrdtool *rrd, const char *ds);
+int validate_rrd_files(struct rrdtool *rrd);
 int add_reading_rrd(struct reading *r, struct rrdtool *rrd);
+int flush_rrd_files(struct rrdtool *rrd, time_t now);
+void rrd_files_created(struct rrdtool *rrd);
+long rrd_flush_timeout(struct rrdtool *rrd, time_t now);
+int write_rrd_queue(struct rrd_queue *q);
+uint32_t rrd_hash_str(const char *str);
+
+/* rrdcached endpoint functions */
+int rrdcached_init(struct rrdcached **c_p, const char *path);
+int rrdcached_update(struct rrdcached *c, struct rrd_queue **q,
+    unsigned count, int *status);
+void free_rrdcached(struct rrdcached *c);
 void free_rrd_file(struct rrd_file *file);
 void free_rrd_files(struct rrdtool *rrd);
 
@@ -91,9 +91,11 @@ int convert_cc_dev_reading(struct reading *r, char *buf, size_t len) {
       goto end;
     }
 
-    /* set reading time to NOW */
-    time_t t = time(NULL);
-    r->t = *localtime((const time_t *)&t);
+    /* set reading time to NOW, unless stamped upon arrival */
+    if (!r->ts.tv_sec) {
+      clock_gettime(CLOCK_REALTIME, &r->ts);
+      localtime_r(&r->ts.tv_sec, &r->t);
+    }
 
     struct measurement *m = NULL;
 
@@ -22,127 +22,125 @@
  *
  *****************************************************************************/
 #include <stdlib.h>
+#include <string.h>
 
 #include "reading.h"
 
-#define INI_MAX_LINE_LEN        256
 #define INI_DEVICEID_SUBSTR     "DID="
 #define INI_DATE_SUBSTR         "DATE="
 #define INI_MEAS_SUBSTR         "MEAS="
-#define INI_MEAS_DELIM_CHAR     ";"
-#define INI_STR_EOL             "\n"
-#define INI_DELIM_CHAR          "="
+#define INI_MEAS_DELIM_CHAR     ';'
+#define INI_STR_EOL             '\n'
+#define INI_DELIM_CHAR          '='
 
 /**
  * \brief process reading in ini format
+ * \param r Pointer to output reading struct
+ * \param buf The ini buffer, need not be NUL terminated
+ * \param len The length of the ini buffer
  */
-int convert_ini_reading(struct reading *r, char *buf, size_t len) {
+int convert_ini_reading(struct reading *r, const char *buf, size_t len) {
 
-  char tmp[INI_MAX_LINE_LEN];
-  char *idx = NULL;
-  char *t_idx = NULL;
+  const char *idx = NULL;
+  const char *t_idx = NULL;
+  const char *end = buf + len;
+  const char *line_end = NULL;
   int ret = SS_SUCCESS;
   size_t t_len = 0;
   int line = 0;
   struct measurement *m = NULL;
 
   /* Process buf line by line */
-  idx = buf;
-  do {
-    /* copy line to tmp */
-    if (strstr(idx, "\n")) {
-      t_len = (size_t)strstr(idx, INI_STR_EOL) - (size_t)idx;
-      strncpy(tmp, idx, t_len);
-      tmp[t_len] = '\0';
-
-      line++;
-
-      /* next line */
-      idx += t_len + 1;
-
-    } else {
+  for (idx = buf; idx < end; idx = line_end + 1) {
+    line_end = memchr(idx, INI_STR_EOL, end - idx);
+    if (!line_end) {
       /* no new lines => EOF */
       ret = SS_SUCCESS;
       break;
     }
+    t_len = (size_t)(line_end - idx);
+
+    line++;
 
     /* new section => new reading */
-    if (tmp[0] == '[') {
+    if (t_len && idx[0] == '[') {
       /* not currenty supported. */
       if (line > 1) {
         log_stderr(LOG_ERROR, "Multiple readings not currently supported");
         ret = SS_INI_ERROR;
-        free_reading(r);
+        free_measurements(r);
         break;
       }
       continue;
     }
 
     /* device_id */
-    if (strstr(tmp, INI_DEVICEID_SUBSTR)) {
-      t_idx = strstr(tmp, INI_DELIM_CHAR) + 1;
+    if (find_str(idx, t_len, INI_DEVICEID_SUBSTR)) {
+      t_idx = (const char *)memchr(idx, INI_DELIM_CHAR, t_len) + 1;
 
-      r->device_id = atoi(t_idx);
+      r->device_id = convert_str_to_uint(t_idx, line_end - t_idx);
     }
 
     /* reading date */
-    if (strstr(tmp, INI_DATE_SUBSTR)) {
-      t_idx = strstr(tmp, INI_DELIM_CHAR) + 1;
+    if (find_str(idx, t_len, INI_DATE_SUBSTR)) {
+      t_idx = (const char *)memchr(idx, INI_DELIM_CHAR, t_len) + 1;
 
-      convert_db_date_to_tm((char *)t_idx, &r->t);
+      convert_db_date_to_tm(t_idx, line_end - t_idx, &r->t);
     }
 
     /* reading measurement */
-    if (strstr(tmp, INI_MEAS_SUBSTR)) {
+    if (find_str(idx, t_len, INI_MEAS_SUBSTR)) {
 
       if (measurement_init(r)) {
         log_stderr(LOG_ERROR, "Failed to init measurement");
         ret = SS_INI_ERROR;
-        free_reading(r);
+        free_measurements(r);
         break;
       } else {
 
         m = r->meas[r->count - 1];
 
         /* sensor_id */
-        t_idx = strstr(tmp, INI_DELIM_CHAR) + 1;
-        if (!t_idx) {
+        t_idx = memchr(idx, INI_DELIM_CHAR, t_len);
+        if (!t_idx++) {
           log_stderr(LOG_ERROR, "Failed to init measurement");
           ret = SS_INI_ERROR;
-          free_reading(r);
+          free_measurements(r);
           break;
         }
-        m->sensor_id = atoi(t_idx);
+        m->sensor_id = convert_str_to_uint(t_idx, line_end - t_idx);
 
         /* measurement */
-        t_idx = strstr(tmp, INI_MEAS_DELIM_CHAR) + 1;
-        if (!t_idx) {
+        t_idx = memchr(idx, INI_MEAS_DELIM_CHAR, t_len);
+        if (!t_idx++ || line_end - t_idx >= READ_MEAS_LEN) {
           log_stderr(LOG_ERROR, "Failed to init measurement");
           ret = SS_INI_ERROR;
-          free_reading(r);
+          free_measurements(r);
           break;
         }
 
-        if (strcpy(m->meas, t_idx) <= 0) {
+        if (t_idx == line_end) {
           log_stderr(LOG_ERROR, "Measurement data invalid");
           ret = SS_INI_ERROR;
-          free_reading(r);
+          free_measurements(r);
           break;
         }
+        memcpy(m->meas, t_idx, line_end - t_idx);
+        m->meas[line_end - t_idx] = '\0';
 
         log_stdout(LOG_DEBUG, "New measurement:");
         log_stdout(LOG_DEBUG, "sensor_id: %d", m->sensor_id);
         log_stdout(LOG_DEBUG, "meas: %s", m->meas);
       }
     }
-  }  while ((size_t)idx < (size_t)buf + (size_t)len);
+  }
 
-  ret = validate_reading(r);
+  if (!ret) {
+    ret = validate_reading(r);
+  }
   if (ret) {
     log_stderr(LOG_ERROR, "Reading validation failed");
   }
 
   return ret;
 }
-
-
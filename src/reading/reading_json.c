@@ -33,6 +33,7 @@
 #define JSON_ARRAY_END_CONTAINER  ']'
 #define JSON_STR_CONTAINER        '\"'
 #define JSON_DATE_KEY             "\"date\""
+#define JSON_TS_KEY               "\"ts\""
 #define JSON_DEVICE_KEY           "\"device\""
 #define JSON_ID_KEY               "\"id\""
 #define JSON_NAME_KEY             "\"name\""
@@ -55,6 +56,13 @@ int convert_reading_json(struct reading *r, char *buf, size_t *len) {
       r->t.tm_min, r->t.tm_sec);
   if (l < 0) goto error;
 
+  /* Set precise timestamp */
+  if (r->ts.tv_sec) {
+    l += snprintf(buf + l, *len - l, "\"ts\":\"%lld.%09ld\",",
+        (long long)r->ts.tv_sec, r->ts.tv_nsec);
+    if (l < 0) goto error;
+  }
+
   /* Set device_id */
   if (r->device_id || r->name[0]) {
     l += snprintf(buf + l, *len - l, "\"device\":{");
@@ -111,6 +119,12 @@ int convert_reading_json(struct reading *r, char *buf, size_t *len) {
         if (l < 0) goto error;
       }
 
+      if (r->meas[i]->type != MEAS_UNKNOWN) {
+        l += snprintf(buf + l, *len - l, ",\"type\":\"%s\"",
+            meas_type_str(r->meas[i]->type));
+        if (l < 0) goto error;
+      }
+
       /* close */
       l += sprintf(buf + l, "}");
 
@@ -132,24 +146,27 @@ error:
 /**
  * \brief Function to get find the end of a container within a json buffer
  * \param start The start location
- * \param end The end location to be returned
+ * \param buf_end The end of the json buffer
+ * \param end_p The location following the close container to be returned
  * \param open The container opening character
  * \param close The container closing character to search for
  */
-static int get_json_end_container(const char *start, char **end_p,
-    const char open, const char close) {
-  int ret = SS_SUCCESS;
-  char *end = (char *)start;
+static int get_json_end_container(const char *start, const char *buf_end,
+    const char **end_p, const char open, const char close) {
+  const char *end = start;
   unsigned indent = 1;
 
   log_stderr(LOG_DEBUG, "Finding container contents: %c*%c", open, close);
 
   /* find opening tag */
-  while (*end != open && *end != '\0' ) end++;
+  while (end < buf_end && *end != open) end++;
+  if (end == buf_end) {
+    return SS_GET_EMPTY;
+  }
   end++;
 
   /* Get end of array */
-  while (*end != '\0') {
+  while (end < buf_end) {
 
     if (*end == close) {
       /* nested array end */
@@ -159,9 +176,6 @@ static int get_json_end_container(const char *start, char **end_p,
       indent++;
     }
 
-    log_stderr(LOG_DEBUG, "JSON current: %c, searching: %c Current indent %zd",
-      *end, close, indent);
-
     if (indent == 0) {
       /* found close container */
       log_stderr(LOG_DEBUG, "End container found");
@@ -172,33 +186,36 @@ static int get_json_end_container(const char *start, char **end_p,
     }
   }
 
-  if (end == '\0') {
-    /* reached end of string - without finding end */
+  if (end == buf_end) {
+    /* reached end of buffer - without finding end */
     log_stderr(LOG_ERROR, "JSON incomplete");
-    ret = SS_GET_ERROR;
+    return SS_GET_ERROR;
   }
 
   /* Ensure we capure end container too */
   *end_p = end + 1;
 
-  return ret;
+  return SS_SUCCESS;
 }
 
 /**
- * \brief Function to find the "value" represented by a "key"
- * \param buf Buffer to hold the JSON string
+ * \brief Function to find the "value" represented by a "key". The value is
+ *        returned as a view into buf, without its enclosing container.
+ * \param buf Buffer to hold the JSON string, need not be NUL terminated
+ * \param len The length of the JSON buffer
  * \param key The key to search for
- * \param val The value to be returned
+ * \param val The start of the value to be returned
+ * \param val_len The length of the value to be returned
  */
-int json_get_key_value(const char *buf, const char *key, char *val) {
+int json_get_key_value(const char *buf, size_t len, const char *key,
+    const char **val, size_t *val_len) {
   int ret = SS_SUCCESS;
-  char *idx = NULL, *idx_end = NULL;
-  size_t len = 0;
+  const char *idx = NULL, *idx_end = NULL, *end = buf + len;
 
   log_stderr(LOG_DEBUG, "Searching for JSON key: %s", key);
 
   /* find key */
-  idx = strstr(buf, key);
+  idx = find_str(buf, len, key);
   if (!idx) {
     log_stderr(LOG_DEBUG, "JSON key: %s not present", key);
     return SS_GET_EMPTY;
@@ -206,14 +223,8 @@ int json_get_key_value(const char *buf, const char *key, char *val) {
 
   log_stderr(LOG_DEBUG, "JSON key found: %s", key);
 
-  /* find next none whitespace/return value */
-  while (*idx == ' ' || *idx == '\r' || *idx == '\n') idx++;
-
-  while (*idx != JSON_DELIMITER && *idx != '\0') {
-    idx++;
-  }
-
-  if (*idx != JSON_DELIMITER) {
+  idx = memchr(idx, JSON_DELIMITER, end - idx);
+  if (!idx) {
     log_stderr(LOG_ERROR, "JSON extraction failed: no delimiter");
     return SS_GET_ERROR;
   }
@@ -222,22 +233,25 @@ int json_get_key_value(const char *buf, const char *key, char *val) {
   idx++;
 
   /* find next none whitespace/return value */
-  while (*idx == ' ' || *idx == '\r' || *idx == '\n') idx++;
+  while (idx < end && (*idx == ' ' || *idx == '\r' || *idx == '\n')) idx++;
+  if (idx == end) {
+    return SS_GET_ERROR;
+  }
 
   /* extract value */
   switch (*idx) {
     case JSON_STR_CONTAINER:
-      ret = get_json_end_container(idx, &idx_end, JSON_STR_CONTAINER,
+      ret = get_json_end_container(idx, end, &idx_end, JSON_STR_CONTAINER,
           JSON_STR_CONTAINER);
       break;
 
     case JSON_ARRAY_CONTAINER:
-      ret = get_json_end_container(idx, &idx_end, JSON_ARRAY_CONTAINER,
+      ret = get_json_end_container(idx, end, &idx_end, JSON_ARRAY_CONTAINER,
           JSON_ARRAY_END_CONTAINER);
       break;
 
     case JSON_BLOCK_CONTAINER:
-      ret = get_json_end_container(idx, &idx_end, JSON_BLOCK_CONTAINER,
+      ret = get_json_end_container(idx, end, &idx_end, JSON_BLOCK_CONTAINER,
           JSON_BLOCK_END_CONTAINER);
       break;
 
@@ -251,177 +265,168 @@ int json_get_key_value(const char *buf, const char *key, char *val) {
   }
 
   /* Remove start and end tags */
-  len = (size_t)(--idx_end - ++idx);
-  log_stderr(LOG_DEBUG, "Attempting to copy %zu bytes", len);
-
-  /* copy value string */
-  if (!strncpy(val, idx, len)) {
-    log_stderr(LOG_ERROR, "JSON extraction failed, could not copy value");
-    ret = SS_GET_ERROR;
-  }
-
-  /* ensure terminated */
-  val[len] = '\0';
+  *val = idx + 1;
+  *val_len = (size_t)(idx_end - idx) - 2;
 
-  log_stderr(LOG_DEBUG, "JSON value extracted: %s", val);
+  log_stderr(LOG_DEBUG, "JSON value extracted: %.*s", (int)*val_len, *val);
 
   return ret;
 }
 
 /**
- * \brief Function to get a JSON array element
- * \param buf Buffer to hold the JSON array
- * \param i The array element's index to get
- * \param block The array block returned.
+ * \brief Copy a JSON value into a fixed size reading field
+ * \param dst The field to fill
+ * \param size The size of the field
+ * \param val The value, as returned by json_get_key_value()
+ * \param len The length of the value
  */
-static int get_array_block(const char *buf, unsigned i, char *block) {
-  int ret = SS_SUCCESS;
-  unsigned count = 0;
-  char *idx = (char *)buf;
-  char *idx_end = NULL;
-
-  while (1) {
-    ret = get_json_end_container(idx,
-        (char **)&idx_end, JSON_BLOCK_CONTAINER,JSON_BLOCK_END_CONTAINER);
-    if (ret || !idx) break;
-
-    if (i == count) {
-
-      if (*idx == ',') {
-        idx++;
-      }
-
-      /* replace buffer */
-      if (!strncpy(block, idx, (idx_end - idx))) {
-        log_stderr(LOG_ERROR, "Failed to copy JSON block to buffer");
-        ret = SS_GET_ERROR;
-      }
-      block[(idx_end - idx) + 1] = '\0';
-      break;
-    }
-    count++;
+static int json_copy_value(char *dst, size_t size, const char *val,
+    size_t len) {
 
-    idx = idx_end;
-    /* find next none whitespace/return value */
-    while (*idx == ' ' || *idx == '\r' || *idx == '\n') idx++;
-
-    if (*idx != ',') {
-      log_stderr(LOG_ERROR, "JSON array index %d not available", i);
-      ret = SS_GET_ERROR;
-      break;
-    }
+  if (len >= size) {
+    log_stderr(LOG_ERROR, "JSON value too long: %zu bytes", len);
+    return SS_GET_ERROR;
   }
 
-  return ret;
+  memcpy(dst, val, len);
+  dst[len] = '\0';
+
+  return SS_SUCCESS;
 }
 
 /**
- * \brief Returns the number of elements within a JSON array
- * \param buf Buffer to hold the JSON array
+ * \brief Function to get the next element of a JSON array of blocks
+ * \param idx The array position, advanced past the element returned
+ * \param end The end of the JSON array
+ * \param block The start of the array block returned
+ * \param block_len The length of the array block returned
+ * \return SS_GET_EMPTY once the array is exhausted
  */
-static int get_array_block_count(const char *buf) {
-  char *idx = (char *)buf;
-  int i = 0;
-
-  while (1) {
-    int ret = get_json_end_container(buf + (idx - buf),
-        (char **)&idx, JSON_BLOCK_CONTAINER,JSON_BLOCK_END_CONTAINER);
-    if (ret || !idx) break;
-
-    /* find next none whitespace/return value */
-    while (*idx == ' ' || *idx == '\r' || *idx == '\n') idx++;
+static int get_next_array_block(const char **idx, const char *end,
+    const char **block, size_t *block_len) {
+  const char *p = *idx, *block_end = NULL;
+  int ret;
+
+  /* find next none whitespace/separator */
+  while (p < end && (*p == ' ' || *p == '\r' || *p == '\n' || *p == ',')) {
+    p++;
+  }
 
-    if (*idx == ',') {
-      i++;
-    } else {
-      break;
-    }
+  ret = get_json_end_container(p, end, &block_end, JSON_BLOCK_CONTAINER,
+      JSON_BLOCK_END_CONTAINER);
+  if (ret) {
+    return ret;
   }
 
-  return i;
+  *block = p;
+  *block_len = (size_t)(block_end - p);
+  *idx = block_end;
+
+  return SS_SUCCESS;
 }
 
 /**
- * \brief Convert JSON into a reading struct
+ * \brief Convert JSON into a reading struct. Values are decoded directly
+ *        from buf into the reading, buf is not modified or copied.
  * \param r Pointer to output reading struct
- * \param buf The JSON buffer
+ * \param buf The JSON buffer, need not be NUL terminated
  * \param len The length of the JSON buffer
+ * \return SS_GET_ERROR if a value is too long for the reading
  */
-int convert_json_reading(struct reading *r, char *buf, size_t len) {
+int convert_json_reading(struct reading *r, const char *buf, size_t len) {
   int ret = SS_SUCCESS;
-  int i;
-  int blk_cnt = 0;
-  char val[1024], val1[1024], val2[1024];
+  const char *val, *blk, *field, *idx;
+  size_t val_len, blk_len, field_len;
+  struct measurement *m;
 
   /* date conversion */
-  ret = json_get_key_value(buf, JSON_DATE_KEY, val);
+  ret = json_get_key_value(buf, len, JSON_DATE_KEY, &val, &val_len);
   if (ret) {
     /* set date to NOW */
   } else {
-    convert_db_date_to_tm(val, &r->t);
+    convert_db_date_to_tm(val, val_len, &r->t);
+  }
+
+  /* precise timestamp conversion */
+  ret = json_get_key_value(buf, len, JSON_TS_KEY, &val, &val_len);
+  if (!ret) {
+    convert_ts_str_to_timespec(val, val_len, &r->ts);
   }
 
   /* device conversion */
-  ret = json_get_key_value(buf, JSON_DEVICE_KEY, val);
+  ret = json_get_key_value(buf, len, JSON_DEVICE_KEY, &val, &val_len);
   if (!ret) {
 
     /* we should have a device object */
-    ret = json_get_key_value(val, JSON_ID_KEY, val1);
+    ret = json_get_key_value(val, val_len, JSON_ID_KEY, &field, &field_len);
     if (!ret) {
-      r->device_id = atoi(val1);
+      r->device_id = convert_str_to_uint(field, field_len);
     }
 
-    ret = json_get_key_value(val, JSON_NAME_KEY, r->name);
+    ret = json_get_key_value(val, val_len, JSON_NAME_KEY, &field,
+        &field_len);
     if (!ret) {
-      /* need proper error checking */
+      ret = json_copy_value(r->name, sizeof(r->name), field, field_len);
+      if (ret) {
+        return ret;
+      }
     }
   }
 
   /* measurement conversion */
-  ret = json_get_key_value(buf, JSON_SENSORS_KEY, val);
+  ret = json_get_key_value(buf, len, JSON_SENSORS_KEY, &val, &val_len);
   if (!ret) {
 
-    blk_cnt = get_array_block_count(val);
-    log_stderr(LOG_DEBUG, "JSON measurement count: %d\n", blk_cnt + 1);
-
     /* for each sensors array element */
-    for (i = 0; i <= blk_cnt; i++) {
-
-      /* get array element */
-      ret = get_array_block(val, i, val1);
-      if (ret) {
-        log_stderr(LOG_ERROR, "Failed to copy JSON block to buffer");
-      }
-      /* how do we return from a single measurement - i.e - no array */
+    idx = val;
+    while (!(ret = get_next_array_block(&idx, val + val_len, &blk,
+            &blk_len))) {
 
-      log_stderr(LOG_DEBUG, "Processing array block: %s", val1);
+      log_stderr(LOG_DEBUG, "Processing array block: %.*s", (int)blk_len,
+          blk);
 
       /* measurement */
       ret = measurement_init(r);
       if (ret) {
         break;
       }
+      m = r->meas[r->count - 1];
 
       /* measurement id */
-      ret = json_get_key_value(val1, JSON_MEAS_KEY, r->meas[r->count - 1]->meas);
+      ret = json_get_key_value(blk, blk_len, JSON_MEAS_KEY, &field,
+          &field_len);
+      if (!ret) {
+        ret = json_copy_value(m->meas, sizeof(m->meas), field, field_len);
+        if (ret) {
+          break;
+        }
+      }
 
       /* name */
-      ret = json_get_key_value(val1, JSON_NAME_KEY, r->meas[r->count - 1]->name);
+      ret = json_get_key_value(blk, blk_len, JSON_NAME_KEY, &field,
+          &field_len);
+      if (!ret) {
+        ret = json_copy_value(m->name, sizeof(m->name), field, field_len);
+        if (ret) {
+          break;
+        }
+      }
 
       /* sensor id */
-      ret = json_get_key_value(val1, JSON_ID_KEY, val2);
+      ret = json_get_key_value(blk, blk_len, JSON_ID_KEY, &field,
+          &field_len);
       if (!ret) {
-        r->meas[r->count - 1]->sensor_id = atoi(val2);
+        m->sensor_id = convert_str_to_uint(field, field_len);
       }
 
-
       /* type */
-      ret = json_get_key_value(val1, JSON_TYPE_KEY, val2);
+      ret = json_get_key_value(blk, blk_len, JSON_TYPE_KEY, &field,
+          &field_len);
       if (!ret) {
-        /* ToDo: type conversion */
+        m->type = convert_str_to_meas_type(field, field_len);
       }
-
     }
+    log_stderr(LOG_DEBUG, "JSON measurement count: %d", r->count);
     log_stderr(LOG_DEBUG, "JSON conversion complete");
   }
 
@@ -431,3 +436,64 @@ int convert_json_reading(struct reading *r, char *buf, size_t len) {
     return ret;
   }
 }
+
+/**
+ * \brief Convert each of the JSON readings held in a buffer and pass it to
+ *        a sink. Readings without a date are given the current time.
+ * \param buf The JSON readings, need not be NUL terminated
+ * \param len The length of the buffer
+ * \param sep The character separating the readings
+ * \param sensor_id The sensor_id of measurements carrying none, 0 for none
+ * \param sink Called with each reading converted, which is freed once it
+ *        returns. The sink reports its own errors, a reading it fails to
+ *        take does not stop the rest.
+ * \param arg The argument of the sink
+ * \return SS_OUT_OF_MEM_ERROR if a reading could not be allocated
+ */
+int convert_json_readings(const char *buf, size_t len, char sep,
+    uint32_t sensor_id, reading_sink_cb sink, void *arg) {
+
+  const char *line, *end = buf + len, *next;
+  struct reading *r;
+  time_t t;
+  int ret, i;
+
+  log_stderr(LOG_DEBUG, "PKT: %.*s", (int)len, buf);
+
+  for (line = buf; line < end; line = next + 1) {
+    next = memchr(line, sep, end - line);
+    if (!next) {
+      next = end;
+    }
+    if (next == line) {
+      continue;
+    }
+
+    ret = reading_init(&r);
+    if (ret) {
+      log_stderr(LOG_ERROR, "Failed to initialise reading");
+      return ret;
+    }
+
+    /* set reading date/time to now - fallback */
+    t = time(0);
+    localtime_r(&t, &r->t);
+
+    ret = convert_json_reading(r, line, next - line);
+    if (ret) {
+      log_stderr(LOG_ERROR, "Converting reading from JSON");
+    } else {
+      /* the topic names the sensor */
+      for (i = 0; sensor_id && i < r->count; i++) {
+        if (!r->meas[i]->sensor_id) {
+          r->meas[i]->sensor_id = sensor_id;
+        }
+      }
+      sink(r, arg);
+    }
+
+    free_reading(r);
+  }
+
+  return SS_SUCCESS;
+}
@@ -0,0 +1,321 @@
+/******************************************************************************
+ * File: reading_remap.c
+ * Description: functions to remap the sensor IDs of readings
+ * Author: Steven Swann - swannonline@googlemail.com
+ *
+ * Copyright (c) swannonline, 2013-2014
+ *
+ * This file is part of sensorspace.
+ *
+ * sensorspace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * sensorspace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with sensorspace.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+
+#include "sensorspace.h"
+#include "log.h"
+#include "reading_remap.h"
+
+/**
+ * \brief Get the slot a sensor ID hashes to
+ */
+static size_t sensor_remap_hash(struct sensor_remaps *rm, uint32_t id) {
+
+  /* Fibonacci hashing spreads sequential IDs across the table */
+  return (uint32_t)(id * 2654435769u) >> (32 - rm->bits);
+}
+
+/**
+ * \brief Allocate the slots of a remap table
+ */
+static int sensor_remaps_alloc(struct sensor_remaps *rm, unsigned bits) {
+
+  if (!(rm->slot = calloc((size_t)1 << bits, sizeof(struct sensor_remap)))) {
+    log_stderr(LOG_ERROR, "Sensor remaps: Out of memory");
+    return SS_OUT_OF_MEM_ERROR;
+  }
+
+  rm->bits = bits;
+  rm->count = 0;
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Initialise a sensor ID remap table
+ * \param rm_p Pointer to the remap table to be returned
+ * \param count The number of remaps expected, the table grows as required
+ */
+int sensor_remaps_init(struct sensor_remaps **rm_p, size_t count) {
+
+  struct sensor_remaps *rm;
+  unsigned bits = 0;
+
+  while (((size_t)1 << bits) < SENSOR_REMAP_MIN_SLOTS ||
+      ((size_t)1 << bits) < count * 2) {
+    bits++;
+  }
+
+  if (!(rm = calloc(1, sizeof(struct sensor_remaps)))) {
+    log_stderr(LOG_ERROR, "Sensor remaps: Out of memory");
+    return SS_OUT_OF_MEM_ERROR;
+  }
+
+  if (sensor_remaps_alloc(rm, bits)) {
+    free(rm);
+    return SS_OUT_OF_MEM_ERROR;
+  }
+
+  *rm_p = rm;
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Double the size of a remap table, rehashing its remaps
+ */
+static int sensor_remaps_grow(struct sensor_remaps *rm) {
+
+  struct sensor_remap *old = rm->slot;
+  size_t i, size = (size_t)1 << rm->bits;
+
+  if (rm->bits >= 31 || sensor_remaps_alloc(rm, rm->bits + 1)) {
+    rm->slot = old;
+    return SS_OUT_OF_MEM_ERROR;
+  }
+
+  for (i = 0; i < size; i++) {
+    if (old[i].used) {
+      sensor_remaps_add(rm, old[i].id, old[i].to_id);
+    }
+  }
+
+  free(old);
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Add a remap to a table, replacing any existing remap of the ID
+ * \param rm The remap table
+ * \param id The sensor ID as received
+ * \param to_id The sensor ID to use in its place
+ */
+int sensor_remaps_add(struct sensor_remaps *rm, uint32_t id, uint32_t to_id) {
+
+  size_t mask, i;
+
+  if ((rm->count + 1) * 2 > ((size_t)1 << rm->bits)) {
+    if (sensor_remaps_grow(rm)) {
+      return SS_OUT_OF_MEM_ERROR;
+    }
+  }
+
+  mask = ((size_t)1 << rm->bits) - 1;
+  for (i = sensor_remap_hash(rm, id); rm->slot[i].used; i = (i + 1) & mask) {
+    if (rm->slot[i].id == id) {
+      break;
+    }
+  }
+
+  if (!rm->slot[i].used) {
+    rm->slot[i].used = true;
+    rm->slot[i].id = id;
+    rm->count++;
+  }
+  rm->slot[i].to_id = to_id;
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Look up the remap of a sensor ID
+ * \param rm The remap table
+ * \param id The sensor ID as received
+ * \param to_id Set to the sensor ID to use in its place
+ * \return SS_NO_MATCH if the ID is not remapped
+ */
+int sensor_remaps_lookup(struct sensor_remaps *rm, uint32_t id,
+    uint32_t *to_id) {
+
+  size_t mask, i;
+
+  if (!rm || !rm->count) {
+    return SS_NO_MATCH;
+  }
+
+  mask = ((size_t)1 << rm->bits) - 1;
+  for (i = sensor_remap_hash(rm, id); rm->slot[i].used; i = (i + 1) & mask) {
+    if (rm->slot[i].id == id) {
+      *to_id = rm->slot[i].to_id;
+      return SS_SUCCESS;
+    }
+  }
+
+  return SS_NO_MATCH;
+}
+
+/**
+ * \brief Add all the remaps of one table to another, replacing remaps of
+ *        the same IDs
+ * \param rm The remap table to add to
+ * \param from The remap table to add from
+ */
+int sensor_remaps_merge(struct sensor_remaps *rm, struct sensor_remaps *from) {
+
+  size_t i;
+
+  for (i = 0; from && i < ((size_t)1 << from->bits); i++) {
+    if (from->slot[i].used &&
+        sensor_remaps_add(rm, from->slot[i].id, from->slot[i].to_id)) {
+      return SS_OUT_OF_MEM_ERROR;
+    }
+  }
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Parse a remap of the form "<id>:<to_id>" or "<id> <to_id>"
+ * \param str The NULL terminated string to parse
+ * \param id Set to the sensor ID as received
+ * \param to_id Set to the sensor ID to use in its place
+ * \return SS_CFG_FAILED if the string is not a valid remap
+ */
+int sensor_remap_parse(const char *str, uint32_t *id, uint32_t *to_id) {
+
+  unsigned long from, to;
+  char *end;
+
+  errno = 0;
+  from = strtoul(str, &end, 10);
+  if (end == str || (*end != ':' && !isspace((unsigned char)*end))) {
+    return SS_CFG_FAILED;
+  }
+
+  str = end + 1;
+  to = strtoul(str, &end, 10);
+  if (end == str || errno || from > UINT32_MAX || to > UINT32_MAX) {
+    return SS_CFG_FAILED;
+  }
+
+  while (isspace((unsigned char)*end)) {
+    end++;
+  }
+  if (*end && *end != SENSOR_REMAP_COMMENT) {
+    return SS_CFG_FAILED;
+  }
+
+  *id = from;
+  *to_id = to;
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Load a remap table from a file. Each line holds a single remap
+ *        of the form "<id>:<to_id>" or "<id> <to_id>", blank lines and
+ *        lines starting with '#' are ignored.
+ * \param rm_p Pointer to the remap table to be returned
+ * \param path The remap file
+ */
+int sensor_remaps_load(struct sensor_remaps **rm_p, const char *path) {
+
+  struct sensor_remaps *rm = NULL;
+  char line[SENSOR_REMAP_LINE_LEN];
+  char *p;
+  uint32_t id, to_id;
+  unsigned line_no = 0;
+  int ret;
+  FILE *f;
+
+  if (!(f = fopen(path, "r"))) {
+    log_stderr(LOG_ERROR, "Opening remap file %s: %s", path,
+        strerror(errno));
+    return SS_CFG_FAILED;
+  }
+
+  ret = sensor_remaps_init(&rm, 0);
+  if (ret) {
+    goto free;
+  }
+
+  while (fgets(line, sizeof(line), f)) {
+    line_no++;
+
+    for (p = line; isspace((unsigned char)*p); p++);
+    if (!*p || *p == SENSOR_REMAP_COMMENT) {
+      continue;
+    }
+
+    if (sensor_remap_parse(p, &id, &to_id)) {
+      log_stderr(LOG_ERROR, "%s:%u: Invalid remap", path, line_no);
+      ret = SS_CFG_FAILED;
+      goto free;
+    }
+
+    ret = sensor_remaps_add(rm, id, to_id);
+    if (ret) {
+      goto free;
+    }
+  }
+
+  log_stdout(LOG_INFO, "Loaded %zu sensor ID remaps from %s", rm->count,
+      path);
+
+  fclose(f);
+  *rm_p = rm;
+  return SS_SUCCESS;
+
+free:
+  fclose(f);
+  free_sensor_remaps(rm);
+  return ret;
+}
+
+/**
+ * \brief Remap the sensor IDs of a reading's measurements
+ * \param r The reading
+ * \param rm The remap table, may be NULL
+ */
+void remap_reading_sensor_ids(struct reading *r, struct sensor_remaps *rm) {
+
+  uint32_t to_id;
+  int i;
+
+  for (i = 0; i < r->count; i++) {
+    if (!sensor_remaps_lookup(rm, r->meas[i]->sensor_id, &to_id)) {
+      log_stdout(LOG_DEBUG, "remapped sensor_id: %u->%u",
+          r->meas[i]->sensor_id, to_id);
+      r->meas[i]->sensor_id = to_id;
+    }
+  }
+
+  return;
+}
+
+/**
+ * \brief Free a remap table
+ */
+void free_sensor_remaps(struct sensor_remaps *rm) {
+
+  if (rm) {
+    free(rm->slot);
+    free(rm);
+  }
+
+  return;
+}
@@ -0,0 +1,72 @@
+#ifndef READING_REMAP__H
+#define READING_REMAP__H
+/******************************************************************************
+ * File: reading_remap.h
+ * Description: functions to remap the sensor IDs of readings
+ * Author: Steven Swann - swannonline@googlemail.com
+ *
+ * Copyright (c) swannonline, 2013-2014
+ *
+ * This file is part of sensorspace.
+ *
+ * sensorspace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * sensorspace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with sensorspace.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "reading.h"
+
+#define SENSOR_REMAP_MIN_SLOTS    16
+#define SENSOR_REMAP_LINE_LEN     256
+#define SENSOR_REMAP_COMMENT      '#'
+
+/*
+ * \brief Struct to hold a single sensor ID remap
+ * \param id The sensor ID as received
+ * \param to_id The sensor ID to use in its place
+ * \param used True when the slot holds a remap
+ */
+struct sensor_remap {
+  uint32_t id;
+  uint32_t to_id;
+  bool used;
+};
+
+/*
+ * \brief Struct to hold an open-addressing hash table of sensor ID remaps.
+ *        Collisions are resolved with linear probing, the table is kept at
+ *        most half full.
+ * \param slot The remap slots
+ * \param bits The log2 of the number of slots
+ * \param count The number of remaps held
+ */
+struct sensor_remaps {
+  struct sensor_remap *slot;
+  unsigned bits;
+  size_t count;
+};
+
+int sensor_remaps_init(struct sensor_remaps **rm_p, size_t count);
+int sensor_remaps_add(struct sensor_remaps *rm, uint32_t id, uint32_t to_id);
+int sensor_remaps_lookup(struct sensor_remaps *rm, uint32_t id,
+    uint32_t *to_id);
+int sensor_remaps_merge(struct sensor_remaps *rm, struct sensor_remaps *from);
+int sensor_remap_parse(const char *str, uint32_t *id, uint32_t *to_id);
+int sensor_remaps_load(struct sensor_remaps **rm_p, const char *path);
+void remap_reading_sensor_ids(struct reading *r, struct sensor_remaps *rm);
+void free_sensor_remaps(struct sensor_remaps *rm);
+
+#endif        /* READING_REMAP__H */
@@ -0,0 +1,401 @@
+/******************************************************************************
+ * File: reading_rrdcached.c
+ * Description: client for the rrdcached update protocol
+ * Author: Steven Swann - swannonline@googlemail.com
+ *
+ * Copyright (c) swannonline, 2013-2014
+ *
+ * This file is part of sensorspace.
+ *
+ * sensorspace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * sensorspace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with sensorspace.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "reading.h"
+
+#define RRDCACHED_ADDR_PREFIX     "unix:"
+#define RRDCACHED_BUF_SIZE        4096
+/* rrdcached reads commands into a 4KiB line buffer */
+#define RRDCACHED_LINE_MAX        4000
+#define RRDCACHED_TIMEOUT_S       5
+/* initial number of commands a batch is sized for */
+#define RRDCACHED_CMD_MIN         64
+#define RRDCACHED_BATCH           "BATCH\n"
+#define RRDCACHED_BATCH_END       ".\n"
+
+/**
+ * \brief Initialise an rrdcached connection, connected on first use
+ * \param c_p Pointer to the connection to be returned
+ * \param path The daemon's Unix socket, optionally prefixed with "unix:"
+ */
+int rrdcached_init(struct rrdcached **c_p, const char *path) {
+
+  struct rrdcached *c;
+
+  if (!strncmp(path, RRDCACHED_ADDR_PREFIX, strlen(RRDCACHED_ADDR_PREFIX))) {
+    path += strlen(RRDCACHED_ADDR_PREFIX);
+  }
+
+  if (strlen(path) >= sizeof(((struct sockaddr_un *)0)->sun_path)) {
+    log_stderr(LOG_ERROR, "rrdcached: Socket path too long: %s", path);
+    return SS_INIT_ERROR;
+  }
+
+  if (!(c = calloc(1, sizeof(struct rrdcached)))) {
+    log_stderr(LOG_ERROR, "rrdcached: Out of memory");
+    return SS_OUT_OF_MEM_ERROR;
+  }
+
+  if (!(c->buf = malloc(RRDCACHED_BUF_SIZE))) {
+    log_stderr(LOG_ERROR, "rrdcached: Out of memory");
+    free(c);
+    return SS_OUT_OF_MEM_ERROR;
+  }
+  c->size = RRDCACHED_BUF_SIZE;
+  c->fd = -1;
+  strcpy(c->path, path);
+
+  *c_p = c;
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Close the daemon socket, it is reconnected on next use
+ */
+static void rrdcached_close(struct rrdcached *c) {
+
+  if (c->fd >= 0) {
+    close(c->fd);
+    c->fd = -1;
+  }
+}
+
+/**
+ * \brief Connect to the daemon if not already connected
+ */
+static int rrdcached_connect(struct rrdcached *c) {
+
+  struct sockaddr_un addr;
+  struct timeval tv = { .tv_sec = RRDCACHED_TIMEOUT_S };
+
+  if (c->fd >= 0) {
+    return SS_SUCCESS;
+  }
+
+  memset(&addr, 0, sizeof(struct sockaddr_un));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, c->path);
+
+  if ((c->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+    log_stderr(LOG_ERROR, "rrdcached: socket: %s", strerror(errno));
+    return SS_CONN_ERROR;
+  }
+
+  /* a stalled daemon should not stall the sink forever */
+  setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(c->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+  if (connect(c->fd, (struct sockaddr *)&addr, sizeof(addr))) {
+    log_stderr(LOG_ERROR, "rrdcached: Connecting to %s: %s", c->path,
+        strerror(errno));
+    rrdcached_close(c);
+    return SS_CONN_ERROR;
+  }
+
+  log_stdout(LOG_INFO, "Connected to rrdcached: %s", c->path);
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Make room for len more bytes in the command buffer
+ */
+static int rrdcached_reserve(struct rrdcached *c, size_t len) {
+
+  size_t size = c->size;
+  char *buf;
+
+  while (size - c->len < len) {
+    size *= 2;
+  }
+
+  if (size != c->size) {
+    if (!(buf = realloc(c->buf, size))) {
+      log_stderr(LOG_ERROR, "rrdcached: Out of memory");
+      return SS_OUT_OF_MEM_ERROR;
+    }
+    c->buf = buf;
+    c->size = size;
+  }
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Append a string to the command buffer
+ */
+static int rrdcached_append(struct rrdcached *c, const char *str) {
+
+  size_t len = strlen(str);
+
+  if (rrdcached_reserve(c, len)) {
+    return SS_OUT_OF_MEM_ERROR;
+  }
+  memcpy(c->buf + c->len, str, len);
+  c->len += len;
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Write the command buffer to the daemon
+ */
+static int rrdcached_send(struct rrdcached *c) {
+
+  size_t off = 0;
+  ssize_t n;
+
+  while (off < c->len) {
+    n = send(c->fd, c->buf + off, c->len - off, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      log_stderr(LOG_ERROR, "rrdcached: Sending: %s", strerror(errno));
+      return SS_WRITE_ERROR;
+    }
+    off += n;
+  }
+  c->len = 0;
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Read a response line from the daemon into the buffer, replacing
+ *        the newline with a NUL. The line is removed by the next call.
+ * \param c The connection
+ * \param line_len The length of the previous line returned, 0 at first
+ */
+static int rrdcached_recv_line(struct rrdcached *c, size_t *line_len) {
+
+  char *nl;
+  ssize_t n;
+
+  /* discard the previous line */
+  if (*line_len) {
+    c->len -= *line_len + 1;
+    memmove(c->buf, c->buf + *line_len + 1, c->len);
+    *line_len = 0;
+  }
+
+  while (!(nl = memchr(c->buf, '\n', c->len))) {
+    if (c->len == c->size && rrdcached_reserve(c, 1)) {
+      return SS_OUT_OF_MEM_ERROR;
+    }
+
+    n = recv(c->fd, c->buf + c->len, c->size - c->len, 0);
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      log_stderr(LOG_ERROR, "rrdcached: Receiving: %s",
+          n ? strerror(errno) : "connection closed");
+      return SS_READ_ERROR;
+    }
+    c->len += n;
+  }
+
+  *nl = '\0';
+  *line_len = nl - c->buf;
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Start a new UPDATE command for a file in the command buffer. The
+ *        daemon resolves relative paths against its own directory, so they
+ *        are made absolute with realpath() first, as librrd's client does.
+ * \param c The connection
+ * \param q The queue of the file the command updates
+ * \param idx The index of the queue in the batch
+ * \param cmd The number of commands in the batch so far
+ */
+static int rrdcached_cmd(struct rrdcached *c, struct rrd_queue *q,
+    unsigned idx, unsigned cmd) {
+
+  char path[PATH_MAX];
+  const char *file = q->file;
+  unsigned *cmd_file;
+  unsigned size;
+
+  if (file[0] != '/') {
+    if (realpath(file, path)) {
+      file = path;
+    } else {
+      log_stderr(LOG_WARN, "rrdcached: Can not resolve %s: %s", file,
+          strerror(errno));
+    }
+  }
+
+  if (cmd == c->cmd_size) {
+    size = c->cmd_size ? c->cmd_size * 2 : RRDCACHED_CMD_MIN;
+    if (!(cmd_file = realloc(c->cmd_file, size * sizeof(unsigned)))) {
+      log_stderr(LOG_ERROR, "rrdcached: Out of memory");
+      return SS_OUT_OF_MEM_ERROR;
+    }
+    c->cmd_file = cmd_file;
+    c->cmd_size = size;
+  }
+  c->cmd_file[cmd] = idx;
+
+  if (rrdcached_append(c, cmd ? "\nUPDATE " : "UPDATE ") ||
+      rrdcached_append(c, file)) {
+    return SS_OUT_OF_MEM_ERROR;
+  }
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Send the queued updates of a number of RRD files to the daemon in
+ *        a single BATCH, one UPDATE command per file
+ * \param c The connection
+ * \param q The update queues of the files
+ * \param count The number of queues
+ * \param status The result for each queue, SS_POST_ERROR if the daemon
+ *        rejected its update
+ * \return SS_CONN_ERROR if the batch could not be completed, in which case
+ *         status is not set
+ */
+int rrdcached_update(struct rrdcached *c, struct rrd_queue **q,
+    unsigned count, int *status) {
+
+  size_t line_len = 0, line_start = 0, off, val_len;
+  const char *val;
+  unsigned i, j, cmd;
+  long errors, n;
+  char *end;
+
+  if (!count) {
+    return SS_SUCCESS;
+  }
+
+  if (rrdcached_connect(c)) {
+    return SS_CONN_ERROR;
+  }
+
+  /* BATCH, then the commands, then "." - without waiting in between */
+  c->len = 0;
+  if (rrdcached_append(c, RRDCACHED_BATCH)) {
+    goto error;
+  }
+
+  for (i = 0, cmd = 0; i < count; i++) {
+    status[i] = SS_SUCCESS;
+
+    /* as many values per UPDATE as fit the daemon's line buffer */
+    for (j = 0, off = 0; j < q[i]->count; j++) {
+      val = q[i]->buf + off;
+      val_len = strlen(val);
+      if (!j || c->len - line_start + val_len + 1 > RRDCACHED_LINE_MAX) {
+        line_start = c->len;
+        if (rrdcached_cmd(c, q[i], i, cmd++)) {
+          goto error;
+        }
+      }
+
+      if (rrdcached_append(c, " ") || rrdcached_append(c, val)) {
+        goto error;
+      }
+      off += val_len + 1;
+    }
+  }
+
+  if (cmd && rrdcached_append(c, "\n")) {
+    goto error;
+  }
+
+  if (rrdcached_append(c, RRDCACHED_BATCH_END) || rrdcached_send(c)) {
+    goto error;
+  }
+
+  /* "0 Go ahead..." */
+  if (rrdcached_recv_line(c, &line_len)) {
+    goto error;
+  }
+  if (strtol(c->buf, &end, 10) != 0 || end == c->buf) {
+    log_stderr(LOG_ERROR, "rrdcached: BATCH refused: %s", c->buf);
+    goto error;
+  }
+
+  /* "<n> errors", then "<command> <message>" for each */
+  if (rrdcached_recv_line(c, &line_len)) {
+    goto error;
+  }
+  errors = strtol(c->buf, &end, 10);
+  if (end == c->buf || errors < 0) {
+    log_stderr(LOG_ERROR, "rrdcached: BATCH failed: %s", c->buf);
+    goto error;
+  }
+
+  for (; errors > 0; errors--) {
+    if (rrdcached_recv_line(c, &line_len)) {
+      goto error;
+    }
+
+    /* commands are numbered from 1, BATCH itself excluded */
+    n = strtol(c->buf, &end, 10);
+    if (n >= 1 && n <= (long)cmd) {
+      i = c->cmd_file[n - 1];
+      status[i] = SS_POST_ERROR;
+      log_stderr(LOG_ERROR, "rrdcached: %s:%s", q[i]->file, end);
+    } else {
+      log_stderr(LOG_ERROR, "rrdcached: %s", c->buf);
+    }
+  }
+
+  /* drop the last line */
+  c->len -= line_len + 1;
+
+  return SS_SUCCESS;
+
+error:
+  rrdcached_close(c);
+  c->len = 0;
+  return SS_CONN_ERROR;
+}
+
+/**
+ * \brief Close and free an rrdcached connection
+ */
+void free_rrdcached(struct rrdcached *c) {
+
+  if (c) {
+    rrdcached_close(c);
+    free(c->cmd_file);
+    free(c->buf);
+    free(c);
+  }
+}
@@ -0,0 +1,506 @@
+/******************************************************************************
+ * File: reading_rrdcreate.c
+ * Description: creation of RRD files from templates, off the receive path
+ * Author: Steven Swann - swannonline@googlemail.com
+ *
+ * Copyright (c) swannonline, 2013-2014
+ *
+ * This file is part of sensorspace.
+ *
+ * sensorspace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * sensorspace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with sensorspace.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <rrd.h>
+
+#include "reading.h"
+#include "reading_rrdcreate.h"
+
+#define RRD_TEMPLATE_ANY          "default"
+#define RRD_TEMPLATE_SEP          " \t"
+#define RRD_TEMPLATE_DS           "DS:"
+
+/*
+ * \brief The keys of a path pattern, each given as {key}
+ */
+typedef enum {
+  RRD_PATH_DEVICE,
+  RRD_PATH_SENSOR,
+  RRD_PATH_NAME,
+  RRD_PATH_TYPE,
+  RRD_PATH_KEYS,
+} rrd_path_key_t;
+
+static const char *rrd_path_keys[RRD_PATH_KEYS] = {
+  "device", "sensor", "name", "type",
+};
+
+/**
+ * \brief Compare a string that need not be NUL terminated with a name
+ */
+static bool str_is(const char *str, size_t len, const char *name) {
+  return strlen(name) == len && !strncmp(str, name, len);
+}
+
+/**
+ * \brief Get the key of a path pattern placeholder
+ * \return The key, RRD_PATH_KEYS if not known
+ */
+static rrd_path_key_t rrd_path_key(const char *key, size_t len) {
+
+  unsigned i;
+
+  for (i = 0; i < RRD_PATH_KEYS; i++) {
+    if (str_is(key, len, rrd_path_keys[i])) {
+      break;
+    }
+  }
+
+  return (rrd_path_key_t)i;
+}
+
+/**
+ * \brief Create the directories leading to a file, as mkdir -p
+ */
+static int rrd_create_dirs(const char *path) {
+
+  char dir[MAX_FILENAME_LEN];
+  char *p;
+
+  strcpy(dir, path);
+
+  for (p = dir + 1; (p = strchr(p, '/')); p++) {
+    *p = '\0';
+    if (mkdir(dir, 0755) && errno != EEXIST) {
+      log_stderr(LOG_ERROR, "RRD: Failed to create %s: %s", dir,
+          strerror(errno));
+      return SS_INIT_ERROR;
+    }
+    *p = '/';
+  }
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Create an RRD file, unless it already exists
+ */
+static void rrd_create_file(struct rrd_creator *c, struct rrd_create *cr) {
+
+  struct rrd_template *t = cr->tmpl;
+  int ret = SS_SUCCESS;
+  uint64_t one = 1;
+
+  if (!access(cr->path, F_OK)) {
+    log_stdout(LOG_INFO, "RRD: Using existing file: %s", cr->path);
+    c->existing++;
+
+  } else if (!(ret = rrd_create_dirs(cr->path))) {
+    if (rrd_create_r(cr->path, t->step, cr->start, t->argc, t->argv)) {
+      log_stderr(LOG_ERROR, "rrd_error: %s", rrd_get_error());
+      rrd_clear_error();
+      ret = SS_INIT_ERROR;
+    } else {
+      log_stdout(LOG_INFO, "RRD: Created %s", cr->path);
+      c->created++;
+    }
+  }
+
+  if (ret) {
+    c->failed++;
+  }
+
+  /* cr belongs to the caller again once taken */
+  pthread_mutex_lock(&c->lock);
+  cr->status = ret;
+  cr->next = c->done;
+  c->done = cr;
+  pthread_mutex_unlock(&c->lock);
+
+  if (write(c->fd, &one, sizeof(one)) < 0) {
+    log_stderr(LOG_ERROR, "RRD creator: eventfd: %s", strerror(errno));
+  }
+}
+
+/**
+ * \brief Creator thread, creating the files queued in order
+ */
+static void *rrd_creator_run(void *arg) {
+
+  struct rrd_creator *c = (struct rrd_creator *)arg;
+  struct rrd_create *list, *next;
+
+  pthread_mutex_lock(&c->lock);
+  while (1) {
+    while (!c->head && !c->stop) {
+      pthread_cond_wait(&c->cond, &c->lock);
+    }
+    if (!c->head) {
+      break;
+    }
+
+    list = c->head;
+    c->head = c->tail = NULL;
+    c->busy = true;
+    pthread_mutex_unlock(&c->lock);
+
+    for (; list; list = next) {
+      next = list->next;
+      rrd_create_file(c, list);
+    }
+
+    pthread_mutex_lock(&c->lock);
+    c->busy = false;
+    pthread_cond_broadcast(&c->idle);
+  }
+  pthread_mutex_unlock(&c->lock);
+
+  return NULL;
+}
+
+/**
+ * \brief Initialise an RRD file creator, to be given templates with
+ *        rrd_creator_template() before rrd_creator_start()
+ */
+int rrd_creator_init(struct rrd_creator **c_p) {
+
+  struct rrd_creator *c;
+
+  if (!(c = calloc(1, sizeof(struct rrd_creator)))) {
+    log_stderr(LOG_ERROR, "RRD creator: Out of memory");
+    return SS_OUT_OF_MEM_ERROR;
+  }
+
+  if ((c->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+    log_stderr(LOG_ERROR, "RRD creator: eventfd: %s", strerror(errno));
+    free(c);
+    return SS_INIT_ERROR;
+  }
+
+  pthread_mutex_init(&c->lock, NULL);
+  pthread_cond_init(&c->cond, NULL);
+  pthread_cond_init(&c->idle, NULL);
+
+  *c_p = c;
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Add an RRD file template
+ * \param c The creator
+ * \param def The template, "<type>=<step> <DS>... <RRA>...", where type
+ *        is a measurement type or "default" for any type without its own
+ *        template. The sensor updates the first DS.
+ */
+int rrd_creator_template(struct rrd_creator *c, const char *def) {
+
+  int ret = SS_INIT_ERROR;
+  const char *eq = strchr(def, '=');
+  struct rrd_template *t;
+  meas_type_t type;
+  char *arg, *save, *end;
+  size_t len;
+
+  if (!eq) {
+    log_stderr(LOG_ERROR, "RRD template should be"
+        " <type>=<step> <DS>... <RRA>...: %s", def);
+    return SS_INIT_ERROR;
+  }
+
+  if (str_is(def, eq - def, RRD_TEMPLATE_ANY)) {
+    t = &c->any;
+  } else {
+    type = convert_str_to_meas_type(def, eq - def);
+    if (type == MEAS_UNKNOWN &&
+        !str_is(def, eq - def, meas_type_str(MEAS_UNKNOWN))) {
+      log_stderr(LOG_ERROR, "RRD template: Unknown measurement type: %.*s",
+          (int)(eq - def), def);
+      return SS_INIT_ERROR;
+    }
+    t = &c->tmpl[type];
+  }
+
+  if (t->step) {
+    log_stderr(LOG_ERROR, "RRD template given twice for %.*s",
+        (int)(eq - def), def);
+    return SS_INIT_ERROR;
+  }
+
+  if (!(t->args = strdup(eq + 1))) {
+    log_stderr(LOG_ERROR, "RRD creator: Out of memory");
+    return SS_OUT_OF_MEM_ERROR;
+  }
+
+  arg = strtok_r(t->args, RRD_TEMPLATE_SEP, &save);
+  if (!arg || !(t->step = strtoul(arg, &end, 10)) || *end) {
+    log_stderr(LOG_ERROR, "RRD template: Invalid step: %s", eq + 1);
+    goto free;
+  }
+
+  while ((arg = strtok_r(NULL, RRD_TEMPLATE_SEP, &save))) {
+    if (t->argc == RRD_CREATE_MAX_ARGS) {
+      log_stderr(LOG_ERROR, "RRD template: More than %d arguments",
+          RRD_CREATE_MAX_ARGS);
+      goto free;
+    }
+
+    if (!t->ds[0] && !strncmp(arg, RRD_TEMPLATE_DS,
+          strlen(RRD_TEMPLATE_DS))) {
+      arg += strlen(RRD_TEMPLATE_DS);
+      len = strcspn(arg, ":");
+      if (!len || len >= RRD_DS_NAME_LEN) {
+        log_stderr(LOG_ERROR, "RRD template: Invalid DS: %s", arg);
+        goto free;
+      }
+      memcpy(t->ds, arg, len);
+      arg -= strlen(RRD_TEMPLATE_DS);
+    }
+
+    t->argv[t->argc++] = arg;
+  }
+
+  if (!t->ds[0]) {
+    log_stderr(LOG_ERROR, "RRD template: No DS given: %s", eq + 1);
+    goto free;
+  }
+
+  return SS_SUCCESS;
+
+free:
+  free(t->args);
+  memset(t, 0, sizeof(struct rrd_template));
+  return ret;
+}
+
+/**
+ * \brief Start creating files
+ * \param c The creator
+ * \param path The path pattern of the files, in which {device}, {sensor},
+ *        {name} and {type} are replaced by those of the measurement. It
+ *        should contain {sensor}, as files are created by sensor_id.
+ */
+int rrd_creator_start(struct rrd_creator *c, const char *path) {
+
+  const char *p, *end;
+  bool sensor = false;
+  sigset_t all, old;
+  rrd_path_key_t key;
+
+  if (strlen(path) >= MAX_FILENAME_LEN) {
+    log_stderr(LOG_ERROR, "RRD creator: Path too long: %s", path);
+    return SS_INIT_ERROR;
+  }
+
+  for (p = path; (p = strchr(p, '{')); p = end + 1) {
+    if (!(end = strchr(p, '}')) ||
+        (key = rrd_path_key(p + 1, end - p - 1)) == RRD_PATH_KEYS) {
+      log_stderr(LOG_ERROR, "RRD creator: Invalid path: %s", path);
+      return SS_INIT_ERROR;
+    }
+    sensor |= key == RRD_PATH_SENSOR;
+  }
+
+  if (!sensor) {
+    log_stderr(LOG_ERROR, "RRD creator: Path should contain {sensor}: %s",
+        path);
+    return SS_INIT_ERROR;
+  }
+  strcpy(c->path, path);
+
+  /* signals are left to the caller's thread */
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+  if (pthread_create(&c->thread, NULL, rrd_creator_run, c)) {
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    log_stderr(LOG_ERROR, "RRD creator: Failed to start thread");
+    return SS_INIT_ERROR;
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  c->started = true;
+
+  log_stdout(LOG_INFO, "Creating RRD files for new sensors: %s", path);
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Get the template for a measurement type
+ * \return The template, NULL if there is none
+ */
+struct rrd_template *rrd_creator_find(struct rrd_creator *c,
+    meas_type_t type) {
+
+  if (type < MEAS_TYPE_COUNT && c->tmpl[type].step) {
+    return &c->tmpl[type];
+  }
+
+  return c->any.step ? &c->any : NULL;
+}
+
+/**
+ * \brief Expand the path pattern for a measurement. A {name} that is
+ *        empty, "." or ".." is rejected, and '/' in a name replaced.
+ * \param path Buffer of MAX_FILENAME_LEN for the path
+ */
+int rrd_creator_path(struct rrd_creator *c, struct reading *r,
+    struct measurement *m, char *path) {
+
+  char val[READ_NAME_LEN];
+  const char *p = c->path, *end, *src;
+  size_t len = 0, n;
+  char *s;
+
+  while (*p) {
+    if (*p == '{' && (end = strchr(p, '}'))) {
+      switch (rrd_path_key(p + 1, end - p - 1)) {
+        case RRD_PATH_DEVICE:
+          sprintf(val, "%u", r->device_id);
+          break;
+        case RRD_PATH_SENSOR:
+          sprintf(val, "%u", m->sensor_id);
+          break;
+        case RRD_PATH_NAME:
+          /* keep names within their directory */
+          if (!m->name[0] || !strcmp(m->name, ".") ||
+              !strcmp(m->name, "..")) {
+            log_stderr(LOG_ERROR, "RRD creator: Invalid name for sensor"
+                " %u: \"%s\"", m->sensor_id, m->name);
+            return SS_INIT_ERROR;
+          }
+          strcpy(val, m->name);
+          for (s = val; (s = strchr(s, '/')); s++) {
+            *s = '_';
+          }
+          break;
+        default:
+          strcpy(val, meas_type_str(m->type));
+          break;
+      }
+      src = val;
+      n = strlen(val);
+      p = end + 1;
+    } else {
+      src = p++;
+      n = 1;
+    }
+
+    if (len + n >= MAX_FILENAME_LEN) {
+      log_stderr(LOG_ERROR, "RRD creator: Path too long for sensor %u",
+          m->sensor_id);
+      return SS_INIT_ERROR;
+    }
+    memcpy(path + len, src, n);
+    len += n;
+  }
+  path[len] = '\0';
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Queue a file to be created. cr should not be freed until it is
+ *        returned by rrd_creator_take().
+ */
+void rrd_creator_queue(struct rrd_creator *c, struct rrd_create *cr) {
+
+  cr->next = NULL;
+
+  pthread_mutex_lock(&c->lock);
+  if (c->tail) {
+    c->tail->next = cr;
+  } else {
+    c->head = cr;
+  }
+  c->tail = cr;
+
+  pthread_cond_signal(&c->cond);
+  pthread_mutex_unlock(&c->lock);
+}
+
+/**
+ * \brief Take the files created since last taken, once c->fd is readable
+ *        or after rrd_creator_sync()
+ * \return The files, linked by next, NULL if none
+ */
+struct rrd_create *rrd_creator_take(struct rrd_creator *c) {
+
+  struct rrd_create *list;
+  uint64_t n;
+
+  /* the count only wakes the caller, the list tells what was created */
+  while (read(c->fd, &n, sizeof(n)) < 0 && errno == EINTR) {
+    continue;
+  }
+
+  pthread_mutex_lock(&c->lock);
+  list = c->done;
+  c->done = NULL;
+  pthread_mutex_unlock(&c->lock);
+
+  return list;
+}
+
+/**
+ * \brief Wait until every queued file has been created
+ */
+void rrd_creator_sync(struct rrd_creator *c) {
+
+  pthread_mutex_lock(&c->lock);
+  while (c->head || c->busy) {
+    pthread_cond_wait(&c->idle, &c->lock);
+  }
+  pthread_mutex_unlock(&c->lock);
+}
+
+/**
+ * \brief Stop the creator once the queued files are created, and free it
+ */
+void free_rrd_creator(struct rrd_creator *c) {
+
+  unsigned i;
+
+  if (!c) {
+    return;
+  }
+
+  if (c->started) {
+    pthread_mutex_lock(&c->lock);
+    c->stop = true;
+    pthread_cond_signal(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+
+    pthread_join(c->thread, NULL);
+
+    log_stderr(LOG_DEBUG, "RRD creator: %lu files created, %lu existing,"
+        " %lu failed", c->created, c->existing, c->failed);
+  }
+
+  pthread_mutex_destroy(&c->lock);
+  pthread_cond_destroy(&c->cond);
+  pthread_cond_destroy(&c->idle);
+  close(c->fd);
+
+  for (i = 0; i < MEAS_TYPE_COUNT; i++) {
+    free(c->tmpl[i].args);
+  }
+  free(c->any.args);
+  free(c);
+}
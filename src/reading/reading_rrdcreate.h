@@ -0,0 +1,124 @@
+#ifndef READING_RRDCREATE__H
+#define READING_RRDCREATE__H
+/******************************************************************************
+ * File: reading_rrdcreate.h
+ * Description: creation of RRD files from templates, off the receive path
+ * Author: Steven Swann - swannonline@googlemail.com
+ *
+ * Copyright (c) swannonline, 2013-2014
+ *
+ * This file is part of sensorspace.
+ *
+ * sensorspace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * sensorspace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with sensorspace.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "reading.h"
+
+#define RRD_CREATE_DEFAULT_PATH   "/var/lib/ss/{device}/{sensor}.rrd"
+#define RRD_CREATE_MAX_ARGS       32
+
+/*
+ * \brief Struct to hold an RRD file template
+ * \param step The RRD step in seconds, 0 if the template is not set
+ * \param ds The name of the first DS, updated by the sensor
+ * \param args The template arguments, NUL separated
+ * \param argv The DS and RRA arguments to rrd_create_r()
+ * \param argc The number of arguments
+ */
+struct rrd_template {
+  unsigned long step;
+  char ds[RRD_DS_NAME_LEN];
+  char *args;
+  const char *argv[RRD_CREATE_MAX_ARGS];
+  int argc;
+};
+
+/*
+ * \brief Struct to hold the creation of an RRD file
+ * \param path The file to create
+ * \param tmpl The template to create it from
+ * \param start The time before the first update
+ * \param file The RRD file waiting for it, given back once done
+ * \param status The result, once done
+ * \param next The next file to create, or the next created
+ */
+struct rrd_create {
+  char path[MAX_FILENAME_LEN];
+  struct rrd_template *tmpl;
+  time_t start;
+  struct rrd_file *file;
+  int status;
+  struct rrd_create *next;
+};
+
+/*
+ * \brief Struct to hold the RRD file creator thread
+ * \param thread The creator thread
+ * \param lock Protects the lists
+ * \param cond Signalled when a file is queued or the creator should stop
+ * \param idle Signalled when the list has been created
+ * \param fd An eventfd, readable once files are created, for the
+ *        caller's event loop
+ * \param head The first file to create
+ * \param tail The last file to create
+ * \param done The files created, not yet taken by rrd_creator_take()
+ * \param busy The creator is creating a file taken from the list
+ * \param stop The creator should exit once the list is created
+ * \param started The creator thread is running
+ * \param path The path pattern of the files
+ * \param tmpl The templates, by measurement type
+ * \param any The template for types without their own
+ * \param created The number of files created
+ * \param existing The number of files that already existed
+ * \param failed The number of files that could not be created
+ */
+struct rrd_creator {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_cond_t idle;
+  int fd;
+
+  struct rrd_create *head;
+  struct rrd_create *tail;
+  struct rrd_create *done;
+  bool busy;
+  bool stop;
+  bool started;
+
+  char path[MAX_FILENAME_LEN];
+  struct rrd_template tmpl[MEAS_TYPE_COUNT];
+  struct rrd_template any;
+
+  unsigned long created;
+  unsigned long existing;
+  unsigned long failed;
+};
+
+int rrd_creator_init(struct rrd_creator **c_p);
+int rrd_creator_template(struct rrd_creator *c, const char *def);
+int rrd_creator_start(struct rrd_creator *c, const char *path);
+struct rrd_template *rrd_creator_find(struct rrd_creator *c,
+    meas_type_t type);
+int rrd_creator_path(struct rrd_creator *c, struct reading *r,
+    struct measurement *m, char *path);
+void rrd_creator_queue(struct rrd_creator *c, struct rrd_create *cr);
+struct rrd_create *rrd_creator_take(struct rrd_creator *c);
+void rrd_creator_sync(struct rrd_creator *c);
+void free_rrd_creator(struct rrd_creator *c);
+
+#endif        /* READING_RRDCREATE__H */
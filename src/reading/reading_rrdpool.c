@@ -0,0 +1,298 @@
+/******************************************************************************
+ * File: reading_rrdpool.c
+ * Description: pool of RRD writer threads, sharded by file
+ * Author: Steven Swann - swannonline@googlemail.com
+ *
+ * Copyright (c) swannonline, 2013-2014
+ *
+ * This file is part of sensorspace.
+ *
+ * sensorspace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * sensorspace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with sensorspace.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+
+#include "reading.h"
+#include "reading_rrdpool.h"
+
+/**
+ * \brief Get the writer that owns a file, by hash of its name
+ */
+static struct rrd_worker *rrd_pool_shard(struct rrd_pool *pool,
+    const char *file) {
+  return &pool->w[rrd_hash_str(file) % pool->count];
+}
+
+/**
+ * \brief Wait before retrying a connection to rrdcached
+ * \return false if the writer is stopping
+ */
+static bool rrd_worker_wait(struct rrd_worker *w) {
+
+  struct timespec until;
+  bool stop;
+
+  clock_gettime(CLOCK_REALTIME, &until);
+  until.tv_sec += RRD_POOL_RETRY_S;
+
+  pthread_mutex_lock(&w->lock);
+  while (!w->stop &&
+      pthread_cond_timedwait(&w->cond, &w->lock, &until) != ETIMEDOUT);
+  stop = w->stop;
+  pthread_mutex_unlock(&w->lock);
+
+  return !stop;
+}
+
+/**
+ * \brief Write a list of update queues, then free them
+ */
+static void rrd_worker_write(struct rrd_worker *w, struct rrd_queue *list) {
+
+  struct rrd_queue *batch[RRD_POOL_BATCH];
+  int status[RRD_POOL_BATCH];
+  unsigned n, i;
+
+  while (list) {
+    for (n = 0; list && n < RRD_POOL_BATCH; n++) {
+      batch[n] = list;
+      list = list->next;
+    }
+
+    if (w->cached) {
+      /* keep the updates, in order, until the daemon is back */
+      while (rrdcached_update(w->cached, batch, n, status)) {
+        if (!rrd_worker_wait(w)) {
+          log_stderr(LOG_ERROR, "rrdcached: dropping updates for %u files",
+              n);
+          for (i = 0; i < n; i++) {
+            status[i] = SS_CONN_ERROR;
+          }
+          break;
+        }
+      }
+    } else {
+      for (i = 0; i < n; i++) {
+        status[i] = write_rrd_queue(batch[i]);
+      }
+    }
+
+    for (i = 0; i < n; i++) {
+      if (status[i]) {
+        w->errors++;
+      } else {
+        w->writes++;
+      }
+      free(batch[i]->buf);
+      free(batch[i]);
+    }
+  }
+}
+
+/**
+ * \brief Writer thread, writing the update queues handed to it in order
+ */
+static void *rrd_worker_run(void *arg) {
+
+  struct rrd_worker *w = (struct rrd_worker *)arg;
+  struct rrd_queue *list;
+
+  pthread_mutex_lock(&w->lock);
+  while (1) {
+    while (!w->head && !w->stop) {
+      pthread_cond_wait(&w->cond, &w->lock);
+    }
+    if (!w->head) {
+      /* stopped, and everything written */
+      break;
+    }
+
+    list = w->head;
+    w->head = w->tail = NULL;
+    w->jobs = 0;
+    w->busy = true;
+    pthread_cond_broadcast(&w->idle);
+    pthread_mutex_unlock(&w->lock);
+
+    rrd_worker_write(w, list);
+
+    pthread_mutex_lock(&w->lock);
+    w->busy = false;
+    pthread_cond_broadcast(&w->idle);
+  }
+  pthread_mutex_unlock(&w->lock);
+
+  return NULL;
+}
+
+/**
+ * \brief Start a pool of RRD writer threads
+ * \param pool_p Pointer to the pool to be returned
+ * \param workers The number of writer threads
+ * \param cached The rrdcached socket each writer should connect to, NULL
+ *        to write with librrd
+ */
+int rrd_pool_init(struct rrd_pool **pool_p, unsigned workers,
+    const char *cached) {
+
+  int ret = SS_SUCCESS;
+  struct rrd_pool *pool;
+  struct rrd_worker *w;
+  sigset_t all, old;
+
+  if (!(pool = calloc(1, sizeof(struct rrd_pool))) ||
+      !(pool->w = calloc(workers, sizeof(struct rrd_worker)))) {
+    log_stderr(LOG_ERROR, "RRD pool: Out of memory");
+    free(pool);
+    return SS_OUT_OF_MEM_ERROR;
+  }
+
+  /* signals are left to the caller's thread */
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
+
+  for (; pool->count < workers; pool->count++) {
+    w = &pool->w[pool->count];
+
+    if (cached && (ret = rrdcached_init(&w->cached, cached))) {
+      goto free;
+    }
+
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    pthread_cond_init(&w->idle, NULL);
+
+    if (pthread_create(&w->thread, NULL, rrd_worker_run, w)) {
+      log_stderr(LOG_ERROR, "RRD pool: Failed to start writer thread");
+      pthread_mutex_destroy(&w->lock);
+      pthread_cond_destroy(&w->cond);
+      pthread_cond_destroy(&w->idle);
+      free_rrdcached(w->cached);
+      ret = SS_INIT_ERROR;
+      goto free;
+    }
+  }
+
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  log_stdout(LOG_INFO, "Started %u RRD writer threads", workers);
+
+  *pool_p = pool;
+
+  return SS_SUCCESS;
+
+free:
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  free_rrd_pool(pool);
+  return ret;
+}
+
+/**
+ * \brief Hand the updates queued for a file to the writer that owns it.
+ *        The caller blocks while the writer has RRD_POOL_MAX_JOBS waiting.
+ * \param pool The pool
+ * \param q The update queue, its buffer is taken by the writer
+ */
+int rrd_pool_write(struct rrd_pool *pool, struct rrd_queue *q) {
+
+  struct rrd_worker *w = rrd_pool_shard(pool, q->file);
+  struct rrd_queue *job;
+
+  if (!(job = malloc(sizeof(struct rrd_queue)))) {
+    log_stderr(LOG_ERROR, "RRD pool: Out of memory");
+    return SS_OUT_OF_MEM_ERROR;
+  }
+  *job = *q;
+  job->next = NULL;
+
+  q->buf = NULL;
+  q->size = 0;
+
+  pthread_mutex_lock(&w->lock);
+  while (w->jobs >= RRD_POOL_MAX_JOBS) {
+    pthread_cond_wait(&w->idle, &w->lock);
+  }
+
+  if (w->tail) {
+    w->tail->next = job;
+  } else {
+    w->head = job;
+  }
+  w->tail = job;
+  w->jobs++;
+
+  pthread_cond_signal(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Wait until every update queue handed to the pool is written
+ */
+void rrd_pool_sync(struct rrd_pool *pool) {
+
+  struct rrd_worker *w;
+  unsigned i;
+
+  for (i = 0; i < pool->count; i++) {
+    w = &pool->w[i];
+
+    pthread_mutex_lock(&w->lock);
+    while (w->head || w->busy) {
+      pthread_cond_wait(&w->idle, &w->lock);
+    }
+    pthread_mutex_unlock(&w->lock);
+  }
+}
+
+/**
+ * \brief Stop the writer threads once they have written every update
+ *        queue handed to them, and free the pool
+ */
+void free_rrd_pool(struct rrd_pool *pool) {
+
+  struct rrd_worker *w;
+  unsigned i;
+
+  if (!pool) {
+    return;
+  }
+
+  for (i = 0; i < pool->count; i++) {
+    w = &pool->w[i];
+
+    pthread_mutex_lock(&w->lock);
+    w->stop = true;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+
+    pthread_join(w->thread, NULL);
+
+    log_stderr(LOG_DEBUG, "RRD writer %u: %lu files written, %lu failed",
+        i, w->writes, w->errors);
+
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->cond);
+    pthread_cond_destroy(&w->idle);
+    free_rrdcached(w->cached);
+  }
+
+  free(pool->w);
+  free(pool);
+}
@@ -0,0 +1,87 @@
+#ifndef READING_RRDPOOL__H
+#define READING_RRDPOOL__H
+/******************************************************************************
+ * File: reading_rrdpool.h
+ * Description: pool of RRD writer threads, sharded by file
+ * Author: Steven Swann - swannonline@googlemail.com
+ *
+ * Copyright (c) swannonline, 2013-2014
+ *
+ * This file is part of sensorspace.
+ *
+ * sensorspace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * sensorspace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with sensorspace.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "reading.h"
+
+/* queues waiting for a writer before the caller blocks */
+#define RRD_POOL_MAX_JOBS         1024
+/* queues sent to rrdcached in each batch */
+#define RRD_POOL_BATCH            64
+#define RRD_POOL_RETRY_S          1
+#define RRD_DEFAULT_WORKERS       1
+
+/*
+ * \brief Struct to hold an RRD writer thread. Each file is written by one
+ *        writer only, so its updates stay in order without file locks.
+ * \param thread The writer thread
+ * \param lock Protects the fields below it
+ * \param cond Signalled when work is queued or the writer should stop
+ * \param idle Signalled when the writer has room or has run dry
+ * \param head The first update queue to write
+ * \param tail The last update queue to write
+ * \param jobs The number of update queues waiting
+ * \param busy The writer is writing update queues taken from the list
+ * \param stop The writer should exit once the list is written
+ * \param cached The writer's rrdcached connection, NULL to use librrd
+ * \param writes The number of update queues written
+ * \param errors The number of update queues that failed
+ */
+struct rrd_worker {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pthread_cond_t idle;
+
+  struct rrd_queue *head;
+  struct rrd_queue *tail;
+  unsigned jobs;
+  bool busy;
+  bool stop;
+
+  struct rrdcached *cached;
+  unsigned long writes;
+  unsigned long errors;
+};
+
+/*
+ * \brief Struct to hold the RRD writer threads
+ * \param w The writers
+ * \param count The number of writers
+ */
+struct rrd_pool {
+  struct rrd_worker *w;
+  unsigned count;
+};
+
+int rrd_pool_init(struct rrd_pool **pool_p, unsigned workers,
+    const char *cached);
+int rrd_pool_write(struct rrd_pool *pool, struct rrd_queue *q);
+void rrd_pool_sync(struct rrd_pool *pool);
+void free_rrd_pool(struct rrd_pool *pool);
+
+#endif        /* READING_RRDPOOL__H */
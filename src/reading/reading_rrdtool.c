@@ -22,167 +22,1304 @@
  *
  *****************************************************************************/
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <rrd.h>
 
 #include "reading.h"
+#include "reading_rrdpool.h"
+#include "reading_rrdcreate.h"
 
-#define RRD_UPDATE_ARG_COUNT      4
-#define RRD_UPDATE_ARG_0          "update"
+#define RRD_INFO_STEP_KEY         "step"
+#define RRD_INFO_DS_KEY           "ds["
+#define RRD_INFO_DS_INDEX_KEY     "].index"
+/* "<time>:" followed by each value and separator */
+#define RRD_UPDATE_LEN            (21 + RRD_MAX_DS * READ_MEAS_LEN)
+/* initial size of the file and sensor tables */
+#define RRD_TABLE_MIN             64
+/* files written by each call to write_rrd_files() */
+#define RRD_WRITE_BATCH           64
+
+#define FNV_OFFSET_BASIS          2166136261u
+#define FNV_PRIME                 16777619u
 
 /*
- * \brief function to initialise a new RRD file.
+ * \brief function to hash a file or sensor name, FNV-1a.
  */
-int rrd_file_init(struct rrdtool *rrd, char *file) {
+uint32_t rrd_hash_str(const char *str) {
 
-  log_stdout(LOG_INFO, "New RRD database added: %s", file);
-  if (rrd->f_count + 1 <= RRD_MAX_SENSORS) {
-    if (!(rrd->file[rrd->f_count] = calloc(1, sizeof(struct rrd_file)))) {
-      log_stderr(LOG_ERROR, "RRDtool: Out of memory");
-      goto free;
+  uint32_t hash = FNV_OFFSET_BASIS;
+
+  for (; *str; str++) {
+    hash ^= (uint8_t)*str;
+    hash *= FNV_PRIME;
+  }
+
+  return hash;
+}
+
+/*
+ * \brief function to hash a sensor_id, keeping consecutive ids apart.
+ */
+static uint32_t rrd_hash_id(uint32_t id) {
+  return id * 2654435761u;
+}
+
+/*
+ * \brief function to double the size of a table.
+ * \param table The table, left as it is on failure
+ * \param size The number of entries, updated on success
+ * \param entry The size of an entry
+ * \return The resized table, or NULL if out of memory
+ */
+static void *rrd_grow(void *table, unsigned *size, size_t entry) {
+
+  unsigned n = *size ? *size * 2 : RRD_TABLE_MIN;
+
+  if (!(table = realloc(table, n * entry))) {
+    log_stderr(LOG_ERROR, "RRDtool: Out of memory");
+    return NULL;
+  }
+  *size = n;
+
+  return table;
+}
+
+/*
+ * \brief function to find a file already given, by name.
+ */
+static struct rrd_file *rrd_file_find(struct rrdtool *rrd, const char *name) {
+
+  struct rrd_file *f = NULL;
+
+  if (rrd->f_hash_size) {
+    f = rrd->f_hash[rrd_hash_str(name) & (rrd->f_hash_size - 1)];
+  }
+  for (; f; f = f->hash_next) {
+    if (!strcmp(f->name, name)) {
+      break;
+    }
+  }
+
+  return f;
+}
+
+/*
+ * \brief function to add a file to the file name hash.
+ */
+static void rrd_file_hash(struct rrdtool *rrd, struct rrd_file *f) {
+
+  struct rrd_file **bucket =
+    &rrd->f_hash[rrd_hash_str(f->name) & (rrd->f_hash_size - 1)];
+
+  f->hash_next = *bucket;
+  *bucket = f;
+}
+
+/*
+ * \brief function to add a new file to the file table, growing the table
+ *        and its hash as needed.
+ */
+static int rrd_file_add(struct rrdtool *rrd, struct rrd_file *f) {
+
+  struct rrd_file **table;
+  unsigned size, i;
+
+  /* the due heap holds each file at most once */
+  if (rrd->f_count == rrd->f_size) {
+    size = rrd->f_size;
+    if (!(table = rrd_grow(rrd->due, &size, sizeof(struct rrd_file *)))) {
+      return SS_OUT_OF_MEM_ERROR;
+    }
+    rrd->due = table;
+    if (!(table = rrd_grow(rrd->file, &rrd->f_size,
+            sizeof(struct rrd_file *)))) {
+      return SS_OUT_OF_MEM_ERROR;
     }
-    if (!(rrd->name[rrd->f_count++] = calloc(READ_NAME_LEN,
-            sizeof(char)))) {
+    rrd->file = table;
+  }
+
+  /* keep the hash at most half full */
+  if ((rrd->f_count + 1) * 2 > rrd->f_hash_size) {
+    size = rrd->f_hash_size ? rrd->f_hash_size * 2 : RRD_TABLE_MIN;
+    if (!(table = calloc(size, sizeof(struct rrd_file *)))) {
       log_stderr(LOG_ERROR, "RRDtool: Out of memory");
-      goto free;
+      return SS_OUT_OF_MEM_ERROR;
     }
+    free(rrd->f_hash);
+    rrd->f_hash = table;
+    rrd->f_hash_size = size;
+
+    for (i = 0; i < rrd->f_count; i++) {
+      rrd_file_hash(rrd, rrd->file[i]);
+    }
+  }
+
+  rrd->file[rrd->f_count++] = f;
+  rrd_file_hash(rrd, f);
+
+  return SS_SUCCESS;
+}
+
+/*
+ * \brief function to drop the sensor indexes, once sensors are added.
+ */
+static void rrd_unindex_sensors(struct rrdtool *rrd) {
+
+  free(rrd->by_id);
+  free(rrd->by_name);
+  rrd->by_id = NULL;
+  rrd->by_name = NULL;
+  rrd->s_hash_size = 0;
+}
+
+/*
+ * \brief function to add a sensor to the sensor_id and name indexes.
+ */
+static void rrd_index_sensor(struct rrdtool *rrd, struct rrd_sensor *s) {
+
+  unsigned mask = rrd->s_hash_size - 1;
+  struct rrd_sensor **bucket;
+
+  if (s->sensor_id) {
+    bucket = &rrd->by_id[rrd_hash_id(s->sensor_id) & mask];
+    s->id_next = *bucket;
+    *bucket = s;
+  }
+
+  if (s->name[0]) {
+    bucket = &rrd->by_name[rrd_hash_str(s->name) & mask];
+    s->name_next = *bucket;
+    *bucket = s;
+  }
+}
+
+/*
+ * \brief function to index the sensors by sensor_id and by name.
+ */
+static int rrd_index_sensors(struct rrdtool *rrd) {
+
+  unsigned size = RRD_TABLE_MIN;
+  unsigned i;
+
+  while (size < rrd->s_count * 2) {
+    size *= 2;
+  }
+
+  rrd_unindex_sensors(rrd);
+  if (!(rrd->by_id = calloc(size, sizeof(struct rrd_sensor *))) ||
+      !(rrd->by_name = calloc(size, sizeof(struct rrd_sensor *)))) {
+    log_stderr(LOG_ERROR, "RRDtool: Out of memory");
+    rrd_unindex_sensors(rrd);
+    return SS_OUT_OF_MEM_ERROR;
+  }
+  rrd->s_hash_size = size;
+
+  /* in reverse, so each bucket lists its sensors in the order given */
+  for (i = rrd->s_count; i-- > 0;) {
+    rrd_index_sensor(rrd, rrd->sensor[i]);
+  }
+
+  return SS_SUCCESS;
+}
+
+/*
+ * \brief function to add a new file to the rrdtool struct.
+ * \return The file, or NULL on failure
+ */
+static struct rrd_file *rrd_file_new(struct rrdtool *rrd, const char *file) {
+
+  struct rrd_file *f;
+
+  if (strlen(file) >= MAX_FILENAME_LEN) {
+    log_stderr(LOG_ERROR, "RRDtool: File name too long: %s", file);
+    return NULL;
+  }
+
+  if (!(f = calloc(1, sizeof(struct rrd_file)))) {
+    log_stderr(LOG_ERROR, "RRDtool: Out of memory");
+    return NULL;
+  }
+  strcpy(f->name, file);
+  f->queue.file = f->name;
+
+  if (rrd_file_add(rrd, f)) {
+    free_rrd_file(f);
+    return NULL;
+  }
+
+  return f;
+}
+
+/*
+ * \brief function to connect a new sensor to the next DS of a file.
+ * \param f The file, NULL for a sensor that is ignored
+ * \return The sensor, or NULL if out of memory
+ */
+static struct rrd_sensor *rrd_sensor_add(struct rrdtool *rrd,
+    struct rrd_file *f) {
+
+  struct rrd_sensor **table, *s;
+
+  if (rrd->s_count == rrd->s_size) {
+    if (!(table = rrd_grow(rrd->sensor, &rrd->s_size,
+            sizeof(struct rrd_sensor *)))) {
+      return NULL;
+    }
+    rrd->sensor = table;
+  }
+
+  if (!(s = calloc(1, sizeof(struct rrd_sensor)))) {
+    log_stderr(LOG_ERROR, "RRDtool: Out of memory");
+    return NULL;
+  }
+  s->file = f;
+  s->ds = f ? f->ds_count++ : 0;
+  rrd->sensor[rrd->s_count++] = s;
+
+  return s;
+}
+
+/*
+ * \brief function to initialise a new RRD file. A file given more than
+ *        once gains a further DS, which should be named with rrd_ds_init().
+ */
+int rrd_file_init(struct rrdtool *rrd, char *file) {
+
+  struct rrd_file *f;
+
+  /* further DS of a file already given */
+  if ((f = rrd_file_find(rrd, file))) {
+    if (f->ds_count == RRD_MAX_DS) {
+      log_stderr(LOG_ERROR, "RRDtool: Exceded max number of DS: %d",
+          RRD_MAX_DS);
+      return SS_OUT_OF_MEM_ERROR;
+    }
+    log_stdout(LOG_INFO, "New RRD data source added: %s", file);
+
   } else {
-    log_stderr(LOG_ERROR, "RRDtool: Exceded max number of files: %d",
-        RRD_MAX_SENSORS);
+    if (!(f = rrd_file_new(rrd, file))) {
+      return SS_INIT_ERROR;
+    }
+    log_stdout(LOG_INFO, "New RRD database added: %s", file);
+  }
+
+  if (!rrd_sensor_add(rrd, f)) {
     return SS_OUT_OF_MEM_ERROR;
   }
+  /* the sensor is yet to be given an id or name */
+  rrd_unindex_sensors(rrd);
+
+  return SS_SUCCESS;
+}
 
-  /* Copy filename */
-  if (!strncpy(rrd->file[rrd->f_count - 1]->name, file,
-        sizeof(struct rrd_file))) {
-    log_stderr(LOG_ERROR, "RRDtool: Failed to copy rrd file name");
+/*
+ * \brief function to name the DS of the most recently added RRD file.
+ */
+int rrd_ds_init(struct rrdtool *rrd, const char *ds) {
+
+  struct rrd_sensor *s;
+  struct rrd_file *f;
+  unsigned i;
+
+  if (!rrd->s_count) {
     return SS_INIT_ERROR;
   }
+  s = rrd->sensor[rrd->s_count - 1];
+  f = s->file;
+
+  if (!*ds || strlen(ds) >= RRD_DS_NAME_LEN) {
+    log_stderr(LOG_ERROR, "RRDtool: Invalid DS name: %s", ds);
+    return SS_INIT_ERROR;
+  }
+
+  for (i = 0; i < f->ds_count; i++) {
+    if (!strcmp(f->ds[i].name, ds)) {
+      log_stderr(LOG_ERROR, "RRDtool: DS %s given twice for %s", ds,
+          f->name);
+      return SS_INIT_ERROR;
+    }
+  }
+
+  strcpy(f->ds[s->ds].name, ds);
 
   return SS_SUCCESS;
+}
+
+/*
+ * \brief function to check that each multi-DS file has its DS named, and
+ *        index the sensors ready for readings.
+ */
+int validate_rrd_files(struct rrdtool *rrd) {
+
+  struct rrd_sensor *s;
+  unsigned i;
+
+  for (i = 0; i < rrd->s_count; i++) {
+    s = rrd->sensor[i];
+    if (s->file->ds_count > 1 && !s->file->ds[s->ds].name[0]) {
+      log_stderr(LOG_ERROR,
+          "RRDtool: Each DS of %s should be named, it has %u DS",
+          s->file->name, s->file->ds_count);
+      return SS_INIT_ERROR;
+    }
+  }
 
-free:
-  free_rrd_file(rrd->file[--rrd->f_count]);
-  return SS_OUT_OF_MEM_ERROR;
+  return rrd_index_sensors(rrd);
 }
 
 /*
- * \brief function to add a raw measurement to an RR database.
+ * \brief function to read the step and DS layout of an RR database.
  */
-static int add_measurement_rrd(struct reading *r, unsigned m_idx,
-    struct rrd_file *file) {
+static int get_rrd_info(struct rrd_file *file) {
 
   int ret = SS_SUCCESS;
-  char buf[32];
-
-  /* ToDo:
-   * Currently, we are limited to a single DS per RRD since we can not
-   * easily update a single DS in a multi-DS RRD without setting other
-   * values to zero.
-   * To fix this, we need to update RRD every t interval, and cache
-   * each of the DS values so we can update a multi-DS RRD with one
-   * update instruction.
-   */
-  sprintf(buf, "%lld:%s", (long long) mktime(&r->t),
-      r->meas[m_idx]->meas);
-
-  const char *updateparams[] = {
-    RRD_UPDATE_ARG_0,
-    file->name,
-    buf,
-    NULL
-  };
+  rrd_info_t *info, *i;
+  const char *name;
+  size_t len;
+  unsigned d;
 
-  log_stderr(LOG_DEBUG, "RRD: Sensor ID: %d, Measurement: %s, File: %s",
-      r->meas[m_idx]->sensor_id, r->meas[m_idx]->meas, file);
-  log_stderr(LOG_DEBUG, "[rrdtool] %s, %s, %s, %s",
-      updateparams[0], updateparams[1], updateparams[2], updateparams[3]);
+  info = rrd_info_r(file->name);
+  if (!info) {
+    log_stderr(LOG_ERROR, "rrd_error: %s", rrd_get_error());
+    rrd_clear_error();
+    return SS_POST_ERROR;
+  }
+
+  file->ds_total = 0;
+  for (d = 0; d < file->ds_count; d++) {
+    file->ds[d].idx = RRD_MAX_DS;
+  }
 
-#if 0
-  /* Full debug */
-  rrd_info_t *rrd_inf = rrd_update_v(3, (char **)updateparams);
+  for (i = info; i; i = i->next) {
+    if (!strcmp(i->key, RRD_INFO_STEP_KEY)) {
+      file->step = i->value.u_cnt;
+      continue;
+    }
 
-  /* need to extract return value */
-  rrd_info_print(rrd_inf);
+    /* "ds[<name>].index" */
+    len = strlen(i->key);
+    if (strncmp(i->key, RRD_INFO_DS_KEY, strlen(RRD_INFO_DS_KEY)) ||
+        len <= strlen(RRD_INFO_DS_KEY) + strlen(RRD_INFO_DS_INDEX_KEY) ||
+        strcmp(i->key + len - strlen(RRD_INFO_DS_INDEX_KEY),
+          RRD_INFO_DS_INDEX_KEY)) {
+      continue;
+    }
+    name = i->key + strlen(RRD_INFO_DS_KEY);
+    len -= strlen(RRD_INFO_DS_KEY) + strlen(RRD_INFO_DS_INDEX_KEY);
 
-#else
-  ret = rrd_update(3, (char **)&updateparams);
-#endif
+    if (i->value.u_cnt >= file->ds_total) {
+      file->ds_total = i->value.u_cnt + 1;
+    }
+    for (d = 0; d < file->ds_count; d++) {
+      if (strlen(file->ds[d].name) == len &&
+          !strncmp(file->ds[d].name, name, len)) {
+        file->ds[d].idx = i->value.u_cnt;
+      }
+    }
+  }
+  rrd_info_free(info);
+
+  /* the single DS of an unnamed file */
+  if (file->ds_total == 1 && !file->ds[0].name[0]) {
+    file->ds[0].idx = 0;
+  }
+
+  if (!file->step || file->ds_total > RRD_MAX_DS) {
+    log_stderr(LOG_ERROR, "RRD: %s: no step, or more than %d DS",
+        file->name, RRD_MAX_DS);
+    ret = SS_POST_ERROR;
+  }
+
+  for (d = 0; !ret && d < file->ds_count; d++) {
+    if (file->ds[d].idx >= file->ds_total) {
+      log_stderr(LOG_ERROR, "RRD: %s: has %u DS, no DS named '%s'",
+          file->name, file->ds_total, file->ds[d].name);
+      ret = SS_POST_ERROR;
+    }
+  }
+
+  if (ret) {
+    file->step = 0;
+    return ret;
+  }
+
+  log_stderr(LOG_DEBUG, "RRD: %s step: %lus, %u DS", file->name, file->step,
+      file->ds_total);
+
+  return SS_SUCCESS;
+}
+
+/*
+ * \brief function to write the queued updates of an RR database with a
+ *        single librrd update call.
+ */
+int write_rrd_queue(struct rrd_queue *q) {
+
+  int ret = SS_SUCCESS;
+  const char *updateparams[RRD_QUEUE_MAX];
+  size_t off;
+  unsigned i;
+
+  for (i = 0, off = 0; i < q->count; i++) {
+    updateparams[i] = q->buf + off;
+    off += strlen(q->buf + off) + 1;
+  }
+
+  log_stderr(LOG_DEBUG, "[rrdtool] update %s %s ... (%u)", q->file,
+      updateparams[0], q->count);
+
+  ret = rrd_update_r(q->file, NULL, q->count, updateparams);
   if (ret) {
     log_stderr(LOG_ERROR, "rrd_error: %s", rrd_get_error());
     rrd_clear_error();
     ret = SS_POST_ERROR;
   } else {
-    log_stdout(LOG_INFO, "Measurement added to RRD: %s", buf);
+    log_stdout(LOG_INFO, "%u measurements added to RRD: %s", q->count,
+        q->file);
+  }
+
+  return ret;
+}
+
+/*
+ * \brief function to write the queued updates of a number of RR databases,
+ *        handing them to the writer threads if there are any, or else
+ *        either with librrd or in a single rrdcached batch. Updates are kept
+ *        for another interval if rrdcached can not be reached.
+ * \param rrd The rrdtool struct
+ * \param files The files with queued updates
+ * \param count The number of files, at most RRD_WRITE_BATCH
+ */
+static int write_rrd_files(struct rrdtool *rrd, struct rrd_file **files,
+    unsigned count) {
+
+  int ret = SS_SUCCESS;
+  struct rrd_queue *q[RRD_WRITE_BATCH];
+  int status[RRD_WRITE_BATCH];
+  unsigned i;
+
+  for (i = 0; i < count; i++) {
+    q[i] = &files[i]->queue;
+  }
+
+  if (rrd->pool) {
+    for (i = 0; i < count; i++) {
+      status[i] = rrd_pool_write(rrd->pool, q[i]);
+    }
+  } else if (rrd->cached) {
+    if (rrdcached_update(rrd->cached, q, count, status)) {
+      for (i = 0; i < count; i++) {
+        files[i]->write_at = time(0) + (rrd->flush_s ? rrd->flush_s : 1);
+      }
+      return SS_CONN_ERROR;
+    }
+  } else {
+    for (i = 0; i < count; i++) {
+      status[i] = write_rrd_queue(q[i]);
+    }
+  }
+
+  for (i = 0; i < count; i++) {
+    if (status[i]) {
+      ret = SS_POST_ERROR;
+    } else if (rrd->cached && !rrd->pool) {
+      log_stdout(LOG_INFO, "%u measurements sent to rrdcached: %s",
+          q[i]->count, q[i]->file);
+    }
+    q[i]->len = 0;
+    q[i]->count = 0;
+    files[i]->write_at = 0;
+  }
+
+  return ret;
+}
+
+/*
+ * \brief function to queue an update of an RR database with the DS values
+ *        cached for a step, one update for all DS in the order of the file.
+ *        DS without a value in the step are unknown rather than zero.
+ * \param rrd The rrdtool struct
+ * \param file The RR database
+ * \param st The step
+ * \param now The current time
+ */
+static int queue_rrd_update(struct rrdtool *rrd, struct rrd_file *file,
+    struct rrd_step *st, time_t now) {
+
+  int ret = SS_SUCCESS;
+  struct rrd_queue *q = &file->queue;
+  const char *val[RRD_MAX_DS];
+  size_t len;
+  char *queue;
+  unsigned i;
+
+  for (i = 0; i < file->ds_total; i++) {
+    val[i] = "U";
+  }
+  for (i = 0; i < file->ds_count; i++) {
+    if (st->set & (1u << i)) {
+      val[file->ds[i].idx] = st->val[i];
+    }
+  }
+
+  /* rrdtool only accepts updates after the last */
+  if (file->queue_last && st->t <= file->queue_last) {
+    log_stderr(LOG_WARN, "RRD: %s: dropping update at %lld, not after %lld",
+        file->name, (long long)st->t, (long long)file->queue_last);
+    return SS_POST_ERROR;
+  }
+
+  if (q->count == RRD_QUEUE_MAX) {
+    ret = write_rrd_files(rrd, &file, 1);
+    if (q->count) {
+      log_stderr(LOG_ERROR, "RRD: %s: dropping %u queued updates",
+          file->name, q->count);
+      q->len = 0;
+      q->count = 0;
+    }
+  }
+
+  if (q->size - q->len < RRD_UPDATE_LEN) {
+    len = q->size ? q->size * 2 : RRD_UPDATE_LEN * 4;
+    if (!(queue = realloc(q->buf, len))) {
+      log_stderr(LOG_ERROR, "RRDtool: Out of memory");
+      return SS_OUT_OF_MEM_ERROR;
+    }
+    q->buf = queue;
+    q->size = len;
+  }
+
+  queue = q->buf + q->len;
+  len = sprintf(queue, "%lld", (long long)st->t);
+  for (i = 0; i < file->ds_total; i++) {
+    len += sprintf(queue + len, ":%s", val[i]);
+  }
+
+  log_stderr(LOG_DEBUG, "RRD: %s: queued %s", file->name, queue);
+
+  if (!q->count++) {
+    file->write_at = now + rrd->flush_s;
+  }
+  q->len += len + 1;
+  file->queue_last = st->t;
+
+  return ret;
+}
+
+/*
+ * \brief function to get the number of the step holding a time. Every time
+ *        is in step 0 until the step of the file is known.
+ */
+static unsigned long rrd_step_no(struct rrd_file *file, time_t t) {
+  return file->step ? (unsigned long)t / file->step : 0;
+}
+
+/*
+ * \brief function to get the end of the step holding a time
+ */
+static time_t rrd_step_end(struct rrd_file *file, time_t t) {
+  return (time_t)(rrd_step_no(file, t) + 1) * file->step;
+}
+
+/*
+ * \brief function to remove the earliest step from the heap of an RR
+ *        database
+ */
+static void rrd_steps_pop(struct rrd_file *file) {
+
+  struct rrd_step *h = file->steps, last;
+  unsigned i = 0, child;
+
+  if (!--file->step_count) {
+    return;
+  }
+
+  last = h[file->step_count];
+  while ((child = 2 * i + 1) < file->step_count) {
+    if (child + 1 < file->step_count && h[child + 1].t < h[child].t) {
+      child++;
+    }
+    if (last.t <= h[child].t) {
+      break;
+    }
+    h[i] = h[child];
+    i = child;
+  }
+  h[i] = last;
+}
+
+/*
+ * \brief function to queue an update with each cached step of an RR
+ *        database that ended reorder_s seconds or more before a time,
+ *        earliest first, and with the earliest steps beyond
+ *        RRD_REORDER_MAX.
+ * \param rrd The rrdtool struct
+ * \param file The RR database
+ * \param until The time, 0 to queue every step
+ * \param now The current time
+ */
+static int rrd_release_steps(struct rrdtool *rrd, struct rrd_file *file,
+    time_t until, time_t now) {
+
+  int ret = SS_SUCCESS;
+
+  while (file->step_count) {
+    if (until && file->step_count <= RRD_REORDER_MAX &&
+        rrd_step_end(file, file->steps[0].t) + rrd->reorder_s > until) {
+      break;
+    }
+    if (queue_rrd_update(rrd, file, &file->steps[0], now)) {
+      ret = SS_POST_ERROR;
+    }
+    rrd_steps_pop(file);
+  }
+
+  return ret;
+}
+
+/*
+ * \brief function to get the cached step of an RR database holding a time,
+ *        adding it to the heap if new.
+ * \param st_p Pointer to the step
+ */
+static int rrd_step_get(struct rrd_file *file, time_t t,
+    struct rrd_step **st_p) {
+
+  struct rrd_step *h = file->steps, st;
+  unsigned long no = rrd_step_no(file, t);
+  unsigned i, parent, size;
+
+  /* few steps are held, late readings are the exception */
+  for (i = 0; i < file->step_count; i++) {
+    if (rrd_step_no(file, h[i].t) == no) {
+      *st_p = &h[i];
+      return SS_SUCCESS;
+    }
+  }
+
+  if (file->step_count == file->step_size) {
+    size = file->step_size ? file->step_size * 2 : 2;
+    if (!(h = realloc(file->steps, size * sizeof(struct rrd_step)))) {
+      log_stderr(LOG_ERROR, "RRDtool: Out of memory");
+      return SS_OUT_OF_MEM_ERROR;
+    }
+    file->steps = h;
+    file->step_size = size;
+  }
+
+  memset(&st, 0, sizeof(struct rrd_step));
+  st.t = t;
+  for (i = file->step_count++; i; i = parent) {
+    parent = (i - 1) / 2;
+    if (h[parent].t <= t) {
+      break;
+    }
+    h[i] = h[parent];
+  }
+  h[i] = st;
+
+  *st_p = &h[i];
+  return SS_SUCCESS;
+}
+
+/*
+ * \brief function to get the time a cached step of an RR database is
+ *        released or its queued updates are written, whichever is earlier
+ * \return The time, 0 if nothing is cached or queued
+ */
+static time_t rrd_file_due(struct rrdtool *rrd, struct rrd_file *file) {
+
+  time_t due = 0;
+
+  if (file->step_count) {
+    due = rrd_step_end(file, file->steps[0].t) + rrd->reorder_s;
+  }
+  if (file->queue.count && (!due || file->write_at < due)) {
+    due = file->write_at;
+  }
+
+  return due;
+}
+
+/*
+ * \brief function to place a file at a position of the due heap, moving
+ *        it up or down to keep the heap ordered by due time.
+ */
+static void rrd_due_place(struct rrdtool *rrd, struct rrd_file *file,
+    unsigned i) {
+
+  struct rrd_file **h = rrd->due;
+  unsigned parent, child;
+
+  while (i && h[parent = (i - 1) / 2]->due > file->due) {
+    h[i] = h[parent];
+    h[i]->due_idx = i + 1;
+    i = parent;
+  }
+
+  while ((child = 2 * i + 1) < rrd->d_count) {
+    if (child + 1 < rrd->d_count && h[child + 1]->due < h[child]->due) {
+      child++;
+    }
+    if (file->due <= h[child]->due) {
+      break;
+    }
+    h[i] = h[child];
+    h[i]->due_idx = i + 1;
+    i = child;
+  }
+
+  h[i] = file;
+  file->due_idx = i + 1;
+}
+
+/*
+ * \brief function to remove an RR database from the due heap.
+ */
+static void rrd_due_remove(struct rrdtool *rrd, struct rrd_file *file) {
+
+  struct rrd_file *last;
+  unsigned i;
+
+  if (!file->due_idx) {
+    return;
+  }
+
+  i = file->due_idx - 1;
+  file->due_idx = 0;
+  last = rrd->due[--rrd->d_count];
+  if (last != file) {
+    rrd_due_place(rrd, last, i);
+  }
+}
+
+/*
+ * \brief function to update the position of an RR database in the due
+ *        heap after its cached steps or queued updates changed, adding it
+ *        or removing it as needed.
+ */
+static void rrd_due_update(struct rrdtool *rrd, struct rrd_file *file) {
+
+  time_t due = rrd_file_due(rrd, file);
+
+  if (!due) {
+    rrd_due_remove(rrd, file);
+    return;
+  }
+
+  file->due = due;
+  rrd_due_place(rrd, file,
+      file->due_idx ? file->due_idx - 1 : rrd->d_count++);
+}
+
+/*
+ * \brief function to hold a value received while an RR database is
+ *        created, until the step of the file is known. Values beyond
+ *        RRD_HOLD_MAX are dropped and counted.
+ */
+static int rrd_hold_value(struct rrd_file *file, unsigned ds, time_t t,
+    const char *val) {
+
+  struct rrd_value *v;
+  unsigned size;
+
+  if (file->held_count == RRD_HOLD_MAX) {
+    if (!file->held_dropped++) {
+      log_stderr(LOG_WARN, "RRD: %s: %u values held while created,"
+          " dropping later values", file->name, RRD_HOLD_MAX);
+    }
+    return SS_SUCCESS;
+  }
+
+  if (file->held_count == file->held_size) {
+    size = file->held_size ? file->held_size * 2 : 8;
+    if (!(v = realloc(file->held, size * sizeof(struct rrd_value)))) {
+      log_stderr(LOG_ERROR, "RRDtool: Out of memory");
+      return SS_OUT_OF_MEM_ERROR;
+    }
+    file->held = v;
+    file->held_size = size;
+  }
+
+  v = &file->held[file->held_count++];
+  v->t = t;
+  v->ds = ds;
+  strcpy(v->val, val);
+
+  return SS_SUCCESS;
+}
+
+/*
+ * \brief function to cache a value for an RR database in the step holding
+ *        its time. Values of steps already queued are dropped and counted
+ *        as late.
+ * \param rrd The rrdtool struct
+ * \param file The RR database, its step known
+ * \param ds The DS slot of the value
+ * \param t The time of the value
+ * \param val The value
+ */
+static int rrd_cache_value(struct rrdtool *rrd, struct rrd_file *file,
+    unsigned ds, time_t t, const char *val) {
+
+  struct rrd_step *st;
+  int ret;
+
+  if (file->queue_last &&
+      rrd_step_no(file, t) <= rrd_step_no(file, file->queue_last)) {
+    file->late++;
+    rrd->late++;
+    log_stderr(LOG_DEBUG, "RRD: %s: dropping late value at %lld",
+        file->name, (long long)t);
+    return SS_SUCCESS;
+  }
+
+  if ((ret = rrd_step_get(file, t, &st))) {
+    return ret;
+  }
+
+  /* latest value within the step wins */
+  strcpy(st->val[ds], val);
+  st->set |= 1u << ds;
+  if (t > st->t) {
+    st->t = t;
+  }
+  if (t > file->newest) {
+    file->newest = t;
+  }
+
+  return SS_SUCCESS;
+}
+
+/*
+ * \brief function to finish the creation of an RR database, reading its
+ *        layout and caching the values held meanwhile by its step. The
+ *        values held are dropped if it could not be created.
+ * \param status The result of the creation
+ */
+static void rrd_file_created(struct rrdtool *rrd, struct rrd_file *file,
+    int status) {
+
+  struct rrd_value *v;
+  unsigned i;
+
+  free(file->create);
+  file->create = NULL;
+
+  if (status || get_rrd_info(file)) {
+    if (file->held_count) {
+      log_stderr(LOG_WARN, "RRD: %s: dropping %u values", file->name,
+          file->held_count);
+    }
+  } else {
+    for (i = 0; i < file->held_count; i++) {
+      v = &file->held[i];
+      rrd_cache_value(rrd, file, v->ds, v->t, v->val);
+    }
+  }
+
+  if (file->held_dropped) {
+    log_stderr(LOG_WARN, "RRD: %s: %lu values dropped while created",
+        file->name, file->held_dropped);
   }
 
-        return ret;
+  free(file->held);
+  file->held = NULL;
+  file->held_count = file->held_size = 0;
 }
 
 /*
- * \brief function to add a reading to an RR database.
+ * \brief function to finish the RR databases created since last called,
+ *        once the creator's fd is readable. Their values are then due by
+ *        their step.
+ */
+void rrd_files_created(struct rrdtool *rrd) {
+
+  struct rrd_create *cr, *next;
+  struct rrd_file *f;
+
+  if (!rrd->creator) {
+    return;
+  }
+
+  for (cr = rrd_creator_take(rrd->creator); cr; cr = next) {
+    next = cr->next;
+    f = cr->file;
+    rrd_file_created(rrd, f, cr->status);
+    rrd_due_update(rrd, f);
+  }
+}
+
+/*
+ * \brief function to add a new sensor to the sensor_id and name indexes,
+ *        growing them if needed.
+ */
+static void rrd_index_new_sensor(struct rrdtool *rrd, struct rrd_sensor *s) {
+
+  if (rrd->s_count * 2 > rrd->s_hash_size) {
+    rrd_index_sensors(rrd);
+  } else {
+    rrd_index_sensor(rrd, s);
+  }
+}
+
+/*
+ * \brief function to ignore a sensor_id whose RR database could not be
+ *        created, rather than trying again with each reading.
+ */
+static void rrd_ignore_sensor(struct rrdtool *rrd, uint32_t sensor_id) {
+
+  struct rrd_sensor *s;
+
+  if ((s = rrd_sensor_add(rrd, NULL))) {
+    s->sensor_id = sensor_id;
+    rrd_index_new_sensor(rrd, s);
+  }
+}
+
+/*
+ * \brief function to connect a new sensor_id to an RR database created
+ *        from the template for its measurement type. The file is created
+ *        by the creator thread, its values cached until it exists.
+ * \return The sensor, NULL if there is no template or on failure
+ */
+static struct rrd_sensor *rrd_create_sensor(struct rrdtool *rrd,
+    struct reading *r, struct measurement *m) {
+
+  struct rrd_template *t;
+  struct rrd_create *cr;
+  struct rrd_file *f;
+  struct rrd_sensor *s;
+
+  if (!(t = rrd_creator_find(rrd->creator, m->type))) {
+    return NULL;
+  }
+
+  if (!(cr = calloc(1, sizeof(struct rrd_create)))) {
+    log_stderr(LOG_ERROR, "RRDtool: Out of memory");
+    return NULL;
+  }
+  if (rrd_creator_path(rrd->creator, r, m, cr->path)) {
+    rrd_ignore_sensor(rrd, m->sensor_id);
+    free(cr);
+    return NULL;
+  }
+
+  if (rrd_file_find(rrd, cr->path)) {
+    log_stderr(LOG_ERROR, "RRDtool: %s is already updated by another"
+        " sensor, ignoring sensor %u", cr->path, m->sensor_id);
+    rrd_ignore_sensor(rrd, m->sensor_id);
+    free(cr);
+    return NULL;
+  }
+
+  if (!(f = rrd_file_new(rrd, cr->path))) {
+    free(cr);
+    return NULL;
+  }
+  if (!(s = rrd_sensor_add(rrd, f))) {
+    /* the file is left without sensors */
+    free(cr);
+    return NULL;
+  }
+  s->sensor_id = m->sensor_id;
+  strcpy(f->ds[s->ds].name, t->ds);
+  rrd_index_new_sensor(rrd, s);
+
+  log_stdout(LOG_INFO, "New RRD database for sensor %u: %s", m->sensor_id,
+      f->name);
+
+  cr->tmpl = t;
+  cr->start = mktime(&r->t) - t->step;
+  cr->file = f;
+  f->create = cr;
+  rrd_creator_queue(rrd->creator, cr);
+
+  return s;
+}
+
+/*
+ * \brief function to check whether any sensor matches a measurement.
+ */
+static bool rrd_sensor_known(struct rrdtool *rrd, struct measurement *m) {
+
+  unsigned mask = rrd->s_hash_size - 1;
+  struct rrd_sensor *s;
+
+  for (s = rrd->by_id[rrd_hash_id(m->sensor_id) & mask]; s;
+      s = s->id_next) {
+    if (s->sensor_id == m->sensor_id) {
+      return true;
+    }
+  }
+
+  if (m->name[0]) {
+    for (s = rrd->by_name[rrd_hash_str(m->name) & mask]; s;
+        s = s->name_next) {
+      if (!strcmp(s->name, m->name)) {
+        return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+/*
+ * \brief function to cache a raw measurement for an RR database in the
+ *        step holding its time, then queue an update with each step that
+ *        ended reorder_s seconds or more before the latest value. Values
+ *        received while the file is created are held until its step is
+ *        known.
+ * \param rrd The rrdtool struct
+ * \param s The sensor
+ * \param r The reading
+ * \param m_idx The index of the measurement within the reading
+ */
+static int add_measurement_rrd(struct rrdtool *rrd, struct rrd_sensor *s,
+    struct reading *r, unsigned m_idx) {
+
+  int ret = SS_SUCCESS;
+  struct rrd_file *file = s->file;
+  const char *val = r->meas[m_idx]->meas;
+  time_t t = mktime(&r->t);
+
+  log_stderr(LOG_DEBUG, "RRD: Sensor ID: %d, Measurement: %s, File: %s",
+      r->meas[m_idx]->sensor_id, val, file->name);
+
+  if (file->create) {
+    return rrd_hold_value(file, s->ds, t, val);
+  }
+
+  if (!file->step && (ret = get_rrd_info(file))) {
+    goto due;
+  }
+
+  if ((ret = rrd_cache_value(rrd, file, s->ds, t, val))) {
+    goto due;
+  }
+
+  if (rrd_release_steps(rrd, file, file->newest, time(0))) {
+    ret = SS_POST_ERROR;
+  }
+
+due:
+  rrd_due_update(rrd, file);
+  return ret;
+}
+
+/*
+ * \brief function to add a reading to the RR databases of its sensors,
+ *        found through the sensor_id and name indexes. A sensor takes
+ *        the first measurement matching its sensor_id, or else its name.
+ *        With a creator, a file is created for each new sensor_id.
  */
 int add_reading_rrd(struct reading *r, struct rrdtool *rrd) {
 
   int ret = SS_SUCCESS;
-  uint16_t idx = 0;
+  struct measurement *m;
+  struct rrd_sensor *s;
+  unsigned long seen;
+  unsigned mask;
   unsigned i;
 
-  for (i = 0; i < rrd->f_count; i++) {
-    /* check sensor_id first */
-    if (rrd->sensor_id[i]) {
-      ret = get_sensor_id_measurement_idx(r, rrd->sensor_id[i], &idx);
-      if (!ret) {
-        /* We have sucessfully found the measurement, move to next DS */
-        add_measurement_rrd(r, idx, rrd->file[i]);
-        continue;
+  if (!rrd->s_count && !rrd->creator) {
+    return SS_SUCCESS;
+  }
+  if (!rrd->s_hash_size && (ret = rrd_index_sensors(rrd))) {
+    return ret;
+  }
+  mask = rrd->s_hash_size - 1;
+  seen = ++rrd->readings;
+
+  for (i = 0; i < r->count; i++) {
+    m = r->meas[i];
+    if (!m->sensor_id) {
+      continue;
+    }
+    for (s = rrd->by_id[rrd_hash_id(m->sensor_id) & mask]; s;
+        s = s->id_next) {
+      if (s->sensor_id == m->sensor_id && s->seen != seen && s->file) {
+        s->seen = seen;
+        add_measurement_rrd(rrd, s, r, i);
       }
     }
-    if (rrd->name[i]) {
-      ret = get_sensor_name_measurement_idx(r, (char *)rrd->name[i], &idx);
-      if (!ret) {
-        /* We have sucessfully found the measurement, move to next DS */
-        add_measurement_rrd(r, idx, rrd->file[i]);
-        continue;
+  }
+
+  for (i = 0; i < r->count; i++) {
+    m = r->meas[i];
+    if (!m->name[0]) {
+      continue;
+    }
+    for (s = rrd->by_name[rrd_hash_str(m->name) & mask]; s;
+        s = s->name_next) {
+      if (s->seen != seen && !strcmp(s->name, m->name)) {
+        s->seen = seen;
+        add_measurement_rrd(rrd, s, r, i);
       }
     }
+  }
 
-    if (ret == SS_NO_MATCH) {
-      ret = SS_SUCCESS;
-    } else if (ret) {
-      return ret;
+  for (i = 0; rrd->creator && i < r->count; i++) {
+    m = r->meas[i];
+    if (!m->sensor_id || rrd_sensor_known(rrd, m)) {
+      continue;
+    }
+    if ((s = rrd_create_sensor(rrd, r, m))) {
+      s->seen = seen;
+      add_measurement_rrd(rrd, s, r, i);
+    }
+    if (!rrd->s_hash_size) {
+      /* the indexes could not be grown */
+      return SS_OUT_OF_MEM_ERROR;
     }
   }
 
   return ret;
 }
 
+/*
+ * \brief function to write a batch of RR databases taken from the due
+ *        heap, putting them back by their next due time.
+ */
+static int rrd_write_due(struct rrdtool *rrd, struct rrd_file **files,
+    unsigned count) {
+
+  int ret = write_rrd_files(rrd, files, count);
+  unsigned i;
+
+  for (i = 0; i < count; i++) {
+    rrd_due_update(rrd, files[i]);
+  }
+
+  return ret;
+}
+
+/*
+ * \brief function to queue the values of each RR database whose step
+ *        ended reorder_s seconds or more ago, and write each database
+ *        whose flush interval has passed. Only the databases due are
+ *        visited, taken from the head of the due heap.
+ * \param rrd The rrdtool struct
+ * \param now The current time, 0 to write every cached and queued value
+ */
+int flush_rrd_files(struct rrdtool *rrd, time_t now) {
+
+  int ret = SS_SUCCESS;
+  struct rrd_file *due[RRD_WRITE_BATCH];
+  struct rrd_file *f;
+  unsigned n, count = 0;
+
+  if (!now && rrd->creator) {
+    rrd_creator_sync(rrd->creator);
+  }
+  rrd_files_created(rrd);
+
+  /* each file once, as those rrdcached refused are due again */
+  for (n = rrd->d_count; n && rrd->d_count; n--) {
+    f = rrd->due[0];
+    if (now && f->due > now) {
+      break;
+    }
+    rrd_due_remove(rrd, f);
+
+    if (f->step_count &&
+        rrd_release_steps(rrd, f, now, now ? now : time(0))) {
+      ret = SS_POST_ERROR;
+    }
+
+    if (f->queue.count && (!now || now >= f->write_at)) {
+      due[count++] = f;
+    } else {
+      rrd_due_update(rrd, f);
+    }
+
+    if (count == RRD_WRITE_BATCH) {
+      if (rrd_write_due(rrd, due, count)) {
+        ret = SS_POST_ERROR;
+      }
+      count = 0;
+    }
+  }
+
+  if (count && rrd_write_due(rrd, due, count)) {
+    ret = SS_POST_ERROR;
+  }
+
+  return ret;
+}
+
+/*
+ * \brief function to get the time until the next RR database step ends or
+ *        queued updates are due to be written, from the head of the due
+ *        heap.
+ * \param rrd The rrdtool struct
+ * \param now The current time
+ * \return The time in ms, or -1 if no values are cached or queued
+ */
+long rrd_flush_timeout(struct rrdtool *rrd, time_t now) {
+
+  long timeout = -1;
+
+  if (rrd->d_count) {
+    timeout = (long)(rrd->due[0]->due - now) * 1000;
+    if (timeout < 0) {
+      timeout = 0;
+    }
+  }
+
+  return timeout;
+}
+
 /*
  * \brief function to free an rrd_file struct.
  */
 void free_rrd_file(struct rrd_file *file) {
 
-  if (file)
+  if (file) {
+    free(file->queue.buf);
+    free(file->steps);
+    free(file->create);
+    free(file->held);
     free(file);
+  }
 
   return;
 }
 
 /*
- * \brief function to free all files in a rrdtool struct.
+ * \brief function to free all files and sensors in a rrdtool struct.
  */
 void free_rrd_files(struct rrdtool *rrd) {
 
-  int i;
-  for (i = rrd->f_count; i >= 0; i--) {
-    if (rrd->file[i]) {
-      free_rrd_file(rrd->file[i]);
-    }
-    if (rrd->name[i]) {
-      free(rrd->name[i]);
-    }
+  unsigned i;
+
+  if (rrd->late) {
+    log_stdout(LOG_INFO, "RRD: %lu late values dropped", rrd->late);
   }
 
+  for (i = 0; i < rrd->f_count; i++) {
+    free_rrd_file(rrd->file[i]);
+  }
+  free(rrd->file);
+  free(rrd->f_hash);
+  free(rrd->due);
+  for (i = 0; i < rrd->s_count; i++) {
+    free(rrd->sensor[i]);
+  }
+  free(rrd->sensor);
+  rrd_unindex_sensors(rrd);
+
+  rrd->file = NULL;
+  rrd->f_hash = NULL;
+  rrd->due = NULL;
+  rrd->sensor = NULL;
+  rrd->f_count = rrd->f_size = rrd->f_hash_size = 0;
+  rrd->d_count = 0;
+  rrd->s_count = rrd->s_size = 0;
+
   return;
 }
@@ -0,0 +1,217 @@
+/******************************************************************************
+ * File: reading_client.c
+ * Description: client to submit readings to a reading_mqtt daemon
+ * Author: Steven Swann - swannonline@googlemail.com
+ *
+ * Copyright (c) swannonline, 2013-2014
+ *
+ * This file is part of sensorspace.
+ *
+ * sensorspace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * sensorspace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with sensorspace.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <getopt.h>
+
+#include "sensorspace.h"
+#include "reading_mqtt.h"
+#include "log.h"
+
+static int print_usage(void);
+
+/*
+ * \brief function to print help
+ */
+static int print_usage() {
+
+  fprintf(stderr,
+      "reading_client submits a reading to a reading_mqtt daemon, started\n"
+      "with 'reading_mqtt --daemon <socket>', without connecting to the\n"
+      "broker. Reading options following '--' are passed to the daemon\n"
+      "as given, otherwise a JSON or INI reading is read from stdin.\n"
+      "Usage: reading_client [options] [-- <reading options>]\n"
+      "General options:\n"
+      " -h [--help]              : Displays this help and exits\n"
+      "\n"
+      "Client options:\n"
+      " -u [--socket] <socket>   : The daemon socket.\n"
+      "                            Default: " READING_SOCK_DEFAULT_PATH "\n"
+      " -a [--ack]               : Wait for the daemon to confirm that the\n"
+      "                            reading was accepted\n"
+      "\n"
+      "Example:\n"
+      " reading_client -- -d 1 -m 21.5 -s 2\n"
+      "\n"
+      "\nDebug options:\n"
+      " -v [--verbose] <LEVEL>   : set verbose level to LEVEL\n"
+      "                               Levels are:\n"
+      "                                 SILENT\n"
+      "                                 ERROR\n"
+      "                                 WARN\n"
+      "                                 INFO (default)\n"
+      "                                 DEBUG\n"
+      "                                 DEBUG_THREAD\n"
+      "\n");
+
+  return 0;
+}
+
+int main(int argc, char **argv) {
+
+  int ret;
+  int c, option_index = 0;
+  char sock_path[READING_SOCK_PATH_LEN] = READING_SOCK_DEFAULT_PATH;
+  static char msg[READING_SOCK_MAX_MSG];
+  size_t len = 0, arg_len;
+  struct sockaddr_un addr;
+  struct timeval tv;
+  sa_family_t family = AF_UNIX;
+  uint8_t status;
+  int ack = 0, fd, i;
+  ssize_t n;
+
+  static struct option long_options[] =
+  {
+    /* These options set a flag. */
+    {"help",   no_argument,             0, 'h'},
+    {"socket", required_argument,       0, 'u'},
+    {"ack", no_argument,                0, 'a'},
+    {"verbose", required_argument,      0, 'v'},
+    {0, 0, 0, 0}
+  };
+
+  /* get arguments, stopping at the reading options */
+  while (1)
+  {
+    if ((c = getopt_long(argc, argv, "+hu:av:", long_options,
+            &option_index)) != -1) {
+
+      switch (c) {
+        case 'h':
+          return print_usage();
+
+        case 'v':
+          /* set log level */
+          if (optarg) {
+            set_log_level_str(optarg);
+          }
+          break;
+
+        case 'u':
+          /* set daemon socket */
+          if (optarg && strlen(optarg) < sizeof(addr.sun_path)) {
+            strcpy(sock_path, optarg);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The socket flag should be followed by a socket path");
+            return print_usage();
+          }
+          break;
+
+        case 'a':
+          /* wait for acknowledgement */
+          ack = 1;
+          break;
+
+        default:
+          return print_usage();
+      }
+    } else {
+      /* Final arguement */
+      break;
+    }
+  }
+
+  if (optind < argc) {
+    /* reading options, NULL separated */
+    for (i = optind; i < argc; i++) {
+      arg_len = strlen(argv[i]) + 1;
+      if (len + arg_len > sizeof(msg)) {
+        log_stderr(LOG_ERROR, "Reading too large");
+        return SS_BUF_FULL;
+      }
+      memcpy(msg + len, argv[i], arg_len);
+      len += arg_len;
+    }
+
+    if (msg[0] != READING_SOCK_ARG_CHAR) {
+      log_stderr(LOG_ERROR, "Reading options should follow '--'");
+      return print_usage();
+    }
+  } else {
+    /* JSON or INI reading */
+    while (len < sizeof(msg) &&
+        (n = read(STDIN_FILENO, msg + len, sizeof(msg) - len)) > 0) {
+      len += n;
+    }
+    if (!len || len == sizeof(msg)) {
+      log_stderr(LOG_ERROR, "No reading, or reading too large");
+      return SS_READING_ERROR;
+    }
+  }
+
+  if ((fd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) {
+    log_stderr(LOG_ERROR, "socket: %s", strerror(errno));
+    return SS_CONN_ERROR;
+  }
+
+  if (ack) {
+    /* bind an autobind address so that the daemon can reply */
+    if (bind(fd, (struct sockaddr *)&family, sizeof(family))) {
+      log_stderr(LOG_ERROR, "bind: %s", strerror(errno));
+      ret = SS_CONN_ERROR;
+      goto free;
+    }
+
+    tv.tv_sec = READING_SOCK_ACK_TIMEOUT / 1000;
+    tv.tv_usec = (READING_SOCK_ACK_TIMEOUT % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  }
+
+  memset(&addr, 0, sizeof(struct sockaddr_un));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, sock_path);
+
+  if (sendto(fd, msg, len, 0, (struct sockaddr *)&addr,
+        sizeof(struct sockaddr_un)) < 0) {
+    log_stderr(LOG_ERROR, "Sending reading to %s: %s", sock_path,
+        strerror(errno));
+    ret = SS_WRITE_ERROR;
+    goto free;
+  }
+
+  ret = SS_SUCCESS;
+  if (ack) {
+    if (recv(fd, &status, sizeof(status), 0) != sizeof(status)) {
+      log_stderr(LOG_ERROR, "No reply from daemon: %s", strerror(errno));
+      ret = SS_READ_ERROR;
+    } else if (status) {
+      log_stderr(LOG_ERROR, "Reading rejected by daemon: %d", status);
+      ret = status;
+    }
+  }
+
+free:
+  close(fd);
+  return ret;
+}
@@ -26,6 +26,10 @@
 #include <stdbool.h>
 #include <string.h>
 #include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include <getopt.h>
 
@@ -34,15 +38,55 @@
 
 #include "sensorspace.h"
 #include "reading.h"
+#include "mqtt_batch.h"
+#include "mqtt_conn.h"
+#include "evloop.h"
+#include "reading_mqtt.h"
 #include "log.h"
 
 #define MQTT_DEFAULT_TOPIC    "sensorspace/reading"
 
 #define MAX_TOPIC_LEN 1024
 #define MAX_MSG_LEN 2048
+/* connection attempts are retried with backoff for up to */
+#define READING_CONNECT_WAIT_MS 30000
+
+#define READING_MQTT_OPTS "hv:s:n:N:d:D:jirR:L:S:Q:W:A:t:l:m:b:p:c:k:U:B:T:"
 
 static int print_usage(void);
 
+static struct option long_options[] =
+{
+  /* These options set a flag. */
+  {"help",   no_argument,             0, 'h'},
+  {"measure", required_argument,      0, 'm'},
+  {"sensor-id", required_argument,    0, 's'},
+  {"device-id", required_argument,    0, 'd'},
+  {"device-name", required_argument,  0, 'N'},
+  {"name", required_argument,         0, 'n'},
+  {"date", required_argument,         0, 'D'},
+  {"json", no_argument,               0, 'j'},
+  {"ini", no_argument,                0, 'i'},
+  {"retain",  no_argument,            0, 'r'},
+  {"repeat", required_argument,       0, 'R'},
+  {"linger", required_argument,       0, 'L'},
+  {"batch-size", required_argument,   0, 'S'},
+  {"qos", required_argument,          0, 'Q'},
+  {"window", required_argument,       0, 'W'},
+  {"ack-timeout", required_argument,  0, 'A'},
+  {"verbose", required_argument,      0, 'v'},
+  {"location", required_argument,     0, 'l'},
+  {"topic", required_argument,        0, 't'},
+  {"broker", required_argument,       0, 'b'},
+  {"port", required_argument,         0, 'p'},
+  {"clientid", required_argument,     0, 'c'},
+  {"keepalive", required_argument,    0, 'k'},
+  {"daemon", required_argument,       0, 'U'},
+  {"batch", required_argument,        0, 'B'},
+  {"rate", required_argument,         0, 'T'},
+  {0, 0, 0, 0}
+};
+
 /*
  * \brief function to print help
  */
@@ -61,8 +105,8 @@ static int print_usage() {
       "                            Format: '%%Y-%%m-%%d %%H:%%M:%%S'\n"
       " -d [--device-id] <id>    : The device_id the reading is attached to.\n"
       " -N [--device-name] <name>: The device_id the reading is attached to.\n"
-      " -m [--meas] <measurement>: Measurement to sent as part of the reading.\n"
-      "                            Can be used multiple times.\n"
+      " -m [--meas] <measurement>: Measurement to sent as part of the\n"
+      "                            reading. Can be used multiple times.\n"
       " -s [--sensor-id] <id>    : The sensor_id of the previous measurement.\n"
       " -n [--name] <name>       : The sensor/measurement name.\n"
       " -j [--json]              : Embed the reading in JSON format (DEFAULT)\n"
@@ -77,6 +121,29 @@ static int print_usage() {
       "                            'sensorspace/reading/[location]/'\n"
       "                             [device-id]/[device-name]"
       " -r [--retain]            : Set the retain flag\n"
+      " -R [--repeat] <count>    : Publish the reading <count> times\n"
+      " -L [--linger] <ms>       : Batch readings for up to <ms> milliseconds\n"
+      "                            before publishing. Default: 0 (disabled)\n"
+      " -S [--batch-size] <bytes>: Maximum batch payload size. Default: 1024\n"
+      " -Q [--qos] <0|1>         : Publish QoS level. Default: 0\n"
+      " -W [--window] <n>        : Maximum unacknowledged QoS 1 packets\n"
+      "                            Default: 64\n"
+      " -A [--ack-timeout] <ms>  : Retransmit QoS 1 packets that are not\n"
+      "                            acknowledged within <ms>. Default: 5000\n"
+      "\n"
+      "Daemon options:\n"
+      " -U [--daemon] <socket>   : Stay connected to the broker, publishing\n"
+      "                            readings received on the Unix datagram\n"
+      "                            socket <socket>. Readings may be sent in\n"
+      "                            JSON, INI or reading option form, see\n"
+      "                            reading_client.\n"
+      "\n"
+      "Batch options:\n"
+      " -B [--batch] <file|->    : Publish readings read from <file>, or\n"
+      "                            stdin for '-'. The input may hold JSON\n"
+      "                            readings, one per line, and INI sections.\n"
+      " -T [--rate] <readings/s> : Limit the batch publish rate.\n"
+      "                            Default: 0 (unlimited)\n"
       "\n"
       "Broker options:\n"
       " -b [--broker] <broker-IP>: Change the default broker IP\n"
@@ -84,6 +151,9 @@ static int print_usage() {
       "                            currently supported. Default: localhost\n"
       " -p [--port] <port>       : Change the default port. Default: 1883\n"
       " -c [--clientid] <id>     : Change the default clientid\n"
+      " -k [--keepalive] <s>     : Daemon and batch mode seconds between\n"
+      "                            keepalive PINGREQs, 0 to disable.\n"
+      "                            Default: 30\n"
       "\n"
       "\nDebug options:\n"
       " -v [--verbose] <LEVEL>   : set verbose level to LEVEL\n"
@@ -99,6 +169,627 @@ static int print_usage() {
   return 0;
 }
 
+/**
+ * \brief Apply a reading option to a reading. Shared by the command line
+ *        and the daemon's argument form.
+ * \param r The reading
+ * \param c The option character
+ * \param arg The option argument
+ * \param topic The publish topic, MAX_TOPIC_LEN bytes
+ * \param topic_set Set when the topic is given explicitly
+ * \return SS_NO_MATCH if c is not a reading option, SS_CFG_FAILED if the
+ *         option is invalid
+ */
+static int set_reading_opt(struct reading *r, int c, const char *arg,
+    char *topic, bool *topic_set) {
+
+  size_t len;
+
+  switch (c) {
+    case 't':
+      /* Set topic */
+      if (arg) {
+        *topic_set = true;
+        strncpy(topic, arg, MAX_TOPIC_LEN - 1);
+        topic[MAX_TOPIC_LEN - 1] = '\0';
+      } else {
+        log_stderr(LOG_ERROR,
+            "The topic flag should be followed by a topic");
+        return SS_CFG_FAILED;
+      }
+      break;
+
+    case 'l':
+      /* Set location */
+      if (arg) {
+        if (*topic_set) {
+          log_stderr(LOG_ERROR,
+              "Location flag are invalid when the topic flag is used");
+          return SS_CFG_FAILED;
+        }
+        len = strlen(topic);
+        snprintf(topic + len, MAX_TOPIC_LEN - len, "/%s", arg);
+      } else {
+        log_stderr(LOG_ERROR,
+            "The topic flag should be followed by a topic");
+        return SS_CFG_FAILED;
+      }
+      break;
+
+    case 'D':
+      /* set the reading date */
+      if (arg) {
+        if (convert_db_date_to_tm(arg, strlen(arg), &r->t)) {
+          log_stderr(LOG_ERROR, "Invalid date: %s", arg);
+          return SS_CFG_FAILED;
+        }
+      } else {
+        log_stderr(LOG_ERROR,
+            "The date flag should be followed by a date");
+        return SS_CFG_FAILED;
+      }
+      break;
+
+    case 'd':
+      /* set a device_id */
+      if (arg) {
+        r->device_id = atoi(arg);
+      } else {
+        log_stderr(LOG_ERROR,
+            "The device_id flag should be followed by a device_id");
+        return SS_CFG_FAILED;
+      }
+      break;
+
+    case 'N':
+      /* set device name */
+      if (arg) {
+        strncpy(r->name, arg, READ_NAME_LEN - 1);
+      } else {
+        log_stderr(LOG_ERROR,
+            "The device name flag should be followed by a string");
+        return SS_CFG_FAILED;
+      }
+      break;
+
+    case 'm':
+      /* set a measurement */
+      if (arg) {
+        if (measurement_init(r)) {
+          log_stderr(LOG_ERROR, "Failed to initialise measurement");
+          return SS_CFG_FAILED;
+        }
+
+        strncpy(r->meas[r->count - 1]->meas, arg, READ_MEAS_LEN - 1);
+
+      } else {
+        log_stderr(LOG_ERROR,
+            "The measurement flag should be followed by a measurement");
+        return SS_CFG_FAILED;
+      }
+      break;
+
+    case 'n':
+      /* set sensor/measurement name */
+      if (arg && r->count) {
+        strncpy(r->meas[r->count - 1]->name, arg, READ_NAME_LEN - 1);
+      } else {
+        log_stderr(LOG_ERROR,
+            "The name flag should follow a measurement flag, and"
+            " should be followed by a string");
+        return SS_CFG_FAILED;
+      }
+      break;
+
+    case 's':
+      /* set a sensor_id */
+      if (arg && r->count) {
+        r->meas[r->count - 1]->sensor_id = atoi(arg);
+      } else {
+        log_stderr(LOG_ERROR,
+            "The sensor_id flag should follow a measurement flag, and"
+            " should be followed by a sensor_id");
+        return SS_CFG_FAILED;
+      }
+      break;
+
+    default:
+      return SS_NO_MATCH;
+  }
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Append the device ID and name of a reading to the topic
+ */
+static void build_reading_topic(struct reading *r, char *topic) {
+
+  size_t len;
+
+  if (r->device_id) {
+    len = strlen(topic);
+    snprintf(topic + len, MAX_TOPIC_LEN - len, "/%d", r->device_id);
+  }
+
+  len = strlen(topic);
+  snprintf(topic + len, MAX_TOPIC_LEN - len, "/%s", r->name);
+
+  return;
+}
+
+/**
+ * \brief Managed connection callback processing packets received from the
+ *        broker, PUBACKs are passed to the QoS 1 publisher
+ */
+static void read_broker_input(struct mqtt_conn *mc, void *arg) {
+
+  struct mqtt_batcher *b = (struct mqtt_batcher *)arg;
+  struct mqtt_frame frame;
+
+  while (!mqtt_conn_next(mc, &frame)) {
+    if (!b->qos || mqtt_qos_handle(b->qos, &frame)) {
+      log_stdout(LOG_DEBUG, "Ignoring packet type 0x%02x", frame.ctrl);
+    }
+  }
+
+  /* acknowledgements free the window for spooled packets */
+  mqtt_batcher_arm(b);
+}
+
+static void stop_handler(struct evloop *el, int sig, void *arg) {
+  (void)sig;
+  (void)arg;
+  evloop_stop(el);
+}
+
+/**
+ * \brief Decode a reading received on the daemon socket, or read in batch
+ *        mode, and queue it for publishing. JSON messages start with
+ *        '{', INI messages with '[' and the argument form is a NULL
+ *        separated list of reading options, so starts with '-'.
+ * \param b The batching publisher
+ * \param buf The NULL terminated message
+ * \param len The length of the message
+ * \param topic The base topic
+ * \param topic_set True if the base topic was given explicitly
+ */
+static int publish_encoded_reading(struct mqtt_batcher *b, char *buf,
+    size_t len, const char *topic, bool topic_set) {
+
+  struct reading *r = NULL;
+  char r_topic[MAX_TOPIC_LEN];
+  char msg[MAX_MSG_LEN];
+  static char prog[] = "reading_mqtt";
+  char *argv[READING_SOCK_MAX_ARGS + 1];
+  bool r_topic_set = topic_set;
+  size_t msg_len = MAX_MSG_LEN;
+  time_t now = time(0);
+  int argc = 0, c, ret;
+  char *p;
+
+  ret = reading_init(&r);
+  if (ret) {
+    return ret;
+  }
+
+  localtime_r(&now, &r->t);
+  strcpy(r_topic, topic);
+
+  switch (buf[0]) {
+    case '{':
+      ret = convert_json_reading(r, buf, len);
+      break;
+
+    case '[':
+      ret = convert_ini_reading(r, buf, len);
+      break;
+
+    case READING_SOCK_ARG_CHAR:
+      argv[argc++] = prog;
+      for (p = buf; p < buf + len && argc < READING_SOCK_MAX_ARGS;
+          p += strlen(p) + 1) {
+        argv[argc++] = p;
+      }
+      argv[argc] = NULL;
+
+      /* restart option parsing for the new argument list */
+      optind = 0;
+      opterr = 0;
+      while ((c = getopt_long(argc, argv, READING_MQTT_OPTS, long_options,
+              NULL)) != -1) {
+        ret = set_reading_opt(r, c, optarg, r_topic, &r_topic_set);
+        if (ret) {
+          log_stderr(LOG_ERROR, "Invalid reading option: %s",
+              argv[optind - 1]);
+          ret = SS_READING_ERROR;
+          goto free;
+        }
+      }
+      break;
+
+    default:
+      log_stderr(LOG_ERROR, "Unknown reading format");
+      ret = SS_READING_ERROR;
+      break;
+  }
+
+  if (ret) {
+    goto free;
+  }
+
+  if (!r_topic_set) {
+    build_reading_topic(r, r_topic);
+  }
+
+  ret = convert_reading_json(r, msg, &msg_len);
+  if (ret) {
+    goto free;
+  }
+
+  log_stdout(LOG_DEBUG, "Reading for %s: %s", r_topic, msg);
+
+  ret = mqtt_batcher_add(b, r_topic, (uint8_t *)msg, strlen(msg));
+
+free:
+  free_reading(r);
+  return ret;
+}
+
+/*
+ * \brief Struct to hold the state of the daemon socket
+ * \param b The batching publisher
+ * \param topic The base topic
+ * \param topic_set True if the base topic was given explicitly
+ * \param fd The daemon socket
+ * \param throttled Readings are left queued on the socket while the
+ *        broker falls behind
+ */
+struct daemon_state {
+  struct mqtt_batcher *b;
+  const char *topic;
+  bool topic_set;
+  int fd;
+  bool throttled;
+};
+
+/**
+ * \brief Event loop callback taking every reading queued on the daemon
+ *        socket. If the sender has bound an address, the result is
+ *        returned as a single byte.
+ */
+static void daemon_input(struct evloop *el, int fd, uint32_t events,
+    void *arg) {
+
+  struct daemon_state *st = (struct daemon_state *)arg;
+  static char buf[READING_SOCK_MAX_MSG + 1];
+  struct sockaddr_un from;
+  socklen_t from_len;
+  uint8_t status;
+  ssize_t n;
+
+  (void)el;
+  (void)events;
+
+  while (1) {
+    from_len = sizeof(struct sockaddr_un);
+    n = recvfrom(fd, buf, READING_SOCK_MAX_MSG, MSG_DONTWAIT,
+        (struct sockaddr *)&from, &from_len);
+    if (n < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        log_stderr(LOG_ERROR, "recvfrom: %s", strerror(errno));
+      }
+      break;
+    } else if (!n) {
+      continue;
+    }
+    buf[n] = '\0';
+
+    status = publish_encoded_reading(st->b, buf, n, st->topic,
+        st->topic_set);
+    if (status) {
+      log_stderr(LOG_ERROR, "Failed to publish reading");
+    }
+
+    if (from_len > sizeof(sa_family_t)) {
+      sendto(fd, &status, sizeof(status), MSG_DONTWAIT,
+          (struct sockaddr *)&from, from_len);
+    }
+  }
+}
+
+/**
+ * \brief Batcher callback leaving readings queued on the daemon socket
+ *        while the broker falls behind
+ */
+static void daemon_flushed(struct mqtt_batcher *b, void *arg) {
+
+  struct daemon_state *st = (struct daemon_state *)arg;
+
+  if (mqtt_conn_congested(b->mc) != st->throttled &&
+      !evloop_mod_fd(b->mc->el, st->fd, st->throttled ? EPOLLIN : 0)) {
+    st->throttled = !st->throttled;
+  }
+}
+
+/**
+ * \brief Keep the broker connection open, publishing readings received on
+ *        a Unix datagram socket until SIGINT or SIGTERM
+ * \param b The batching publisher, attached to the broker connection
+ * \param mc The broker connection, attached to an event loop
+ * \param path The socket path
+ * \param topic The base topic
+ * \param topic_set True if the base topic was given explicitly
+ */
+static int run_daemon(struct mqtt_batcher *b, struct mqtt_conn *mc,
+    const char *path, const char *topic, bool topic_set) {
+
+  struct evloop *el = mc->el;
+  struct sockaddr_un addr;
+  struct daemon_state st;
+  int fd, ret;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    log_stderr(LOG_ERROR, "Socket path too long: %s", path);
+    return SS_INIT_ERROR;
+  }
+
+  if ((fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0) {
+    log_stderr(LOG_ERROR, "socket: %s", strerror(errno));
+    return SS_INIT_ERROR;
+  }
+
+  memset(&addr, 0, sizeof(struct sockaddr_un));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  /* replace a socket left by a previous instance */
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(struct sockaddr_un))) {
+    log_stderr(LOG_ERROR, "bind: %s: %s", path, strerror(errno));
+    close(fd);
+    return SS_INIT_ERROR;
+  }
+
+  st.b = b;
+  st.topic = topic;
+  st.topic_set = topic_set;
+  st.fd = fd;
+  st.throttled = false;
+
+  if ((ret = evloop_add_fd(el, fd, EPOLLIN, daemon_input, &st)) ||
+      (ret = evloop_add_signal(el, SIGINT, stop_handler, NULL)) ||
+      (ret = evloop_add_signal(el, SIGTERM, stop_handler, NULL))) {
+    goto free;
+  }
+
+  log_stdout(LOG_INFO, "Waiting for readings on %s", path);
+
+  mqtt_batcher_set_flush_cb(b, daemon_flushed, &st);
+  ret = evloop_run(el);
+
+  log_stdout(LOG_INFO, "Stopping daemon");
+
+free:
+  mqtt_batcher_set_flush_cb(b, NULL, NULL);
+  evloop_del_fd(el, fd);
+  close(fd);
+  unlink(path);
+
+  return ret;
+}
+
+/*
+ * \brief Struct to hold the state of a batch mode run
+ * \param b The batching publisher
+ * \param mc The broker connection, attached to an event loop
+ * \param topic The base topic
+ * \param topic_set True if the base topic was given explicitly
+ * \param rate The maximum rate in readings per second, 0 for no limit
+ * \param start The time (CLOCK_MONOTONIC) the run started
+ * \param slot The timer ending the wait for the next reading's slot
+ * \param sent The number of readings published
+ * \param failed The number of readings that could not be published
+ */
+struct batch_state {
+  struct mqtt_batcher *b;
+  struct mqtt_conn *mc;
+  const char *topic;
+  bool topic_set;
+  unsigned rate;
+  struct timespec start;
+  struct evloop_timer *slot;
+  unsigned long sent;
+  unsigned long failed;
+};
+
+/**
+ * \brief Event loop callback ending the wait for a reading's slot
+ */
+static void batch_slot(struct evloop *el, struct evloop_timer *t,
+    void *arg) {
+
+  (void)t;
+  (void)arg;
+
+  evloop_stop(el);
+}
+
+/**
+ * \brief Batcher callback ending the wait for the broker to catch up
+ */
+static void batch_flushed(struct mqtt_batcher *b, void *arg) {
+
+  (void)arg;
+
+  if (!mqtt_conn_congested(b->mc)) {
+    evloop_stop(b->mc->el);
+  }
+}
+
+/**
+ * \brief Service the broker connection until a CLOCK_MONOTONIC time,
+ *        publishing lingering batches and handling PUBACKs meanwhile
+ * \param st The batch mode state
+ * \param until The time to return at
+ * \return SS_SELECT_ERROR if waiting failed
+ */
+static int broker_wait(struct batch_state *st, const struct timespec *until) {
+
+  struct timespec now;
+  long wait_ms;
+  int ret;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  wait_ms = (until->tv_sec - now.tv_sec) * 1000 +
+    (until->tv_nsec - now.tv_nsec) / 1000000;
+  if (wait_ms <= 0) {
+    return SS_SUCCESS;
+  }
+
+  if ((ret = evloop_timer_set(st->slot, wait_ms, 0))) {
+    return ret;
+  }
+
+  return evloop_run(st->mc->el);
+}
+
+/**
+ * \brief Publish a reading in batch mode, then wait for its slot in the
+ *        schedule. The schedule is kept from the start of the run so that
+ *        a slow send is made up for.
+ * \return SS_SELECT_ERROR if waiting failed
+ */
+static int batch_publish(struct batch_state *st, char *buf, size_t len) {
+
+  struct timespec next;
+
+  if (publish_encoded_reading(st->b, buf, len, st->topic, st->topic_set)) {
+    st->failed++;
+  } else {
+    st->sent++;
+  }
+
+  if (!st->rate) {
+    mqtt_batcher_flush_due(st->b);
+
+    /* packets are written in bulk once past the high-water mark, the loop
+     * runs while the broker falls behind */
+    if (mqtt_conn_congested(st->mc)) {
+      return evloop_run(st->mc->el);
+    }
+
+    return SS_SUCCESS;
+  }
+
+  next.tv_sec = st->start.tv_sec + st->sent / st->rate;
+  next.tv_nsec = st->start.tv_nsec +
+    (st->sent % st->rate) * (1000000000UL / st->rate);
+  if (next.tv_nsec >= 1000000000L) {
+    next.tv_sec++;
+    next.tv_nsec -= 1000000000L;
+  }
+
+  return broker_wait(st, &next);
+}
+
+/**
+ * \brief Publish readings read from a file or pipe. Each line holding a
+ *        JSON reading is published, as is each INI section, which runs
+ *        until the next section, JSON reading or blank line.
+ * \param b The batching publisher, attached to the broker connection
+ * \param mc The broker connection, attached to an event loop
+ * \param path The file to read, '-' for stdin
+ * \param rate The maximum rate in readings per second, 0 for no limit
+ * \param topic The base topic
+ * \param topic_set True if the base topic was given explicitly
+ */
+static int run_batch(struct mqtt_batcher *b, struct mqtt_conn *mc,
+    const char *path, unsigned rate, const char *topic, bool topic_set) {
+
+  static char ini[READING_SOCK_MAX_MSG + 1];
+  struct batch_state st;
+  size_t ini_len = 0, line_size = 0;
+  char *line = NULL;
+  ssize_t len;
+  struct timespec end;
+  int ret = SS_SUCCESS;
+  double secs;
+  FILE *f;
+
+  if (!strcmp(path, "-")) {
+    f = stdin;
+  } else if (!(f = fopen(path, "r"))) {
+    log_stderr(LOG_ERROR, "Opening %s: %s", path, strerror(errno));
+    return SS_READ_ERROR;
+  }
+
+  memset(&st, 0, sizeof(struct batch_state));
+  st.b = b;
+  st.mc = mc;
+  st.topic = topic;
+  st.topic_set = topic_set;
+  st.rate = rate;
+
+  /* the loop runs until the next slot, or without a rate limit until the
+   * broker has caught up */
+  if (rate) {
+    ret = evloop_add_timer(mc->el, &st.slot, batch_slot, NULL);
+  } else {
+    mqtt_batcher_set_flush_cb(b, batch_flushed, NULL);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &st.start);
+
+  while (!ret) {
+    len = getline(&line, &line_size, f);
+
+    /* an INI section ends at the next reading, blank line or EOF */
+    if (ini_len && (len < 0 || line[0] == '{' || line[0] == '[' ||
+          line[0] == '\n' || line[0] == '\r')) {
+      ini[ini_len] = '\0';
+      ret = batch_publish(&st, ini, ini_len);
+      ini_len = 0;
+    }
+
+    if (ret || len < 0) {
+      break;
+    }
+
+    if (line[0] == '[' || ini_len) {
+      if (ini_len + len > READING_SOCK_MAX_MSG) {
+        log_stderr(LOG_ERROR, "INI reading too large, skipped");
+        ini_len = 0;
+        st.failed++;
+      } else {
+        memcpy(ini + ini_len, line, len);
+        ini_len += len;
+      }
+    } else if (line[0] == '{') {
+      if (line[len - 1] == '\n') {
+        line[--len] = '\0';
+      }
+      ret = batch_publish(&st, line, len);
+    } else if (line[0] != '\n' && line[0] != '\r') {
+      log_stderr(LOG_WARN, "Skipping unknown input: %s", line);
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  secs = (end.tv_sec - st.start.tv_sec) +
+    (end.tv_nsec - st.start.tv_nsec) / 1e9;
+  log_stdout(LOG_INFO, "Published %lu readings in %.3fs (%.0f/s), %lu failed",
+      st.sent, secs, secs > 0 ? st.sent / secs : 0.0, st.failed);
+
+  mqtt_batcher_set_flush_cb(b, NULL, NULL);
+  evloop_del_timer(mc->el, st.slot);
+  free(line);
+  if (f != stdin) {
+    fclose(f);
+  }
+
+  return ret;
+}
+
 int main(int argc, char **argv) {
 
   int ret;
@@ -109,9 +800,22 @@ int main(int argc, char **argv) {
   size_t len = MAX_MSG_LEN;
   char msg[MAX_MSG_LEN] = "\0";
   char clientid[UMQTT_CLIENTID_MAX_LEN] = "\0";
+  unsigned keepalive = MQTT_CONN_DEFAULT_KEEPALIVE;
   uint8_t retain = 0;
   uint32_t repeat = 1;
   bool topic_set = false;
+  struct mqtt_batcher *batcher = NULL;
+  unsigned linger_ms = 0;
+  size_t batch_bytes = 0;
+  uint8_t qos = 0;
+  unsigned window = 0, ack_ms = 0;
+  struct mqtt_qos *q = NULL;
+  struct mqtt_spool *spool = NULL;
+  struct mqtt_conn *mc = NULL;
+  struct evloop *el = NULL;
+  char sock_path[READING_SOCK_PATH_LEN] = "\0";
+  char batch_file[MAX_FILENAME_LEN] = "\0";
+  unsigned rate = 0;
 
   struct reading *r = NULL;
   ret = reading_init(&r);
@@ -123,32 +827,10 @@ int main(int argc, char **argv) {
   time_t t = time(0);
   localtime_r(&t, &r->t);
 
-  static struct option long_options[] =
-  {
-    /* These options set a flag. */
-    {"help",   no_argument,             0, 'h'},
-    {"measure", required_argument,      0, 'm'},
-    {"sensor-id", required_argument,    0, 's'},
-    {"device-id", required_argument,    0, 'd'},
-    {"device-name", required_argument,  0, 'N'},
-    {"name", required_argument,         0, 'n'},
-    {"date", required_argument,         0, 'D'},
-    {"json", no_argument,               0, 'j'},
-    {"ini", no_argument,                0, 'i'},
-    {"retain",  no_argument,            0, 'r'},
-    {"verbose", required_argument,      0, 'v'},
-    {"location", required_argument,     0, 'l'},
-    {"topic", required_argument,        0, 't'},
-    {"broker", required_argument,       0, 'b'},
-    {"port", required_argument,         0, 'p'},
-    {"clientid", required_argument,     0, 'c'},
-    {0, 0, 0, 0}
-  };
-
   /* get arguments */
   while (1)
   {
-    if ((c = getopt_long(argc, argv, "hv:s:n:N:d:D:jirt:l:m:b:p:c:", long_options,
+    if ((c = getopt_long(argc, argv, READING_MQTT_OPTS, long_options,
             &option_index)) != -1) {
 
       switch (c) {
@@ -167,144 +849,156 @@ int main(int argc, char **argv) {
           retain = 1;
           break;
 
-        case 't':
-          /* Set topic */
+        case 'R':
+          /* set repeat count */
+          if (optarg && atoi(optarg) > 0) {
+            repeat = atoi(optarg);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The repeat flag should be followed by a count");
+            return print_usage();
+          }
+          break;
+
+        case 'L':
+          /* set batch linger time */
           if (optarg) {
-            topic_set = true;
-            strcpy(topic, optarg);
+            linger_ms = atoi(optarg);
           } else {
             log_stderr(LOG_ERROR,
-                "The topic flag should be followed by a topic");
+                "The linger flag should be followed by a time in ms");
             return print_usage();
           }
           break;
 
-        case 'l':
-          /* Set location */
+        case 'S':
+          /* set maximum batch size */
           if (optarg) {
-            if (topic_set) {
-              log_stderr(LOG_ERROR,
-                  "Location flag are invalid when the topic flag is used");
-              return print_usage();
-            }
-            sprintf(topic, "%s/%s", topic, optarg);
+            batch_bytes = atoi(optarg);
           } else {
             log_stderr(LOG_ERROR,
-                "The topic flag should be followed by a topic");
+                "The batch-size flag should be followed by a size in bytes");
             return print_usage();
           }
           break;
 
+        case 'Q':
+          /* set publish QoS */
+          if (optarg && (atoi(optarg) == 0 || atoi(optarg) == 1)) {
+            qos = atoi(optarg);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The qos flag should be followed by 0 or 1");
+            return print_usage();
+          }
+          break;
 
-        case 'D':
-          /* set the reading date */
+        case 'W':
+          /* set QoS 1 in-flight window */
           if (optarg) {
-            convert_db_date_to_tm(optarg, &r->t);
+            window = atoi(optarg);
           } else {
             log_stderr(LOG_ERROR,
-                "The date flag should be followed by a date");
+                "The window flag should be followed by a packet count");
             return print_usage();
           }
           break;
 
-        case 'd':
-          /* set a device_id */
+        case 'A':
+          /* set QoS 1 retransmit timeout */
           if (optarg) {
-            r->device_id = atoi(optarg);
+            ack_ms = atoi(optarg);
           } else {
             log_stderr(LOG_ERROR,
-                "The device_id flag should be followed by a device_id");
+                "The ack-timeout flag should be followed by a time in ms");
             return print_usage();
           }
           break;
 
-        case 'N':
-          /* set device name */
+        case 'b':
+          /* change the default broker ip */
           if (optarg) {
-            strcpy(r->name, optarg);
+            strcpy(broker_ip, optarg);
           } else {
             log_stderr(LOG_ERROR,
-                "The device name flag should be followed by a string");
+                "The broker flag should be followed by an IP address");
             return print_usage();
           }
           break;
 
-
-        case 'm':
-          /* set a measurement */
+        case 'p':
+          /* change the default port */
           if (optarg) {
-
-            ret = measurement_init(r);
-            if (ret) {
-              log_stderr(LOG_ERROR, "Failed to initialise measurement");
-              return print_usage();
-            }
-
-            strcpy(r->meas[r->count - 1]->meas, optarg);
-
+            broker_port = atoi(optarg);
           } else {
             log_stderr(LOG_ERROR,
-                "The measurement flag should be followed by a measurement");
+                "The port flag should be followed by a port");
             return print_usage();
           }
           break;
 
-        case 'n':
-          /* set sensor/measurement name */
+        case 'c':
+          /* Set clientid */
           if (optarg) {
-            strcpy(r->meas[r->count - 1]->name, optarg);
+            strcpy(clientid, optarg);
           } else {
             log_stderr(LOG_ERROR,
-                "The name flag should be followed by a string");
+                "The clientid flag should be followed by a clientid");
             return print_usage();
           }
           break;
 
-        case 's':
-          /* set a sensor_id */
-          if (optarg && r->count) {
-            r->meas[r->count - 1]->sensor_id = atoi(optarg);
+        case 'k':
+          /* set keepalive interval */
+          if (optarg) {
+            keepalive = atoi(optarg);
           } else {
             log_stderr(LOG_ERROR,
-                "The sensor_id flag should follow a measurement flag, and"
-                " should be followed by a sensor_id");
+                "The keepalive flag should be followed by a time in seconds");
             return print_usage();
           }
           break;
 
-        case 'b':
-          /* change the default broker ip */
+        case 'U':
+          /* run as a daemon */
           if (optarg) {
-            strcpy(broker_ip, optarg);
+            strncpy(sock_path, optarg, sizeof(sock_path) - 1);
           } else {
             log_stderr(LOG_ERROR,
-                "The broker flag should be followed by an IP address");
+                "The daemon flag should be followed by a socket path");
             return print_usage();
           }
           break;
 
-        case 'p':
-          /* change the default port */
+        case 'B':
+          /* publish readings from a file */
           if (optarg) {
-            broker_port = *optarg;
+            strncpy(batch_file, optarg, sizeof(batch_file) - 1);
           } else {
             log_stderr(LOG_ERROR,
-                "The port flag should be followed by a port");
+                "The batch flag should be followed by a file or '-'");
             return print_usage();
           }
           break;
 
-        case 'c':
-          /* Set clientid */
+        case 'T':
+          /* set batch publish rate */
           if (optarg) {
-            strcpy(clientid, optarg);
+            rate = atoi(optarg);
           } else {
             log_stderr(LOG_ERROR,
-                "The clientid flag should be followed by a clientid");
+                "The rate flag should be followed by readings per second");
             return print_usage();
           }
           break;
 
+        default:
+          /* reading options */
+          if (set_reading_opt(r, c, optarg, topic, &topic_set) ==
+              SS_CFG_FAILED) {
+            return print_usage();
+          }
+          break;
       }
     } else {
       /* Final arguement */
@@ -312,89 +1006,102 @@ int main(int argc, char **argv) {
     }
   }
 
-  struct broker_conn *conn;
-
-  log_stdout(LOG_INFO, "Initialisig socket connection");
-
-  init_linux_socket_connection(&conn, broker_ip, sizeof(broker_ip), broker_port);
-  if (!conn) {
-    log_stdout(LOG_ERROR, "Initialising socket connection");
-    return -1;
+  /* only the daemon and batch mode are long lived enough to ping */
+  if (!sock_path[0] && !batch_file[0]) {
+    keepalive = 0;
   }
 
-  if (clientid[0]) {
-    broker_set_clientid(conn, clientid, sizeof(clientid));
+  ret = mqtt_conn_init(&mc, broker_ip, broker_port, clientid, keepalive);
+  if (ret) {
+    free_reading(r);
+    return ret;
   }
 
-  log_stdout(LOG_INFO, "Connecting to broker");
+  /* build topic string, the daemon and batch mode do so for each reading */
+  if (!topic_set && !sock_path[0] && !batch_file[0]) {
+    build_reading_topic(r, topic);
+  }
 
-  struct linux_broker_socket *skt = '\0';
-  if ((ret = broker_connect(conn))) {
-    log_stderr(LOG_ERROR, "Connecting to broker");
-    free_connection(conn);
-    return ret;
-  } else {
-    skt = (struct linux_broker_socket *)conn->context;
-    log_stdout(LOG_INFO,
-        "Connected to broker:\nip: %s port: %d", skt->ip, skt->port);
+  ret = mqtt_batcher_init(&batcher, mc->conn, retain, linger_ms, batch_bytes);
+  if (ret) {
+    goto free;
   }
 
-  struct mqtt_packet *pkt = construct_packet_headers(PUBLISH);
+  /* the batcher follows the connection across reconnects */
+  mqtt_conn_set_callbacks(mc, mqtt_batcher_conn_changed,
+      mqtt_batcher_conn_changed, batcher);
 
-  /* build topic string */
-  if (!topic_set) {
-    if (r->device_id) {
-      sprintf(topic, "%s/%d", topic, r->device_id);
-    }
-    if (r->name) {
-      sprintf(topic, "%s/%s", topic, r->name);
+  /* packets beyond the in-flight window wait in a spool held in memory */
+  if (qos) {
+    if ((ret = mqtt_spool_open(&spool, NULL, 0, 0)) ||
+        (ret = mqtt_qos_init(&q, mc->conn, window, ack_ms))) {
+      goto free;
     }
+    q->spool = spool;
+    batcher->qos = q;
   }
 
-  if (!pkt || (ret = set_publish_variable_header(pkt, topic, strlen(topic)))) {
-    log_stderr(LOG_ERROR, "Setting up packet");
-    ret = UMQTT_ERROR;
+  /* broker connection, input, PUBACKs, keepalive and reconnection are
+   * driven by the loop, as are lingering batches and retransmissions */
+  if ((ret = evloop_init(&el)) ||
+      (ret = mqtt_conn_attach(mc, el, read_broker_input, batcher)) ||
+      (ret = mqtt_batcher_attach(batcher, mc))) {
     goto free;
   }
 
-  if ((ret = set_publish_fixed_flags(pkt, retain, 0, 0))) {
-    log_stderr(LOG_ERROR, "Setting publish flags");
-    ret = UMQTT_ERROR;
+  /* the daemon spools or drops readings while disconnected, otherwise
+   * there is nothing to do until the broker is reached */
+  if (!sock_path[0] &&
+      (ret = mqtt_conn_wait(mc, READING_CONNECT_WAIT_MS))) {
     goto free;
   }
 
+  if (sock_path[0]) {
+    ret = run_daemon(batcher, mc, sock_path, topic, topic_set);
+    if (mqtt_batcher_flush(batcher)) {
+      ret = SS_WRITE_ERROR;
+    }
+    goto wait;
+  }
+
+  if (batch_file[0]) {
+    ret = run_batch(batcher, mc, batch_file, rate, topic, topic_set);
+    if (mqtt_batcher_flush(batcher)) {
+      ret = SS_WRITE_ERROR;
+    }
+    goto wait;
+  }
+
   /* convert reading ready for mqtt tx */
   convert_reading_json(r, msg, &len);
 
-  log_stdout(LOG_INFO, "Constructed MQTT PUBLISH packet with:");
+  log_stdout(LOG_INFO, "Sending reading to broker");
   log_stdout(LOG_INFO, "Topic: %s", topic);
   log_stdout(LOG_INFO, "Message: %s", msg);
 
-  if ((ret = init_packet_payload(pkt, PUBLISH, (uint8_t *)msg, strlen(msg)))) {
-    log_stderr(LOG_ERROR, "Attaching payload");
-    ret = UMQTT_ERROR;
-    goto free;
-  }
-
-  finalise_packet(pkt);
-
-  log_stdout(LOG_INFO, "Sending packet to broker");
-
   /* Send packets */
   do {
-    ret = broker_send_packet(conn, pkt);
-    if (ret) {
-      log_stderr(LOG_ERROR, "Sending packet failed");
-    } else {
-      log_stdout(LOG_INFO, "Successfully sent packet");
+    ret = mqtt_batcher_add(batcher, topic, (uint8_t *)msg, strlen(msg));
+    if (ret == SS_INIT_ERROR || ret == SS_OUT_OF_MEM_ERROR) {
+      goto free;
     }
   } while (--repeat);
 
+  /* publish anything still lingering */
+  ret = mqtt_batcher_flush(batcher);
+
+wait:
+  /* wait for delivery before disconnecting */
+  if (q && mqtt_qos_wait(q, mc, 0, q->timeout_ms * 4)) {
+    ret = SS_WRITE_ERROR;
+  }
+
 free:
-  log_stdout(LOG_INFO, "Disconnecting from broker");
-  broker_disconnect(conn);
   free_reading(r);
-  free_connection(conn);
-  free_packet(pkt);
+  free_mqtt_batcher(batcher);
+  free_mqtt_qos(q);
+  mqtt_spool_close(spool);
+  free_mqtt_conn(mc);
+  free_evloop(el);
   return ret;
 }
@@ -0,0 +1,34 @@
+#ifndef READING_MQTT__H
+#define READING_MQTT__H
+/******************************************************************************
+ * File: reading_mqtt.h
+ * Description: definitions shared by the reading_mqtt daemon and its client
+ * Author: Steven Swann - swannonline@googlemail.com
+ *
+ * Copyright (c) swannonline, 2013-2014
+ *
+ * This file is part of sensorspace.
+ *
+ * sensorspace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * sensorspace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with sensorspace.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+
+#define READING_SOCK_DEFAULT_PATH   "/tmp/reading_mqtt.sock"
+#define READING_SOCK_PATH_LEN       108
+#define READING_SOCK_MAX_MSG        4096
+#define READING_SOCK_MAX_ARGS       128
+#define READING_SOCK_ARG_CHAR       '-'
+#define READING_SOCK_ACK_TIMEOUT    1000
+
+#endif        /* READING_MQTT__H */
@@ -53,6 +53,7 @@
 #define SS_CFG_NO_DB               26
 #define SS_READING_ERROR           27
 #define SS_TTY_ERROR               28
+#define SS_TTY_DISCONNECT          29
 #define SS_CONTINUE                99
 
 #endif                    /* SENSORSPACE__H */
@@ -26,9 +26,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
+#include <sys/inotify.h>
 
 #include "sensorspace.h"
 #include "log.h"
@@ -41,7 +44,7 @@
 int tty_conn_check_config(struct tty_conn *tty) {
 
   if (access(tty->path, F_OK)) {
-    log_stderr(LOG_ERROR, "tty connection device access: %s\n\t%s\n",
+    log_stderr(LOG_WARN, "tty connection device access: %s\n\t%s\n",
         tty->path, strerror(errno));
     return SS_CFG_FAILED;
   }
@@ -75,6 +78,10 @@ int tty_conn_init(struct tty_conn **tty_p)
     goto free;
   }
 
+  tty->fd = -1;
+  tty->watch_fd = -1;
+  tty->watch_wd = -1;
+
   *tty_p = (void *)tty;
   return SS_SUCCESS;
 
@@ -84,24 +91,31 @@ free:
 }
 
 /**
- * \brief Open a tty connection
- * \param tty The tty connection to open
+ * \brief Flush the tty and activate the configured termios settings
+ * \param tty The tty connection to configure
  */
-int tty_conn_open(struct tty_conn *tty) {
+static int tty_conn_apply_settings(struct tty_conn *tty) {
 
-  log_stdout(LOG_INFO, "Attempting to open device: %s", tty->path);
-  /*
-     Open modem device for reading and writing and not as controlling tty
-     because we don't want to get killed if linenoise sends CTRL-C.
-     */
-  tty->fd = open(tty->path, O_RDWR | O_NOCTTY);// | O_NONBLOCK);
-  if (tty->fd < 0) {
-    log_stderr(LOG_ERROR, "Open failed: %s: %s", tty->path, strerror(errno));
-    goto error;
+  if (tcflush(tty->fd, TCIFLUSH)) {
+    log_stderr(LOG_ERROR, "%s: %s", tty->path, strerror(errno));
+    return SS_INIT_ERROR;
   }
 
-  /* save current serial port settings */
-  tcgetattr(tty->fd, tty->tty_ios_old);
+  /* Activate new settings */
+  if (tcsetattr(tty->fd, TCSANOW, tty->tty_ios)) {
+    log_stderr(LOG_ERROR, "%s: %s", tty->path, strerror(errno));
+    return SS_INIT_ERROR;
+  }
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Set the termios settings of the connection from its baud rate
+ *        and mode
+ * \param tty The tty connection to configure
+ */
+static void tty_conn_settings(struct tty_conn *tty) {
 
   /* Configure device */
   int baud;
@@ -134,19 +148,42 @@ int tty_conn_open(struct tty_conn *tty) {
   /* Raw output */
   tty->tty_ios->c_oflag = 0;
   /* Disable all echo */
-  tty->tty_ios->c_lflag = ICANON;
+  if (tty->raw) {
+    /* return data as soon as the first byte arrives */
+    tty->tty_ios->c_lflag = 0;
+    tty->tty_ios->c_cc[VMIN] = 1;
+    tty->tty_ios->c_cc[VTIME] = 0;
+  } else {
+    tty->tty_ios->c_lflag = ICANON;
+  }
+}
 
-  if (tcflush(tty->fd, TCIFLUSH)) {
-    log_stderr(LOG_ERROR, "%s: %s", tty->path, strerror(errno));
+/**
+ * \brief Open a tty connection
+ * \param tty The tty connection to open
+ */
+int tty_conn_open(struct tty_conn *tty) {
+
+  log_stdout(LOG_INFO, "Attempting to open device: %s", tty->path);
+  /*
+     Open modem device for reading and writing and not as controlling tty
+     because we don't want to get killed if linenoise sends CTRL-C.
+     */
+  tty->fd = open(tty->path, O_RDWR | O_NOCTTY);// | O_NONBLOCK);
+  if (tty->fd < 0) {
+    log_stderr(LOG_ERROR, "Open failed: %s: %s", tty->path, strerror(errno));
     goto error;
   }
 
-  /* Activate new settings */
-  if (tcsetattr(tty->fd, TCSANOW, tty->tty_ios)) {
-    log_stderr(LOG_ERROR, "%s: %s", tty->path, strerror(errno));
+  /* save current serial port settings */
+  tcgetattr(tty->fd, tty->tty_ios_old);
+
+  tty_conn_settings(tty);
+  if (tty_conn_apply_settings(tty)) {
     goto error;
   }
 
+  tty->connected = true;
   log_stdout(LOG_INFO, "Device open, success");
 
   return SS_SUCCESS;
@@ -155,25 +192,213 @@ error:
   return SS_INIT_ERROR;
 }
 
+/**
+ * \brief Reopen a tty connection that has gone away, reapplying the termios
+ *        settings of the original connection, or open a device that was
+ *        missing at start.
+ * \param tty The tty connection to reopen
+ */
+int tty_conn_reopen(struct tty_conn *tty) {
+
+  log_stdout(LOG_INFO, "Attempting to reopen device: %s", tty->path);
+
+  tty->fd = open(tty->path, O_RDWR | O_NOCTTY);
+  if (tty->fd < 0) {
+    /* udev may not have set the permissions yet - wait for next event */
+    log_stderr(LOG_WARN, "Reopen failed: %s: %s", tty->path, strerror(errno));
+    tty->fd = -1;
+    return SS_CONTINUE;
+  }
+
+  /* the device was missing at start, it is configured as first opened */
+  if (!tty->tty_ios->c_cflag) {
+    tcgetattr(tty->fd, tty->tty_ios_old);
+    tty_conn_settings(tty);
+  }
+
+  if (tty_conn_apply_settings(tty)) {
+    close(tty->fd);
+    tty->fd = -1;
+    return SS_CONTINUE;
+  }
+
+  /* device is back, stop watching */
+  close(tty->watch_fd);
+  tty->watch_fd = -1;
+  tty->watch_wd = -1;
+  tty->connected = true;
+
+  log_stdout(LOG_INFO, "Device reconnected: %s", tty->path);
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Watch the nearest existing ancestor directory of the device for
+ *        the next name of its path to appear, descending as each
+ *        directory of the path returns, or climbing if the directory
+ *        watched goes away.
+ * \param tty The disconnected tty connection
+ * \return SS_SUCCESS when the device has been reopened, SS_CONTINUE while
+ *         watched, SS_INIT_ERROR if the watch failed
+ */
+static int tty_conn_watch_path(struct tty_conn *tty) {
+
+  char dir[TTY_DEV_STRING_MAX];
+  size_t len;
+  char *sep;
+  int wd;
+
+  while (1) {
+    /* the device may have returned before the watch was in place */
+    if (!access(tty->path, F_OK)) {
+      return tty_conn_reopen(tty);
+    }
+
+    strcpy(dir, tty->path);
+    while (1) {
+      if (!(sep = strrchr(dir, '/'))) {
+        strcpy(dir, ".");
+        tty->watch_name = 0;
+        break;
+      }
+      tty->watch_name = sep - dir + 1;
+      if (sep == dir) {
+        dir[1] = '\0';
+        break;
+      }
+      *sep = '\0';
+      if (!access(dir, F_OK)) {
+        break;
+      }
+    }
+
+    wd = inotify_add_watch(tty->watch_fd, dir,
+        IN_CREATE | IN_ATTRIB | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+    if (wd < 0) {
+      log_stderr(LOG_ERROR, "inotify watch: %s: %s", dir, strerror(errno));
+      return SS_INIT_ERROR;
+    }
+    if (tty->watch_wd >= 0 && tty->watch_wd != wd) {
+      inotify_rm_watch(tty->watch_fd, tty->watch_wd);
+    }
+    tty->watch_wd = wd;
+
+    log_stdout(LOG_INFO, "Waiting for %s to appear in %s", tty->path, dir);
+
+    /* the next directory may have returned before the watch was in place */
+    len = strcspn(tty->path + tty->watch_name, "/");
+    if (!tty->path[tty->watch_name + len]) {
+      return SS_CONTINUE;
+    }
+    memcpy(dir, tty->path, tty->watch_name + len);
+    dir[tty->watch_name + len] = '\0';
+    if (access(dir, F_OK)) {
+      return SS_CONTINUE;
+    }
+  }
+}
+
+/**
+ * \brief Close a tty connection whose device has gone away, or was never
+ *        there, and start watching for it to appear.
+ * \param tty The disconnected tty connection
+ */
+int tty_conn_watch(struct tty_conn *tty) {
+
+  /* device is gone, there are no settings to restore */
+  if (tty->fd >= 0) {
+    close(tty->fd);
+    tty->fd = -1;
+  }
+  tty->connected = false;
+
+  if (tty->watch_fd < 0) {
+    tty->watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (tty->watch_fd < 0) {
+      log_stderr(LOG_ERROR, "inotify init: %s", strerror(errno));
+      return SS_INIT_ERROR;
+    }
+    tty->watch_wd = -1;
+  }
+
+  return tty_conn_watch_path(tty);
+}
+
+/**
+ * \brief Process pending inotify events for a disconnected tty, reopening
+ *        the device if it has reappeared, and moving the watch as the
+ *        directories of its path come and go.
+ * \param tty The disconnected tty connection
+ * \return SS_SUCCESS when the device has been reopened, SS_INIT_ERROR if
+ *         it can no longer be watched, else SS_CONTINUE
+ */
+int tty_conn_watch_event(struct tty_conn *tty) {
+
+  char buf[sizeof(struct inotify_event) + NAME_MAX + 1]
+    __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  const struct inotify_event *ev;
+  const char *name = tty->path + tty->watch_name;
+  size_t name_len = strcspn(name, "/");
+  bool match = false;
+  ssize_t len;
+  char *p;
+
+  while ((len = read(tty->watch_fd, buf, sizeof(buf))) > 0) {
+    for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len) {
+      ev = (const struct inotify_event *)p;
+      if (ev->wd != tty->watch_wd) {
+        continue;
+      }
+      if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+        log_stdout(LOG_DEBUG, "inotify event 0x%x: watched directory gone",
+            ev->mask);
+        match = true;
+      } else if (ev->len && !strncmp(ev->name, name, name_len) &&
+          !ev->name[name_len]) {
+        log_stdout(LOG_DEBUG, "inotify event 0x%x: %s", ev->mask, ev->name);
+        match = true;
+      }
+    }
+  }
+
+  if (match) {
+    return tty_conn_watch_path(tty);
+  }
+
+  return SS_CONTINUE;
+}
+
 /**
  * \brief read() tty connection - assumes data is available, else may block
  * \param tty The tty connection to attempt to read
  * \param buf pointer to a multiple character buffer
  * \param len pointer to the size of the buffer, if successful, size is
- *        updated with the number of bytes read
+ *        updated with the number of bytes read. Upon return, tty->rx_ts
+ *        holds the time at which the data was read.
  */
 int tty_conn_read(struct tty_conn *tty, char *buf, size_t *len) {
   int ret = SS_SUCCESS;
 
-  *len = read(tty->fd, buf, *len);
+  /* leave room for terminator */
+  *len = read(tty->fd, buf, *len - 1);
+  clock_gettime(CLOCK_REALTIME, &tty->rx_ts);
   if ((ssize_t)*len == -1) {// || buf[0] == '\n') {
     if (errno == EINTR || errno == EAGAIN) {
       ret = SS_CONTINUE;
+    } else if (errno == EIO || errno == ENXIO || errno == ENODEV) {
+      /* usb-serial adapter has gone away */
+      *len = 0;
+      ret = SS_TTY_DISCONNECT;
     } else {
       log_stderr(LOG_ERROR, "Read error: %d:%s", errno, strerror(errno));
       ret = SS_READ_ERROR;
     }
 
+  } else if (!*len && access(tty->path, F_OK)) {
+    /* hangup - device node removed */
+    ret = SS_TTY_DISCONNECT;
+
   } else {
     buf[*len] = '\0';
     log_stdout(LOG_DEBUG, "read returned %d bytes:", *len);
@@ -189,13 +414,20 @@ void close_tty_conn(struct tty_conn *tty) {
   if (tty) {
     log_stdout(LOG_INFO, "Closing tty device: %s", tty->path);
 
-    if (tty->fd) {
+    if (tty->fd >= 0) {
       /* Restore old settings */
       tcflush(tty->fd, TCIFLUSH);
       tcsetattr(tty->fd, TCSANOW, tty->tty_ios_old);
       close(tty->fd);
-      tty->fd = 0;
+      tty->fd = -1;
+    }
+
+    if (tty->watch_fd >= 0) {
+      close(tty->watch_fd);
+      tty->watch_fd = -1;
+      tty->watch_wd = -1;
     }
+    tty->connected = false;
   }
   return;
 }
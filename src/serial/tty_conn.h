@@ -24,13 +24,36 @@
  *
  *****************************************************************************/
 
+#include <stdbool.h>
+
 #define TTY_DEV_STRING_MAX      32
 
+/*
+ * \brief Struct to hold a tty connection
+ * \param path The tty device path
+ * \param baud The baud rate of the connection
+ * \param raw When true, the device is read byte-wise rather than per line
+ * \param fd The tty device file descriptor, -1 while closed
+ * \param rx_ts Arrival time (CLOCK_REALTIME) of the last data read
+ * \param connected False when the device has gone away and is being watched
+ * \param watch_fd inotify fd used to wait for the device to reappear
+ * \param watch_wd The watch on the nearest existing ancestor of path
+ * \param watch_name The offset in path of the name awaited in the
+ *        directory watched
+ * \param tty_ios The active termios settings, reapplied upon reconnection
+ * \param tty_ios_old The termios settings to restore upon close
+ */
 struct tty_conn {
   char *path;
   int baud;
+  bool raw;
 
   int fd;
+  struct timespec rx_ts;
+  bool connected;
+  int watch_fd;
+  int watch_wd;
+  size_t watch_name;
 
   struct termios *tty_ios;
   struct termios *tty_ios_old;
@@ -41,6 +64,9 @@ int tty_conn_check_config(struct tty_conn *tty);
 int tty_conn_init(struct tty_conn **tty_p);
 int tty_conn_open(struct tty_conn *tty);
 int tty_conn_read(struct tty_conn *tty, char *buf, size_t *len);
+int tty_conn_watch(struct tty_conn *tty);
+int tty_conn_watch_event(struct tty_conn *tty);
+int tty_conn_reopen(struct tty_conn *tty);
 void close_tty_conn(struct tty_conn *tty);
 void free_tty_conn(struct tty_conn *tty);
 #endif    /* TTY_CONNECTION__H */
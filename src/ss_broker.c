@@ -0,0 +1,777 @@
+/******************************************************************************
+ * File: ss_broker.c
+ * Description: Minimal MQTT 3.1.1 broker for local pipeline testing
+ * Author: Steven Swann - swannonline@googlemail.com
+ *
+ * Copyright (c) swannonline, 2013-2014
+ *
+ * This file is part of sensorspace.
+ *
+ * sensorspace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * sensorspace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with sensorspace.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <getopt.h>
+
+#include "sensorspace.h"
+#include "mqtt_publish.h"
+#include "mqtt_rx.h"
+#include "log.h"
+
+#define BROKER_DEFAULT_IP         "127.0.0.1"
+#define BROKER_BACKLOG            16
+
+/* clients whose unsent output grows beyond this are dropped */
+#define BROKER_OUT_MAX            (16 * 1024 * 1024)
+
+#define MQTT_CONNECT_TYPE         0x10
+#define MQTT_CONNACK_TYPE         0x20
+#define MQTT_SUBSCRIBE_TYPE       0x80
+#define MQTT_SUBACK_TYPE          0x90
+#define MQTT_UNSUBSCRIBE_TYPE     0xa0
+#define MQTT_UNSUBACK_TYPE        0xb0
+#define MQTT_PINGREQ_TYPE         0xc0
+#define MQTT_DISCONNECT_TYPE      0xe0
+
+static int print_usage(void);
+
+static volatile sig_atomic_t stop = 0;
+static volatile sig_atomic_t print_stats = 0;
+
+/*
+ * \brief Struct to hold a connected client
+ * \param fd The client socket
+ * \param rx The client receive buffer
+ * \param out Output waiting to be sent
+ * \param out_len The number of bytes in out
+ * \param out_size The size of out
+ * \param sub The topic filters subscribed to
+ * \param sub_count The number of topic filters
+ * \param connected A CONNECT has been received
+ */
+struct broker_client {
+  int fd;
+  struct mqtt_rx *rx;
+  uint8_t *out;
+  size_t out_len;
+  size_t out_size;
+  char **sub;
+  size_t sub_count;
+  bool connected;
+};
+
+/*
+ * \brief Struct to hold the broker statistics
+ * \param conns The number of connections accepted
+ * \param pub_in The number of PUBLISH packets received
+ * \param pub_out The number of PUBLISH packets delivered
+ * \param bytes_in The number of payload bytes received
+ * \param bytes_out The number of payload bytes delivered
+ */
+struct broker_stats {
+  uint64_t conns;
+  uint64_t pub_in;
+  uint64_t pub_out;
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+};
+
+static void stop_handler(int sig) {
+  (void)sig;
+  stop = 1;
+}
+
+static void stats_handler(int sig) {
+  (void)sig;
+  print_stats = 1;
+}
+
+/*
+ * \brief function to print help
+ */
+static int print_usage() {
+
+  fprintf(stderr,
+      "ss_broker is a minimal MQTT 3.1.1 broker for testing and benchmarking\n"
+      "sensorspace pipelines without an external service. It supports\n"
+      "CONNECT, SUBSCRIBE, UNSUBSCRIBE, PUBLISH at QoS 0 and 1, PINGREQ and\n"
+      "DISCONNECT. Messages are delivered at QoS 0 and are not retained.\n"
+      "Statistics are printed on SIGUSR1 and at exit.\n"
+      "Usage: ss_broker [options]\n"
+      "General options:\n"
+      " -h [--help]              : Displays this help and exits\n"
+      "\n"
+      "Listen options:\n"
+      " -b [--bind] <IP>         : Address to listen on. Default: 127.0.0.1\n"
+      " -p [--port] <port>       : TCP port to listen on, 0 to disable.\n"
+      "                            Default: 1883\n"
+      " -u [--unix] <path>       : Also listen on a Unix domain socket\n"
+      "\n"
+      "\nDebug options:\n"
+      " -v [--verbose] <LEVEL>   : set verbose level to LEVEL\n"
+      "                               Levels are:\n"
+      "                                 SILENT\n"
+      "                                 ERROR\n"
+      "                                 WARN\n"
+      "                                 INFO (default)\n"
+      "                                 DEBUG\n"
+      "                                 DEBUG_THREAD\n"
+      "\n");
+
+  return 0;
+}
+
+/**
+ * \brief Match a topic against a topic filter, which may contain the
+ *        single level '+' and multi level '#' wildcards
+ * \param filter The NULL terminated topic filter
+ * \param topic The topic
+ * \param len The length of the topic
+ */
+static bool topic_match(const char *filter, const char *topic, size_t len) {
+
+  const char *end = topic + len;
+
+  while (*filter) {
+    if (*filter == '#') {
+      return true;
+
+    } else if (*filter == '+') {
+      while (topic < end && *topic != '/') {
+        topic++;
+      }
+      filter++;
+
+    } else {
+      if (topic == end || *filter != *topic) {
+        /* "a/#" also matches the parent level "a" */
+        return topic == end && filter[0] == '/' && filter[1] == '#' &&
+          !filter[2];
+      }
+      filter++;
+      topic++;
+    }
+  }
+
+  return topic == end;
+}
+
+/**
+ * \brief Queue output for a client
+ * \param c The client
+ * \param data The data to queue
+ * \param len The length of the data
+ * \return SS_BUF_FULL if the client is too far behind
+ */
+static int client_queue(struct broker_client *c, const void *data,
+    size_t len) {
+
+  uint8_t *out;
+  size_t size;
+
+  if (c->out_len + len > c->out_size) {
+    if (c->out_len + len > BROKER_OUT_MAX) {
+      log_stderr(LOG_WARN, "Client %d: output backlog full", c->fd);
+      return SS_BUF_FULL;
+    }
+    for (size = c->out_size ? c->out_size : 4096; size < c->out_len + len;
+        size *= 2);
+    if (!(out = realloc(c->out, size))) {
+      log_stderr(LOG_ERROR, "Client output: Out of memory");
+      return SS_OUT_OF_MEM_ERROR;
+    }
+    c->out = out;
+    c->out_size = size;
+  }
+
+  memcpy(c->out + c->out_len, data, len);
+  c->out_len += len;
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Send as much queued output as the socket will take
+ * \param c The client
+ * \return SS_WRITE_ERROR if the connection failed
+ */
+static int client_flush(struct broker_client *c) {
+
+  ssize_t n;
+
+  while (c->out_len) {
+    n = send(c->fd, c->out, c->out_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      log_stderr(LOG_DEBUG, "Client %d: send: %s", c->fd, strerror(errno));
+      return SS_WRITE_ERROR;
+    }
+    memmove(c->out, c->out + n, c->out_len - n);
+    c->out_len -= n;
+  }
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Queue a packet with a two byte packet identifier
+ */
+static int client_queue_ack(struct broker_client *c, uint8_t type,
+    const uint8_t *id) {
+
+  uint8_t pkt[4] = { type, 2, id[0], id[1] };
+
+  return client_queue(c, pkt, sizeof(pkt));
+}
+
+/**
+ * \brief Deliver a PUBLISH to every subscribed client at QoS 0
+ * \param clients The connected clients
+ * \param count The number of clients
+ * \param stats The broker statistics
+ * \param topic The topic
+ * \param topic_len The length of the topic
+ * \param payload The payload
+ * \param len The length of the payload
+ */
+static void broker_deliver(struct broker_client **clients, size_t count,
+    struct broker_stats *stats, const char *topic, size_t topic_len,
+    const uint8_t *payload, size_t len) {
+
+  uint8_t hdr[MQTT_FIXED_HDR_MAX_LEN + 2];
+  size_t i, j, n;
+
+  hdr[0] = MQTT_PUBLISH_TYPE;
+  n = 1 + mqtt_encode_remaining_len(hdr + 1, 2 + topic_len + len);
+  hdr[n++] = topic_len >> 8;
+  hdr[n++] = topic_len & 0xff;
+
+  for (i = 0; i < count; i++) {
+    for (j = 0; j < clients[i]->sub_count; j++) {
+      if (topic_match(clients[i]->sub[j], topic, topic_len)) {
+        break;
+      }
+    }
+    if (j == clients[i]->sub_count) {
+      continue;
+    }
+
+    if (client_queue(clients[i], hdr, n) ||
+        client_queue(clients[i], topic, topic_len) ||
+        client_queue(clients[i], payload, len)) {
+      /* the client is dropped when its output fails */
+      shutdown(clients[i]->fd, SHUT_RDWR);
+      continue;
+    }
+    stats->pub_out++;
+    stats->bytes_out += len;
+  }
+}
+
+/**
+ * \brief Process a SUBSCRIBE or UNSUBSCRIBE packet
+ * \param c The client
+ * \param f The packet
+ * \return SS_READ_ERROR if the packet is malformed
+ */
+static int client_subscribe(struct broker_client *c,
+    const struct mqtt_frame *f) {
+
+  bool sub = MQTT_PKT_TYPE(f->ctrl) == MQTT_SUBSCRIBE_TYPE;
+  uint8_t granted[256];
+  uint8_t hdr[MQTT_FIXED_HDR_MAX_LEN + 2];
+  size_t off = 2, len, count = 0, i, n;
+  char *filter, **subs;
+
+  if (f->len < 2) {
+    return SS_READ_ERROR;
+  }
+
+  while (off + 2 <= f->len) {
+    len = (f->body[off] << 8) | f->body[off + 1];
+    off += 2;
+    if (off + len + sub > f->len || count == sizeof(granted)) {
+      return SS_READ_ERROR;
+    }
+
+    if (sub) {
+      if (!(filter = strndup((const char *)f->body + off, len)) ||
+          !(subs = realloc(c->sub, (c->sub_count + 1) * sizeof(char *)))) {
+        free(filter);
+        return SS_OUT_OF_MEM_ERROR;
+      }
+      c->sub = subs;
+      c->sub[c->sub_count++] = filter;
+      log_stdout(LOG_INFO, "Client %d: subscribed to %s", c->fd, filter);
+
+      /* only QoS 0 delivery is offered */
+      granted[count++] = 0;
+      off++;
+
+    } else {
+      for (i = 0; i < c->sub_count; i++) {
+        if (strlen(c->sub[i]) == len &&
+            !memcmp(c->sub[i], f->body + off, len)) {
+          free(c->sub[i]);
+          c->sub[i] = c->sub[--c->sub_count];
+          break;
+        }
+      }
+    }
+    off += len;
+  }
+
+  if (!sub) {
+    return client_queue_ack(c, MQTT_UNSUBACK_TYPE, f->body);
+  }
+
+  hdr[0] = MQTT_SUBACK_TYPE;
+  n = 1 + mqtt_encode_remaining_len(hdr + 1, 2 + count);
+  hdr[n++] = f->body[0];
+  hdr[n++] = f->body[1];
+
+  if (client_queue(c, hdr, n) || client_queue(c, granted, count)) {
+    return SS_BUF_FULL;
+  }
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Process the packets received from a client
+ * \param clients The connected clients
+ * \param count The number of clients
+ * \param c The client to process
+ * \param stats The broker statistics
+ * \return SS_CONN_ERROR if the client should be disconnected
+ */
+static int client_process(struct broker_client **clients, size_t count,
+    struct broker_client *c, struct broker_stats *stats) {
+
+  static const uint8_t connack[] = { MQTT_CONNACK_TYPE, 2, 0, 0 };
+  static const uint8_t pingresp[] = { MQTT_PINGRESP_TYPE, 0 };
+  struct mqtt_frame f;
+  const uint8_t *payload;
+  const char *topic;
+  size_t topic_len, len;
+  int ret;
+
+  if (mqtt_rx_fill(c->rx, c->fd)) {
+    return SS_CONN_ERROR;
+  }
+
+  while (!(ret = mqtt_rx_next(c->rx, &f))) {
+
+    if (!c->connected && MQTT_PKT_TYPE(f.ctrl) != MQTT_CONNECT_TYPE) {
+      log_stderr(LOG_ERROR, "Client %d: packet before CONNECT", c->fd);
+      return SS_CONN_ERROR;
+    }
+
+    switch (MQTT_PKT_TYPE(f.ctrl)) {
+      case MQTT_CONNECT_TYPE:
+        c->connected = true;
+        ret = client_queue(c, connack, sizeof(connack));
+        break;
+
+      case MQTT_PUBLISH_FRAME_TYPE:
+        if (mqtt_frame_publish(&f, &topic, &topic_len, &payload, &len)) {
+          return SS_CONN_ERROR;
+        }
+        stats->pub_in++;
+        stats->bytes_in += len;
+        ret = SS_SUCCESS;
+        if (f.ctrl & MQTT_PUBLISH_QOS1) {
+          ret = client_queue_ack(c, MQTT_PUBACK_TYPE,
+              (const uint8_t *)topic + topic_len);
+        }
+        broker_deliver(clients, count, stats, topic, topic_len, payload,
+            len);
+        break;
+
+      case MQTT_SUBSCRIBE_TYPE:
+      case MQTT_UNSUBSCRIBE_TYPE:
+        ret = client_subscribe(c, &f);
+        break;
+
+      case MQTT_PINGREQ_TYPE:
+        ret = client_queue(c, pingresp, sizeof(pingresp));
+        break;
+
+      case MQTT_DISCONNECT_TYPE:
+        return SS_CONN_ERROR;
+
+      default:
+        log_stdout(LOG_DEBUG, "Client %d: ignoring packet type 0x%02x",
+            c->fd, f.ctrl);
+        ret = SS_SUCCESS;
+        break;
+    }
+
+    if (ret) {
+      return SS_CONN_ERROR;
+    }
+  }
+
+  return ret == SS_BUF_EMPTY ? SS_SUCCESS : SS_CONN_ERROR;
+}
+
+/**
+ * \brief Free a client, closing its connection
+ */
+static void free_broker_client(struct broker_client *c) {
+
+  size_t i;
+
+  if (c) {
+    if (c->fd >= 0) {
+      close(c->fd);
+    }
+    for (i = 0; i < c->sub_count; i++) {
+      free(c->sub[i]);
+    }
+    free(c->sub);
+    free(c->out);
+    free_mqtt_rx(c->rx);
+    free(c);
+  }
+}
+
+/**
+ * \brief Open a listening TCP socket
+ */
+static int listen_tcp(const char *ip, int port) {
+
+  struct sockaddr_in addr;
+  int fd, one = 1;
+
+  memset(&addr, 0, sizeof(struct sockaddr_in));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  if (inet_pton(AF_INET, ip, &addr.sin_addr) != 1) {
+    log_stderr(LOG_ERROR, "Invalid listen address: %s", ip);
+    return -1;
+  }
+
+  if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+    log_stderr(LOG_ERROR, "socket: %s", strerror(errno));
+    return -1;
+  }
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+      listen(fd, BROKER_BACKLOG)) {
+    log_stderr(LOG_ERROR, "Listening on %s:%d: %s", ip, port,
+        strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/**
+ * \brief Open a listening Unix domain socket
+ */
+static int listen_unix(const char *path) {
+
+  struct sockaddr_un addr;
+  int fd;
+
+  memset(&addr, 0, sizeof(struct sockaddr_un));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    log_stderr(LOG_ERROR, "Socket path too long: %s", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+    log_stderr(LOG_ERROR, "socket: %s", strerror(errno));
+    return -1;
+  }
+
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+      listen(fd, BROKER_BACKLOG)) {
+    log_stderr(LOG_ERROR, "Listening on %s: %s", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/**
+ * \brief Accept a new client
+ * \param clients_p Pointer to the connected clients
+ * \param count The number of clients
+ * \param fd The listening socket
+ * \return SS_SUCCESS if a client was added
+ */
+static int broker_accept(struct broker_client ***clients_p, size_t count,
+    int fd) {
+
+  struct broker_client **clients, *c;
+  int cfd, one = 1;
+
+  if ((cfd = accept(fd, NULL, NULL)) < 0) {
+    log_stderr(LOG_ERROR, "accept: %s", strerror(errno));
+    return SS_CONN_ERROR;
+  }
+  setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  if (!(c = calloc(1, sizeof(struct broker_client)))) {
+    close(cfd);
+    return SS_OUT_OF_MEM_ERROR;
+  }
+  c->fd = cfd;
+
+  if (mqtt_rx_init(&c->rx, 0) ||
+      !(clients = realloc(*clients_p,
+          (count + 1) * sizeof(struct broker_client *)))) {
+    free_broker_client(c);
+    return SS_OUT_OF_MEM_ERROR;
+  }
+
+  clients[count] = c;
+  *clients_p = clients;
+  log_stdout(LOG_INFO, "Client %d: connected", cfd);
+
+  return SS_SUCCESS;
+}
+
+static void broker_print_stats(struct broker_stats *stats, size_t count) {
+
+  fprintf(stdout, "clients: %zu connections: %llu published: %llu "
+      "delivered: %llu bytes in: %llu bytes out: %llu\n", count,
+      (unsigned long long)stats->conns, (unsigned long long)stats->pub_in,
+      (unsigned long long)stats->pub_out, (unsigned long long)stats->bytes_in,
+      (unsigned long long)stats->bytes_out);
+  fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+
+  int ret = SS_SUCCESS;
+  int c, option_index = 0;
+  char bind_ip[16] = BROKER_DEFAULT_IP;
+  int port = MQTT_BROKER_PORT;
+  char *unix_path = NULL;
+  int listen_fd[2] = { -1, -1 };
+  size_t i, count = 0;
+
+  struct broker_client **clients = NULL;
+  struct broker_stats stats;
+  struct pollfd *fds = NULL, *p;
+  struct sigaction sa;
+
+  static struct option long_options[] =
+  {
+    /* These options set a flag. */
+    {"help",   no_argument,             0, 'h'},
+    {"verbose", required_argument,      0, 'v'},
+    {"bind", required_argument,         0, 'b'},
+    {"port", required_argument,         0, 'p'},
+    {"unix", required_argument,         0, 'u'},
+    {0, 0, 0, 0}
+  };
+
+  /* get arguments */
+  while (1)
+  {
+    if ((c = getopt_long(argc, argv, "hv:b:p:u:", long_options,
+            &option_index)) != -1) {
+
+      switch (c) {
+        case 'h':
+          return print_usage();
+
+        case 'v':
+          /* set log level */
+          if (optarg) {
+            set_log_level_str(optarg);
+          }
+          break;
+
+        case 'b':
+          /* change the listen address */
+          if (optarg) {
+            strncpy(bind_ip, optarg, sizeof(bind_ip) - 1);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The bind flag should be followed by an IP address");
+            return print_usage();
+          }
+          break;
+
+        case 'p':
+          /* change the listen port */
+          if (optarg) {
+            port = atoi(optarg);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The port flag should be followed by a port");
+            return print_usage();
+          }
+          break;
+
+        case 'u':
+          /* listen on a Unix domain socket */
+          if (optarg) {
+            unix_path = optarg;
+          } else {
+            log_stderr(LOG_ERROR,
+                "The unix flag should be followed by a socket path");
+            return print_usage();
+          }
+          break;
+
+        default:
+          return print_usage();
+      }
+    } else {
+      /* Final arguement */
+      break;
+    }
+  }
+
+  if (!port && !unix_path) {
+    log_stderr(LOG_ERROR, "No TCP port or Unix socket to listen on");
+    return print_usage();
+  }
+
+  if ((port && (listen_fd[0] = listen_tcp(bind_ip, port)) < 0) ||
+      (unix_path && (listen_fd[1] = listen_unix(unix_path)) < 0)) {
+    ret = SS_INIT_ERROR;
+    goto free;
+  }
+
+  memset(&stats, 0, sizeof(struct broker_stats));
+
+  memset(&sa, 0, sizeof(struct sigaction));
+  sigemptyset(&sa.sa_mask);
+  sa.sa_handler = stop_handler;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  sa.sa_handler = stats_handler;
+  sigaction(SIGUSR1, &sa, NULL);
+
+  log_stdout(LOG_INFO, "Listening on %s:%d%s%s", bind_ip, port,
+      unix_path ? " and " : "", unix_path ? unix_path : "");
+
+  while (!stop) {
+
+    if (print_stats) {
+      print_stats = 0;
+      broker_print_stats(&stats, count);
+    }
+
+    /* listening sockets first, followed by one entry per client */
+    if (!(p = realloc(fds, (count + 2) * sizeof(struct pollfd)))) {
+      log_stderr(LOG_ERROR, "Out of memory");
+      ret = SS_OUT_OF_MEM_ERROR;
+      goto free;
+    }
+    fds = p;
+
+    for (i = 0; i < 2; i++) {
+      fds[i].fd = listen_fd[i];
+      fds[i].events = POLLIN;
+    }
+    for (i = 0; i < count; i++) {
+      fds[i + 2].fd = clients[i]->fd;
+      fds[i + 2].events = POLLIN | (clients[i]->out_len ? POLLOUT : 0);
+      fds[i + 2].revents = 0;
+    }
+
+    if (poll(fds, count + 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      log_stderr(LOG_ERROR, "poll: %s", strerror(errno));
+      ret = SS_SELECT_ERROR;
+      goto free;
+    }
+
+    /* process input, queueing deliveries to any client */
+    for (i = 0; i < count; i++) {
+      if (fds[i + 2].revents & (POLLIN | POLLERR | POLLHUP) &&
+          client_process(clients, count, clients[i], &stats)) {
+        shutdown(clients[i]->fd, SHUT_RDWR);
+        close(clients[i]->fd);
+        clients[i]->fd = -1;
+      }
+    }
+
+    /* send queued output and drop closed clients */
+    for (i = 0; i < count; ) {
+      if (clients[i]->fd >= 0 && client_flush(clients[i])) {
+        close(clients[i]->fd);
+        clients[i]->fd = -1;
+      }
+      if (clients[i]->fd < 0) {
+        log_stdout(LOG_INFO, "Client disconnected");
+        free_broker_client(clients[i]);
+        clients[i] = clients[--count];
+        fds[i + 2] = fds[count + 2];
+        continue;
+      }
+      i++;
+    }
+
+    for (i = 0; i < 2; i++) {
+      if (fds[i].revents & POLLIN &&
+          !broker_accept(&clients, count, listen_fd[i])) {
+        count++;
+        stats.conns++;
+      }
+    }
+  }
+
+  broker_print_stats(&stats, count);
+
+free:
+  for (i = 0; i < count; i++) {
+    free_broker_client(clients[i]);
+  }
+  free(clients);
+  free(fds);
+  for (i = 0; i < 2; i++) {
+    if (listen_fd[i] >= 0) {
+      close(listen_fd[i]);
+    }
+  }
+  if (unix_path) {
+    unlink(unix_path);
+  }
+  return ret;
+}
@@ -0,0 +1,189 @@
+/******************************************************************************
+ * File: ss_hist.c
+ * Description: log-linear latency histogram with HDR style reporting
+ * Author: Steven Swann - swannonline@googlemail.com
+ *
+ * Copyright (c) swannonline, 2013-2014
+ *
+ * This file is part of sensorspace.
+ *
+ * sensorspace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * sensorspace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with sensorspace.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+#include <string.h>
+#include <stdint.h>
+
+#include "ss_hist.h"
+
+/**
+ * \brief Reset a histogram
+ */
+void ss_hist_reset(struct ss_hist *h) {
+
+  memset(h, 0, sizeof(struct ss_hist));
+  h->min = UINT64_MAX;
+
+  return;
+}
+
+/**
+ * \brief Get the bucket a value is recorded in
+ */
+static unsigned ss_hist_index(uint64_t value) {
+
+  unsigned shift;
+
+  if (value < SS_HIST_SUB_COUNT) {
+    return value;
+  }
+
+  /* shift the value down to the top half of the sub-buckets */
+  shift = 63 - __builtin_clzll(value) - (SS_HIST_SUB_BITS - 1);
+  if (shift > SS_HIST_MAX_SHIFT) {
+    return SS_HIST_BUCKETS - 1;
+  }
+
+  return SS_HIST_SUB_COUNT + (shift - 1) * SS_HIST_HALF_COUNT +
+    ((value >> shift) - SS_HIST_HALF_COUNT);
+}
+
+/**
+ * \brief Get the highest value recorded in a bucket
+ */
+static uint64_t ss_hist_value(unsigned idx) {
+
+  unsigned shift;
+  uint64_t sub;
+
+  if (idx < SS_HIST_SUB_COUNT) {
+    return idx;
+  }
+
+  idx -= SS_HIST_SUB_COUNT;
+  shift = idx / SS_HIST_HALF_COUNT + 1;
+  sub = idx % SS_HIST_HALF_COUNT + SS_HIST_HALF_COUNT;
+
+  return ((sub + 1) << shift) - 1;
+}
+
+/**
+ * \brief Record a value in a histogram
+ */
+void ss_hist_record(struct ss_hist *h, uint64_t value) {
+
+  h->counts[ss_hist_index(value)]++;
+  h->total++;
+  h->sum += value;
+
+  if (value < h->min) {
+    h->min = value;
+  }
+  if (value > h->max) {
+    h->max = value;
+  }
+
+  return;
+}
+
+/**
+ * \brief Get the value at a percentile
+ * \param h The histogram
+ * \param percentile The percentile, 0 to 100
+ * \return The value below which the percentile of values fall, to within
+ *         the bucket precision
+ */
+uint64_t ss_hist_percentile(struct ss_hist *h, double percentile) {
+
+  uint64_t target, count = 0;
+  unsigned i;
+
+  if (!h->total) {
+    return 0;
+  }
+
+  target = (uint64_t)(percentile / 100.0 * h->total + 0.5);
+  if (target < 1) {
+    target = 1;
+  }
+
+  for (i = 0; i < SS_HIST_BUCKETS; i++) {
+    count += h->counts[i];
+    if (count >= target) {
+      return ss_hist_value(i) < h->max ? ss_hist_value(i) : h->max;
+    }
+  }
+
+  return h->max;
+}
+
+/**
+ * \brief Get the number of values recorded up to a value's bucket
+ */
+static uint64_t ss_hist_count_to(struct ss_hist *h, uint64_t value) {
+
+  unsigned i, last = ss_hist_index(value);
+  uint64_t count = 0;
+
+  for (i = 0; i <= last; i++) {
+    count += h->counts[i];
+  }
+
+  return count;
+}
+
+/**
+ * \brief Print the percentile distribution of a histogram followed by a
+ *        summary, in the form used by HdrHistogram. Percentiles are
+ *        reported at ticks that halve the remaining distance to 100%.
+ * \param h The histogram
+ * \param stream The stream to print to
+ * \param unit The unit name of the printed values
+ * \param scale The recorded values are divided by scale when printed
+ */
+void ss_hist_print(struct ss_hist *h, FILE *stream, const char *unit,
+    double scale) {
+
+  double percentile, remaining;
+  uint64_t value;
+
+  fprintf(stream, "%12s %14s %12s %16s\n\n", unit, "Percentile",
+      "TotalCount", "1/(1-Percentile)");
+
+  if (!h->total) {
+    return;
+  }
+
+  for (remaining = 100.0; remaining * h->total >= 100.0; remaining /= 2) {
+    percentile = 100.0 - remaining;
+    value = ss_hist_percentile(h, percentile);
+    fprintf(stream, "%12.3f %14.6f %12llu %16.2f\n", value / scale,
+        percentile / 100.0, (unsigned long long)ss_hist_count_to(h, value),
+        100.0 / remaining);
+  }
+
+  fprintf(stream, "%12.3f %14.6f %12llu\n", h->max / scale, 1.0,
+      (unsigned long long)h->total);
+
+  fprintf(stream, "#[Mean    = %12.3f, Max         = %12.3f]\n",
+      h->sum / h->total / scale, h->max / scale);
+  fprintf(stream, "#[Min     = %12.3f, Total count = %12llu]\n",
+      h->min / scale, (unsigned long long)h->total);
+  fprintf(stream, "#[p50     = %12.3f, p99         = %12.3f]\n",
+      ss_hist_percentile(h, 50.0) / scale,
+      ss_hist_percentile(h, 99.0) / scale);
+  fprintf(stream, "#[p999    = %12.3f]\n",
+      ss_hist_percentile(h, 99.9) / scale);
+
+  return;
+}
@@ -0,0 +1,60 @@
+#ifndef SS_HIST__H
+#define SS_HIST__H
+/******************************************************************************
+ * File: ss_hist.h
+ * Description: log-linear latency histogram with HDR style reporting
+ * Author: Steven Swann - swannonline@googlemail.com
+ *
+ * Copyright (c) swannonline, 2013-2014
+ *
+ * This file is part of sensorspace.
+ *
+ * sensorspace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * sensorspace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with sensorspace.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+#include <stdio.h>
+#include <stdint.h>
+
+/* values below 2^SS_HIST_SUB_BITS are recorded exactly, larger values
+ * to within 1 part in 2^(SS_HIST_SUB_BITS - 1) */
+#define SS_HIST_SUB_BITS        7
+#define SS_HIST_SUB_COUNT       (1 << SS_HIST_SUB_BITS)
+#define SS_HIST_HALF_COUNT      (SS_HIST_SUB_COUNT / 2)
+#define SS_HIST_MAX_SHIFT       40
+#define SS_HIST_BUCKETS         \
+  (SS_HIST_SUB_COUNT + SS_HIST_MAX_SHIFT * SS_HIST_HALF_COUNT)
+
+/*
+ * \brief Struct to hold a histogram of recorded values
+ * \param counts The number of values recorded in each bucket
+ * \param total The number of values recorded
+ * \param min The smallest value recorded
+ * \param max The largest value recorded
+ * \param sum The sum of the values recorded
+ */
+struct ss_hist {
+  uint64_t counts[SS_HIST_BUCKETS];
+  uint64_t total;
+  uint64_t min;
+  uint64_t max;
+  double sum;
+};
+
+void ss_hist_reset(struct ss_hist *h);
+void ss_hist_record(struct ss_hist *h, uint64_t value);
+uint64_t ss_hist_percentile(struct ss_hist *h, double percentile);
+void ss_hist_print(struct ss_hist *h, FILE *stream, const char *unit,
+    double scale);
+
+#endif        /* SS_HIST__H */
@@ -0,0 +1,670 @@
+/******************************************************************************
+ * File: ss_loadgen.c
+ * Description: MQTT load generator reporting end-to-end reading latency
+ * Author: Steven Swann - swannonline@googlemail.com
+ *
+ * Copyright (c) swannonline, 2013-2014
+ *
+ * This file is part of sensorspace.
+ *
+ * sensorspace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * sensorspace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with sensorspace.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/select.h>
+
+#include <getopt.h>
+
+#include "uMQTT.h"
+#include "uMQTT_linux_client.h"
+
+#include "sensorspace.h"
+#include "reading.h"
+#include "mqtt_publish.h"
+#include "mqtt_out.h"
+#include "mqtt_qos.h"
+#include "mqtt_rx.h"
+#include "ss_hist.h"
+#include "log.h"
+
+#define LOADGEN_DEFAULT_TOPIC     "sensorspace/loadgen"
+#define LOADGEN_DEFAULT_DEVICES   10
+#define LOADGEN_DEFAULT_SENSORS   4
+#define LOADGEN_DEFAULT_RATE      1000
+#define LOADGEN_DEFAULT_DURATION  10
+
+/* readings published per loop before servicing the sockets */
+#define LOADGEN_BURST_MAX         256
+/* time allowed for outstanding readings to arrive once publishing stops */
+#define LOADGEN_DRAIN_MS          2000
+#define LOADGEN_MAX_WAIT_US       100000
+
+#define MAX_TOPIC_LEN             1024
+#define MAX_MSG_LEN               2048
+
+static int print_usage(void);
+
+static volatile sig_atomic_t stop = 0;
+
+static void stop_handler(int sig) {
+  (void)sig;
+  stop = 1;
+}
+
+/*
+ * \brief function to print help
+ */
+static int print_usage() {
+
+  fprintf(stderr,
+      "ss_loadgen publishes readings for a number of simulated devices at\n"
+      "a target rate, subscribes to them and reports the throughput and\n"
+      "end-to-end latency seen. Each reading carries its publish time.\n"
+      "Usage: ss_loadgen [options]\n"
+      "General options:\n"
+      " -h [--help]              : Displays this help and exits\n"
+      "\n"
+      "Load options:\n"
+      " -n [--devices] <N>       : Number of simulated devices. Default: 10\n"
+      " -m [--sensors] <M>       : Sensors per device. Default: 4\n"
+      " -r [--rate] <readings/s> : Aggregate publish rate. Default: 1000\n"
+      " -d [--duration] <s>      : Time to publish for. Default: 10\n"
+      " -t [--topic] <topic>     : Topic prefix, readings are published to\n"
+      "                            <topic>/<device_id>\n"
+      "                            Default: 'sensorspace/loadgen'\n"
+      " -Q [--qos] <0|1>         : Publish QoS level. Default: 0\n"
+      " -W [--window] <n>        : Maximum unacknowledged QoS 1 packets\n"
+      "                            Default: 64\n"
+      "\n"
+      "Broker options:\n"
+      " -b [--broker] <broker-IP>: Change the default broker IP - only IP\n"
+      "                            addresses are currently supported.\n"
+      "                            Default: localhost\n"
+      " -p [--port] <port>       : Change the default port. Default: 1883\n"
+      "\n"
+      "\nDebug options:\n"
+      " -v [--verbose] <LEVEL>   : set verbose level to LEVEL\n"
+      "                               Levels are:\n"
+      "                                 SILENT\n"
+      "                                 ERROR\n"
+      "                                 WARN\n"
+      "                                 INFO (default)\n"
+      "                                 DEBUG\n"
+      "                                 DEBUG_THREAD\n"
+      "\n");
+
+  return 0;
+}
+
+/**
+ * \brief Connect to the broker
+ * \param conn_p Pointer to the connection to be returned
+ * \param ip The broker IP address
+ * \param port The broker port
+ * \param clientid The client identifier
+ */
+static int loadgen_connect(struct broker_conn **conn_p, char *ip, int port,
+    const char *clientid) {
+
+  struct broker_conn *conn;
+
+  init_linux_socket_connection(&conn, ip, strlen(ip) + 1, port);
+  if (!conn) {
+    log_stderr(LOG_ERROR, "Initialising socket connection");
+    return SS_CONN_ERROR;
+  }
+
+  broker_set_clientid(conn, clientid, strlen(clientid) + 1);
+
+  if (broker_connect(conn)) {
+    log_stderr(LOG_ERROR, "Connecting to broker %s:%d", ip, port);
+    free_connection(conn);
+    return SS_CONN_ERROR;
+  }
+
+  *conn_p = conn;
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Get the nanoseconds elapsed between two times
+ */
+static int64_t elapsed_ns(const struct timespec *from,
+    const struct timespec *to) {
+
+  return (int64_t)(to->tv_sec - from->tv_sec) * 1000000000LL +
+    (to->tv_nsec - from->tv_nsec);
+}
+
+/**
+ * \brief Record the latency of each reading in a received payload
+ * \param h The latency histogram, in microseconds
+ * \param r A reading used for decoding
+ * \param payload The payload, one or more JSON readings separated by '\n'
+ * \param len The length of the payload
+ * \return The number of readings received
+ */
+static unsigned record_latency(struct ss_hist *h, struct reading *r,
+    const uint8_t *payload, size_t len) {
+
+  const uint8_t *line, *end = payload + len, *nl;
+  struct timespec now;
+  unsigned count = 0;
+  size_t line_len;
+  int64_t ns;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  for (line = payload; line < end; line = nl + 1) {
+    if (!(nl = memchr(line, '\n', end - line))) {
+      nl = end;
+    }
+
+    line_len = nl - line;
+    if (!line_len) {
+      continue;
+    }
+
+    free_measurements(r);
+    memset(&r->ts, 0, sizeof(struct timespec));
+    if (convert_json_reading(r, (const char *)line, line_len) ||
+        !r->ts.tv_sec) {
+      log_stderr(LOG_WARN, "Received reading without a timestamp");
+      continue;
+    }
+
+    ns = elapsed_ns(&r->ts, &now);
+    ss_hist_record(h, ns > 0 ? ns / 1000 : 0);
+    count++;
+  }
+
+  return count;
+}
+
+/**
+ * \brief Read packets from the subscriber connection, recording the
+ *        latency of the readings received
+ * \return SS_CONN_ERROR if the connection failed
+ */
+static int read_subscriber(int fd, struct mqtt_rx *rx, struct ss_hist *h,
+    struct reading *r, uint64_t *received) {
+
+  struct mqtt_frame frame;
+  const uint8_t *payload;
+  const char *topic;
+  size_t topic_len, len;
+  int ret;
+
+  if (mqtt_rx_fill(rx, fd)) {
+    return SS_CONN_ERROR;
+  }
+
+  while (!(ret = mqtt_rx_next(rx, &frame))) {
+    if (!mqtt_frame_publish(&frame, &topic, &topic_len, &payload, &len)) {
+      *received += record_latency(h, r, payload, len);
+    }
+  }
+
+  return ret == SS_BUF_EMPTY ? SS_SUCCESS : SS_CONN_ERROR;
+}
+
+/**
+ * \brief Read packets from the publisher connection, passing PUBACKs to
+ *        the QoS 1 publisher
+ * \return SS_CONN_ERROR if the connection failed
+ */
+static int read_publisher(int fd, struct mqtt_rx *rx, struct mqtt_qos *q) {
+
+  struct mqtt_frame frame;
+  int ret;
+
+  if (mqtt_rx_fill(rx, fd)) {
+    return SS_CONN_ERROR;
+  }
+
+  while (!(ret = mqtt_rx_next(rx, &frame))) {
+    if (q) {
+      mqtt_qos_handle(q, &frame);
+    }
+  }
+
+  return ret == SS_BUF_EMPTY ? SS_SUCCESS : SS_CONN_ERROR;
+}
+
+int main(int argc, char **argv) {
+
+  int ret;
+  int c, option_index = 0;
+  char topic[MAX_TOPIC_LEN] = LOADGEN_DEFAULT_TOPIC;
+  char sub_topic[MAX_TOPIC_LEN + 2];
+  char dev_topic[MAX_TOPIC_LEN + 16];
+  char broker_ip[16] = MQTT_BROKER_IP;
+  int broker_port = MQTT_BROKER_PORT;
+  char clientid[UMQTT_CLIENTID_MAX_LEN];
+  char msg[MAX_MSG_LEN];
+  size_t len;
+  unsigned devices = LOADGEN_DEFAULT_DEVICES;
+  unsigned sensors = LOADGEN_DEFAULT_SENSORS;
+  unsigned rate = LOADGEN_DEFAULT_RATE;
+  unsigned duration = LOADGEN_DEFAULT_DURATION;
+  uint8_t qos = 0;
+  unsigned window = 0;
+  unsigned i, dev, burst;
+
+  struct broker_conn *pub = NULL, *sub = NULL;
+  struct linux_broker_socket *pub_skt, *sub_skt;
+  struct mqtt_out *out = NULL;
+  struct mqtt_pub_tmpl **tmpl = NULL;
+  struct mqtt_rx *pub_rx = NULL, *sub_rx = NULL;
+  struct mqtt_qos *q = NULL;
+  struct reading *r = NULL, *rx_r = NULL;
+  static struct ss_hist hist;
+
+  struct timespec start, now, drain_start, last_report;
+  uint64_t sent = 0, received = 0, last_sent = 0, last_received = 0;
+  int64_t ns, wait_us;
+  bool draining = false;
+  bool full = false;
+  struct timeval timeout;
+  fd_set read_fds, write_fds;
+  struct sigaction sa;
+  int nfds;
+  double secs;
+
+  static struct option long_options[] =
+  {
+    /* These options set a flag. */
+    {"help",   no_argument,             0, 'h'},
+    {"verbose", required_argument,      0, 'v'},
+    {"devices", required_argument,      0, 'n'},
+    {"sensors", required_argument,      0, 'm'},
+    {"rate", required_argument,         0, 'r'},
+    {"duration", required_argument,     0, 'd'},
+    {"topic", required_argument,        0, 't'},
+    {"qos", required_argument,          0, 'Q'},
+    {"window", required_argument,       0, 'W'},
+    {"broker", required_argument,       0, 'b'},
+    {"port", required_argument,         0, 'p'},
+    {0, 0, 0, 0}
+  };
+
+  /* get arguments */
+  while (1)
+  {
+    if ((c = getopt_long(argc, argv, "hv:n:m:r:d:t:Q:W:b:p:", long_options,
+            &option_index)) != -1) {
+
+      switch (c) {
+        case 'h':
+          return print_usage();
+
+        case 'v':
+          /* set log level */
+          if (optarg) {
+            set_log_level_str(optarg);
+          }
+          break;
+
+        case 'n':
+          /* set device count */
+          if (optarg && atoi(optarg) > 0) {
+            devices = atoi(optarg);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The devices flag should be followed by a device count");
+            return print_usage();
+          }
+          break;
+
+        case 'm':
+          /* set sensors per device */
+          if (optarg && atoi(optarg) > 0 && atoi(optarg) <= READ_MEAS_COUNT) {
+            sensors = atoi(optarg);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The sensors flag should be followed by a sensor count");
+            return print_usage();
+          }
+          break;
+
+        case 'r':
+          /* set publish rate */
+          if (optarg && atoi(optarg) > 0) {
+            rate = atoi(optarg);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The rate flag should be followed by readings per second");
+            return print_usage();
+          }
+          break;
+
+        case 'd':
+          /* set duration */
+          if (optarg && atoi(optarg) > 0) {
+            duration = atoi(optarg);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The duration flag should be followed by a time in seconds");
+            return print_usage();
+          }
+          break;
+
+        case 't':
+          /* Set topic prefix */
+          if (optarg) {
+            strncpy(topic, optarg, sizeof(topic) - 1);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The topic flag should be followed by a topic");
+            return print_usage();
+          }
+          break;
+
+        case 'Q':
+          /* set publish QoS */
+          if (optarg && (atoi(optarg) == 0 || atoi(optarg) == 1)) {
+            qos = atoi(optarg);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The qos flag should be followed by 0 or 1");
+            return print_usage();
+          }
+          break;
+
+        case 'W':
+          /* set QoS 1 in-flight window */
+          if (optarg) {
+            window = atoi(optarg);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The window flag should be followed by a packet count");
+            return print_usage();
+          }
+          break;
+
+        case 'b':
+          /* change the default broker ip */
+          if (optarg) {
+            strncpy(broker_ip, optarg, sizeof(broker_ip) - 1);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The broker flag should be followed by an IP address");
+            return print_usage();
+          }
+          break;
+
+        case 'p':
+          /* change the default port */
+          if (optarg) {
+            broker_port = atoi(optarg);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The port flag should be followed by a port");
+            return print_usage();
+          }
+          break;
+
+        default:
+          return print_usage();
+      }
+    } else {
+      /* Final arguement */
+      break;
+    }
+  }
+
+  /* reading used to build each published reading */
+  if (reading_init(&r) || reading_init(&rx_r)) {
+    ret = SS_OUT_OF_MEM_ERROR;
+    goto free;
+  }
+  for (i = 0; i < sensors; i++) {
+    if (measurement_init(r)) {
+      ret = SS_OUT_OF_MEM_ERROR;
+      goto free;
+    }
+    r->meas[i]->sensor_id = i + 1;
+  }
+
+  /* one pre-encoded topic per device */
+  if (!(tmpl = calloc(devices, sizeof(struct mqtt_pub_tmpl *)))) {
+    log_stderr(LOG_ERROR, "Out of memory");
+    ret = SS_OUT_OF_MEM_ERROR;
+    goto free;
+  }
+  for (dev = 0; dev < devices; dev++) {
+    snprintf(dev_topic, sizeof(dev_topic), "%s/%u", topic, dev + 1);
+    ret = mqtt_pub_tmpl_init(&tmpl[dev], dev_topic, 0);
+    if (ret) {
+      goto free;
+    }
+  }
+
+  /* the subscriber is connected first so that no reading is missed */
+  snprintf(clientid, sizeof(clientid), "ss_lg_%d_sub", (int)getpid());
+  ret = loadgen_connect(&sub, broker_ip, broker_port, clientid);
+  if (ret) {
+    goto free;
+  }
+
+  snprintf(sub_topic, sizeof(sub_topic), "%s/#", topic);
+  if ((ret = broker_subscribe(sub, sub_topic, strlen(sub_topic)))) {
+    log_stderr(LOG_ERROR, "Subscribing to topic %s.", sub_topic);
+    goto free;
+  }
+
+  snprintf(clientid, sizeof(clientid), "ss_lg_%d_pub", (int)getpid());
+  ret = loadgen_connect(&pub, broker_ip, broker_port, clientid);
+  if (ret) {
+    goto free;
+  }
+
+  pub_skt = (struct linux_broker_socket *)pub->context;
+  sub_skt = (struct linux_broker_socket *)sub->context;
+
+  /* readings are queued and written as the socket allows */
+  if ((ret = mqtt_out_init(&out, 0, 0)) ||
+      (ret = mqtt_out_attach(out, pub_skt->sockfd))) {
+    goto free;
+  }
+
+  if (mqtt_rx_init(&pub_rx, 0) || mqtt_rx_init(&sub_rx, 0)) {
+    ret = SS_OUT_OF_MEM_ERROR;
+    goto free;
+  }
+
+  if (qos && (ret = mqtt_qos_init(&q, out, window, 0))) {
+    goto free;
+  }
+
+  memset(&sa, 0, sizeof(struct sigaction));
+  sa.sa_handler = stop_handler;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  ss_hist_reset(&hist);
+
+  log_stdout(LOG_INFO, "Publishing %u readings/s from %u devices with %u "
+      "sensors for %us", rate, devices, sensors, duration);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  last_report = start;
+
+  while (1) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ns = elapsed_ns(&start, &now);
+
+    if (stop || ns >= (int64_t)duration * 1000000000LL) {
+      /* stop publishing and wait for outstanding readings */
+      if (!draining) {
+        draining = true;
+        drain_start = now;
+      }
+      if (received >= sent ||
+          elapsed_ns(&drain_start, &now) >= LOADGEN_DRAIN_MS * 1000000LL) {
+        break;
+      }
+      wait_us = LOADGEN_MAX_WAIT_US;
+
+    } else {
+      /* publish the readings due by now */
+      full = false;
+      for (burst = 0; burst < LOADGEN_BURST_MAX &&
+          sent < (uint64_t)(ns / 1000 * rate / 1000000); burst++) {
+
+        dev = sent % devices;
+        r->device_id = dev + 1;
+        for (i = 0; i < sensors; i++) {
+          snprintf(r->meas[i]->meas, READ_MEAS_LEN, "%llu",
+              (unsigned long long)sent);
+        }
+        clock_gettime(CLOCK_REALTIME, &r->ts);
+        localtime_r(&r->ts.tv_sec, &r->t);
+
+        len = MAX_MSG_LEN;
+        if (convert_reading_json(r, msg, &len)) {
+          ret = SS_READING_ERROR;
+          goto free;
+        }
+
+        if (q) {
+          ret = mqtt_qos_publish(q, tmpl[dev], (uint8_t *)msg, strlen(msg));
+        } else {
+          ret = mqtt_publish(out, tmpl[dev], (uint8_t *)msg, strlen(msg));
+        }
+        if (ret == SS_BUF_FULL) {
+          /* window or output buffer full, resume once a PUBACK arrives
+           * or the socket drains */
+          full = true;
+          break;
+        }
+        /* QoS 1 packets that failed to send are retransmitted */
+        if (ret && (!q || ret != SS_WRITE_ERROR)) {
+          log_stderr(LOG_ERROR, "Publishing failed");
+          goto free;
+        }
+        sent++;
+      }
+
+      /* time until the next reading is due */
+      wait_us = (int64_t)(sent + 1) * 1000000 / rate - ns / 1000;
+      if (full) {
+        wait_us = LOADGEN_MAX_WAIT_US;
+      } else if (wait_us < 0 || burst == LOADGEN_BURST_MAX) {
+        wait_us = 0;
+      } else if (wait_us > LOADGEN_MAX_WAIT_US) {
+        wait_us = LOADGEN_MAX_WAIT_US;
+      }
+    }
+
+    if (q && mqtt_qos_timeout(q) >= 0 &&
+        mqtt_qos_timeout(q) * 1000LL < wait_us) {
+      wait_us = mqtt_qos_timeout(q) * 1000LL;
+    }
+
+    FD_ZERO(&read_fds);
+    FD_ZERO(&write_fds);
+    if ((ret = mqtt_out_flush(out)) == SS_CONTINUE) {
+      FD_SET(pub_skt->sockfd, &write_fds);
+    } else if (ret) {
+      log_stderr(LOG_ERROR, "Lost publisher connection");
+      ret = SS_CONN_ERROR;
+      goto free;
+    }
+    FD_SET(pub_skt->sockfd, &read_fds);
+    FD_SET(sub_skt->sockfd, &read_fds);
+    nfds = ((pub_skt->sockfd > sub_skt->sockfd) ?
+        pub_skt->sockfd : sub_skt->sockfd) + 1;
+    timeout.tv_sec = wait_us / 1000000;
+    timeout.tv_usec = wait_us % 1000000;
+
+    ret = select(nfds, &read_fds, &write_fds, NULL, &timeout);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      log_stderr(LOG_ERROR, "Select failed: %s", strerror(errno));
+      goto free;
+    }
+
+    if (ret && FD_ISSET(sub_skt->sockfd, &read_fds) &&
+        read_subscriber(sub_skt->sockfd, sub_rx, &hist, rx_r, &received)) {
+      log_stderr(LOG_ERROR, "Lost subscriber connection");
+      ret = SS_CONN_ERROR;
+      goto free;
+    }
+
+    if (ret && FD_ISSET(pub_skt->sockfd, &read_fds) &&
+        read_publisher(pub_skt->sockfd, pub_rx, q)) {
+      log_stderr(LOG_ERROR, "Lost publisher connection");
+      ret = SS_CONN_ERROR;
+      goto free;
+    }
+
+    mqtt_qos_retransmit(q);
+
+    /* progress report */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (elapsed_ns(&last_report, &now) >= 1000000000LL) {
+      secs = elapsed_ns(&last_report, &now) / 1e9;
+      log_stdout(LOG_INFO, "sent %.0f/s received %.0f/s p99 %.3fms",
+          (sent - last_sent) / secs, (received - last_received) / secs,
+          ss_hist_percentile(&hist, 99.0) / 1000.0);
+      last_report = now;
+      last_sent = sent;
+      last_received = received;
+    }
+  }
+
+  secs = elapsed_ns(&start, &now) / 1e9;
+  fprintf(stdout, "\nsent: %llu received: %llu lost: %llu in %.3fs\n",
+      (unsigned long long)sent, (unsigned long long)received,
+      (unsigned long long)(sent > received ? sent - received : 0), secs);
+  fprintf(stdout, "throughput: %.0f readings/s sent, %.0f readings/s "
+      "received\n\n", sent / secs, received / secs);
+  ss_hist_print(&hist, stdout, "Latency(ms)", 1000.0);
+
+  ret = SS_SUCCESS;
+
+free:
+  if (sub) {
+    broker_disconnect(sub);
+    free_connection(sub);
+  }
+  if (pub) {
+    mqtt_out_sync(out, LOADGEN_DRAIN_MS);
+    free_mqtt_out(out);
+    broker_disconnect(pub);
+    free_connection(pub);
+  }
+  free_mqtt_qos(q);
+  free_mqtt_rx(pub_rx);
+  free_mqtt_rx(sub_rx);
+  for (dev = 0; tmpl && dev < devices; dev++) {
+    free_mqtt_pub_tmpl(tmpl[dev]);
+  }
+  free(tmpl);
+  free_reading(r);
+  free_reading(rx_r);
+  return ret;
+}
@@ -0,0 +1,377 @@
+/******************************************************************************
+ * File: ss_query.c
+ * Description: range queries and export of the native time-series store
+ * Author: Steven Swann - swannonline@googlemail.com
+ *
+ * Copyright (c) swannonline, 2013-2014
+ *
+ * This file is part of sensorspace.
+ *
+ * sensorspace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * sensorspace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with sensorspace.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include <getopt.h>
+
+#include "sensorspace.h"
+#include "reading.h"
+#include "tsdb.h"
+#include "log.h"
+
+#define QUERY_DEFAULT_RANGE_S   86400
+#define QUERY_DEFAULT_NAME      "value"
+#define QUERY_MSG_LEN           1024
+
+/*
+ * \brief The output formats
+ */
+typedef enum {
+  QUERY_JSON,
+  QUERY_CSV,
+} query_fmt_t;
+
+static int print_usage(void);
+
+/*
+ * \brief function to print help
+ */
+static int print_usage() {
+
+  fprintf(stderr,
+      "ss_query prints the points of a sensor held in the native\n"
+      "time-series store within a time range, either each point or the\n"
+      "min/max/mean of each interval.\n"
+      "Usage: ss_query [options] -s <sensor_id>\n"
+      "General options:\n"
+      " -h [--help]              : Displays this help and exits\n"
+      "\n"
+      "Query options:\n"
+      " -D [--dir] <dir>         : The store directory.\n"
+      "                             Default: " TSDB_DEFAULT_DIR "\n"
+      " -s [--sensor-id] <id>    : The sensor_id to read\n"
+      " -S [--start] <time>      : Start of the range, inclusive, in\n"
+      "                             seconds since the epoch, or before\n"
+      "                             now if negative. Default: a day\n"
+      "                             before the end\n"
+      " -E [--end] <time>        : End of the range, exclusive, as for\n"
+      "                             --start. Default: now\n"
+      " -a [--aggregate] <s>     : Print the min, max and mean of each\n"
+      "                             interval of <s> seconds holding any\n"
+      "                             points, rather than each point\n"
+      " -o [--output] <format>   : json, one reading per line, or csv.\n"
+      "                             Default: json\n"
+      " -n [--name] <name>       : The measurement name of printed\n"
+      "                             readings. Default: " QUERY_DEFAULT_NAME "\n"
+      "\n"
+      "\nDebug options:\n"
+      " -v [--verbose] <LEVEL>   : set verbose level to LEVEL\n"
+      "                               Levels are:\n"
+      "                                 SILENT\n"
+      "                                 ERROR (default)\n"
+      "                                 WARN\n"
+      "                                 INFO\n"
+      "                                 DEBUG\n"
+      "\n");
+
+  return 0;
+}
+
+/**
+ * \brief Convert a time option to ms since the epoch
+ * \param str Seconds since the epoch, or before now if negative
+ * \param now The current time
+ * \param t The time, ms since the epoch
+ */
+static int parse_time(const char *str, time_t now, int64_t *t) {
+
+  long long sec;
+  char *end;
+
+  sec = strtoll(str, &end, 10);
+  if (end == str || *end) {
+    log_stderr(LOG_ERROR, "Invalid time: %s", str);
+    return SS_INIT_ERROR;
+  }
+
+  if (sec < 0) {
+    sec += now;
+  }
+  *t = (int64_t)sec * 1000;
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Set the time of a reading from ms since the epoch
+ */
+static void set_reading_time(struct reading *r, int64_t t) {
+
+  r->ts.tv_sec = t / 1000;
+  r->ts.tv_nsec = (t % 1000) * 1000000;
+  localtime_r(&r->ts.tv_sec, &r->t);
+}
+
+/**
+ * \brief Print a reading as JSON
+ */
+static int print_json(struct reading *r) {
+
+  char msg[QUERY_MSG_LEN];
+  size_t len = sizeof(msg);
+  int ret;
+
+  if ((ret = convert_reading_json(r, msg, &len))) {
+    log_stderr(LOG_ERROR, "Failed to convert reading to JSON");
+    return ret;
+  }
+  fprintf(stdout, "%s\n", msg);
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Print each point in range
+ * \param q The scan
+ * \param r A reading holding one measurement for the sensor
+ * \param fmt The output format
+ */
+static int query_points(struct tsdb_query *q, struct reading *r,
+    query_fmt_t fmt) {
+
+  int64_t t;
+  double val;
+  int ret;
+
+  if (fmt == QUERY_CSV) {
+    fprintf(stdout, "time,%s\n", r->meas[0]->name);
+  }
+
+  while (!(ret = tsdb_query_next(q, &t, &val))) {
+    if (fmt == QUERY_CSV) {
+      fprintf(stdout, "%lld.%03d,%.15g\n", (long long)(t / 1000),
+          (int)(t % 1000), val);
+      continue;
+    }
+
+    set_reading_time(r, t);
+    snprintf(r->meas[0]->meas, READ_MEAS_LEN, "%.15g", val);
+    if ((ret = print_json(r))) {
+      return ret;
+    }
+  }
+
+  return ret == SS_BUF_EMPTY ? SS_SUCCESS : ret;
+}
+
+/**
+ * \brief Print the min, max and mean of each bucket in range
+ * \param q The scan
+ * \param width The bucket length, ms
+ * \param r A reading holding min, max, mean and count measurements
+ * \param fmt The output format
+ */
+static int query_buckets(struct tsdb_query *q, int64_t width,
+    struct reading *r, query_fmt_t fmt) {
+
+  struct tsdb_bucket b;
+  double mean;
+  int ret;
+
+  if (fmt == QUERY_CSV) {
+    fprintf(stdout, "time,min,max,mean,count\n");
+  }
+
+  while (!(ret = tsdb_query_bucket(q, width, &b))) {
+    mean = b.sum / b.count;
+
+    if (fmt == QUERY_CSV) {
+      fprintf(stdout, "%lld.%03d,%.15g,%.15g,%.15g,%lu\n",
+          (long long)(b.t / 1000), (int)(b.t % 1000), b.min, b.max, mean,
+          b.count);
+      continue;
+    }
+
+    set_reading_time(r, b.t);
+    snprintf(r->meas[0]->meas, READ_MEAS_LEN, "%.15g", b.min);
+    snprintf(r->meas[1]->meas, READ_MEAS_LEN, "%.15g", b.max);
+    snprintf(r->meas[2]->meas, READ_MEAS_LEN, "%.15g", mean);
+    snprintf(r->meas[3]->meas, READ_MEAS_LEN, "%lu", b.count);
+    if ((ret = print_json(r))) {
+      return ret;
+    }
+  }
+
+  return ret == SS_BUF_EMPTY ? SS_SUCCESS : ret;
+}
+
+int main(int argc, char **argv) {
+
+  int ret = SS_SUCCESS;
+  int c, option_index = 0;
+  char dir[MAX_FILENAME_LEN] = TSDB_DEFAULT_DIR;
+  char name[READ_NAME_LEN] = QUERY_DEFAULT_NAME;
+  static const char *bucket_names[] = { "min", "max", "mean", "count" };
+  const char *start = NULL, *end = NULL;
+  uint32_t sensor_id = 0;
+  unsigned aggregate = 0, i, meas;
+  query_fmt_t fmt = QUERY_JSON;
+  time_t now = time(0);
+  int64_t t0, t1;
+
+  struct tsdb_reader *rd = NULL;
+  struct reading *r = NULL;
+  struct tsdb_query q;
+
+  static struct option long_options[] =
+  {
+    /* These options set a flag. */
+    {"help",   no_argument,             0, 'h'},
+    {"verbose", required_argument,      0, 'v'},
+    {"dir", required_argument,          0, 'D'},
+    {"sensor-id", required_argument,    0, 's'},
+    {"start", required_argument,        0, 'S'},
+    {"end", required_argument,          0, 'E'},
+    {"aggregate", required_argument,    0, 'a'},
+    {"output", required_argument,       0, 'o'},
+    {"name", required_argument,         0, 'n'},
+    {0, 0, 0, 0}
+  };
+
+  log_level(LOG_ERROR);
+
+  /* get arguments */
+  while (1)
+  {
+    if ((c = getopt_long(argc, argv, "hv:D:s:S:E:a:o:n:", long_options,
+            &option_index)) != -1) {
+
+      switch (c) {
+        case 'h':
+          return print_usage();
+
+        case 'v':
+          /* set log level */
+          if (optarg) {
+            set_log_level_str(optarg);
+          }
+          break;
+
+        case 'D':
+          /* set the store directory */
+          strncpy(dir, optarg, MAX_FILENAME_LEN - 1);
+          break;
+
+        case 's':
+          /* set the sensor_id */
+          sensor_id = atoi(optarg);
+          break;
+
+        case 'S':
+          /* start of the range */
+          start = optarg;
+          break;
+
+        case 'E':
+          /* end of the range */
+          end = optarg;
+          break;
+
+        case 'a':
+          /* bucket length */
+          aggregate = atoi(optarg);
+          if (!aggregate) {
+            log_stderr(LOG_ERROR,
+                "The aggregate flag should be followed by a time in seconds");
+            return print_usage();
+          }
+          break;
+
+        case 'o':
+          /* output format */
+          if (!strcmp(optarg, "json")) {
+            fmt = QUERY_JSON;
+          } else if (!strcmp(optarg, "csv")) {
+            fmt = QUERY_CSV;
+          } else {
+            log_stderr(LOG_ERROR, "Unknown output format: %s", optarg);
+            return print_usage();
+          }
+          break;
+
+        case 'n':
+          /* measurement name */
+          strncpy(name, optarg, READ_NAME_LEN - 1);
+          break;
+
+        default:
+          return print_usage();
+      }
+    } else {
+      /* Final arguement */
+      break;
+    }
+  }
+
+  if (!sensor_id) {
+    log_stderr(LOG_ERROR, "A sensor_id should be given");
+    return print_usage();
+  }
+
+  t1 = (int64_t)now * 1000;
+  if (end && (ret = parse_time(end, now, &t1))) {
+    return ret;
+  }
+  t0 = t1 - (int64_t)QUERY_DEFAULT_RANGE_S * 1000;
+  if (start && (ret = parse_time(start, now, &t0))) {
+    return ret;
+  }
+  if (t0 >= t1) {
+    log_stderr(LOG_ERROR, "The start should be before the end");
+    return SS_INIT_ERROR;
+  }
+
+  if ((ret = tsdb_reader_open(&rd, dir, sensor_id))) {
+    goto free;
+  }
+
+  /* the reading printed for each point or bucket */
+  if ((ret = reading_init(&r))) {
+    goto free;
+  }
+  meas = aggregate ? 4 : 1;
+  for (i = 0; i < meas; i++) {
+    if ((ret = measurement_init(r))) {
+      goto free;
+    }
+    r->meas[i]->sensor_id = sensor_id;
+    strcpy(r->meas[i]->name, aggregate ? bucket_names[i] : name);
+  }
+
+  tsdb_query_init(&q, rd, t0, t1);
+  if (aggregate) {
+    ret = query_buckets(&q, (int64_t)aggregate * 1000, r, fmt);
+  } else {
+    ret = query_points(&q, r, fmt);
+  }
+  log_stdout(LOG_INFO, "Read %zu of %zu chunks", q.chunks, rd->chunks);
+
+free:
+  free_reading(r);
+  free_tsdb_reader(rd);
+  return ret;
+}
@@ -0,0 +1,412 @@
+/******************************************************************************
+ * File: ss_rrdbench.c
+ * Description: RRD sink throughput benchmark against temporary RRD files
+ * Author: Steven Swann - swannonline@googlemail.com
+ *
+ * Copyright (c) swannonline, 2013-2014
+ *
+ * This file is part of sensorspace.
+ *
+ * sensorspace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * sensorspace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with sensorspace.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <rrd.h>
+
+#include <getopt.h>
+
+#include "sensorspace.h"
+#include "reading.h"
+#include "reading_rrdpool.h"
+#include "tsdb.h"
+#include "log.h"
+
+#define RRDBENCH_DEFAULT_FILES    16
+#define RRDBENCH_DEFAULT_UPDATES  1000
+#define RRDBENCH_DEFAULT_BATCH    60
+#define RRDBENCH_DEFAULT_DIR      "/tmp"
+#define RRDBENCH_STEP             1
+
+static int print_usage(void);
+
+/*
+ * \brief function to print help
+ */
+static int print_usage() {
+
+  fprintf(stderr,
+      "ss_rrdbench measures the update rate of the RRD sink against a set\n"
+      "of temporary RRD files. Each file is first updated once per step,\n"
+      "then with the updates of several steps written by a single call.\n"
+      "The same readings are then written to the native time-series store\n"
+      "for comparison.\n"
+      "Usage: ss_rrdbench [options]\n"
+      "General options:\n"
+      " -h [--help]              : Displays this help and exits\n"
+      "\n"
+      "Benchmark options:\n"
+      " -f [--files] <N>         : Number of RRD files. Default: 16\n"
+      " -u [--updates] <N>       : Updates per file. Default: 1000\n"
+      " -F [--flush] <steps>     : Steps written per call in the batched\n"
+      "                            run. Default: 60\n"
+      " -d [--dir] <dir>         : Directory for the temporary files.\n"
+      "                            Default: /tmp\n"
+      " -w [--workers] <n>       : Write the files from <n> threads.\n"
+      "                            Default: 0, written inline\n"
+      "\n"
+      "\nDebug options:\n"
+      " -v [--verbose] <LEVEL>   : set verbose level to LEVEL\n"
+      "                               Levels are:\n"
+      "                                 SILENT\n"
+      "                                 ERROR (default)\n"
+      "                                 WARN\n"
+      "                                 INFO\n"
+      "                                 DEBUG\n"
+      "\n");
+
+  return 0;
+}
+
+/**
+ * \brief Create the temporary RRD files, one DS each, and add them to the
+ *        sink with sensor_ids 1 to files
+ * \param rrd The RRD sink
+ * \param dir The directory to create the files in
+ * \param files The number of files
+ * \param updates The updates each file should hold
+ * \param start The time of the first update
+ */
+static int bench_create(struct rrdtool *rrd, const char *dir,
+    unsigned files, unsigned updates, time_t start) {
+
+  char path[MAX_FILENAME_LEN + 32];
+  char ds[64], rra[64];
+  const char *params[] = { ds, rra };
+  unsigned i;
+  int ret;
+
+  sprintf(ds, "DS:val:GAUGE:%u:U:U", RRDBENCH_STEP * 2);
+  sprintf(rra, "RRA:AVERAGE:0.5:1:%u", updates);
+
+  for (i = 0; i < files; i++) {
+    snprintf(path, sizeof(path), "%s/bench%u.rrd", dir, i);
+
+    if (rrd_create_r(path, RRDBENCH_STEP, start - 1, 2, params)) {
+      log_stderr(LOG_ERROR, "rrd_error: %s", rrd_get_error());
+      rrd_clear_error();
+      return SS_INIT_ERROR;
+    }
+
+    if ((ret = rrd_file_init(rrd, path))) {
+      return ret;
+    }
+    rrd->sensor[rrd->s_count - 1]->sensor_id = i + 1;
+  }
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Remove a temporary file
+ * \return The size of the file
+ */
+static off_t bench_unlink(const char *path) {
+
+  struct stat st;
+
+  if (stat(path, &st)) {
+    return 0;
+  }
+  unlink(path);
+
+  return st.st_size;
+}
+
+/**
+ * \brief Remove the temporary RRD files and free the sink
+ * \return The size of the files
+ */
+static off_t bench_remove(struct rrdtool *rrd) {
+
+  off_t bytes = 0;
+  unsigned i;
+
+  for (i = 0; i < rrd->f_count; i++) {
+    bytes += bench_unlink(rrd->file[i]->name);
+  }
+  free_rrd_files(rrd);
+
+  return bytes;
+}
+
+/**
+ * \brief Remove the files of the native store
+ * \return The size of the files
+ */
+static off_t bench_remove_tsdb(const char *dir, unsigned files) {
+
+  char path[MAX_FILENAME_LEN + 32];
+  off_t bytes = 0;
+  unsigned i;
+
+  for (i = 0; i < files; i++) {
+    snprintf(path, sizeof(path), "%s/%u" TSDB_DATA_EXT, dir, i + 1);
+    bytes += bench_unlink(path);
+    snprintf(path, sizeof(path), "%s/%u" TSDB_INDEX_EXT, dir, i + 1);
+    bytes += bench_unlink(path);
+  }
+
+  return bytes;
+}
+
+/**
+ * \brief Feed the readings of each step, together carrying a measurement
+ *        for each file, to the sink and time it
+ * \param rrd The RRD sink
+ * \param r The reading, carrying the measurements of up to
+ *        READ_MEAS_COUNT files at a time
+ * \param files The number of files
+ * \param updates The number of steps
+ * \param batch The steps after which the queued updates are written
+ * \param start The time of the first step
+ * \return The elapsed time in seconds
+ */
+static double bench_run(struct rrdtool *rrd, struct reading *r,
+    unsigned files, unsigned updates, unsigned batch, time_t start) {
+
+  struct timespec begin, end;
+  unsigned k, i, base;
+  time_t t;
+
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+
+  for (k = 0; k < updates; k++) {
+    t = start + (time_t)k * RRDBENCH_STEP;
+    localtime_r(&t, &r->t);
+
+    for (base = 0; base < files; base += r->count) {
+      for (i = 0; i < r->count; i++) {
+        /* sensor_id 0 matches no file */
+        r->meas[i]->sensor_id = base + i < files ? base + i + 1 : 0;
+        sprintf(r->meas[i]->meas, "%u", (k + i) % 100);
+      }
+      add_reading_rrd(r, rrd);
+    }
+    if ((k + 1) % batch == 0) {
+      flush_rrd_files(rrd, 0);
+    }
+  }
+  flush_rrd_files(rrd, 0);
+  if (rrd->pool) {
+    rrd_pool_sync(rrd->pool);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  return (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+}
+
+/**
+ * \brief Feed the readings of bench_run() to the native store and time it
+ * \param db The store
+ * \param batch The steps after which the store is flushed
+ * \return The elapsed time in seconds
+ */
+static double bench_run_tsdb(struct tsdb *db, struct reading *r,
+    unsigned files, unsigned updates, unsigned batch, time_t start) {
+
+  struct timespec begin, end;
+  unsigned k, i, base;
+  time_t t;
+
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+
+  for (k = 0; k < updates; k++) {
+    t = start + (time_t)k * RRDBENCH_STEP;
+    localtime_r(&t, &r->t);
+
+    for (base = 0; base < files; base += r->count) {
+      for (i = 0; i < r->count; i++) {
+        r->meas[i]->sensor_id = base + i < files ? base + i + 1 : 0;
+        sprintf(r->meas[i]->meas, "%u", (k + i) % 100);
+      }
+      add_reading_tsdb(r, db);
+    }
+    if ((k + 1) % batch == 0) {
+      tsdb_flush(db);
+    }
+  }
+  tsdb_flush(db);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  return (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+}
+
+int main(int argc, char **argv) {
+
+  int ret = SS_SUCCESS;
+  int c, option_index = 0;
+  unsigned files = RRDBENCH_DEFAULT_FILES;
+  unsigned updates = RRDBENCH_DEFAULT_UPDATES;
+  unsigned batch = RRDBENCH_DEFAULT_BATCH;
+  unsigned workers = 0;
+  char base[MAX_FILENAME_LEN] = RRDBENCH_DEFAULT_DIR;
+  char dir[MAX_FILENAME_LEN];
+  struct reading *r = NULL;
+  struct rrdtool rrd;
+  struct tsdb *db = NULL;
+  double secs[3] = { 0 };
+  off_t bytes[3] = { 0 };
+  unsigned i, run;
+  time_t start;
+
+  static struct option long_options[] =
+  {
+    /* These options set a flag. */
+    {"help",   no_argument,             0, 'h'},
+    {"verbose", required_argument,      0, 'v'},
+    {"files", required_argument,        0, 'f'},
+    {"updates", required_argument,      0, 'u'},
+    {"flush", required_argument,        0, 'F'},
+    {"dir", required_argument,          0, 'd'},
+    {"workers", required_argument,      0, 'w'},
+    {0, 0, 0, 0}
+  };
+
+  memset(&rrd, 0, sizeof(struct rrdtool));
+  log_level(LOG_ERROR);
+
+  /* get arguments */
+  while (1)
+  {
+    if ((c = getopt_long(argc, argv, "hv:f:u:F:d:w:", long_options,
+            &option_index)) != -1) {
+
+      switch (c) {
+        case 'h':
+          return print_usage();
+
+        case 'v':
+          /* set log level */
+          if (optarg) {
+            set_log_level_str(optarg);
+          }
+          break;
+
+        case 'f':
+          /* number of files */
+          files = atoi(optarg);
+          break;
+
+        case 'u':
+          /* updates per file */
+          updates = atoi(optarg);
+          break;
+
+        case 'F':
+          /* steps per write */
+          batch = atoi(optarg);
+          break;
+
+        case 'd':
+          /* temporary file directory */
+          snprintf(base, sizeof(base), "%s", optarg);
+          break;
+
+        case 'w':
+          /* writer threads */
+          workers = atoi(optarg);
+          break;
+
+        default:
+          return print_usage();
+      }
+    } else {
+      /* Final arguement */
+      break;
+    }
+  }
+
+  if (!files || !updates || !batch) {
+    log_stderr(LOG_ERROR, "Files, updates and steps per write should be at"
+        " least 1");
+    return print_usage();
+  }
+
+  snprintf(dir, sizeof(dir), "%s/ss_rrdbench.XXXXXX", base);
+  if (!mkdtemp(dir)) {
+    log_stderr(LOG_ERROR, "Failed to create a directory in %s", base);
+    return SS_INIT_ERROR;
+  }
+
+  if (workers && (ret = rrd_pool_init(&rrd.pool, workers, NULL))) {
+    goto free;
+  }
+
+  if ((ret = reading_init(&r))) {
+    goto free;
+  }
+  for (i = 0; i < files && i < READ_MEAS_COUNT; i++) {
+    if ((ret = measurement_init(r))) {
+      goto free;
+    }
+  }
+
+  /* one update per step, then several steps per call */
+  for (run = 0; run < 2; run++) {
+    start = time(0) - (time_t)updates * RRDBENCH_STEP;
+
+    if ((ret = bench_create(&rrd, dir, files, updates, start))) {
+      goto free;
+    }
+    secs[run] = bench_run(&rrd, r, files, updates, run ? batch : 1, start);
+    bytes[run] = bench_remove(&rrd);
+  }
+
+  /* the same readings to the native store, flushed as the batched run */
+  if ((ret = tsdb_open(&db, dir))) {
+    goto free;
+  }
+  start = time(0) - (time_t)updates * RRDBENCH_STEP;
+  secs[2] = bench_run_tsdb(db, r, files, updates, batch, start);
+  free_tsdb(db);
+  db = NULL;
+  bytes[2] = bench_remove_tsdb(dir, files);
+
+  fprintf(stdout, "files: %u updates/file: %u step: %us writers: %u\n",
+      files, updates, RRDBENCH_STEP, workers);
+  fprintf(stdout, "1 step per call:    %8.3fs %10.0f updates/s\n", secs[0],
+      files * updates / secs[0]);
+  fprintf(stdout, "%-3u steps per call: %8.3fs %10.0f updates/s x%.1f\n",
+      batch, secs[1], files * updates / secs[1], secs[0] / secs[1]);
+  fprintf(stdout, "native store:       %8.3fs %10.0f updates/s x%.1f\n",
+      secs[2], files * updates / secs[2], secs[0] / secs[2]);
+  fprintf(stdout, "disk: rrd %lld bytes, native store %lld bytes\n",
+      (long long)bytes[1], (long long)bytes[2]);
+
+free:
+  free_rrd_pool(rrd.pool);
+  bench_remove(&rrd);
+  free_tsdb(db);
+  bench_remove_tsdb(dir, files);
+  rmdir(dir);
+  free_reading(r);
+  return ret;
+}
@@ -0,0 +1,837 @@
+/******************************************************************************
+ * File: tsdb.c
+ * Description: append-only time-series store for sensor readings
+ * Author: Steven Swann - swannonline@googlemail.com
+ *
+ * Copyright (c) swannonline, 2013-2014
+ *
+ * This file is part of sensorspace.
+ *
+ * sensorspace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * sensorspace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with sensorspace.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sensorspace.h"
+#include "reading.h"
+#include "tsdb.h"
+
+#define TSDB_HASH_MIN             64
+
+#define TSDB_CHUNK_HDR_LEN        sizeof(struct tsdb_chunk_hdr)
+#define TSDB_FILE_HDR_LEN         sizeof(struct tsdb_file_hdr)
+#define TSDB_INDEX_LEN            sizeof(struct tsdb_index)
+
+/**
+ * \brief Get the hash bucket of a sensor_id
+ */
+static unsigned tsdb_hash(uint32_t sensor_id, unsigned size) {
+  return (sensor_id * 2654435761u) & (size - 1);
+}
+
+/**
+ * \brief Find the series of a sensor_id
+ */
+static struct tsdb_series *tsdb_find(struct tsdb *db, uint32_t sensor_id) {
+
+  struct tsdb_series *s;
+
+  for (s = db->hash[tsdb_hash(sensor_id, db->hash_size)]; s;
+      s = s->hash_next) {
+    if (s->sensor_id == sensor_id) {
+      break;
+    }
+  }
+
+  return s;
+}
+
+/**
+ * \brief Double the hash buckets once there are more series than buckets
+ */
+static int tsdb_rehash(struct tsdb *db) {
+
+  struct tsdb_series **hash, *s;
+  unsigned size = db->hash_size * 2, i;
+
+  if (!(hash = calloc(size, sizeof(struct tsdb_series *)))) {
+    log_stderr(LOG_ERROR, "TSDB: Out of memory");
+    return SS_OUT_OF_MEM_ERROR;
+  }
+
+  for (s = db->series; s; s = s->next) {
+    i = tsdb_hash(s->sensor_id, size);
+    s->hash_next = hash[i];
+    hash[i] = s;
+  }
+
+  free(db->hash);
+  db->hash = hash;
+  db->hash_size = size;
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Write the whole of a buffer at an offset
+ */
+static int tsdb_pwrite(int fd, const void *buf, size_t len, off_t offset) {
+
+  const uint8_t *p = buf;
+  ssize_t n;
+
+  while (len) {
+    if ((n = pwrite(fd, p, len, offset)) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      log_stderr(LOG_ERROR, "TSDB: Write failed: %s", strerror(errno));
+      return SS_WRITE_ERROR;
+    }
+    p += n;
+    len -= n;
+    offset += n;
+  }
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Read the whole of a buffer from an offset
+ */
+static int tsdb_pread(int fd, void *buf, size_t len, off_t offset) {
+
+  uint8_t *p = buf;
+  ssize_t n;
+
+  while (len) {
+    if ((n = pread(fd, p, len, offset)) <= 0) {
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      return SS_READ_ERROR;
+    }
+    p += n;
+    len -= n;
+    offset += n;
+  }
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Check the header of a .tsd or .tsi file
+ */
+static int tsdb_check_hdr(const struct tsdb_file_hdr *hdr, uint32_t magic,
+    uint32_t sensor_id) {
+
+  if (hdr->magic != magic || hdr->version != TSDB_VERSION ||
+      hdr->sensor_id != sensor_id) {
+    return SS_READ_ERROR;
+  }
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Close the files of a series, taking it off the LRU list
+ */
+static void tsdb_series_close(struct tsdb *db, struct tsdb_series *s) {
+
+  if (s->data_fd < 0) {
+    return;
+  }
+
+  close(s->data_fd);
+  close(s->index_fd);
+  s->data_fd = s->index_fd = -1;
+
+  if (s->lru_prev) {
+    s->lru_prev->lru_next = s->lru_next;
+  } else {
+    db->lru_head = s->lru_next;
+  }
+  if (s->lru_next) {
+    s->lru_next->lru_prev = s->lru_prev;
+  } else {
+    db->lru_tail = s->lru_prev;
+  }
+  s->lru_prev = s->lru_next = NULL;
+  db->open--;
+}
+
+/**
+ * \brief Make a series the most recently used, opening its files if
+ *        closed. The files of the least recently used series are closed
+ *        to stay within TSDB_OPEN_MAX.
+ * \param flags O_CREAT to create the files on first use
+ */
+static int tsdb_series_files(struct tsdb *db, struct tsdb_series *s,
+    int flags) {
+
+  char path[MAX_FILENAME_LEN + 16];
+
+  if (s->data_fd >= 0) {
+    if (s != db->lru_head) {
+      s->lru_prev->lru_next = s->lru_next;
+      if (s->lru_next) {
+        s->lru_next->lru_prev = s->lru_prev;
+      } else {
+        db->lru_tail = s->lru_prev;
+      }
+      goto head;
+    }
+    return SS_SUCCESS;
+  }
+
+  if (db->open >= TSDB_OPEN_MAX) {
+    tsdb_series_close(db, db->lru_tail);
+  }
+
+  flags |= O_RDWR | O_CLOEXEC;
+  snprintf(path, sizeof(path), "%s/%u" TSDB_DATA_EXT, db->dir,
+      s->sensor_id);
+  if ((s->data_fd = open(path, flags, 0644)) < 0) {
+    goto fail;
+  }
+  snprintf(path, sizeof(path), "%s/%u" TSDB_INDEX_EXT, db->dir,
+      s->sensor_id);
+  if ((s->index_fd = open(path, flags, 0644)) < 0) {
+    close(s->data_fd);
+    s->data_fd = -1;
+    goto fail;
+  }
+  db->open++;
+
+head:
+  s->lru_prev = NULL;
+  s->lru_next = db->lru_head;
+  if (db->lru_head) {
+    db->lru_head->lru_prev = s;
+  } else {
+    db->lru_tail = s;
+  }
+  db->lru_head = s;
+
+  return SS_SUCCESS;
+
+fail:
+  log_stderr(LOG_ERROR, "TSDB: Failed to open %s: %s", path,
+      strerror(errno));
+  return SS_INIT_ERROR;
+}
+
+/**
+ * \brief Write the headers of a new pair of files
+ */
+static int tsdb_series_create(struct tsdb_series *s) {
+
+  struct tsdb_file_hdr hdr = { 0 };
+  int ret;
+
+  if (ftruncate(s->data_fd, 0) || ftruncate(s->index_fd, 0)) {
+    log_stderr(LOG_ERROR, "TSDB: Truncate failed: %s", strerror(errno));
+    return SS_WRITE_ERROR;
+  }
+
+  hdr.version = TSDB_VERSION;
+  hdr.sensor_id = s->sensor_id;
+
+  hdr.magic = TSDB_DATA_MAGIC;
+  if ((ret = tsdb_pwrite(s->data_fd, &hdr, TSDB_FILE_HDR_LEN, 0))) {
+    return ret;
+  }
+  hdr.magic = TSDB_INDEX_MAGIC;
+  if ((ret = tsdb_pwrite(s->index_fd, &hdr, TSDB_FILE_HDR_LEN, 0))) {
+    return ret;
+  }
+
+  s->offset = TSDB_FILE_HDR_LEN;
+  s->chunk = 0;
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Read a chunk back into the encoder so that it can be extended.
+ *        The chunk header is written before the index entry, so a crash
+ *        between the two leaves a header ahead of the entry; the points
+ *        of the entry are then kept and the header rewritten to match.
+ * \return SS_SUCCESS if the chunk is whole
+ */
+static int tsdb_series_resume(struct tsdb_series *s,
+    const struct tsdb_index *idx, off_t data_len) {
+
+  struct tsdb_chunk_hdr hdr;
+  struct tsdb_cursor c;
+  uint8_t *buf = NULL;
+  int ret = SS_READ_ERROR;
+  int64_t t;
+  double val;
+
+  if (idx->offset < TSDB_FILE_HDR_LEN || !idx->count ||
+      idx->offset + TSDB_CHUNK_HDR_LEN + idx->size > (uint64_t)data_len) {
+    return SS_READ_ERROR;
+  }
+
+  if (tsdb_pread(s->data_fd, &hdr, TSDB_CHUNK_HDR_LEN, idx->offset) ||
+      hdr.magic != TSDB_CHUNK_MAGIC || hdr.count < idx->count ||
+      hdr.size < idx->size || hdr.t_first != idx->t_first) {
+    return SS_READ_ERROR;
+  }
+
+  if (!(buf = malloc(idx->size ? idx->size : 1))) {
+    return SS_OUT_OF_MEM_ERROR;
+  }
+  if (tsdb_pread(s->data_fd, buf, idx->size,
+        idx->offset + TSDB_CHUNK_HDR_LEN)) {
+    goto free;
+  }
+
+  tsdb_enc_reset(&s->enc);
+  tsdb_cursor_init(&c, idx, buf, idx->size);
+  while (!(ret = tsdb_cursor_next(&c, &t, &val))) {
+    if ((ret = tsdb_enc_put(&s->enc, t, val))) {
+      goto free;
+    }
+  }
+  if (ret != SS_BUF_EMPTY || s->enc.t_last != idx->t_last) {
+    ret = SS_READ_ERROR;
+    goto free;
+  }
+
+  if (hdr.count != idx->count || hdr.size != idx->size) {
+    log_stderr(LOG_WARN, "TSDB: Rolling back chunk of sensor %u from %u to"
+        " %u points", s->sensor_id, hdr.count, idx->count);
+    hdr.count = idx->count;
+    hdr.t_last = idx->t_last;
+    hdr.size = idx->size;
+    if ((ret = tsdb_pwrite(s->data_fd, &hdr, TSDB_CHUNK_HDR_LEN,
+            idx->offset))) {
+      goto free;
+    }
+  }
+
+  s->offset = idx->offset;
+  s->t_last = idx->t_last;
+  ret = SS_SUCCESS;
+
+free:
+  free(buf);
+  return ret;
+}
+
+/**
+ * \brief Pick up a pair of files where they were left. The last chunk is
+ *        reopened, and anything after the last whole chunk, left by a
+ *        crash part way through a flush, is cut off.
+ */
+static int tsdb_series_load(struct tsdb_series *s) {
+
+  struct tsdb_file_hdr hdr;
+  struct tsdb_index idx;
+  struct stat ds, is;
+  uint64_t n;
+  int ret;
+
+  if (fstat(s->data_fd, &ds) || fstat(s->index_fd, &is)) {
+    return SS_READ_ERROR;
+  }
+
+  if (ds.st_size < (off_t)TSDB_FILE_HDR_LEN ||
+      is.st_size < (off_t)TSDB_FILE_HDR_LEN) {
+    if (ds.st_size > (off_t)TSDB_FILE_HDR_LEN) {
+      log_stderr(LOG_ERROR, "TSDB: Missing index for sensor %u",
+          s->sensor_id);
+      return SS_READ_ERROR;
+    }
+    return tsdb_series_create(s);
+  }
+
+  if (tsdb_pread(s->data_fd, &hdr, TSDB_FILE_HDR_LEN, 0) ||
+      tsdb_check_hdr(&hdr, TSDB_DATA_MAGIC, s->sensor_id) ||
+      tsdb_pread(s->index_fd, &hdr, TSDB_FILE_HDR_LEN, 0) ||
+      tsdb_check_hdr(&hdr, TSDB_INDEX_MAGIC, s->sensor_id)) {
+    log_stderr(LOG_ERROR, "TSDB: Not a store file for sensor %u",
+        s->sensor_id);
+    return SS_READ_ERROR;
+  }
+
+  s->offset = TSDB_FILE_HDR_LEN;
+  n = (is.st_size - TSDB_FILE_HDR_LEN) / TSDB_INDEX_LEN;
+  while (n) {
+    if (!tsdb_pread(s->index_fd, &idx, TSDB_INDEX_LEN,
+          TSDB_FILE_HDR_LEN + (n - 1) * TSDB_INDEX_LEN)) {
+      ret = tsdb_series_resume(s, &idx, ds.st_size);
+      if (!ret) {
+        break;
+      } else if (ret == SS_OUT_OF_MEM_ERROR) {
+        return ret;
+      }
+    }
+    log_stderr(LOG_WARN, "TSDB: Dropping damaged chunk %llu of sensor %u",
+        (unsigned long long)(n - 1), s->sensor_id);
+    n--;
+  }
+
+  if (n) {
+    s->chunk = n - 1;
+    s->flushed = (s->enc.bit + 7) / 8;
+    ds.st_size = s->offset + TSDB_CHUNK_HDR_LEN + s->flushed;
+  } else {
+    s->chunk = 0;
+    ds.st_size = TSDB_FILE_HDR_LEN;
+  }
+  if (ftruncate(s->data_fd, ds.st_size) ||
+      ftruncate(s->index_fd, TSDB_FILE_HDR_LEN + n * TSDB_INDEX_LEN)) {
+    log_stderr(LOG_ERROR, "TSDB: Truncate failed: %s", strerror(errno));
+    return SS_WRITE_ERROR;
+  }
+  /* the last byte may still gain bits */
+  s->flushed = s->enc.bit / 8;
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Open the files of a sensor_id, creating them if needed
+ */
+static int tsdb_series_open(struct tsdb *db, uint32_t sensor_id,
+    struct tsdb_series **s_p) {
+
+  struct tsdb_series *s;
+  int ret = SS_SUCCESS;
+  unsigned i;
+
+  if (db->count >= db->hash_size && (ret = tsdb_rehash(db))) {
+    return ret;
+  }
+
+  if (!(s = calloc(1, sizeof(struct tsdb_series)))) {
+    log_stderr(LOG_ERROR, "TSDB: Out of memory");
+    return SS_OUT_OF_MEM_ERROR;
+  }
+  s->sensor_id = sensor_id;
+  s->data_fd = s->index_fd = -1;
+
+  if ((ret = tsdb_series_files(db, s, O_CREAT))) {
+    goto free;
+  }
+
+  if ((ret = tsdb_series_load(s))) {
+    goto free;
+  }
+
+  i = tsdb_hash(sensor_id, db->hash_size);
+  s->hash_next = db->hash[i];
+  db->hash[i] = s;
+  s->next = db->series;
+  db->series = s;
+  db->count++;
+
+  *s_p = s;
+  return SS_SUCCESS;
+
+free:
+  tsdb_series_close(db, s);
+  free(s->enc.buf);
+  free(s);
+  return ret;
+}
+
+/**
+ * \brief Write the points of the open chunk not yet written, then its
+ *        header and index entry, reopening the files if closed
+ */
+static int tsdb_series_flush(struct tsdb *db, struct tsdb_series *s) {
+
+  struct tsdb_chunk_hdr hdr = { 0 };
+  struct tsdb_index idx = { 0 };
+  size_t len = (s->enc.bit + 7) / 8;
+  int ret;
+
+  if (!s->dirty) {
+    return SS_SUCCESS;
+  }
+
+  if ((ret = tsdb_series_files(db, s, 0))) {
+    return ret;
+  }
+
+  if ((ret = tsdb_pwrite(s->data_fd, s->enc.buf + s->flushed,
+          len - s->flushed, s->offset + TSDB_CHUNK_HDR_LEN + s->flushed))) {
+    return ret;
+  }
+  s->flushed = s->enc.bit / 8;
+
+  hdr.magic = TSDB_CHUNK_MAGIC;
+  hdr.count = s->enc.count;
+  hdr.t_first = s->enc.t_first;
+  hdr.t_last = s->enc.t_last;
+  hdr.size = len;
+  if ((ret = tsdb_pwrite(s->data_fd, &hdr, TSDB_CHUNK_HDR_LEN, s->offset))) {
+    return ret;
+  }
+
+  idx.t_first = s->enc.t_first;
+  idx.t_last = s->enc.t_last;
+  idx.offset = s->offset;
+  idx.size = len;
+  idx.count = s->enc.count;
+  if ((ret = tsdb_pwrite(s->index_fd, &idx, TSDB_INDEX_LEN,
+          TSDB_FILE_HDR_LEN + s->chunk * TSDB_INDEX_LEN))) {
+    return ret;
+  }
+
+  s->dirty = false;
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Write out the open chunk and start the next
+ */
+static int tsdb_series_seal(struct tsdb *db, struct tsdb_series *s) {
+
+  int ret;
+
+  if ((ret = tsdb_series_flush(db, s))) {
+    return ret;
+  }
+
+  s->offset += TSDB_CHUNK_HDR_LEN + (s->enc.bit + 7) / 8;
+  s->chunk++;
+  s->flushed = 0;
+  tsdb_enc_reset(&s->enc);
+  db->chunks++;
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Open a store for writing
+ * \param db_p Pointer to the store
+ * \param dir The store directory, created if needed
+ */
+int tsdb_open(struct tsdb **db_p, const char *dir) {
+
+  struct tsdb *db;
+
+  if (strlen(dir) >= MAX_FILENAME_LEN) {
+    log_stderr(LOG_ERROR, "TSDB: Directory name too long: %s", dir);
+    return SS_INIT_ERROR;
+  }
+
+  if (mkdir(dir, 0755) && errno != EEXIST) {
+    log_stderr(LOG_ERROR, "TSDB: Failed to create %s: %s", dir,
+        strerror(errno));
+    return SS_INIT_ERROR;
+  }
+
+  if (!(db = calloc(1, sizeof(struct tsdb)))) {
+    log_stderr(LOG_ERROR, "TSDB: Out of memory");
+    return SS_OUT_OF_MEM_ERROR;
+  }
+  if (!(db->hash = calloc(TSDB_HASH_MIN, sizeof(struct tsdb_series *)))) {
+    log_stderr(LOG_ERROR, "TSDB: Out of memory");
+    free(db);
+    return SS_OUT_OF_MEM_ERROR;
+  }
+  db->hash_size = TSDB_HASH_MIN;
+  strcpy(db->dir, dir);
+
+  *db_p = db;
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Append a point to the series of a sensor_id. Points older than the
+ *        last of the series are dropped.
+ * \param db The store
+ * \param sensor_id The sensor_id
+ * \param t The time, ms since the epoch
+ * \param val The value
+ */
+int tsdb_append(struct tsdb *db, uint32_t sensor_id, int64_t t, double val) {
+
+  struct tsdb_series *s;
+  int ret;
+
+  if (!(s = tsdb_find(db, sensor_id)) &&
+      (ret = tsdb_series_open(db, sensor_id, &s))) {
+    return ret;
+  }
+
+  if ((s->enc.count || s->chunk) && t < s->t_last) {
+    s->dropped++;
+    log_stdout(LOG_DEBUG, "TSDB: Dropped out of order point of sensor %u",
+        sensor_id);
+    return SS_SUCCESS;
+  }
+
+  if ((ret = tsdb_enc_put(&s->enc, t, val))) {
+    return ret;
+  }
+  s->t_last = t;
+  s->dirty = true;
+  db->points++;
+
+  if (s->enc.count >= TSDB_CHUNK_POINTS ||
+      s->enc.bit >= TSDB_CHUNK_BYTES * 8) {
+    return tsdb_series_seal(db, s);
+  }
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Append the numeric measurements of a reading to the store, each to
+ *        the series of its sensor_id
+ * \param r The reading
+ * \param db The store
+ */
+int add_reading_tsdb(struct reading *r, struct tsdb *db) {
+
+  int ret = SS_SUCCESS, err;
+  struct tm tm;
+  int64_t t;
+  double val;
+  char *end;
+  unsigned i;
+
+  if (r->ts.tv_sec) {
+    t = (int64_t)r->ts.tv_sec * 1000 + r->ts.tv_nsec / 1000000;
+  } else {
+    tm = r->t;
+    t = (int64_t)mktime(&tm) * 1000;
+  }
+
+  for (i = 0; i < r->count; i++) {
+    if (!r->meas[i]->sensor_id) {
+      continue;
+    }
+
+    val = strtod(r->meas[i]->meas, &end);
+    if (end == r->meas[i]->meas || *end) {
+      log_stderr(LOG_WARN, "TSDB: Ignoring non-numeric value of sensor %u",
+          r->meas[i]->sensor_id);
+      continue;
+    }
+
+    if ((err = tsdb_append(db, r->meas[i]->sensor_id, t, val)) && !ret) {
+      ret = err;
+    }
+  }
+
+  return ret;
+}
+
+/**
+ * \brief Write the points appended since the last flush
+ * \param db The store
+ */
+int tsdb_flush(struct tsdb *db) {
+
+  struct tsdb_series *s;
+  int ret = SS_SUCCESS, err;
+
+  for (s = db->series; s; s = s->next) {
+    if ((err = tsdb_series_flush(db, s)) && !ret) {
+      ret = err;
+    }
+  }
+
+  return ret;
+}
+
+/**
+ * \brief Flush and close a store
+ * \param db The store
+ */
+void free_tsdb(struct tsdb *db) {
+
+  struct tsdb_series *s, *next;
+  unsigned long dropped = 0;
+
+  if (!db) {
+    return;
+  }
+
+  tsdb_flush(db);
+
+  for (s = db->series; s; s = next) {
+    next = s->next;
+    dropped += s->dropped;
+    tsdb_series_close(db, s);
+    free(s->enc.buf);
+    free(s);
+  }
+
+  log_stdout(LOG_INFO, "TSDB: %lu points, %lu chunks sealed, %lu dropped",
+      db->points, db->chunks, dropped);
+
+  free(db->hash);
+  free(db);
+}
+
+/**
+ * \brief Map a file read-only, checking its header
+ */
+static int tsdb_map(const char *path, uint32_t magic, uint32_t sensor_id,
+    const uint8_t **map, size_t *len) {
+
+  struct stat st;
+  void *p;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+    log_stderr(LOG_ERROR, "TSDB: Failed to open %s: %s", path,
+        strerror(errno));
+    return SS_READ_ERROR;
+  }
+
+  if (fstat(fd, &st) || st.st_size < (off_t)TSDB_FILE_HDR_LEN) {
+    log_stderr(LOG_ERROR, "TSDB: Not a store file: %s", path);
+    close(fd);
+    return SS_READ_ERROR;
+  }
+
+  p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    log_stderr(LOG_ERROR, "TSDB: Failed to map %s: %s", path,
+        strerror(errno));
+    return SS_READ_ERROR;
+  }
+
+  if (tsdb_check_hdr(p, magic, sensor_id)) {
+    log_stderr(LOG_ERROR, "TSDB: Not a store file: %s", path);
+    munmap(p, st.st_size);
+    return SS_READ_ERROR;
+  }
+
+  *map = p;
+  *len = st.st_size;
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Open the series of a sensor_id for reading. The files are mapped
+ *        as they are when opened; points written later are not seen.
+ * \param rd_p Pointer to the reader
+ * \param dir The store directory
+ * \param sensor_id The sensor_id
+ */
+int tsdb_reader_open(struct tsdb_reader **rd_p, const char *dir,
+    uint32_t sensor_id) {
+
+  char path[MAX_FILENAME_LEN];
+  struct tsdb_reader *rd;
+  const uint8_t *index;
+  int ret;
+
+  if (!(rd = calloc(1, sizeof(struct tsdb_reader)))) {
+    log_stderr(LOG_ERROR, "TSDB: Out of memory");
+    return SS_OUT_OF_MEM_ERROR;
+  }
+  rd->sensor_id = sensor_id;
+
+  snprintf(path, sizeof(path), "%s/%u" TSDB_INDEX_EXT, dir, sensor_id);
+  if ((ret = tsdb_map(path, TSDB_INDEX_MAGIC, sensor_id, &index,
+          &rd->index_len))) {
+    goto free;
+  }
+  rd->index = (const struct tsdb_index *)(index + TSDB_FILE_HDR_LEN);
+  rd->chunks = (rd->index_len - TSDB_FILE_HDR_LEN) / TSDB_INDEX_LEN;
+
+  snprintf(path, sizeof(path), "%s/%u" TSDB_DATA_EXT, dir, sensor_id);
+  if ((ret = tsdb_map(path, TSDB_DATA_MAGIC, sensor_id, &rd->data,
+          &rd->data_len))) {
+    goto free;
+  }
+
+  *rd_p = rd;
+  return SS_SUCCESS;
+
+free:
+  free_tsdb_reader(rd);
+  return ret;
+}
+
+/**
+ * \brief Start reading the points of a chunk
+ * \param rd The reader
+ * \param chunk The index entry number of the chunk
+ * \param c The cursor to initialise
+ */
+int tsdb_reader_chunk(struct tsdb_reader *rd, size_t chunk,
+    struct tsdb_cursor *c) {
+
+  const struct tsdb_index *idx;
+  uint32_t magic;
+
+  if (chunk >= rd->chunks) {
+    return SS_NO_MATCH;
+  }
+  idx = &rd->index[chunk];
+
+  if (idx->offset < TSDB_FILE_HDR_LEN ||
+      idx->offset + TSDB_CHUNK_HDR_LEN + idx->size > rd->data_len) {
+    log_stderr(LOG_ERROR, "TSDB: Chunk %zu of sensor %u out of bounds",
+        chunk, rd->sensor_id);
+    return SS_READ_ERROR;
+  }
+
+  /* chunks are not aligned */
+  memcpy(&magic, rd->data + idx->offset, sizeof(magic));
+  if (magic != TSDB_CHUNK_MAGIC) {
+    log_stderr(LOG_ERROR, "TSDB: Chunk %zu of sensor %u is damaged",
+        chunk, rd->sensor_id);
+    return SS_READ_ERROR;
+  }
+
+  tsdb_cursor_init(c, idx, rd->data + idx->offset + TSDB_CHUNK_HDR_LEN,
+      idx->size);
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Unmap the files of a reader
+ * \param rd The reader
+ */
+void free_tsdb_reader(struct tsdb_reader *rd) {
+
+  if (!rd) {
+    return;
+  }
+
+  if (rd->index) {
+    munmap((void *)((const uint8_t *)rd->index - TSDB_FILE_HDR_LEN),
+        rd->index_len);
+  }
+  if (rd->data) {
+    munmap((void *)rd->data, rd->data_len);
+  }
+
+  free(rd);
+}
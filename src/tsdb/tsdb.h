@@ -0,0 +1,321 @@
+#ifndef TSDB__H
+#define TSDB__H
+/******************************************************************************
+ * File: tsdb.h
+ * Description: native append-only time-series store
+ * Author: Steven Swann - swannonline@googlemail.com
+ *
+ * Copyright (c) swannonline, 2013-2014
+ *
+ * This file is part of sensorspace.
+ *
+ * sensorspace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * sensorspace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with sensorspace.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "reading.h"
+
+/*
+ * Each sensor_id is stored as two files in the store directory:
+ *
+ *   <sensor_id>.tsd  append-only chunks, each a struct tsdb_chunk_hdr
+ *                    followed by the compressed points
+ *   <sensor_id>.tsi  one struct tsdb_index per chunk, giving its time
+ *                    range and place in the .tsd file
+ *
+ * Within a chunk, timestamps (ms) are delta-of-delta and values (double)
+ * XOR encoded as in Facebook's Gorilla. Only the last chunk of a file
+ * grows, and is rewritten from its last whole byte on each flush; earlier
+ * chunks are never written again. Files are in host byte order.
+ */
+#define TSDB_DATA_EXT             ".tsd"
+#define TSDB_INDEX_EXT            ".tsi"
+#define TSDB_DATA_MAGIC           0x44545353      /* "SSTD" */
+#define TSDB_INDEX_MAGIC          0x49545353      /* "SSTI" */
+#define TSDB_CHUNK_MAGIC          0x48435353      /* "SSCH" */
+#define TSDB_VERSION              1
+
+/* a chunk is sealed once it holds this many points or bytes */
+#define TSDB_CHUNK_POINTS         1024
+#define TSDB_CHUNK_BYTES          4096
+#define TSDB_DEFAULT_FLUSH_S      10
+/* series holding their two files open at once, the rest reopened */
+#define TSDB_OPEN_MAX             256
+#define TSDB_DEFAULT_DIR          "/var/lib/ss/tsdb"
+
+/*
+ * \brief Struct to hold the header of a .tsd or .tsi file
+ * \param magic TSDB_DATA_MAGIC or TSDB_INDEX_MAGIC
+ * \param version TSDB_VERSION
+ * \param sensor_id The sensor_id stored
+ * \param reserved Zero
+ */
+struct tsdb_file_hdr {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t sensor_id;
+  uint32_t reserved;
+};
+
+/*
+ * \brief Struct to hold the header of a chunk in a .tsd file
+ * \param magic TSDB_CHUNK_MAGIC
+ * \param count The number of points
+ * \param t_first The time of the first point, ms since the epoch
+ * \param t_last The time of the last point, ms since the epoch
+ * \param size The size of the compressed points
+ * \param reserved Zero
+ */
+struct tsdb_chunk_hdr {
+  uint32_t magic;
+  uint32_t count;
+  int64_t t_first;
+  int64_t t_last;
+  uint32_t size;
+  uint32_t reserved;
+};
+
+/*
+ * \brief Struct to hold the index entry of a chunk in a .tsi file
+ * \param t_first The time of the first point, ms since the epoch
+ * \param t_last The time of the last point, ms since the epoch
+ * \param offset The offset of the chunk header in the .tsd file
+ * \param size The size of the compressed points
+ * \param count The number of points
+ */
+struct tsdb_index {
+  int64_t t_first;
+  int64_t t_last;
+  uint64_t offset;
+  uint32_t size;
+  uint32_t count;
+};
+
+/*
+ * \brief Struct to hold the encoder of the chunk being written
+ * \param buf The compressed points
+ * \param size The size of buf
+ * \param bit The number of bits written to buf
+ * \param count The number of points
+ * \param t_first The time of the first point
+ * \param t_last The time of the last point
+ * \param delta The difference between the last two times
+ * \param val The bits of the last value
+ * \param leading The leading zeros of the last XOR window
+ * \param trailing The trailing zeros of the last XOR window
+ * \param window An XOR window has been written
+ */
+struct tsdb_enc {
+  uint8_t *buf;
+  size_t size;
+  size_t bit;
+
+  uint32_t count;
+  int64_t t_first;
+  int64_t t_last;
+  int64_t delta;
+  uint64_t val;
+  unsigned leading;
+  unsigned trailing;
+  bool window;
+};
+
+/*
+ * \brief Struct to hold the decoder of a chunk being read
+ * \param buf The compressed points
+ * \param len The length of buf
+ * \param bit The number of bits read from buf
+ * \param left The number of points left to read
+ * \param count The number of points read
+ * \param t The time of the last point read
+ * \param delta The difference between the last two times
+ * \param val The bits of the last value read
+ * \param leading The leading zeros of the last XOR window
+ * \param trailing The trailing zeros of the last XOR window
+ */
+struct tsdb_cursor {
+  const uint8_t *buf;
+  size_t len;
+  size_t bit;
+
+  uint32_t left;
+  uint32_t count;
+  int64_t t;
+  int64_t delta;
+  uint64_t val;
+  unsigned leading;
+  unsigned trailing;
+};
+
+/*
+ * \brief Struct to hold a sensor's files for writing. The files are only
+ *        held open by the TSDB_OPEN_MAX series flushed last.
+ * \param sensor_id The sensor_id
+ * \param data_fd The .tsd file, -1 while closed
+ * \param index_fd The .tsi file, -1 while closed
+ * \param offset The offset of the open chunk in the .tsd file
+ * \param chunk The index entry number of the open chunk
+ * \param enc The open chunk
+ * \param flushed The bytes of the open chunk written to the file
+ * \param dirty The open chunk has points not yet written
+ * \param t_last The time of the last point, ms since the epoch
+ * \param dropped The points dropped for being older than the last
+ * \param next The next series of the store
+ * \param hash_next The next series in the same sensor_id hash bucket
+ * \param lru_prev The series with its files open used more recently
+ * \param lru_next The series with its files open used less recently
+ */
+struct tsdb_series {
+  uint32_t sensor_id;
+  int data_fd;
+  int index_fd;
+
+  uint64_t offset;
+  uint64_t chunk;
+  struct tsdb_enc enc;
+  size_t flushed;
+  bool dirty;
+  int64_t t_last;
+  unsigned long dropped;
+
+  struct tsdb_series *next;
+  struct tsdb_series *hash_next;
+  struct tsdb_series *lru_prev;
+  struct tsdb_series *lru_next;
+};
+
+/*
+ * \brief Struct to hold a store open for writing
+ * \param dir The store directory
+ * \param series The series written to
+ * \param count The number of series
+ * \param hash The sensor_id hash buckets
+ * \param hash_size The number of hash buckets
+ * \param lru_head The series with its files open used last
+ * \param lru_tail The series with its files open used longest ago
+ * \param open The number of series with their files open
+ * \param points The number of points appended
+ * \param chunks The number of chunks sealed
+ */
+struct tsdb {
+  char dir[MAX_FILENAME_LEN];
+
+  struct tsdb_series *series;
+  unsigned count;
+  struct tsdb_series **hash;
+  unsigned hash_size;
+  struct tsdb_series *lru_head;
+  struct tsdb_series *lru_tail;
+  unsigned open;
+
+  unsigned long points;
+  unsigned long chunks;
+};
+
+/*
+ * \brief Struct to hold a sensor's files mapped for reading
+ * \param sensor_id The sensor_id
+ * \param index The index entries
+ * \param chunks The number of index entries
+ * \param data The .tsd file
+ * \param data_len The length of the .tsd file
+ * \param index_len The length of the .tsi file
+ */
+struct tsdb_reader {
+  uint32_t sensor_id;
+  const struct tsdb_index *index;
+  size_t chunks;
+  const uint8_t *data;
+  size_t data_len;
+  size_t index_len;
+};
+
+/*
+ * \brief Struct to hold a scan of the points of a series within a time
+ *        range. Chunks outside the range are skipped by their index entry.
+ * \param rd The reader
+ * \param t0 The start of the range, ms since the epoch, inclusive
+ * \param t1 The end of the range, ms since the epoch, exclusive
+ * \param chunk The index entry number of the next chunk
+ * \param c The chunk being read
+ * \param open A chunk is being read
+ * \param held A point read past the end of a bucket is held for the next
+ * \param t The time of the held point
+ * \param val The value of the held point
+ * \param chunks The number of chunks read
+ */
+struct tsdb_query {
+  struct tsdb_reader *rd;
+  int64_t t0;
+  int64_t t1;
+
+  size_t chunk;
+  struct tsdb_cursor c;
+  bool open;
+
+  bool held;
+  int64_t t;
+  double val;
+
+  size_t chunks;
+};
+
+/*
+ * \brief Struct to hold the aggregate of the points within a bucket
+ * \param t The start of the bucket, ms since the epoch
+ * \param count The number of points
+ * \param min The smallest value
+ * \param max The largest value
+ * \param sum The sum of the values
+ */
+struct tsdb_bucket {
+  int64_t t;
+  unsigned long count;
+  double min;
+  double max;
+  double sum;
+};
+
+/* chunk encoding */
+int tsdb_enc_put(struct tsdb_enc *enc, int64_t t, double val);
+void tsdb_enc_reset(struct tsdb_enc *enc);
+void tsdb_cursor_init(struct tsdb_cursor *c, const struct tsdb_index *idx,
+    const uint8_t *buf, size_t len);
+int tsdb_cursor_next(struct tsdb_cursor *c, int64_t *t, double *val);
+
+/* writing */
+int tsdb_open(struct tsdb **db_p, const char *dir);
+int tsdb_append(struct tsdb *db, uint32_t sensor_id, int64_t t, double val);
+int add_reading_tsdb(struct reading *r, struct tsdb *db);
+int tsdb_flush(struct tsdb *db);
+void free_tsdb(struct tsdb *db);
+
+/* reading */
+int tsdb_reader_open(struct tsdb_reader **rd_p, const char *dir,
+    uint32_t sensor_id);
+int tsdb_reader_chunk(struct tsdb_reader *rd, size_t chunk,
+    struct tsdb_cursor *c);
+void free_tsdb_reader(struct tsdb_reader *rd);
+
+/* range scans */
+void tsdb_query_init(struct tsdb_query *q, struct tsdb_reader *rd,
+    int64_t t0, int64_t t1);
+int tsdb_query_next(struct tsdb_query *q, int64_t *t, double *val);
+int tsdb_query_bucket(struct tsdb_query *q, int64_t width,
+    struct tsdb_bucket *b);
+
+#endif        /* TSDB__H */
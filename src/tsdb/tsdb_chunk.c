@@ -0,0 +1,337 @@
+/******************************************************************************
+ * File: tsdb_chunk.c
+ * Description: Gorilla-style compression of time-series chunks
+ * Author: Steven Swann - swannonline@googlemail.com
+ *
+ * Copyright (c) swannonline, 2013-2014
+ *
+ * This file is part of sensorspace.
+ *
+ * sensorspace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * sensorspace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with sensorspace.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+#include <stdlib.h>
+#include <string.h>
+
+#include "sensorspace.h"
+#include "tsdb.h"
+
+/* initial size of a chunk buffer */
+#define TSDB_ENC_MIN_SIZE         256
+
+/*
+ * Timestamps after the first are written as the difference between
+ * successive deltas (dod), in the smallest of these that holds it:
+ *
+ *   '0'                    dod == 0
+ *   '10'   + 7 bits        -64 <= dod < 64
+ *   '110'  + 9 bits        -256 <= dod < 256
+ *   '1110' + 12 bits       -2048 <= dod < 2048
+ *   '1111' + 64 bits       any other
+ *
+ * The first value is written whole, and each further value XORed with
+ * the last:
+ *
+ *   '0'                    the same value
+ *   '10' + meaningful bits within the last window of leading and
+ *                          trailing zeros
+ *   '11' + 5 bits leading zeros + 6 bits meaningful length (0 for 64)
+ *        + meaningful bits
+ */
+static const struct {
+  unsigned prefix;
+  unsigned prefix_bits;
+  unsigned bits;
+} tsdb_dod_class[] = {
+  { 0x2, 2, 7 },
+  { 0x6, 3, 9 },
+  { 0xe, 4, 12 },
+  { 0xf, 4, 64 },
+};
+
+#define TSDB_DOD_CLASSES  (sizeof(tsdb_dod_class) / sizeof(tsdb_dod_class[0]))
+
+/**
+ * \brief Append the n low bits of val, most significant first
+ */
+static int bits_put(struct tsdb_enc *enc, uint64_t val, unsigned n) {
+
+  size_t need = (enc->bit + n + 7) / 8, size;
+  unsigned space, take;
+  uint8_t *buf;
+
+  if (need > enc->size) {
+    size = enc->size ? enc->size * 2 : TSDB_ENC_MIN_SIZE;
+    while (size < need) {
+      size *= 2;
+    }
+    if (!(buf = realloc(enc->buf, size))) {
+      log_stderr(LOG_ERROR, "TSDB: Out of memory");
+      return SS_OUT_OF_MEM_ERROR;
+    }
+    memset(buf + enc->size, 0, size - enc->size);
+    enc->buf = buf;
+    enc->size = size;
+  }
+
+  while (n) {
+    space = 8 - (enc->bit & 7);
+    take = n < space ? n : space;
+    enc->buf[enc->bit >> 3] |=
+      ((val >> (n - take)) & ((1u << take) - 1)) << (space - take);
+    enc->bit += take;
+    n -= take;
+  }
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Read n bits, most significant first
+ */
+static int bits_get(struct tsdb_cursor *c, unsigned n, uint64_t *val) {
+
+  unsigned avail, take;
+  uint64_t v = 0;
+
+  if (c->bit + n > c->len * 8) {
+    return SS_READ_ERROR;
+  }
+
+  while (n) {
+    avail = 8 - (c->bit & 7);
+    take = n < avail ? n : avail;
+    v = (v << take) |
+      ((c->buf[c->bit >> 3] >> (avail - take)) & ((1u << take) - 1));
+    c->bit += take;
+    n -= take;
+  }
+  *val = v;
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Get the bits of a double
+ */
+static uint64_t double_bits(double val) {
+
+  uint64_t bits;
+
+  memcpy(&bits, &val, sizeof(bits));
+
+  return bits;
+}
+
+/**
+ * \brief Append a point to a chunk. Times should not go backwards.
+ * \param enc The chunk
+ * \param t The time, ms since the epoch
+ * \param val The value
+ */
+int tsdb_enc_put(struct tsdb_enc *enc, int64_t t, double val) {
+
+  int ret = SS_SUCCESS;
+  uint64_t bits = double_bits(val), xor;
+  unsigned leading, trailing, i;
+  int64_t delta, dod;
+
+  if (!enc->count) {
+    if ((ret = bits_put(enc, bits, 64))) {
+      return ret;
+    }
+    enc->t_first = t;
+    goto done;
+  }
+
+  /* time */
+  delta = t - enc->t_last;
+  dod = delta - enc->delta;
+  if (!dod) {
+    ret = bits_put(enc, 0, 1);
+  } else {
+    for (i = 0; i < TSDB_DOD_CLASSES - 1; i++) {
+      if (dod >= -(1LL << (tsdb_dod_class[i].bits - 1)) &&
+          dod < (1LL << (tsdb_dod_class[i].bits - 1))) {
+        break;
+      }
+    }
+    if (!(ret = bits_put(enc, tsdb_dod_class[i].prefix,
+            tsdb_dod_class[i].prefix_bits))) {
+      ret = bits_put(enc, (uint64_t)dod, tsdb_dod_class[i].bits);
+    }
+  }
+  if (ret) {
+    return ret;
+  }
+  enc->delta = delta;
+
+  /* value */
+  xor = bits ^ enc->val;
+  if (!xor) {
+    ret = bits_put(enc, 0, 1);
+  } else {
+    leading = __builtin_clzll(xor);
+    trailing = __builtin_ctzll(xor);
+    if (leading > 31) {
+      leading = 31;
+    }
+
+    if (enc->window && leading >= enc->leading &&
+        trailing >= enc->trailing) {
+      if (!(ret = bits_put(enc, 0x2, 2))) {
+        ret = bits_put(enc, xor >> enc->trailing,
+            64 - enc->leading - enc->trailing);
+      }
+    } else {
+      if (!(ret = bits_put(enc, 0x3, 2)) &&
+          !(ret = bits_put(enc, leading, 5)) &&
+          !(ret = bits_put(enc, (64 - leading - trailing) & 0x3f, 6))) {
+        ret = bits_put(enc, xor >> trailing, 64 - leading - trailing);
+      }
+      enc->leading = leading;
+      enc->trailing = trailing;
+      enc->window = true;
+    }
+  }
+  if (ret) {
+    return ret;
+  }
+
+done:
+  enc->val = bits;
+  enc->t_last = t;
+  enc->count++;
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Empty a chunk, keeping its buffer
+ */
+void tsdb_enc_reset(struct tsdb_enc *enc) {
+
+  if (enc->buf) {
+    memset(enc->buf, 0, (enc->bit + 7) / 8);
+  }
+  enc->bit = 0;
+  enc->count = 0;
+  enc->delta = 0;
+  enc->val = 0;
+  enc->leading = 0;
+  enc->trailing = 0;
+  enc->window = false;
+}
+
+/**
+ * \brief Start reading the points of a chunk
+ * \param c The cursor
+ * \param idx The chunk's index entry
+ * \param buf The compressed points
+ * \param len The length of buf
+ */
+void tsdb_cursor_init(struct tsdb_cursor *c, const struct tsdb_index *idx,
+    const uint8_t *buf, size_t len) {
+
+  memset(c, 0, sizeof(struct tsdb_cursor));
+  c->buf = buf;
+  c->len = len;
+  c->left = idx->count;
+  c->t = idx->t_first;
+}
+
+/**
+ * \brief Read the next point of a chunk
+ * \param t The time, ms since the epoch
+ * \param val The value
+ * \return SS_BUF_EMPTY after the last point, SS_READ_ERROR if the chunk
+ *         is corrupt
+ */
+int tsdb_cursor_next(struct tsdb_cursor *c, int64_t *t, double *val) {
+
+  unsigned i, leading, len;
+  uint64_t bit, bits;
+
+  if (!c->left) {
+    return SS_BUF_EMPTY;
+  }
+
+  if (!c->count) {
+    if (bits_get(c, 64, &c->val)) {
+      return SS_READ_ERROR;
+    }
+    goto done;
+  }
+
+  /* time */
+  for (i = 0; i < TSDB_DOD_CLASSES; i++) {
+    if (bits_get(c, 1, &bit)) {
+      return SS_READ_ERROR;
+    }
+    if (!bit) {
+      break;
+    }
+  }
+  if (i) {
+    len = tsdb_dod_class[i - 1].bits;
+    if (bits_get(c, len, &bits)) {
+      return SS_READ_ERROR;
+    }
+    /* sign extend */
+    if (len < 64 && bits & (1ULL << (len - 1))) {
+      bits |= ~0ULL << len;
+    }
+    c->delta += (int64_t)bits;
+  }
+  c->t += c->delta;
+
+  /* value */
+  if (bits_get(c, 1, &bit)) {
+    return SS_READ_ERROR;
+  }
+  if (bit) {
+    if (bits_get(c, 1, &bit)) {
+      return SS_READ_ERROR;
+    }
+    if (bit) {
+      if (bits_get(c, 5, &bits)) {
+        return SS_READ_ERROR;
+      }
+      leading = bits;
+      if (bits_get(c, 6, &bits)) {
+        return SS_READ_ERROR;
+      }
+      len = bits ? bits : 64;
+      if (leading + len > 64) {
+        return SS_READ_ERROR;
+      }
+      c->leading = leading;
+      c->trailing = 64 - leading - len;
+    }
+
+    len = 64 - c->leading - c->trailing;
+    if (bits_get(c, len, &bits)) {
+      return SS_READ_ERROR;
+    }
+    c->val ^= bits << c->trailing;
+  }
+
+done:
+  *t = c->t;
+  memcpy(val, &c->val, sizeof(*val));
+  c->left--;
+  c->count++;
+
+  return SS_SUCCESS;
+}
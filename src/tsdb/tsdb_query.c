@@ -0,0 +1,159 @@
+/******************************************************************************
+ * File: tsdb_query.c
+ * Description: range scans of the native time-series store
+ * Author: Steven Swann - swannonline@googlemail.com
+ *
+ * Copyright (c) swannonline, 2013-2014
+ *
+ * This file is part of sensorspace.
+ *
+ * sensorspace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * sensorspace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with sensorspace.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+#include <string.h>
+#include <math.h>
+
+#include "sensorspace.h"
+#include "tsdb.h"
+
+/**
+ * \brief Start a scan of the points of a series within [t0, t1)
+ * \param q The scan
+ * \param rd The reader of the series
+ * \param t0 The start of the range, ms since the epoch, inclusive
+ * \param t1 The end of the range, ms since the epoch, exclusive
+ */
+void tsdb_query_init(struct tsdb_query *q, struct tsdb_reader *rd,
+    int64_t t0, int64_t t1) {
+
+  size_t lo = 0, hi = rd->chunks, mid;
+
+  memset(q, 0, sizeof(struct tsdb_query));
+  q->rd = rd;
+  q->t0 = t0;
+  q->t1 = t1;
+
+  /* chunks are in time order, find the first ending at or after t0 */
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (rd->index[mid].t_last < t0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  q->chunk = lo;
+}
+
+/**
+ * \brief Read the next point of a scan
+ * \param q The scan
+ * \param t The time, ms since the epoch
+ * \param val The value
+ * \return SS_BUF_EMPTY after the last point in range, SS_READ_ERROR if a
+ *         chunk is damaged
+ */
+int tsdb_query_next(struct tsdb_query *q, int64_t *t, double *val) {
+
+  int ret;
+
+  if (q->held) {
+    q->held = false;
+    *t = q->t;
+    *val = q->val;
+    return SS_SUCCESS;
+  }
+
+  while (1) {
+    if (!q->open) {
+      if (q->chunk >= q->rd->chunks ||
+          q->rd->index[q->chunk].t_first >= q->t1) {
+        return SS_BUF_EMPTY;
+      }
+      if ((ret = tsdb_reader_chunk(q->rd, q->chunk++, &q->c))) {
+        return ret;
+      }
+      q->open = true;
+      q->chunks++;
+    }
+
+    if ((ret = tsdb_cursor_next(&q->c, t, val)) == SS_BUF_EMPTY) {
+      q->open = false;
+      continue;
+    } else if (ret) {
+      log_stderr(LOG_ERROR, "TSDB: Chunk %zu of sensor %u is damaged",
+          q->chunk - 1, q->rd->sensor_id);
+      return ret;
+    }
+
+    if (*t >= q->t1) {
+      /* no later chunk can be in range */
+      q->open = false;
+      q->chunk = q->rd->chunks;
+      return SS_BUF_EMPTY;
+    } else if (*t >= q->t0) {
+      return SS_SUCCESS;
+    }
+  }
+}
+
+/**
+ * \brief Read the next bucket of a scan holding any points. Buckets are
+ *        width ms long, starting from t0. NaN values are left out.
+ * \param q The scan
+ * \param width The bucket length, ms
+ * \param b The aggregate of the bucket
+ * \return SS_BUF_EMPTY after the last bucket, SS_READ_ERROR if a chunk is
+ *         damaged
+ */
+int tsdb_query_bucket(struct tsdb_query *q, int64_t width,
+    struct tsdb_bucket *b) {
+
+  int64_t t;
+  double val;
+  int ret;
+
+  memset(b, 0, sizeof(struct tsdb_bucket));
+
+  while (!(ret = tsdb_query_next(q, &t, &val))) {
+    if (b->count && t >= b->t + width) {
+      /* the first point of the next bucket */
+      q->held = true;
+      q->t = t;
+      q->val = val;
+      return SS_SUCCESS;
+    }
+    if (isnan(val)) {
+      continue;
+    }
+
+    if (!b->count) {
+      b->t = q->t0 + (t - q->t0) / width * width;
+      b->min = val;
+      b->max = val;
+    } else if (val < b->min) {
+      b->min = val;
+    } else if (val > b->max) {
+      b->max = val;
+    }
+    b->sum += val;
+    b->count++;
+  }
+
+  if (ret == SS_BUF_EMPTY && b->count) {
+    return SS_SUCCESS;
+  }
+
+  return ret;
+}
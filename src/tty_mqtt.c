@@ -26,6 +26,7 @@
 #include <string.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <signal.h>
 
 #include <getopt.h>
 
@@ -34,7 +35,11 @@
 
 #include "sensorspace.h"
 #include "reading/reading.h"
+#include "reading/reading_remap.h"
 #include "serial/tty_conn.h"
+#include "mqtt_batch.h"
+#include "mqtt_conn.h"
+#include "evloop.h"
 #include "log.h"
 
 #define MQTT_DEFAULT_TOPIC    "sensorspace/readings/"
@@ -59,8 +64,23 @@ typedef enum {
   RAW_DEV
 } device_type_t;
 
+/*
+ * \brief Struct to hold a currentcost frame under assembly
+ * \param buf The frame data
+ * \param len The length of the frame data
+ * \param ts The arrival time of the first byte of the frame
+ * \param oversized True when the current frame is being discarded
+ */
+struct cc_frame {
+  char buf[RX_BUF_LEN];
+  size_t len;
+  struct timespec ts;
+  bool oversized;
+};
+
 static int print_usage(void);
-static int process_cc_buffer(char *buf, size_t *len);
+static int process_cc_buffer(struct cc_frame *f, const char *buf, size_t *len,
+    const struct timespec *ts);
 
 /*
  * \brief function to print help
@@ -88,6 +108,10 @@ static int print_usage() {
       " -i [--ini]               : Embed the reading in INI format\n"
       "                            NOTE: Not currently supported\n"
       " -R [--remap] <id>:<to_id>: Remap sensor IDs for received readings\n"
+      " -m [--remap-file] <file> : Load sensor ID remaps from <file>, one\n"
+      "                            '<id>:<to_id>' per line. The file is\n"
+      "                            reloaded on SIGHUP, -R remaps take\n"
+      "                            precedence.\n"
       "\n"
       "TTY Device options:\n"
       " -D [--tty-dev] <tty-dev> : The TTY device to connect to.\n"
@@ -97,6 +121,19 @@ static int print_usage() {
       " -t [--topic] <topic>     : Change the default topic. \n"
       "                            Default: 'sensorspace/readings/'\n"
       " -r [--retain]            : Set the retain flag\n"
+      " -L [--linger] <ms>       : Batch readings for up to <ms> milliseconds\n"
+      "                            before publishing. Default: 0 (disabled)\n"
+      " -S [--batch-size] <bytes>: Maximum batch payload size. Default: 1024\n"
+      " -F [--spool] <file>      : Spool packets that could not be sent to\n"
+      "                            <file>, sending them once the broker\n"
+      "                            is reachable.\n"
+      " -f [--spool-rate] <rate> : Maximum spool replay rate, packets/second\n"
+      "                            Default: 1000\n"
+      " -Q [--qos] <0|1>         : Publish QoS level. Default: 0\n"
+      " -W [--window] <n>        : Maximum unacknowledged QoS 1 packets\n"
+      "                            Default: 64\n"
+      " -A [--ack-timeout] <ms>  : Retransmit QoS 1 packets that are not\n"
+      "                            acknowledged within <ms>. Default: 5000\n"
       "\n"
       "Broker options:\n"
       " -b [--broker] <broker-IP>: Change the default broker IP - only IP\n"
@@ -104,6 +141,8 @@ static int print_usage() {
       "                            Default: localhost\n"
       " -p [--port] <port>       : Change the default port. Default: 1883\n"
       " -c [--clientid] <id>     : Change the default clientid\n"
+      " -k [--keepalive] <s>     : Seconds between keepalive PINGREQs, 0 to\n"
+      "                            disable. Default: 30\n"
       "\n"
       "\nDebug options:\n"
       " -v [--verbose] <LEVEL>   : set verbose level to LEVEL\n"
@@ -119,92 +158,391 @@ static int print_usage() {
 }
 
 /*
- * \brief Fucntion to process incoming currentcost data.
+ * \brief Function to process incoming currentcost data into frames.
+ *        Bytes are consumed up to, and including, the end of the current
+ *        frame. A frame is stamped with the arrival time of its first byte.
+ * \param f The frame being assembled
  * \param buf data buffer holding raw TTY data
- * \param len length of buffer
+ * \param len length of buffer, updated with the number of bytes consumed
+ * \param ts arrival time of the data in buf
+ * \return SS_SUCCESS when f holds a complete frame, else SS_CONTINUE
  */
-static int process_cc_buffer(char *buf, size_t *len) {
-  static char cc_buf[RX_BUF_LEN];
-  static size_t cc_buf_len = 0;
-  static bool oversized = false;
-
-  /* backup bytes received until we receive newline */
-  strncpy((char *)&cc_buf + cc_buf_len, buf, *len);
-  cc_buf_len += *len;
-
-  if (0) {
-    /* test conversion */
-    strncpy((char *)&cc_buf,
-        "<msg><src>CC128-v0.12</src><dsb>00396</dsb><time>02:49:31</time>"
-        "<tmpr>21.9</tmpr><sensor>0</sensor><id>00983</id><type>1</type>"
-        "<ch1><watts>00836</watts></ch1></msg>",
-        strlen(
-          "<msg><src>CC128-v0.12</src><dsb>00396</dsb><time>02:49:31</time>"
-          "<tmpr>21.9</tmpr><sensor>0</sensor><id>00983</id><type>1</type>"
-          "<ch1><watts>00836</watts></ch1></msg>"));
-  }
-
-
-  /* ensure complete cc packet */
-  if (!strstr(cc_buf, "\n") && !strstr(cc_buf, CC_DEV_MSG_END_STRING)) {
-    /* discard oversized packets */
-    if (cc_buf_len == RX_BUF_LEN) {
-      log_stderr(LOG_ERROR, "TTY packet oversized, discarding data");
-      oversized = true;
-      cc_buf_len = 0;
-      return SS_CONTINUE;
+static int process_cc_buffer(struct cc_frame *f, const char *buf, size_t *len,
+    const struct timespec *ts) {
+  size_t i;
+  bool end = false;
+
+  for (i = 0; i < *len && !end; i++) {
+
+    if (buf[i] == '\n' || buf[i] == '\r') {
+      end = true;
+      continue;
+    }
+
+    if (!f->len) {
+      /* first byte of a new frame */
+      f->ts = *ts;
+    }
+
+    if (f->len == RX_BUF_LEN - 1) {
+      /* discard oversized packets */
+      if (!f->oversized) {
+        log_stderr(LOG_ERROR, "TTY packet oversized, discarding data");
+        f->oversized = true;
+      }
+      f->len = 0;
+    }
+
+    f->buf[f->len++] = buf[i];
+
+    /* ensure complete cc packet */
+    if (f->len >= strlen(CC_DEV_MSG_END_STRING) &&
+        !strncmp(f->buf + f->len - strlen(CC_DEV_MSG_END_STRING),
+          CC_DEV_MSG_END_STRING, strlen(CC_DEV_MSG_END_STRING))) {
+      end = true;
     }
+  }
+  *len = i;
 
+  if (!end) {
     log_stdout(LOG_DEBUG, "awaiting more data");
     return SS_CONTINUE;
   }
 
-  if (oversized) {
-    oversized = false;
-    cc_buf_len = 0;
+  if (f->oversized) {
+    f->oversized = false;
+    f->len = 0;
     log_stderr(LOG_DEBUG, "discarding remains of oversized packet");
     return SS_CONTINUE;
   }
 
-  if (cc_buf_len <= 1) {
+  if (f->len <= 1) {
     /* Probably just a black line, ignore */
     log_stdout(LOG_DEBUG, "ignoring empty line");
-    cc_buf_len = 0;
+    f->len = 0;
     return SS_CONTINUE;
   }
 
-  cc_buf_len = 0;
-  strncpy((char *)buf, (char *)&cc_buf, cc_buf_len);
-  *len = cc_buf_len;
+  f->buf[f->len] = '\0';
+  f->len = 0;
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Build a new remap table from the remap file and the remaps given
+ *        on the command line, which take precedence. The current table is
+ *        only replaced once the new table is complete.
+ * \param rm_p Pointer to the current remap table
+ * \param path The remap file, or an empty string
+ * \param cli The command line remaps, may be NULL
+ */
+static int load_remaps(struct sensor_remaps **rm_p, const char *path,
+    struct sensor_remaps *cli) {
+
+  struct sensor_remaps *rm = NULL;
+  int ret;
+
+  if (path[0]) {
+    ret = sensor_remaps_load(&rm, path);
+  } else {
+    ret = sensor_remaps_init(&rm, cli ? cli->count : 0);
+  }
+
+  if (!ret) {
+    ret = sensor_remaps_merge(rm, cli);
+  }
+
+  if (ret) {
+    free_sensor_remaps(rm);
+    return ret;
+  }
+
+  free_sensor_remaps(*rm_p);
+  *rm_p = rm;
 
   return SS_SUCCESS;
 }
 
-struct sensor_remaps {
-  uint32_t rmap_id[READ_MEAS_COUNT];
-  uint32_t id[READ_MEAS_COUNT];
-  uint8_t count;
+/*
+ * \brief Struct to hold the event loop state
+ * \param el The event loop
+ * \param tty The TTY device
+ * \param tty_fd The TTY fd registered with the loop, -1 if none
+ * \param tty_connected The TTY state when tty_fd was registered
+ * \param throttled TTY input is held back while output is congested
+ * \param type The device type
+ * \param frame The currentcost frame under assembly
+ * \param r The reading decoded from each frame
+ * \param rmaps The sensor ID remaps
+ * \param cli_rmaps The sensor ID remaps given on the command line
+ * \param remap_file The remap file, reloaded on SIGHUP
+ * \param topic The topic readings are published to
+ * \param batcher The batching publisher
+ * \param q The QoS 1 publisher, or NULL
+ * \param ret The error that stopped the loop
+ */
+struct tty_loop {
+  struct evloop *el;
+  struct tty_conn *tty;
+  int tty_fd;
+  bool tty_connected;
+  bool throttled;
+  device_type_t type;
+  struct cc_frame frame;
+  struct reading *r;
+  struct sensor_remaps *rmaps;
+  struct sensor_remaps *cli_rmaps;
+  const char *remap_file;
+  const char *topic;
+  struct mqtt_batcher *batcher;
+  struct mqtt_qos *q;
+  int ret;
 };
 
-static void remap_reading_sensor_ids(struct reading *r,
-    struct sensor_remaps *rmap) {
-  int i, j;
+static void tty_input(struct evloop *el, int fd, uint32_t events,
+    void *arg);
 
-  if (rmap->count && r->count) {
-    for (i = 0; i < r->count; i++) {
-      for (j = 0; j < rmap->count; j++) {
-        if (rmap->id[j] == r->meas[i]->sensor_id) {
-          r->meas[i]->sensor_id = rmap->rmap_id[j];
-          log_stdout(LOG_DEBUG, "remapped sensor_id: %d->%d",
-              rmap->id[j], r->meas[i]->sensor_id);
+/**
+ * \brief Register the TTY device with the loop, or the watch for it to
+ *        return while disconnected. The fd changes with the device state.
+ */
+static int tty_rewatch(struct tty_loop *loop) {
 
-          break;
-        }
-      }
+  struct tty_conn *tty = loop->tty;
+  int fd = tty->connected ? tty->fd : tty->watch_fd;
+
+  if (fd == loop->tty_fd && tty->connected == loop->tty_connected) {
+    return SS_SUCCESS;
+  }
+
+  if (loop->tty_fd >= 0) {
+    evloop_del_fd(loop->el, loop->tty_fd);
+    loop->tty_fd = -1;
+  }
+
+  if (evloop_add_fd(loop->el, fd, loop->throttled ? 0 : EPOLLIN, tty_input,
+        loop)) {
+    return SS_INIT_ERROR;
+  }
+  loop->tty_fd = fd;
+  loop->tty_connected = tty->connected;
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Stop or resume reading the TTY device. While stopped, the device
+ *        data waits in the kernel's TTY buffer.
+ */
+static void tty_throttle(struct tty_loop *loop, bool throttle) {
+
+  if (throttle == loop->throttled || loop->tty_fd < 0) {
+    return;
+  }
+
+  log_stdout(LOG_DEBUG, "%s TTY input", throttle ? "Holding" : "Resuming");
+  if (!evloop_mod_fd(loop->el, loop->tty_fd, throttle ? 0 : EPOLLIN)) {
+    loop->throttled = throttle;
+  }
+}
+
+/**
+ * \brief Decode, remap and queue each currentcost frame completed by the
+ *        data read
+ */
+static int tty_publish_cc(struct tty_loop *loop, const char *buf,
+    size_t buf_len) {
+
+  struct reading *r = loop->r;
+  char msg[MAX_MSG_LEN] = "\0";
+  size_t off, n, len;
+  int ret;
+
+  /* a single read may complete one frame and begin the next */
+  for (off = 0; off < buf_len; off += n) {
+    n = buf_len - off;
+    ret = process_cc_buffer(&loop->frame, buf + off, &n, &loop->tty->rx_ts);
+    if (ret == SS_CONTINUE) {
+      log_stdout(LOG_DEBUG, "No complete frame available");
+      continue;
     }
+
+    /* process reading, stamped with the frame's arrival time */
+    free_measurements(r);
+    r->ts = loop->frame.ts;
+    localtime_r(&r->ts.tv_sec, &r->t);
+
+    ret = convert_cc_dev_reading(r, loop->frame.buf, loop->frame.len);
+    if (ret) {
+      log_stderr(LOG_ERROR, "failed to decode output");
+      continue;
+    }
+
+    remap_reading_sensor_ids(r, loop->rmaps);
+
+    log_stdout(LOG_INFO, "Received new reading:");
+    print_reading(r);
+
+    /* process message */
+    log_stdout(LOG_INFO, "Processing reading");
+    len = MAX_MSG_LEN;
+    ret = convert_reading_json(r, msg, &len);
+    if (ret) {
+      log_stderr(LOG_ERROR, "failed to encode reading into JSON");
+      continue;
+    }
+
+    ret = mqtt_batcher_add(loop->batcher, loop->topic, (uint8_t *)msg,
+        strlen(msg));
+    if (ret == SS_INIT_ERROR || ret == SS_OUT_OF_MEM_ERROR) {
+      return ret;
+    }
+  }
+
+  return SS_SUCCESS;
+}
+
+/**
+ * \brief Event loop callback reading the TTY device, or handling the
+ *        watch for it to return
+ */
+static void tty_input(struct evloop *el, int fd, uint32_t events,
+    void *arg) {
+
+  struct tty_loop *loop = (struct tty_loop *)arg;
+  struct tty_conn *tty = loop->tty;
+  char buf[RX_BUF_LEN];
+  char msg[MAX_MSG_LEN] = "\0";
+  size_t buf_len = RX_BUF_LEN;
+  int ret = SS_SUCCESS;
+
+  (void)fd;
+  (void)events;
+
+  if (!tty->connected) {
+    if ((ret = tty_conn_watch_event(tty)) == SS_INIT_ERROR) {
+      log_stderr(LOG_ERROR, "Unable to watch for TTY device");
+      goto stop;
+    }
+    ret = SS_SUCCESS;
+    goto rewatch;
+  }
+
+  /* packet border */
+  log_stdout(LOG_INFO,
+      "------------------------------------------------------------");
+
+  ret = tty_conn_read(tty, (char *)&buf, &buf_len);
+  if (ret == SS_TTY_DISCONNECT) {
+    /* keep the broker session up until the device returns */
+    log_stderr(LOG_WARN, "TTY device disconnected: %s", tty->path);
+    loop->frame.len = 0;
+    ret = tty_conn_watch(tty);
+    if (ret == SS_INIT_ERROR) {
+      log_stderr(LOG_ERROR, "Unable to watch for TTY device");
+      goto stop;
+    }
+    ret = SS_SUCCESS;
+    goto rewatch;
+
+  } else if (ret && ret != SS_CONTINUE) {
+    log_stderr(LOG_ERROR, "Read: %d:%s", errno, strerror(errno));
+    goto stop;
+
+  } else if (ret == SS_CONTINUE || !buf_len) {
+    return;
+  }
+
+  /* process tty data */
+  log_stdout(LOG_INFO, "Processing received data");
+
+  if (CURRENT_COST_DEV == loop->type) {
+    ret = tty_publish_cc(loop, buf, buf_len);
+
+  } else if (FLOW_DEV == loop->type) {
+    /* not currently supported */
+
+  } else if (RAW_DEV == loop->type) {
+    /* Simply copy buffer to message payload */
+    buf_len = buf_len < MAX_MSG_LEN - 1 ? buf_len : MAX_MSG_LEN - 1;
+    memcpy((void *)msg, (void *)buf, buf_len);
+    msg[buf_len] = '\0';
+    log_stdout(LOG_INFO, "RAW payload ready");
+
+    ret = mqtt_batcher_add(loop->batcher, loop->topic, (uint8_t *)msg,
+        strlen(msg));
   }
 
+  if (ret == SS_INIT_ERROR || ret == SS_OUT_OF_MEM_ERROR) {
+    goto stop;
+  }
   return;
+
+rewatch:
+  if (!(ret = tty_rewatch(loop))) {
+    return;
+  }
+
+stop:
+  loop->ret = ret;
+  evloop_stop(el);
+}
+
+/**
+ * \brief Managed connection callback handing PUBACKs, and anything else
+ *        the broker sends, to the QoS 1 publisher
+ */
+static void tty_broker_input(struct mqtt_conn *mc, void *arg) {
+
+  struct tty_loop *loop = (struct tty_loop *)arg;
+  struct mqtt_frame frame;
+
+  while (!mqtt_conn_next(mc, &frame)) {
+    if (!loop->q || mqtt_qos_handle(loop->q, &frame)) {
+      log_stdout(LOG_DEBUG, "Ignoring packet type 0x%02x", frame.ctrl);
+    }
+  }
+
+  /* acknowledgements free the window for spooled packets */
+  mqtt_batcher_arm(loop->batcher);
+}
+
+/**
+ * \brief Batcher callback holding back TTY input while the broker falls
+ *        behind
+ */
+static void tty_flushed(struct mqtt_batcher *b, void *arg) {
+
+  tty_throttle((struct tty_loop *)arg, mqtt_conn_congested(b->mc));
+}
+
+/**
+ * \brief Reload the sensor ID remaps on SIGHUP
+ */
+static void tty_reload(struct evloop *el, int sig, void *arg) {
+
+  struct tty_loop *loop = (struct tty_loop *)arg;
+
+  (void)el;
+  (void)sig;
+
+  log_stdout(LOG_INFO, "Reloading sensor ID remaps");
+  if (load_remaps(&loop->rmaps, loop->remap_file, loop->cli_rmaps)) {
+    log_stderr(LOG_ERROR, "Keeping the current sensor ID remaps");
+  }
+}
+
+/**
+ * \brief Stop the event loop on SIGINT or SIGTERM, pending batches are
+ *        published before exiting
+ */
+static void tty_stop(struct evloop *el, int sig, void *arg) {
+
+  (void)arg;
+
+  log_stdout(LOG_INFO, "Received signal %d, stopping", sig);
+  evloop_stop(el);
 }
 
 int main(int argc, char **argv) {
@@ -212,20 +550,26 @@ int main(int argc, char **argv) {
   int ret;
   int c, option_index = 0;
 
-  /* select variables */
-  fd_set read_fds;
-  int nfds = 0;
+  /* event loop variables */
+  static struct tty_loop loop = { .tty_fd = -1 };
 
   /* mqtt variables */
   char topic[MAX_TOPIC_LEN] = MQTT_DEFAULT_TOPIC;
   char broker_ip[16] = MQTT_BROKER_IP;
   int broker_port = MQTT_BROKER_PORT;
   char clientid[UMQTT_CLIENTID_MAX_LEN] = "\0";
+  unsigned keepalive = MQTT_CONN_DEFAULT_KEEPALIVE;
   uint8_t retain = 0;
-  char msg[MAX_MSG_LEN] = "\0";
-  size_t len = MAX_MSG_LEN;
-  struct broker_conn *conn;
-  struct mqtt_packet *pkt = NULL;
+  struct mqtt_conn *mc = NULL;
+  struct mqtt_batcher *batcher = NULL;
+  unsigned linger_ms = 0;
+  size_t batch_bytes = 0;
+  struct mqtt_spool *spool = NULL;
+  char spool_file[MAX_FILENAME_LEN] = "\0";
+  unsigned spool_rate = 0;
+  uint8_t qos = 0;
+  unsigned window = 0, ack_ms = 0;
+  struct mqtt_qos *q = NULL;
 
   /* reading variables */
   struct reading *r = NULL;
@@ -234,17 +578,12 @@ int main(int argc, char **argv) {
     return -1;
   }
 
-  /* set reading date to now */
-  time_t t = time(0);
-
   /* Reading sensor id remaps */
-  struct sensor_remaps rmaps;
-  rmaps.count = 0;
-  char *rmap_buf[64];
+  struct sensor_remaps *cli_rmaps = NULL;
+  char remap_file[MAX_FILENAME_LEN] = "\0";
+  uint32_t rmap_id, rmap_to_id;
 
   /* tty variables */
-  char buf[RX_BUF_LEN];
-  size_t buf_len = RX_BUF_LEN;
   device_type_t type = RAW_DEV;
 
   struct tty_conn *tty;
@@ -269,21 +608,31 @@ int main(int argc, char **argv) {
     {"json", no_argument,               0, 'j'},
     {"ini", no_argument,                0, 'i'},
     {"remap", required_argument,        0, 'R'},
+    {"remap-file", required_argument,   0, 'm'},
     {"retain",  no_argument,            0, 'r'},
+    {"linger", required_argument,       0, 'L'},
+    {"batch-size", required_argument,   0, 'S'},
+    {"spool", required_argument,        0, 'F'},
+    {"spool-rate", required_argument,   0, 'f'},
+    {"qos", required_argument,          0, 'Q'},
+    {"window", required_argument,       0, 'W'},
+    {"ack-timeout", required_argument,  0, 'A'},
     {"tty-dev", required_argument,      0, 'D'},
     {"baud", required_argument,         0, 'B'},
     {"topic", required_argument,        0, 't'},
     {"broker", required_argument,       0, 'b'},
     {"port", required_argument,         0, 'p'},
     {"clientid", required_argument,     0, 'c'},
+    {"keepalive", required_argument,    0, 'k'},
     {0, 0, 0, 0}
   };
 
   /* get arguments */
   while (1)
   {
-    if ((c = getopt_long(argc, argv, "hv:s:d:T:D:B:jirt:b:p:c:R:",
-            long_options, &option_index)) != -1) {
+    if ((c = getopt_long(argc, argv,
+            "hv:s:d:T:D:B:jirt:b:p:c:k:R:m:L:S:F:f:Q:W:A:", long_options,
+            &option_index)) != -1) {
 
       switch (c) {
         case 'h':
@@ -301,6 +650,83 @@ int main(int argc, char **argv) {
           retain = 1;
           break;
 
+        case 'L':
+          /* set batch linger time */
+          if (optarg) {
+            linger_ms = atoi(optarg);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The linger flag should be followed by a time in ms");
+            return print_usage();
+          }
+          break;
+
+        case 'S':
+          /* set maximum batch size */
+          if (optarg) {
+            batch_bytes = atoi(optarg);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The batch-size flag should be followed by a size in bytes");
+            return print_usage();
+          }
+          break;
+
+        case 'Q':
+          /* set publish QoS */
+          if (optarg && (atoi(optarg) == 0 || atoi(optarg) == 1)) {
+            qos = atoi(optarg);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The qos flag should be followed by 0 or 1");
+            return print_usage();
+          }
+          break;
+
+        case 'W':
+          /* set QoS 1 in-flight window */
+          if (optarg) {
+            window = atoi(optarg);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The window flag should be followed by a packet count");
+            return print_usage();
+          }
+          break;
+
+        case 'A':
+          /* set QoS 1 retransmit timeout */
+          if (optarg) {
+            ack_ms = atoi(optarg);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The ack-timeout flag should be followed by a time in ms");
+            return print_usage();
+          }
+          break;
+
+        case 'F':
+          /* set spool file */
+          if (optarg) {
+            strncpy(spool_file, optarg, sizeof(spool_file) - 1);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The spool flag should be followed by a file");
+            return print_usage();
+          }
+          break;
+
+        case 'f':
+          /* set spool replay rate */
+          if (optarg) {
+            spool_rate = atoi(optarg);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The spool-rate flag should be followed by a rate");
+            return print_usage();
+          }
+          break;
+
         case 't':
           /* Set topic */
           if (optarg) {
@@ -336,15 +762,15 @@ int main(int argc, char **argv) {
 
         case 'R':
           /* Remap a devices sensor id with another sensor id */
-          if (optarg) {
-            strcpy((char *)rmap_buf, optarg);
-            rmaps.id[rmaps.count] = atoi((char *)rmap_buf);
-            rmaps.rmap_id[rmaps.count] =
-              atoi(strchr((char *)rmap_buf, ':') + 1);
-            log_stdout(LOG_INFO, "Remapping sensor ID: %d to %d",
-                rmaps.id[rmaps.count], rmaps.rmap_id[rmaps.count]);
-
-            rmaps.count++;
+          if (optarg && !sensor_remap_parse(optarg, &rmap_id, &rmap_to_id)) {
+            if (!cli_rmaps && sensor_remaps_init(&cli_rmaps, 0)) {
+              return -1;
+            }
+            if (sensor_remaps_add(cli_rmaps, rmap_id, rmap_to_id)) {
+              return -1;
+            }
+            log_stdout(LOG_INFO, "Remapping sensor ID: %u to %u",
+                rmap_id, rmap_to_id);
           } else {
             log_stderr(LOG_ERROR,
                 "The remap flag should be followed by two sensor IDs");
@@ -352,6 +778,17 @@ int main(int argc, char **argv) {
           }
           break;
 
+        case 'm':
+          /* Load sensor id remaps from a file */
+          if (optarg) {
+            strncpy(remap_file, optarg, sizeof(remap_file) - 1);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The remap-file flag should be followed by a file");
+            return print_usage();
+          }
+          break;
+
         case 'D':
           /* Set the TTY device file */
           if (optarg) {
@@ -412,7 +849,7 @@ int main(int argc, char **argv) {
         case 'p':
           /* change the default port */
           if (optarg) {
-            broker_port = *optarg;
+            broker_port = atoi(optarg);
           } else {
             log_stderr(LOG_ERROR,
                 "The port flag should be followed by a port");
@@ -431,6 +868,17 @@ int main(int argc, char **argv) {
           }
           break;
 
+        case 'k':
+          /* set keepalive interval */
+          if (optarg) {
+            keepalive = atoi(optarg);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The keepalive flag should be followed by a time in seconds");
+            return print_usage();
+          }
+          break;
+
       }
     } else {
       /* Final arguement */
@@ -438,198 +886,127 @@ int main(int argc, char **argv) {
     }
   }
 
-  /* init connections */
-  log_stdout(LOG_INFO, "Initialising broker socket connection");
-
-  init_linux_socket_connection(&conn, broker_ip, sizeof(broker_ip), broker_port);
-  if (!conn) {
-    log_stdout(LOG_ERROR, "Initialising socket connection");
-    return -1;
-  }
-
-  if (clientid[0]) {
-    broker_set_clientid(conn, clientid, sizeof(clientid));
+  /* load sensor id remaps */
+  if ((remap_file[0] || cli_rmaps) &&
+      load_remaps(&loop.rmaps, remap_file, cli_rmaps)) {
+    log_stderr(LOG_ERROR, "Loading sensor ID remaps");
+    ret = -1;
+    goto free;
   }
 
-  log_stdout(LOG_INFO, "Connecting to broker");
-
-  struct linux_broker_socket *skt = '\0';
-  if ((ret = broker_connect(conn))) {
-    log_stderr(LOG_ERROR, "Connecting to broker");
-    free_connection(conn);
-    return ret;
-  } else {
-    skt = (struct linux_broker_socket *)conn->context;
-    log_stdout(LOG_INFO,
-        "Connected to broker:\nip: %s port: %d", skt->ip, skt->port);
-  }
+  /* currentcost frames are assembled byte-wise to stamp their arrival */
+  tty->raw = (type == CURRENT_COST_DEV);
 
-  /* test tty config */
+  /* open the tty device, or wait for it to be plugged in */
   log_stdout(LOG_INFO, "TTY device: %s, baud: %d", tty->path, tty->baud);
   if (tty_conn_check_config(tty)) {
-    log_stdout(LOG_ERROR, "Testing TTY device config");
-    return -1;
+    log_stderr(LOG_WARN, "Waiting for TTY device: %s", tty->path);
+    ret = tty_conn_watch(tty);
+  } else {
+    ret = tty_conn_open(tty);
   }
-
-  /* Open tty device */
-  ret = tty_conn_open(tty);
-  if (ret) {
+  if (ret && ret != SS_CONTINUE) {
     log_stderr(LOG_ERROR, "Opening TTY device");
-    free_connection(conn);
-    free_tty_conn(tty);
-    return ret;
+    goto free;
   }
 
-  /* wait for data - main program loop */
-  while (1) {
-
-    /* select init */
-    FD_ZERO(&read_fds);
-    nfds = ((tty->fd > skt->sockfd) ? tty->fd : skt->sockfd) + 1;
-    FD_SET(tty->fd, &read_fds);
-    FD_SET(skt->sockfd, &read_fds);
-
-    ret = select(nfds, &read_fds, NULL, NULL, NULL);
-    if (ret == -1) {
-      if (errno == EINTR) {
-        log_stderr(LOG_ERROR, "Select: %s: %s", tty->path, strerror(errno));
-        continue;
-      }
-      log_stderr(LOG_ERROR, "Select failed: %s: %s", tty->path,
-          strerror(errno));
-      continue;
-
-    } else if (!ret) {
-      /* should never get here since disabled timeout */
-      log_stdout(LOG_DEBUG, "select timed out");
-    }
-
-    /* Determine if any fds are ready */
-    if (FD_ISSET(tty->fd, &read_fds)) {
-
-      /* packet border */
-      log_stdout(LOG_INFO,
-          "------------------------------------------------------------");
-
-      /* set reading time to now */
-      t = time(0);
-      localtime_r(&t, &r->t);
-
-      buf_len = RX_BUF_LEN;
-      ret = tty_conn_read(tty, (char *)&buf, &buf_len);
-      if (ret && ret != SS_CONTINUE) {
-        log_stderr(LOG_ERROR, "Read: %d:%s", errno, strerror(errno));
-        break;
-
-      } else if (ret == SS_CONTINUE) {
-        continue;
-
-      } else if (buf_len) {
-        /* process tty data */
-        log_stdout(LOG_INFO, "Processing received data");
-
-        if (CURRENT_COST_DEV == type) {
-
-          ret = process_cc_buffer(buf, &buf_len);
-          if (ret == SS_CONTINUE) {
-            log_stdout(LOG_INFO, "No data available");
-            continue;
-          }
-
-          /* process reading */
-          free_measurements(r);
-          ret = convert_cc_dev_reading(r, buf, buf_len);
-          if (ret) {
-            log_stderr(LOG_ERROR, "failed to decode output");
-            continue;
-          }
-
-          remap_reading_sensor_ids(r, &rmaps);
-
-          log_stdout(LOG_INFO, "Received new reading:");
-          print_reading(r);
-
-        } else if (FLOW_DEV == type) {
-          /* not currently supported */
-
-        } else if (RAW_DEV == type) {
-          /* Simply copy buffer to message payload */
-          memcpy((void *)msg, (void *)buf, (buf_len < len ? buf_len : len));
-          log_stdout(LOG_INFO, "RAW payload ready");
-        }
-
-        if (type != RAW_DEV) {
-          /* process message */
-          log_stdout(LOG_INFO, "Processing reading");
-          ret = convert_reading_json(r, msg, &len);
-          if (ret) {
-            log_stderr(LOG_ERROR, "failed to encode reading into JSON");
-            continue;
-          }
-        }
-      } else if (FD_ISSET(skt->sockfd, &read_fds)) {
-        /* process MQTT input */
-        /* need to test this to ensure packets are processed upon recipt */
-        ret = read_socket_packet(conn, pkt);
-        if (ret) {
-          log_stderr(LOG_ERROR, "failed to process packet input");
-          continue;
-        }
-      }
-
-      /* Process output MQTT packet is fall through case */
-
-      /* Create publish packet on new data */
-      pkt = construct_packet_headers(PUBLISH);
-
-      if (!pkt ||
-          (ret = set_publish_variable_header(pkt, topic, strlen(topic)))) {
-        log_stderr(LOG_ERROR, "Setting up packet");
-        ret = UMQTT_ERROR;
-        goto free;
-      }
+  if ((ret = evloop_init(&loop.el)) ||
+      (ret = evloop_add_signal(loop.el, SIGINT, tty_stop, &loop)) ||
+      (ret = evloop_add_signal(loop.el, SIGTERM, tty_stop, &loop)) ||
+      (remap_file[0] &&
+       (ret = evloop_add_signal(loop.el, SIGHUP, tty_reload, &loop)))) {
+    goto free;
+  }
 
-      ret = set_publish_fixed_flags(pkt, retain, 0, 0);
-      if (ret) {
-        log_stderr(LOG_ERROR, "Setting publish flags");
-        ret = UMQTT_ERROR;
-        goto free;
-      }
+  /* init connections */
+  log_stdout(LOG_INFO, "Initialising broker socket connection");
 
-      ret = init_packet_payload(pkt, PUBLISH, (uint8_t *)msg, strlen(msg));
-      if (ret) {
-        log_stderr(LOG_ERROR, "Attaching payload");
-        ret = UMQTT_ERROR;
-        goto free;
-      }
+  ret = mqtt_conn_init(&mc, broker_ip, broker_port, clientid, keepalive);
+  if (ret) {
+    goto free;
+  }
 
-      finalise_packet(pkt);
+  if (mqtt_batcher_init(&batcher, mc->conn, retain, linger_ms, batch_bytes)) {
+    ret = -1;
+    goto free;
+  }
 
-      log_stdout(LOG_INFO, "Constructed MQTT PUBLISH packet:");
-      log_stdout(LOG_INFO, "Topic: %s", topic);
-      log_stdout(LOG_INFO, "Message: %s", msg);
+  /* the batcher follows the connection across reconnects */
+  mqtt_conn_set_callbacks(mc, mqtt_batcher_conn_changed,
+      mqtt_batcher_conn_changed, batcher);
 
-      /* Send packet */
-      ret = broker_send_packet(conn, pkt);
-      if (ret) {
-        log_stderr(LOG_ERROR, "Sending packet failed");
-      } else {
-        log_stdout(LOG_INFO, "Successfully sent packet to broker");
-      }
+  if (spool_file[0]) {
+    if (mqtt_spool_open(&spool, spool_file, 0, spool_rate)) {
+      ret = -1;
+      goto free;
+    }
+    batcher->spool = spool;
+  }
 
-      free_packet(pkt);
-      buf_len = RX_BUF_LEN;
+  /* PUBACKs, and anything else the broker sends, reach tty_broker_input.
+   * Packets beyond the window wait in the spool, held in memory if no
+   * spool file was given. */
+  if (qos) {
+    if ((!spool && mqtt_spool_open(&spool, NULL, 0, 0)) ||
+        mqtt_qos_init(&q, mc->conn, window, ack_ms)) {
+      ret = -1;
+      goto free;
     }
+    q->spool = spool;
+    batcher->qos = q;
+  }
+
+  /* packets still queued when the connection is lost return to the spool */
+  mc->spool = spool;
+
+  loop.tty = tty;
+  loop.type = type;
+  loop.r = r;
+  loop.cli_rmaps = cli_rmaps;
+  loop.remap_file = remap_file;
+  loop.topic = topic;
+  loop.batcher = batcher;
+  loop.q = q;
+
+  /* broker connection, input, keepalive and reconnection are driven by
+   * the loop, readings taken meanwhile are spooled or dropped. Batches,
+   * spool replay and retransmission are timed by the batcher, which holds
+   * back TTY input while the broker falls behind. */
+  if ((ret = mqtt_conn_attach(mc, loop.el, tty_broker_input, &loop)) ||
+      (ret = mqtt_batcher_attach(batcher, mc)) ||
+      (ret = tty_rewatch(&loop))) {
+    goto free;
   }
+  mqtt_batcher_set_flush_cb(batcher, tty_flushed, &loop);
 
+  /* wait for data - main program loop */
+  ret = evloop_run(loop.el);
+  if (loop.ret) {
+    ret = loop.ret;
+  }
 
 free:
-  log_stdout(LOG_INFO, "Disconnecting from broker");
-  broker_disconnect(conn);
+  if (batcher) {
+    mqtt_batcher_flush(batcher);
+  }
+  if (q && mc && mc->el && mc->conn) {
+    /* give outstanding packets a chance to be acknowledged, no more TTY
+     * input is taken meanwhile */
+    if (loop.tty_fd >= 0) {
+      evloop_del_fd(loop.el, loop.tty_fd);
+      loop.tty_fd = -1;
+    }
+    mqtt_qos_wait(q, mc, 0, q->timeout_ms);
+  }
+  free_mqtt_batcher(batcher);
+  free_mqtt_qos(q);
+  free_mqtt_conn(mc);
+  mqtt_spool_close(spool);
+  free_sensor_remaps(loop.rmaps);
+  free_sensor_remaps(cli_rmaps);
   free_reading(r);
   close_tty_conn(tty);
   free_tty_conn(tty);
-  free_connection(conn);
-  free_packet(pkt);
+  free_evloop(loop.el);
   return ret;
 }
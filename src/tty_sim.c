@@ -0,0 +1,387 @@
+/******************************************************************************
+ * File: tty_sim.c
+ * Description: Pseudo terminal device simulator for pipeline testing
+ * Author: Steven Swann - swannonline@googlemail.com
+ *
+ * Copyright (c) swannonline, 2013-2014
+ *
+ * This file is part of sensorspace.
+ *
+ * sensorspace is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * sensorspace is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with sensorspace.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ *****************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/resource.h>
+
+#include <getopt.h>
+
+#include "sensorspace.h"
+#include "log.h"
+
+#define TTY_SIM_DEFAULT_LINK      "/tmp/tty_sim"
+#define TTY_SIM_DEFAULT_RATE      10
+#define TTY_SIM_MAX_SENSORS       10
+
+#define MAX_FRAME_LEN             512
+#define MAX_PATH_LEN              1024
+
+static int print_usage(void);
+
+static volatile sig_atomic_t stop = 0;
+
+static void stop_handler(int sig) {
+  (void)sig;
+  stop = 1;
+}
+
+/*
+ * \brief function to print help
+ */
+static int print_usage() {
+
+  fprintf(stderr,
+      "tty_sim creates a pseudo terminal and writes simulated currentcost\n"
+      "frames to it at a fixed rate, so that tty_mqtt can be run without\n"
+      "hardware. The number of frames written is printed at exit.\n"
+      "Usage: tty_sim [options]\n"
+      "General options:\n"
+      " -h [--help]              : Displays this help and exits\n"
+      "\n"
+      "Device options:\n"
+      " -l [--link] <path>       : Symlink created to the pseudo terminal\n"
+      "                            Default: /tmp/tty_sim\n"
+      " -n [--sensors] <n>       : Number of sensors, 1 to 10. Frames cycle\n"
+      "                            through sensor IDs 1 to n. Default: 1\n"
+      " -r [--rate] <frames/s>   : Frames written per second, 0 to write as\n"
+      "                            fast as the reader allows. Default: 10\n"
+      " -c [--count] <frames>    : Stop after writing <frames> frames\n"
+      " -d [--duration] <s>      : Stop after <s> seconds\n"
+      " -w [--wait] <s>          : Wait <s> seconds before the first frame\n"
+      "\n"
+      "\nDebug options:\n"
+      " -v [--verbose] <LEVEL>   : set verbose level to LEVEL\n"
+      "                               Levels are:\n"
+      "                                 SILENT\n"
+      "                                 ERROR\n"
+      "                                 WARN\n"
+      "                                 INFO (default)\n"
+      "                                 DEBUG\n"
+      "                                 DEBUG_THREAD\n"
+      "\n");
+
+  return 0;
+}
+
+/**
+ * \brief Open a pseudo terminal, returning the master side
+ * \param slave_fd Pointer to the slave side to be returned, which is
+ *        held open so that the terminal persists between readers
+ * \param path The path of the slave side
+ * \param len The length of path
+ */
+static int open_pty(int *slave_fd, char *path, size_t len) {
+
+  struct termios tio;
+  int fd;
+
+  if ((fd = posix_openpt(O_RDWR | O_NOCTTY)) < 0 || grantpt(fd) ||
+      unlockpt(fd) || ptsname_r(fd, path, len)) {
+    log_stderr(LOG_ERROR, "Opening pseudo terminal: %s", strerror(errno));
+    goto free;
+  }
+
+  if ((*slave_fd = open(path, O_RDWR | O_NOCTTY)) < 0) {
+    log_stderr(LOG_ERROR, "Opening %s: %s", path, strerror(errno));
+    goto free;
+  }
+
+  /* frames are passed through untouched */
+  if (!tcgetattr(*slave_fd, &tio)) {
+    cfmakeraw(&tio);
+    tcsetattr(*slave_fd, TCSANOW, &tio);
+  }
+
+  return fd;
+
+free:
+  if (fd >= 0) {
+    close(fd);
+  }
+  return -1;
+}
+
+/**
+ * \brief Build a currentcost frame
+ * \param buf The buffer to build the frame in
+ * \param len The size of buf
+ * \param seq The frame sequence number
+ * \param sensors The number of sensors
+ * \return The length of the frame
+ */
+static size_t build_cc_frame(char *buf, size_t len, uint64_t seq,
+    unsigned sensors) {
+
+  time_t t = time(0);
+  struct tm tm;
+  unsigned sensor = seq % sensors;
+
+  localtime_r(&t, &tm);
+
+  return snprintf(buf, len,
+      "<msg><src>CC128-v0.12</src><dsb>00001</dsb>"
+      "<time>%02d:%02d:%02d</time><tmpr>%.1f</tmpr>"
+      "<sensor>%u</sensor><id>%02u</id><type>1</type>"
+      "<ch1><watts>%05u</watts></ch1></msg>\r\n",
+      tm.tm_hour, tm.tm_min, tm.tm_sec, 20.0 + (seq % 50) / 10.0,
+      sensor, sensor + 1, (unsigned)((seq / sensors) % 5000));
+}
+
+/**
+ * \brief Write a buffer to the terminal
+ */
+static int write_all(int fd, const char *buf, size_t len) {
+
+  ssize_t n;
+
+  while (len) {
+    if ((n = write(fd, buf, len)) < 0) {
+      if (errno == EINTR && !stop) {
+        continue;
+      }
+      return SS_WRITE_ERROR;
+    }
+    buf += n;
+    len -= n;
+  }
+
+  return SS_SUCCESS;
+}
+
+int main(int argc, char **argv) {
+
+  int ret = SS_SUCCESS;
+  int c, option_index = 0;
+  char link_path[MAX_PATH_LEN] = TTY_SIM_DEFAULT_LINK;
+  char pty_path[MAX_PATH_LEN];
+  char frame[MAX_FRAME_LEN];
+  unsigned sensors = 1;
+  unsigned rate = TTY_SIM_DEFAULT_RATE;
+  unsigned duration = 0, wait_s = 0;
+  uint64_t count = 0, seq = 0;
+  int fd, slave_fd = -1;
+  size_t len;
+  double secs;
+
+  struct timespec start, now, due;
+  struct sigaction sa;
+  struct rusage ru;
+
+  static struct option long_options[] =
+  {
+    /* These options set a flag. */
+    {"help",   no_argument,             0, 'h'},
+    {"verbose", required_argument,      0, 'v'},
+    {"link", required_argument,         0, 'l'},
+    {"sensors", required_argument,      0, 'n'},
+    {"rate", required_argument,         0, 'r'},
+    {"count", required_argument,        0, 'c'},
+    {"duration", required_argument,     0, 'd'},
+    {"wait", required_argument,         0, 'w'},
+    {0, 0, 0, 0}
+  };
+
+  /* get arguments */
+  while (1)
+  {
+    if ((c = getopt_long(argc, argv, "hv:l:n:r:c:d:w:", long_options,
+            &option_index)) != -1) {
+
+      switch (c) {
+        case 'h':
+          return print_usage();
+
+        case 'v':
+          /* set log level */
+          if (optarg) {
+            set_log_level_str(optarg);
+          }
+          break;
+
+        case 'l':
+          /* set symlink path */
+          if (optarg) {
+            strncpy(link_path, optarg, sizeof(link_path) - 1);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The link flag should be followed by a path");
+            return print_usage();
+          }
+          break;
+
+        case 'n':
+          /* set sensor count */
+          if (optarg && atoi(optarg) > 0 &&
+              atoi(optarg) <= TTY_SIM_MAX_SENSORS) {
+            sensors = atoi(optarg);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The sensors flag should be followed by a count of 1 to %d",
+                TTY_SIM_MAX_SENSORS);
+            return print_usage();
+          }
+          break;
+
+        case 'r':
+          /* set frame rate */
+          if (optarg) {
+            rate = atoi(optarg);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The rate flag should be followed by frames per second");
+            return print_usage();
+          }
+          break;
+
+        case 'c':
+          /* set frame count */
+          if (optarg) {
+            count = strtoull(optarg, NULL, 10);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The count flag should be followed by a frame count");
+            return print_usage();
+          }
+          break;
+
+        case 'd':
+          /* set duration */
+          if (optarg) {
+            duration = atoi(optarg);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The duration flag should be followed by a time in seconds");
+            return print_usage();
+          }
+          break;
+
+        case 'w':
+          /* set start delay */
+          if (optarg) {
+            wait_s = atoi(optarg);
+          } else {
+            log_stderr(LOG_ERROR,
+                "The wait flag should be followed by a time in seconds");
+            return print_usage();
+          }
+          break;
+
+        default:
+          return print_usage();
+      }
+    } else {
+      /* Final arguement */
+      break;
+    }
+  }
+
+  if ((fd = open_pty(&slave_fd, pty_path, sizeof(pty_path))) < 0) {
+    return SS_TTY_ERROR;
+  }
+
+  unlink(link_path);
+  if (symlink(pty_path, link_path)) {
+    log_stderr(LOG_ERROR, "Linking %s to %s: %s", link_path, pty_path,
+        strerror(errno));
+    ret = SS_TTY_ERROR;
+    goto free;
+  }
+  log_stdout(LOG_INFO, "Simulating device on %s -> %s", link_path, pty_path);
+
+  memset(&sa, 0, sizeof(struct sigaction));
+  sa.sa_handler = stop_handler;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGALRM, &sa, NULL);
+
+  if (wait_s) {
+    sleep(wait_s);
+  }
+
+  /* a reader that stops reading must not hold writes past the duration */
+  if (duration) {
+    alarm(duration);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  while (!stop && (!count || seq < count)) {
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (duration && (now.tv_sec - start.tv_sec) * 1000000000LL +
+        (now.tv_nsec - start.tv_nsec) >= duration * 1000000000LL) {
+      break;
+    }
+
+    if (rate) {
+      /* frames are paced against the start time, not the last write */
+      due.tv_sec = start.tv_sec + seq / rate;
+      due.tv_nsec = start.tv_nsec + (seq % rate) * (1000000000LL / rate);
+      if (due.tv_nsec >= 1000000000L) {
+        due.tv_sec++;
+        due.tv_nsec -= 1000000000L;
+      }
+      if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL)) {
+        continue;
+      }
+    }
+
+    len = build_cc_frame(frame, sizeof(frame), seq, sensors);
+    if (write_all(fd, frame, len)) {
+      if (!stop) {
+        log_stderr(LOG_ERROR, "Write: %s", strerror(errno));
+        ret = SS_WRITE_ERROR;
+      }
+      break;
+    }
+    seq++;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  secs = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+  getrusage(RUSAGE_SELF, &ru);
+  fprintf(stdout, "frames: %llu in %.3fs cpu: %.3fs\n",
+      (unsigned long long)seq, secs,
+      ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+      (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6);
+  fflush(stdout);
+
+  unlink(link_path);
+
+free:
+  close(fd);
+  if (slave_fd >= 0) {
+    close(slave_fd);
+  }
+  return ret;
+}